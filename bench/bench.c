@@ -0,0 +1,560 @@
+//
+//  bench.c
+//  Net-Rewire benchmarks
+//
+
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+// pcap link types with IP packets this reader can find
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL2 276
+
+#define PCAP_HEADER_LEN 24
+#define PCAP_RECORD_LEN 16
+
+// pcapng blocks and options this reader takes; other blocks are skipped
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 1
+#define PCAPNG_SPB 3
+#define PCAPNG_EPB 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_EPB_FLAGS 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_MAX_INTERFACES 64
+
+// Largest packet a frame restored to its original length may have
+#define BENCH_PACKET_MAX 65535
+
+// A frame found in a capture, before the mix is put together in time order
+struct record {
+    const uint8_t *data;    // the IP packet, in the file
+    size_t caplen;          // bytes captured
+    size_t len;             // bytes the packet had
+    uint64_t time;
+    uint8_t dir;
+    size_t seq;             // position in the file, to keep the order of ties
+};
+
+struct capture {
+    struct record *records;
+    size_t count;
+};
+
+// One kind of packet in a synthetic mix
+struct mix_class {
+    unsigned weight;
+    uint8_t version;        // 4 or 6
+    uint8_t proto;          // IPPROTO_TCP or IPPROTO_UDP
+    uint16_t dst_port;
+    uint16_t min_len, max_len;
+    uint8_t ip_options;     // bytes of IPv4 options
+    uint8_t text;           // payload is mail text rather than random bytes
+};
+
+static const struct mix_class smtp_mix[] = {
+    { 40, 4, 6, 25, 52, 52, 0, 1 },         // ACKs
+    { 20, 4, 6, 25, 60, 120, 0, 1 },        // commands
+    { 40, 4, 6, 25, 1400, 1500, 0, 1 },     // message data
+    { 0 },
+};
+
+static const struct mix_class smtp6_mix[] = {
+    { 40, 6, 6, 25, 72, 72, 0, 1 },
+    { 20, 6, 6, 25, 80, 140, 0, 1 },
+    { 40, 6, 6, 25, 1400, 1500, 0, 1 },
+    { 0 },
+};
+
+static const struct mix_class imix_mix[] = {
+    { 7, 4, 6, 443, 40, 40, 0, 0 },
+    { 3, 4, 6, 443, 576, 576, 0, 0 },
+    { 1, 4, 17, 443, 576, 576, 0, 0 },
+    { 1, 4, 6, 443, 1500, 1500, 0, 0 },
+    { 0 },
+};
+
+static const struct mix_class host_mix[] = {
+    { 45, 4, 6, 443, 52, 1500, 0, 0 },      // HTTPS
+    { 20, 4, 17, 443, 1250, 1350, 0, 0 },   // QUIC
+    { 5, 4, 17, 53, 60, 120, 0, 0 },        // DNS
+    { 15, 4, 6, 25, 52, 1500, 0, 1 },       // mail
+    { 10, 6, 6, 443, 72, 1500, 0, 0 },      // HTTPS over IPv6
+    { 5, 4, 6, 25, 64, 600, 4, 1 },         // mail with IP options
+    { 0 },
+};
+
+static const struct {
+    const char *name;
+    const struct mix_class *classes;
+} mixes[] = {
+    { "smtp", smtp_mix },
+    { "smtp6", smtp6_mix },
+    { "imix", imix_mix },
+    { "host", host_mix },
+};
+
+static const char *const mail_words[] = {
+    "the", "report", "for", "quarter", "is", "attached", "please", "review", "and", "reply",
+    "by", "Friday", "regards", "meeting", "notes", "from", "Tuesday", "with", "action", "items",
+    "Received:", "from", "mail.example.com", "by", "mx.example.org", "ESMTPS", "id", "Subject:",
+    "Content-Type:", "text/plain;", "charset=utf-8", "Message-ID:", "Date:", "To:", "Cc:",
+};
+
+uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t bench_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+double bench_measure(void (*run)(void *arg), void *arg, size_t items) {
+    double best = 0;
+    run(arg);   // warm the caches and the branch predictors
+    for (int t = 0; t < BENCH_TRIALS; t++) {
+        uint64_t start = bench_now_ns(), elapsed, done = 0;
+        do {
+            run(arg);
+            done += items;
+            elapsed = bench_now_ns() - start;
+        } while (elapsed < BENCH_TRIAL_NS);
+        double ns = (double)elapsed / (double)done;
+        if (t == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+uint32_t bench_rand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, (uint16_t)(v >> 16));
+    put16(p + 2, (uint16_t)v);
+}
+
+static uint16_t ipv4_checksum(const uint8_t *hdr, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += (uint32_t)(hdr[i] << 8 | hdr[i + 1]);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+static void fill_payload(uint8_t *p, size_t len, int text, uint32_t *seed) {
+    size_t i = 0;
+    if (!text) {
+        for (; i < len; i++) {
+            p[i] = (uint8_t)bench_rand(seed);
+        }
+        return;
+    }
+    while (i < len) {
+        const char *w = mail_words[bench_rand(seed) % (sizeof(mail_words) / sizeof(mail_words[0]))];
+        // A line break now and then, as in a message body
+        const char *sep = bench_rand(seed) % 10 == 0 ? "\r\n" : " ";
+        for (const char *c = w; *c && i < len; c++) {
+            p[i++] = (uint8_t)*c;
+        }
+        for (const char *c = sep; *c && i < len; c++) {
+            p[i++] = (uint8_t)*c;
+        }
+    }
+}
+
+// Write one packet of a class, len bytes long; returns len
+static size_t build_packet(uint8_t *p, size_t len, const struct mix_class *c, uint32_t *seed) {
+    size_t ip_len = c->version == 4 ? 20u + c->ip_options : 40u;
+    size_t l4_len = c->proto == 6 ? (len >= ip_len + 32 ? 32u : 20u) : 8u;
+    uint16_t src_port = (uint16_t)(1024 + bench_rand(seed) % 64000);
+
+    memset(p, 0, ip_len + l4_len);
+    if (c->version == 4) {
+        p[0] = (uint8_t)(0x40 | (ip_len / 4));
+        put16(p + 2, (uint16_t)len);
+        put16(p + 4, (uint16_t)bench_rand(seed));
+        p[6] = 0x40;    // don't fragment
+        p[8] = 64;
+        p[9] = c->proto;
+        put32(p + 12, 0x0a000002);                                  // 10.0.0.2
+        put32(p + 16, 0x5db80000 | (bench_rand(seed) & 0xffff));    // 93.184.x.x
+        for (size_t i = 20; i < ip_len; i++) {
+            p[i] = 1;   // NOP options
+        }
+        put16(p + 10, ipv4_checksum(p, ip_len));
+    } else {
+        p[0] = 0x60;
+        put16(p + 4, (uint16_t)(len - ip_len));
+        p[6] = c->proto;
+        p[7] = 64;
+        put32(p + 8, 0xfd000000);
+        put32(p + 20, 0x00000002);
+        put32(p + 24, 0x20010db8);
+        put32(p + 36, bench_rand(seed));
+    }
+
+    uint8_t *l4 = p + ip_len;
+    put16(l4, src_port);
+    put16(l4 + 2, c->dst_port);
+    if (c->proto == 6) {
+        put32(l4 + 4, bench_rand(seed));
+        put32(l4 + 8, bench_rand(seed));
+        l4[12] = (uint8_t)((l4_len / 4) << 4);
+        l4[13] = len > ip_len + l4_len ? 0x18 : 0x10;   // PSH ACK, or a bare ACK
+        put16(l4 + 14, 65535);
+        if (l4_len == 32) {
+            l4[20] = 1;
+            l4[21] = 1;
+            l4[22] = 8;     // timestamps
+            l4[23] = 10;
+            put32(l4 + 24, bench_rand(seed));
+            put32(l4 + 28, bench_rand(seed));
+        }
+    } else {
+        put16(l4 + 4, (uint16_t)(len - ip_len));
+    }
+    fill_payload(l4 + l4_len, len - ip_len - l4_len, c->text, seed);
+    return len;
+}
+
+static int mix_alloc(struct bench_mix *m, const char *name, size_t data_cap, size_t count_cap) {
+    memset(m, 0, sizeof(*m));
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->data = malloc(data_cap ? data_cap : 1);
+    m->bufs = malloc((count_cap ? count_cap : 1) * sizeof(*m->bufs));
+    m->lens = malloc((count_cap ? count_cap : 1) * sizeof(*m->lens));
+    if (!m->data || !m->bufs || !m->lens) {
+        bench_mix_free(m);
+        return -1;
+    }
+    return 0;
+}
+
+int bench_mix_synthetic(struct bench_mix *m, const char *name, size_t count, uint32_t seed) {
+    const struct mix_class *classes = NULL;
+    unsigned total = 0;
+
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+        if (strcmp(mixes[i].name, name) == 0) {
+            classes = mixes[i].classes;
+        }
+    }
+    if (!classes || seed == 0) {
+        return -1;
+    }
+    for (const struct mix_class *c = classes; c->weight; c++) {
+        total += c->weight;
+    }
+    if (mix_alloc(m, name, count * 1500, count) < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        unsigned pick = bench_rand(&seed) % total;
+        const struct mix_class *c = classes;
+        while (pick >= c->weight) {
+            pick -= c->weight;
+            c++;
+        }
+        size_t len = c->min_len + bench_rand(&seed) % (c->max_len - c->min_len + 1u);
+        uint8_t *p = m->data + m->bytes;
+        m->bufs[i] = p;
+        m->lens[i] = build_packet(p, len, c, &seed);
+        m->bytes += len;
+    }
+    m->count = count;
+    return 0;
+}
+
+static uint32_t pcap_u32(const uint8_t *p, int swapped) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t pcap_u16(const uint8_t *p, int swapped) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return swapped ? __builtin_bswap16(v) : v;
+}
+
+// Offset of the IP header in a captured frame, or -1 if it holds none
+static long pcap_ip_offset(uint32_t linktype, const uint8_t *p, size_t len) {
+    size_t off;
+    uint16_t ethertype;
+
+    switch (linktype) {
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        return 0;
+    case LINKTYPE_NULL:
+        return len >= 4 ? 4 : -1;
+    case LINKTYPE_ETHERNET:
+        off = 14;
+        if (len < off) {
+            return -1;
+        }
+        ethertype = (uint16_t)(p[12] << 8 | p[13]);
+        if (ethertype == 0x8100 && len >= 18) {
+            ethertype = (uint16_t)(p[16] << 8 | p[17]);
+            off = 18;
+        }
+        break;
+    case LINKTYPE_LINUX_SLL:
+        off = 16;
+        if (len < off) {
+            return -1;
+        }
+        ethertype = (uint16_t)(p[14] << 8 | p[15]);
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        off = 20;
+        if (len < off) {
+            return -1;
+        }
+        ethertype = (uint16_t)(p[0] << 8 | p[1]);
+        break;
+    default:
+        return -1;
+    }
+    return ethertype == 0x0800 || ethertype == 0x86dd ? (long)off : -1;
+}
+
+// Keep a captured frame if it holds an IP packet
+static void add_record(struct capture *cap, uint32_t linktype, const uint8_t *frame, size_t caplen,
+                       size_t origlen, uint64_t time, uint8_t dir) {
+    long ip = pcap_ip_offset(linktype, frame, caplen);
+    if (ip < 0 || (size_t)ip >= caplen || ((frame[ip] >> 4) != 4 && (frame[ip] >> 4) != 6)) {
+        return;
+    }
+    struct record *r = &cap->records[cap->count++];
+    r->data = frame + ip;
+    r->caplen = caplen - (size_t)ip;
+    r->len = origlen > caplen ? origlen - (size_t)ip : r->caplen;
+    r->len = r->len < BENCH_PACKET_MAX ? r->len : BENCH_PACKET_MAX;
+    r->time = time;
+    r->dir = dir;
+    r->seq = cap->count;
+}
+
+static void read_pcap(struct capture *cap, const uint8_t *file, size_t size, int swapped, int nanos) {
+    uint32_t linktype = pcap_u32(file + 20, swapped) & 0xffff;
+    for (size_t off = PCAP_HEADER_LEN; off + PCAP_RECORD_LEN <= size;) {
+        const uint8_t *rec = file + off;
+        size_t caplen = pcap_u32(rec + 8, swapped);
+        off += PCAP_RECORD_LEN;
+        if (caplen > size - off) {
+            break;
+        }
+        off += caplen;
+        uint64_t sec = pcap_u32(rec, swapped), frac = pcap_u32(rec + 4, swapped);
+        add_record(cap, linktype, rec + PCAP_RECORD_LEN, caplen, pcap_u32(rec + 12, swapped),
+                   sec * 1000000000ull + frac * (nanos ? 1 : 1000), 0);
+    }
+}
+
+// if_tsresol: a power of ten, or of two with the top bit set
+static uint64_t pcapng_ns(uint64_t ts, uint8_t tsresol) {
+    uint64_t units = 1;
+    for (unsigned i = 0; i < (tsresol & 0x7f) && units < UINT64_MAX / 10; i++) {
+        units *= tsresol & 0x80 ? 2 : 10;
+    }
+    return ts / units * 1000000000ull + (uint64_t)((double)(ts % units) * 1e9 / (double)units);
+}
+
+static void read_pcapng(struct capture *cap, const uint8_t *file, size_t size) {
+    uint32_t linktypes[PCAPNG_MAX_INTERFACES];
+    uint8_t tsresols[PCAPNG_MAX_INTERFACES];
+    unsigned interfaces = 0;
+    int swapped = 0;
+
+    for (size_t off = 0; off + 12 <= size;) {
+        const uint8_t *b = file + off;
+        uint32_t type = pcap_u32(b, swapped);
+        if (type == PCAPNG_SHB) {
+            // Every section has its own byte order and interfaces
+            uint32_t magic = pcap_u32(b + 8, 0);
+            swapped = magic != PCAPNG_BYTE_ORDER_MAGIC;
+            interfaces = 0;
+        }
+        uint32_t len = pcap_u32(b + 4, swapped);
+        if (len < 12 || len % 4 != 0 || len > size - off) {
+            break;
+        }
+        off += len;
+
+        if (type == PCAPNG_IDB && len >= 20 && interfaces < PCAPNG_MAX_INTERFACES) {
+            linktypes[interfaces] = pcap_u16(b + 8, swapped);
+            tsresols[interfaces] = 6;
+            for (size_t o = 16; o + 4 <= len - 4;) {
+                uint16_t code = pcap_u16(b + o, swapped), olen = pcap_u16(b + o + 2, swapped);
+                if (code == PCAPNG_OPT_END || o + 4 + olen > len - 4) {
+                    break;
+                }
+                if (code == PCAPNG_OPT_IF_TSRESOL && olen == 1) {
+                    tsresols[interfaces] = b[o + 4];
+                }
+                o += 4 + ((olen + 3u) & ~3u);
+            }
+            interfaces++;
+        } else if (type == PCAPNG_EPB && len >= 32) {
+            uint32_t iface = pcap_u32(b + 8, swapped);
+            size_t caplen = pcap_u32(b + 20, swapped);
+            if (iface >= interfaces || caplen > len - 32) {
+                continue;
+            }
+            uint8_t dir = 0;
+            for (size_t o = 28 + ((caplen + 3) & ~(size_t)3); o + 4 <= len - 4;) {
+                uint16_t code = pcap_u16(b + o, swapped), olen = pcap_u16(b + o + 2, swapped);
+                if (code == PCAPNG_OPT_END || o + 4 + olen > len - 4) {
+                    break;
+                }
+                if (code == PCAPNG_OPT_EPB_FLAGS && olen == 4) {
+                    dir = pcap_u32(b + o + 4, swapped) & 3;
+                }
+                o += 4 + ((olen + 3u) & ~3u);
+            }
+            uint64_t ts = (uint64_t)pcap_u32(b + 12, swapped) << 32 | pcap_u32(b + 16, swapped);
+            add_record(cap, linktypes[iface], b + 28, caplen, pcap_u32(b + 24, swapped),
+                       pcapng_ns(ts, tsresols[iface]), dir);
+        } else if (type == PCAPNG_SPB && len >= 16 && interfaces > 0) {
+            size_t origlen = pcap_u32(b + 8, swapped);
+            size_t caplen = origlen < len - 16 ? origlen : len - 16;
+            add_record(cap, linktypes[0], b + 12, caplen, origlen, 0, 0);
+        }
+    }
+}
+
+static int record_order(const void *a, const void *b) {
+    const struct record *x = a, *y = b;
+    if (x->time != y->time) {
+        return x->time < y->time ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+int bench_mix_pcap(struct bench_mix *m, const char *path) {
+    FILE *f = fopen(path, "rb");
+    uint8_t *file = NULL;
+    long size;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < PCAP_HEADER_LEN || fseek(f, 0, SEEK_SET) < 0 ||
+        !(file = malloc((size_t)size)) || fread(file, 1, (size_t)size, f) != (size_t)size) {
+        fprintf(stderr, "%s: cannot read capture\n", path);
+        free(file);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    // Every frame takes at least a record header
+    struct capture cap = { .records = malloc(((size_t)size / PCAP_RECORD_LEN + 1) * sizeof(struct record)) };
+    if (!cap.records) {
+        free(file);
+        return -1;
+    }
+    uint32_t magic;
+    memcpy(&magic, file, sizeof(magic));
+    if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+        read_pcap(&cap, file, (size_t)size, 0, magic == 0xa1b23c4d);
+    } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+        read_pcap(&cap, file, (size_t)size, 1, magic == 0x4d3cb2a1);
+    } else if (magic == PCAPNG_SHB) {
+        read_pcapng(&cap, file, (size_t)size);
+    } else {
+        fprintf(stderr, "%s: not a pcap or pcapng capture\n", path);
+        free(cap.records);
+        free(file);
+        return -1;
+    }
+    qsort(cap.records, cap.count, sizeof(struct record), record_order);
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < cap.count; i++) {
+        bytes += cap.records[i].len;
+    }
+    const char *base = strrchr(path, '/');
+    if (mix_alloc(m, base ? base + 1 : path, bytes, cap.count) < 0) {
+        free(cap.records);
+        free(file);
+        return -1;
+    }
+    m->times = malloc((cap.count ? cap.count : 1) * sizeof(*m->times));
+    m->dirs = malloc(cap.count ? cap.count : 1);
+    if (!m->times || !m->dirs) {
+        bench_mix_free(m);
+        free(cap.records);
+        free(file);
+        return -1;
+    }
+    for (size_t i = 0; i < cap.count; i++) {
+        const struct record *r = &cap.records[i];
+        uint8_t *p = m->data + m->bytes;
+        memcpy(p, r->data, r->caplen < r->len ? r->caplen : r->len);
+        if (r->caplen < r->len) {
+            memset(p + r->caplen, 0, r->len - r->caplen);
+        }
+        m->bufs[i] = p;
+        m->lens[i] = r->len;
+        m->times[i] = r->time;
+        m->dirs[i] = r->dir;
+        m->bytes += r->len;
+    }
+    m->count = cap.count;
+    free(cap.records);
+    free(file);
+
+    if (m->count == 0) {
+        fprintf(stderr, "%s: no IP packets in capture\n", path);
+        bench_mix_free(m);
+        return -1;
+    }
+    return 0;
+}
+
+void bench_mix_free(struct bench_mix *m) {
+    free(m->data);
+    free(m->bufs);
+    free(m->lens);
+    free(m->times);
+    free(m->dirs);
+    memset(m, 0, sizeof(*m));
+}
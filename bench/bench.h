@@ -0,0 +1,102 @@
+//
+//  bench.h
+//  Net-Rewire benchmarks
+//
+//  What the benchmarks share: a clock, and packet mixes to run the parser
+//  and the codecs over. A mix is either synthetic, built from a fixed seed
+//  so every run sees the same packets, or read from a capture, so traffic
+//  recorded with `tcpdump -w` on a real host can be replayed through the
+//  same code. Either way its packets sit back to back in one allocation,
+//  in the order they will be fed: a capture's in time order.
+//
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Synthetic mixes: "smtp" (a mail transfer: commands, data, ACKs, all to
+// port 25), "smtp6" (the same over IPv6), "imix" (the classic 7:4:1 mix of
+// 40, 576 and 1500 byte IPv4 packets, mostly TCP) and "host" (what a laptop
+// sends: HTTPS, QUIC, DNS, some mail, some IPv6 and IP options)
+#define BENCH_MIXES "smtp smtp6 imix host"
+
+// Packets in a synthetic mix: a few megabytes, mostly in the last-level
+// cache like a burst that was just received
+#define BENCH_MIX_PACKETS 4096
+
+// A measurement is the best of this many trials, each repeating the work
+// for at least BENCH_TRIAL_NS; the best trial is the least disturbed one
+#define BENCH_TRIALS 5
+#define BENCH_TRIAL_NS 100000000ull
+
+// Directions a capture may record (pcapng epb_flags)
+#define BENCH_DIR_UNKNOWN 0
+#define BENCH_DIR_INBOUND 1
+#define BENCH_DIR_OUTBOUND 2
+
+struct bench_mix {
+    char name[64];
+    uint8_t *data;          // the packets, back to back
+    const uint8_t **bufs;   // packet pointers into data
+    size_t *lens;
+    size_t count;
+    size_t bytes;           // sum of lens
+    uint64_t *times;        // captures: ns since the epoch each packet was seen, else NULL
+    uint8_t *dirs;          // captures: BENCH_DIR_* of each packet, else NULL
+};
+
+/**
+ * Monotonic clock
+ */
+uint64_t bench_now_ns(void);
+
+/**
+ * CPU time this process has used, every thread included
+ */
+uint64_t bench_cpu_ns(void);
+
+/**
+ * Time a piece of work
+ * @param run Work, called repeatedly
+ * @param arg Argument for run
+ * @param items Items one call of run processes, e.g. packets
+ * @return Nanoseconds per item in the best trial
+ */
+double bench_measure(void (*run)(void *arg), void *arg, size_t items);
+
+/**
+ * Build a synthetic mix
+ * @param m Output
+ * @param name One of BENCH_MIXES
+ * @param count Number of packets
+ * @param seed Seed; the same seed gives the same packets
+ * @return 0 on success, -1 on an unknown name or allocation failure
+ */
+int bench_mix_synthetic(struct bench_mix *m, const char *name, size_t count, uint32_t seed);
+
+/**
+ * Read the IP packets of a capture: classic pcap or pcapng (what the
+ * server and the extension record, common/pcapng.h), either byte order,
+ * with raw IP, Ethernet or Linux cooked link headers; others are skipped.
+ * Packets cut short by a snap length get their missing bytes back as
+ * zeros, so they have the lengths that were on the wire.
+ * @param m Output
+ * @param path Capture file
+ * @return 0 on success, -1 if the file is unreadable or holds no packets
+ */
+int bench_mix_pcap(struct bench_mix *m, const char *path);
+
+/**
+ * Release a mix
+ */
+void bench_mix_free(struct bench_mix *m);
+
+/**
+ * Deterministic pseudo-random numbers (xorshift32)
+ * @param state Seed, updated; must not be 0
+ */
+uint32_t bench_rand(uint32_t *state);
+
+#endif
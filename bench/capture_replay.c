@@ -0,0 +1,227 @@
+//
+//  capture_replay.c
+//  Net-Rewire benchmarks
+//
+//  Feeds a capture back through the extension's classifier and the stream
+//  framing, batch by batch as the read loops see them: pkt_parse_batch()
+//  over up to BENCH_BATCH packets, then the packets framed into a stream
+//  buffer and decoded out of it again. At recorded speed a batch is what
+//  arrived since the last one, so the timing and burstiness of the
+//  recorded traffic are kept; the report says how far behind the schedule
+//  the pipeline fell and how busy it was. As fast as possible (-x) it is a
+//  benchmark like the others, the best of BENCH_TRIALS passes.
+//
+//  Captures from the server or the extension (-c, or the `capture`
+//  provider key) hold headers only; their payloads come back as zeros.
+//
+
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "frame.h"
+#include "pktparse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Packets per batch, as read from packetFlow or the TUN device
+#define BENCH_BATCH FRAME_BATCH_MAX
+
+// Gaps shorter than this are waited out spinning rather than sleeping
+#define REPLAY_SPIN_NS 50000
+
+struct replay {
+    const struct bench_mix *mix;
+    size_t *order;              // packets taken, in time order
+    size_t count;
+    size_t bytes;
+
+    uint8_t *stream;            // one batch, framed
+    uint64_t verdicts[2];       // PKT_VERDICT_PASS, PKT_VERDICT_TUNNEL
+    size_t decoded;
+    int failed;
+};
+
+// Classify, frame and decode packets [from, to) of the replay order
+static void replay_batch(struct replay *r, size_t from, size_t to) {
+    const uint8_t *bufs[BENCH_BATCH];
+    size_t lens[BENCH_BATCH];
+    uint8_t verdicts[BENCH_BATCH];
+    struct frame_batch b;
+    size_t n = to - from;
+
+    frame_batch_init(&b);
+    for (size_t i = 0; i < n; i++) {
+        size_t p = r->order[from + i];
+        bufs[i] = r->mix->bufs[p];
+        lens[i] = r->mix->lens[p];
+    }
+    pkt_parse_batch(bufs, lens, n, verdicts);
+    for (size_t i = 0; i < n; i++) {
+        r->verdicts[verdicts[i] == PKT_VERDICT_TUNNEL]++;
+        frame_batch_add(&b, bufs[i], lens[i]);
+    }
+
+    size_t len = frame_batch_pending(&b);
+    frame_batch_copy(&b, r->stream, len);
+    struct frame_decoder d;
+    struct frame f;
+    int rc;
+    frame_decoder_init(&d, r->stream, len);
+    frame_decoder_commit(&d, len);
+    while ((rc = frame_decoder_next(&d, &f)) == 1) {
+        r->decoded++;
+    }
+    if (rc < 0 || frame_decoder_pending(&d) != 0) {
+        r->failed = 1;
+    }
+}
+
+static void run_fast(void *arg) {
+    struct replay *r = arg;
+    for (size_t i = 0; i < r->count; i += BENCH_BATCH) {
+        replay_batch(r, i, r->count - i < BENCH_BATCH ? r->count : i + BENCH_BATCH);
+    }
+}
+
+static void wait_until(uint64_t t) {
+    uint64_t now = bench_now_ns();
+    if (t > now + REPLAY_SPIN_NS) {
+        uint64_t ns = t - now - REPLAY_SPIN_NS;
+        struct timespec ts = { .tv_sec = (time_t)(ns / 1000000000ull), .tv_nsec = (long)(ns % 1000000000ull) };
+        nanosleep(&ts, NULL);
+    }
+    while (bench_now_ns() < t) {
+    }
+}
+
+// One pass on the recorded schedule
+static void run_recorded(struct replay *r) {
+    const uint64_t *times = r->mix->times;
+    uint64_t first = times[r->order[0]], start = bench_now_ns(), busy = 0, lag_max = 0, lag_sum = 0;
+    size_t batches = 0;
+
+    for (size_t i = 0; i < r->count;) {
+        uint64_t due = start + (times[r->order[i]] - first);
+        wait_until(due);
+
+        // Everything that has arrived by now, up to a batch
+        uint64_t now = bench_now_ns();
+        size_t end = i + 1;
+        while (end < r->count && end - i < BENCH_BATCH && start + (times[r->order[end]] - first) <= now) {
+            end++;
+        }
+        replay_batch(r, i, end);
+        busy += bench_now_ns() - now;
+        lag_sum += now - due;
+        lag_max = now - due > lag_max ? now - due : lag_max;
+        batches++;
+        i = end;
+    }
+
+    double wall = (double)(bench_now_ns() - start);
+    double span = (double)(times[r->order[r->count - 1]] - first);
+    printf("%-12s %10zu %10zu %10.3f %10.3f %10.1f %10.1f %8.1f%%\n", r->mix->name, r->count, batches, span / 1e9,
+           wall / 1e9, (double)lag_sum / (double)batches / 1e3, (double)lag_max / 1e3, 100.0 * (double)busy / wall);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-x] [-d in|out] [-l loops] capture\n", prog);
+    fprintf(stderr, "  -x          Replay as fast as possible (default: at the recorded speed)\n");
+    fprintf(stderr, "  -d dir      Only packets recorded going this way (in: from the tunnel, out: into it)\n");
+    fprintf(stderr, "  -l loops    Passes at recorded speed (default: 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int fast = 0, dir = BENCH_DIR_UNKNOWN;
+    long loops = 1;
+    struct bench_mix m;
+    struct replay r;
+    int c, ret = 0;
+
+    while ((c = getopt(argc, argv, "xd:l:h")) != -1) {
+        switch (c) {
+        case 'x':
+            fast = 1;
+            break;
+        case 'd':
+            if (strcmp(optarg, "in") == 0) {
+                dir = BENCH_DIR_INBOUND;
+            } else if (strcmp(optarg, "out") == 0) {
+                dir = BENCH_DIR_OUTBOUND;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'l':
+            loops = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || loops < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (bench_mix_pcap(&m, argv[optind]) < 0) {
+        return 1;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.mix = &m;
+    r.order = malloc(m.count * sizeof(*r.order));
+    r.stream = malloc(BENCH_BATCH * FRAME_MAX_LEN);
+    if (!r.order || !r.stream) {
+        fprintf(stderr, "Error allocating replay buffers\n");
+        ret = 1;
+        goto out;
+    }
+    for (size_t i = 0; i < m.count; i++) {
+        if ((dir == BENCH_DIR_UNKNOWN || m.dirs[i] == dir) && m.lens[i] <= FRAME_MAX_PAYLOAD) {
+            r.order[r.count++] = i;
+            r.bytes += m.lens[i];
+        }
+    }
+    if (r.count == 0) {
+        fprintf(stderr, "%s: no packets to replay\n", argv[optind]);
+        ret = 1;
+        goto out;
+    }
+
+    if (fast) {
+        double ns = bench_measure(run_fast, &r, r.count);
+        printf("replay: best of %d trials, %d packets per batch, pkt_parse_batch and framing\n", BENCH_TRIALS,
+               BENCH_BATCH);
+        printf("%-12s %10s %10s %10s %10s\n", "capture", "packets", "ns/pkt", "Mpkt/s", "Gbit/s");
+        printf("%-12s %10zu %10.2f %10.2f %10.2f\n", m.name, r.count, ns, 1e3 / ns,
+               (double)r.bytes * 8 / (ns * (double)r.count));
+    } else {
+        printf("replay: recorded speed, up to %d packets per batch, pkt_parse_batch and framing\n", BENCH_BATCH);
+        printf("%-12s %10s %10s %10s %10s %10s %10s %9s\n", "capture", "packets", "batches", "span s", "wall s",
+               "lag us", "max us", "busy");
+        for (long l = 0; l < loops; l++) {
+            run_recorded(&r);
+        }
+    }
+
+    uint64_t passes = (r.verdicts[0] + r.verdicts[1]) / r.count;
+    if (r.failed || r.decoded != passes * r.count) {
+        fprintf(stderr, "%s: framed packets do not decode to the packets sent\n", m.name);
+        ret = 1;
+    } else {
+        printf("%-12s %llu of %zu packets to the tunnel\n", m.name, (unsigned long long)(r.verdicts[1] / passes),
+               r.count);
+    }
+
+out:
+    free(r.order);
+    free(r.stream);
+    bench_mix_free(&m);
+    return ret;
+}
@@ -0,0 +1,382 @@
+//
+//  frame_bench.c
+//  Net-Rewire benchmarks
+//
+//  Cost of the stream codecs per packet, both ways: plain framing, LZ
+//  compression and sealing, each the way the server and the extension run
+//  them, a batch of FRAME_BATCH_MAX packets at a time. Encoding ends in a
+//  copy of the batch into a stream buffer and decoding starts with copies
+//  out of it in 64 KiB reads, standing in for writev() and recv(), so the
+//  numbers include the memory traffic the sockets would cause but not the
+//  system calls.
+//
+
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "frame.h"
+#include "lz.h"
+#include "seal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Bytes per simulated recv()
+#define BENCH_READ 65536
+
+enum codec {
+    CODEC_FRAME,
+    CODEC_LZ,
+    CODEC_SEAL,
+    CODECS,
+};
+
+static const char *const codec_names[CODECS] = { "frame", "lz", "seal" };
+
+struct codec_bench {
+    const struct bench_mix *mix;
+    enum codec codec;
+    size_t packets;             // packets of the mix every codec can carry
+    size_t bytes;
+
+    struct frame_batch in, out;
+    uint8_t *stream;            // what the last encode wrote
+    size_t stream_len, stream_cap;
+    uint8_t *rx_buf;
+
+    struct lz_encoder lz_tx;
+    struct lz_decoder lz_rx;
+    void *lz_tx_mem, *lz_rx_mem;
+    uint8_t *lz_scratch;
+
+    uint8_t psk[SEAL_KEY_LEN];
+    uint8_t client_key[SEAL_KEY_FRAME_LEN], server_key[SEAL_KEY_FRAME_LEN];
+    struct seal_stream seal_tx, seal_rx;
+    uint64_t seal_rx_seq;       // where the receiving direction started
+    uint8_t *seal_scratch;
+
+    size_t decoded_packets;     // what the last decode found
+    size_t decoded_bytes;
+    int failed;
+};
+
+static void stream_append(struct codec_bench *cb, struct frame_batch *b) {
+    size_t len = frame_batch_pending(b);
+    frame_batch_copy(b, cb->stream + cb->stream_len, len);
+    cb->stream_len += len;
+    frame_batch_init(b);
+}
+
+static void encode_batch(struct codec_bench *cb) {
+    switch (cb->codec) {
+    case CODEC_FRAME:
+        stream_append(cb, &cb->in);
+        break;
+    case CODEC_LZ:
+        lz_compress_batch(&cb->lz_tx, &cb->in, &cb->out, cb->lz_scratch);
+        stream_append(cb, &cb->out);
+        break;
+    case CODEC_SEAL:
+        if (seal_batch(&cb->seal_tx, &cb->in, &cb->out, cb->seal_scratch) < 0) {
+            cb->failed = 1;
+            frame_batch_init(&cb->in);
+            return;
+        }
+        stream_append(cb, &cb->out);
+        break;
+    default:
+        break;
+    }
+}
+
+static void run_encode(void *arg) {
+    struct codec_bench *cb = arg;
+    const struct bench_mix *m = cb->mix;
+
+    cb->stream_len = 0;
+    frame_batch_init(&cb->in);
+    for (size_t i = 0; i < m->count; i++) {
+        if (m->lens[i] > SEAL_FRAME_MAX_PAYLOAD) {
+            continue;
+        }
+        if (frame_batch_full(&cb->in)) {
+            encode_batch(cb);
+        }
+        frame_batch_add(&cb->in, m->bufs[i], m->lens[i]);
+    }
+    if (cb->in.count > 0) {
+        encode_batch(cb);
+    }
+}
+
+static void decode_inner(struct codec_bench *cb, uint8_t *data, size_t len) {
+    struct frame_decoder d;
+    struct frame f;
+    int r;
+
+    frame_decoder_init(&d, data, len);
+    frame_decoder_commit(&d, len);
+    while ((r = frame_decoder_next(&d, &f)) == 1) {
+        cb->decoded_packets++;
+        cb->decoded_bytes += f.len;
+    }
+    if (r < 0 || frame_decoder_pending(&d) != 0) {
+        cb->failed = 1;
+    }
+}
+
+static void decode_frame(struct codec_bench *cb, const struct frame *f) {
+    const uint8_t *chunk;
+    uint8_t *plain;
+    long n;
+
+    switch (f->type) {
+    case FRAME_TYPE_DATA:
+        cb->decoded_packets++;
+        cb->decoded_bytes += f->len;
+        break;
+    case FRAME_TYPE_LZ:
+        n = lz_decoder_decompress(&cb->lz_rx, f->data, f->len, &chunk);
+        if (n <= 0) {
+            cb->failed = 1;
+            return;
+        }
+        decode_inner(cb, (uint8_t *)chunk, (size_t)n);
+        break;
+    case FRAME_TYPE_SEALED:
+        // The record is in our receive buffer, where it is opened in place
+        n = seal_open(&cb->seal_rx, (uint8_t *)f->data, f->len, &plain);
+        if (n < 0) {
+            cb->failed = 1;
+            return;
+        }
+        decode_inner(cb, plain, (size_t)n);
+        break;
+    default:
+        cb->failed = 1;
+        break;
+    }
+}
+
+static void run_decode(void *arg) {
+    struct codec_bench *cb = arg;
+    struct frame_decoder d;
+    struct frame f;
+    size_t off = 0;
+    int r;
+
+    // Every pass decodes the same stream, so it starts where a fresh
+    // connection would
+    cb->decoded_packets = 0;
+    cb->decoded_bytes = 0;
+    if (cb->codec == CODEC_LZ) {
+        lz_decoder_init(&cb->lz_rx, cb->lz_rx_mem);
+    } else if (cb->codec == CODEC_SEAL) {
+        cb->seal_rx.seq = cb->seal_rx_seq;
+    }
+
+    frame_decoder_init(&d, cb->rx_buf, FRAME_RX_BUFFER_SIZE);
+    while (off < cb->stream_len) {
+        size_t space;
+        uint8_t *to = frame_decoder_space(&d, &space);
+        size_t n = cb->stream_len - off;
+        n = n < space ? n : space;
+        n = n < BENCH_READ ? n : BENCH_READ;
+        memcpy(to, cb->stream + off, n);
+        frame_decoder_commit(&d, n);
+        off += n;
+        while ((r = frame_decoder_next(&d, &f)) == 1) {
+            decode_frame(cb, &f);
+        }
+        if (r < 0) {
+            cb->failed = 1;
+            return;
+        }
+    }
+}
+
+static int codec_bench_init(struct codec_bench *cb, const struct bench_mix *m) {
+    memset(cb, 0, sizeof(*cb));
+    cb->mix = m;
+    for (size_t i = 0; i < m->count; i++) {
+        if (m->lens[i] <= SEAL_FRAME_MAX_PAYLOAD) {
+            cb->packets++;
+            cb->bytes += m->lens[i];
+        }
+    }
+    // Room for the largest expansion of any codec
+    cb->stream_cap = LZ_BOUND(m->bytes) + m->count * (FRAME_HEADER_LEN + SEAL_OVERHEAD) + FRAME_MAX_LEN;
+    cb->stream = malloc(cb->stream_cap);
+    cb->rx_buf = malloc(FRAME_RX_BUFFER_SIZE);
+    cb->lz_tx_mem = malloc(LZ_ENCODER_MEM);
+    cb->lz_rx_mem = malloc(LZ_DECODER_MEM);
+    cb->lz_scratch = malloc(LZ_BATCH_SCRATCH);
+    cb->seal_scratch = malloc(SEAL_BATCH_SCRATCH(FRAME_BATCH_MAX * FRAME_MAX_LEN));
+    if (!cb->stream || !cb->rx_buf || !cb->lz_tx_mem || !cb->lz_rx_mem || !cb->lz_scratch || !cb->seal_scratch) {
+        return -1;
+    }
+
+    // Fixed keys: every run encrypts the same bytes
+    memset(cb->psk, 0x5a, sizeof(cb->psk));
+    memset(cb->client_key, 0xc1, sizeof(cb->client_key));
+    memset(cb->server_key, 0x5e, sizeof(cb->server_key));
+    cb->client_key[0] = cb->server_key[0] = SEAL_SUITE_AES_256_GCM;
+    return 0;
+}
+
+static void codec_bench_free(struct codec_bench *cb) {
+    seal_stream_free(&cb->seal_tx);
+    seal_stream_free(&cb->seal_rx);
+    free(cb->stream);
+    free(cb->rx_buf);
+    free(cb->lz_tx_mem);
+    free(cb->lz_rx_mem);
+    free(cb->lz_scratch);
+    free(cb->seal_scratch);
+}
+
+// Codec state, as on a new connection: the client sends, the server receives
+static int codec_start(struct codec_bench *cb, enum codec codec) {
+    struct seal_stream client_rx, server_tx;
+
+    cb->codec = codec;
+    cb->failed = 0;
+    lz_encoder_init(&cb->lz_tx, cb->lz_tx_mem);
+    seal_stream_free(&cb->seal_tx);
+    seal_stream_free(&cb->seal_rx);
+    if (codec == CODEC_SEAL) {
+        if (seal_start(cb->psk, cb->client_key, cb->server_key, 1, &cb->seal_tx, &client_rx) < 0) {
+            return -1;
+        }
+        seal_stream_free(&client_rx);
+        if (seal_start(cb->psk, cb->client_key, cb->server_key, 0, &server_tx, &cb->seal_rx) < 0) {
+            return -1;
+        }
+        seal_stream_free(&server_tx);
+        cb->seal_rx_seq = cb->seal_rx.seq;
+    }
+    return 0;
+}
+
+static void print_row(const struct codec_bench *cb, const char *stage, double ns, double ratio) {
+    printf("%-12s %-14s %10.2f %10.2f %10.2f %8.3f\n", cb->mix->name, stage, ns, 1e3 / ns,
+           (double)cb->bytes * 8 / (ns * (double)cb->packets), ratio);
+}
+
+static int bench_mix(const struct bench_mix *m) {
+    struct codec_bench cb;
+    char stage[32];
+
+    if (codec_bench_init(&cb, m) < 0) {
+        fprintf(stderr, "Error allocating codec buffers\n");
+        codec_bench_free(&cb);
+        return -1;
+    }
+    for (int c = 0; c < CODECS; c++) {
+        if (codec_start(&cb, (enum codec)c) < 0) {
+            fprintf(stderr, "Error setting up %s\n", codec_names[c]);
+            codec_bench_free(&cb);
+            return -1;
+        }
+        double enc = bench_measure(run_encode, &cb, cb.packets);
+
+        // Decode what a single encode from a fresh connection wrote, which
+        // is what a fresh decoder can take
+        codec_start(&cb, (enum codec)c);
+        run_encode(&cb);
+        double ratio = (double)cb.stream_len / (double)cb.bytes;
+        run_decode(&cb);
+        if (cb.failed || cb.decoded_packets != cb.packets || cb.decoded_bytes != cb.bytes) {
+            fprintf(stderr, "%s: %s stream does not decode to the packets sent\n", m->name, codec_names[c]);
+            codec_bench_free(&cb);
+            return -1;
+        }
+        double dec = bench_measure(run_decode, &cb, cb.packets);
+        if (cb.failed) {
+            fprintf(stderr, "%s: %s decode failed\n", m->name, codec_names[c]);
+            codec_bench_free(&cb);
+            return -1;
+        }
+
+        snprintf(stage, sizeof(stage), "%s encode", codec_names[c]);
+        print_row(&cb, stage, enc, ratio);
+        snprintf(stage, sizeof(stage), "%s decode", codec_names[c]);
+        print_row(&cb, stage, dec, ratio);
+    }
+    codec_bench_free(&cb);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m mix] [-r capture.pcap] [-n packets] [-s seed]\n", prog);
+    fprintf(stderr, "  -m mix      Synthetic mix to run: %s (default: all)\n", BENCH_MIXES);
+    fprintf(stderr, "  -r file     Run over the IP packets of a pcap or pcapng capture instead\n");
+    fprintf(stderr, "  -n packets  Packets per synthetic mix (default: %d)\n", BENCH_MIX_PACKETS);
+    fprintf(stderr, "  -s seed     Seed of the synthetic mixes (default: 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *mix_name = NULL, *capture = NULL;
+    long count = BENCH_MIX_PACKETS;
+    unsigned long seed = 1;
+    struct bench_mix m;
+    int c, ret = 0;
+
+    while ((c = getopt(argc, argv, "m:r:n:s:h")) != -1) {
+        switch (c) {
+        case 'm':
+            mix_name = optarg;
+            break;
+        case 'r':
+            capture = optarg;
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (count <= 0 || seed == 0 || seed > UINT32_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("codecs: best of %d trials, %d packets per batch, %d byte reads\n", BENCH_TRIALS, FRAME_BATCH_MAX,
+           BENCH_READ);
+    printf("%-12s %-14s %10s %10s %10s %8s\n", "mix", "stage", "ns/pkt", "Mpkt/s", "Gbit/s", "wire");
+    if (capture) {
+        if (bench_mix_pcap(&m, capture) < 0) {
+            return 1;
+        }
+        ret = bench_mix(&m);
+        bench_mix_free(&m);
+        return ret < 0;
+    }
+
+    char names[] = BENCH_MIXES;
+    int ran = 0;
+    for (char *name = strtok(names, " "); name && ret == 0; name = strtok(NULL, " ")) {
+        if (mix_name && strcmp(mix_name, name) != 0) {
+            continue;
+        }
+        if (bench_mix_synthetic(&m, name, (size_t)count, (uint32_t)seed) < 0) {
+            fprintf(stderr, "Error building mix %s\n", name);
+            return 1;
+        }
+        ret = bench_mix(&m);
+        bench_mix_free(&m);
+        ran++;
+    }
+    if (!ran) {
+        fprintf(stderr, "Unknown mix: %s\n", mix_name);
+        return 1;
+    }
+    return ret < 0;
+}
@@ -0,0 +1,565 @@
+//
+//  loadgen.c
+//  Net-Rewire benchmarks
+//
+//  Loopback load generator for tunnel_server. Each synthetic client opens
+//  a stream connection, takes a tunnel address of its own and keeps a
+//  window of ICMP echo requests to the server's tunnel address in flight.
+//  The server writes them to its TUN device, the kernel answers, and the
+//  replies come back through the server's TUN read path to the client
+//  that asked, so every echo crosses both forwarding directions. A reply
+//  is answered with the next request at once, which keeps the load closed
+//  loop: throughput is whatever the server sustains at that window.
+//
+//  Round-trip latency is read from a timestamp carried in each request's
+//  payload; CPU is the server process's and the whole machine's, both
+//  taken over the measured interval only.
+//
+//  Client sockets take the socket tuning profile (socktune.h), -T, so the
+//  client side of a setting can be measured along with the server's.
+//
+
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "frame.h"
+#include "metrics.h"
+#include "socktune.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define LOADGEN_PORT 12345
+#define LOADGEN_MAX_CLIENTS 240
+#define LOADGEN_MAX_THREADS 64
+
+// The server's tunnel address; client i uses 10.8.0.(10 + i)
+#define LOADGEN_GATEWAY 0x0a080001u
+#define LOADGEN_FIRST_CLIENT 0x0a08000au
+
+// IPv4 header, ICMP header and the send timestamp
+#define LOADGEN_MIN_PACKET 36
+// The TUN device's MTU; the kernel would fragment longer replies
+#define LOADGEN_MAX_PACKET 1500
+
+// A client that has heard nothing for this long lost its window; it is
+// counted and refilled
+#define LOADGEN_LOST_NS 1000000000ull
+#define LOADGEN_TICK_MS 100
+
+enum phase {
+    PHASE_WARMUP,
+    PHASE_MEASURE,
+    PHASE_STOP,
+};
+
+struct client {
+    int fd;
+    uint32_t addr;                  // tunnel address, host order
+    uint16_t id;
+    uint16_t seq;
+    int in_flight;
+    uint64_t last_reply;
+    int want_out;
+
+    uint8_t *rx_buf;
+    struct frame_decoder rx;
+    uint8_t *tx;                    // framed requests not yet sent
+    size_t tx_off, tx_len, tx_cap;
+};
+
+struct loader {
+    pthread_t thread;
+    int epfd;
+    struct client *clients;
+    int nclients;
+    int failed;
+
+    // Written by the thread during PHASE_MEASURE, read once it is joined;
+    // bytes are IP bytes, as the server forwards them
+    struct metrics_hist rtt;
+    uint64_t packets_sent, bytes_sent;
+    uint64_t packets_received, bytes_received;
+    uint64_t lost;
+};
+
+static struct {
+    const char *host;
+    int port;
+    int nclients;
+    int nthreads;
+    int seconds;
+    int warmup;
+    size_t size;
+    int window;
+    long server_pid;
+    struct socktune tune;
+    volatile int phase;
+} opt = {
+    .host = "127.0.0.1",
+    .port = LOADGEN_PORT,
+    .nclients = 8,
+    .nthreads = 2,
+    .seconds = 10,
+    .warmup = 1,
+    .size = 1400,
+    .window = 16,
+    .server_pid = -1,
+};
+
+static int current_phase(void) {
+    return __atomic_load_n(&opt.phase, __ATOMIC_ACQUIRE);
+}
+
+static uint16_t inet_checksum(const uint8_t *p, size_t len) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += (uint32_t)(p[i] << 8 | p[i + 1]);
+    }
+    if (len & 1) {
+        sum += (uint32_t)p[len - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+// Frame the next echo request onto the client's send buffer
+static void client_queue_request(struct client *c) {
+    size_t len = opt.size;
+
+    if (c->tx_len + FRAME_HEADER_LEN + len > c->tx_cap) {
+        memmove(c->tx, c->tx + c->tx_off, c->tx_len - c->tx_off);
+        c->tx_len -= c->tx_off;
+        c->tx_off = 0;
+    }
+    uint8_t *f = c->tx + c->tx_len;
+    uint8_t *ip = f + FRAME_HEADER_LEN;
+    uint8_t *icmp = ip + 20;
+
+    c->seq++;
+    frame_encode_header(f, len);
+    memset(ip, 0, 28);
+    ip[0] = 0x45;
+    frame_put_u16(ip + 2, (uint16_t)len);
+    frame_put_u16(ip + 4, c->seq);
+    ip[8] = 64;
+    ip[9] = IPPROTO_ICMP;
+    frame_put_u32(ip + 12, c->addr);
+    frame_put_u32(ip + 16, LOADGEN_GATEWAY);
+    frame_put_u16(ip + 10, inet_checksum(ip, 20));
+
+    icmp[0] = 8;    // echo request
+    frame_put_u16(icmp + 4, c->id);
+    frame_put_u16(icmp + 6, c->seq);
+    frame_put_u64(icmp + 8, bench_now_ns());
+    memset(icmp + 16, 0xa5, len - LOADGEN_MIN_PACKET);
+    frame_put_u16(icmp + 2, inet_checksum(icmp, len - 20));
+
+    c->tx_len += FRAME_HEADER_LEN + len;
+    c->in_flight++;
+}
+
+static int client_watch(struct loader *l, struct client *c, int want_out) {
+    struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = c };
+    if (c->want_out == want_out) {
+        return 0;
+    }
+    c->want_out = want_out;
+    return epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static int client_flush(struct loader *l, struct client *c) {
+    while (c->tx_off < c->tx_len) {
+        ssize_t n = send(c->fd, c->tx + c->tx_off, c->tx_len - c->tx_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return client_watch(l, c, 1);
+            }
+            perror("Error sending to server");
+            return -1;
+        }
+        c->tx_off += (size_t)n;
+    }
+    c->tx_off = c->tx_len = 0;
+    return client_watch(l, c, 0);
+}
+
+static void client_reply(struct loader *l, struct client *c, const struct frame *f, uint64_t now) {
+    const uint8_t *ip = f->data;
+    if (f->type != FRAME_TYPE_DATA || f->len < LOADGEN_MIN_PACKET || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_ICMP) {
+        return;
+    }
+    size_t ihl = (size_t)(ip[0] & 0xf) * 4;
+    const uint8_t *icmp = ip + ihl;
+    if (f->len < ihl + 16 || icmp[0] != 0 || frame_get_u32(ip + 16) != c->addr || frame_get_u16(icmp + 4) != c->id) {
+        return;
+    }
+
+    uint64_t sent = frame_get_u64(icmp + 8);
+    c->in_flight--;
+    c->last_reply = now;
+    if (current_phase() == PHASE_MEASURE) {
+        uint64_t rtt = now > sent ? now - sent : 0;
+        l->rtt.buckets[metrics_hist_bucket(rtt)]++;
+        l->rtt.sum_ns += rtt;
+        l->packets_received++;
+        l->bytes_received += f->len;
+    }
+    if (current_phase() != PHASE_STOP) {
+        client_queue_request(c);
+        if (current_phase() == PHASE_MEASURE) {
+            l->packets_sent++;
+            l->bytes_sent += opt.size;
+        }
+    }
+}
+
+static int client_readable(struct loader *l, struct client *c) {
+    struct frame f;
+    int r;
+
+    for (;;) {
+        ssize_t n = frame_decoder_recv(&c->rx, c->fd);
+        if (n == 0) {
+            fprintf(stderr, "Server closed client %d\n", c->id);
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("Error receiving from server");
+            return -1;
+        }
+        uint64_t now = bench_now_ns();
+        while ((r = frame_decoder_next(&c->rx, &f)) == 1) {
+            client_reply(l, c, &f, now);
+        }
+        if (r < 0) {
+            fprintf(stderr, "Invalid frame from server\n");
+            return -1;
+        }
+    }
+    return client_flush(l, c);
+}
+
+// Windows lost to drops would shrink the load for good; start them over
+static int loader_refill(struct loader *l, uint64_t now) {
+    for (int i = 0; i < l->nclients; i++) {
+        struct client *c = &l->clients[i];
+        if (c->in_flight == 0 || now - c->last_reply < LOADGEN_LOST_NS) {
+            continue;
+        }
+        if (current_phase() == PHASE_MEASURE) {
+            l->lost += (uint64_t)c->in_flight;
+        }
+        c->in_flight = 0;
+        c->last_reply = now;
+        for (int k = 0; k < opt.window; k++) {
+            client_queue_request(c);
+        }
+        if (client_flush(l, c) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *loader_main(void *arg) {
+    struct loader *l = arg;
+    struct epoll_event events[64];
+    uint64_t last_tick = bench_now_ns();
+
+    for (int i = 0; i < l->nclients; i++) {
+        struct client *c = &l->clients[i];
+        c->last_reply = last_tick;
+        for (int k = 0; k < opt.window; k++) {
+            client_queue_request(c);
+        }
+        if (client_flush(l, c) < 0) {
+            l->failed = 1;
+            return NULL;
+        }
+    }
+
+    while (current_phase() != PHASE_STOP) {
+        int n = epoll_wait(l->epfd, events, 64, LOADGEN_TICK_MS);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            l->failed = 1;
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            int r = (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? client_readable(l, c) : client_flush(l, c);
+            if (r < 0) {
+                l->failed = 1;
+                return NULL;
+            }
+        }
+        uint64_t now = bench_now_ns();
+        if (now - last_tick >= LOADGEN_TICK_MS * 1000000ull) {
+            last_tick = now;
+            if (loader_refill(l, now) < 0) {
+                l->failed = 1;
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int client_open(struct loader *l, struct client *c, int index) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)opt.port) };
+
+    if (inet_pton(AF_INET, opt.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address: %s\n", opt.host);
+        return -1;
+    }
+    c->id = (uint16_t)index;
+    c->addr = LOADGEN_FIRST_CLIENT + (uint32_t)index;
+    c->rx_buf = malloc(FRAME_RX_BUFFER_SIZE);
+    c->tx_cap = (size_t)opt.window * (FRAME_HEADER_LEN + opt.size) * 2;
+    c->tx = malloc(c->tx_cap);
+    if (!c->rx_buf || !c->tx) {
+        fprintf(stderr, "Error allocating client buffers\n");
+        return -1;
+    }
+    frame_decoder_init(&c->rx, c->rx_buf, FRAME_RX_BUFFER_SIZE);
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unsigned failed = c->fd >= 0 ? socktune_apply(c->fd, &opt.tune) : 0;
+    if (failed && index == 0) {
+        char text[160];
+        socktune_describe(&opt.tune, failed, text, sizeof(text));
+        fprintf(stderr, "Socket tuning not applied: %s\n", text);
+    }
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Error connecting to server");
+        return -1;
+    }
+    socktune_fit_buffers(c->fd, &opt.tune);
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// Server CPU time in ns, or 0 if it cannot be read
+static uint64_t process_cpu_ns(long pid) {
+    char path[64], buf[1024];
+    unsigned long long utime, stime;
+
+    if (pid <= 0) {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // Fields 14 and 15, counted from the state after the command name
+    const char *p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return 0;
+    }
+    return (utime + stime) * (1000000000ull / (uint64_t)sysconf(_SC_CLK_TCK));
+}
+
+// Busy CPU time of the whole machine in ns: everything but idle and iowait
+static uint64_t system_cpu_ns(void) {
+    unsigned long long v[8] = { 0 };
+    FILE *f = fopen("/proc/stat", "r");
+    if (!f) {
+        return 0;
+    }
+    int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+                   &v[6], &v[7]);
+    fclose(f);
+    if (n < 7) {
+        return 0;
+    }
+    return (v[0] + v[1] + v[2] + v[5] + v[6] + v[7]) * (1000000000ull / (uint64_t)sysconf(_SC_CLK_TCK));
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c clients] [-t threads] [-d seconds] [-W seconds] "
+                    "[-s bytes] [-n window] [-P pid] [-T profile]\n", prog);
+    fprintf(stderr, "  -H host     Server address (default: 127.0.0.1)\n");
+    fprintf(stderr, "  -p port     Server port (default: %d)\n", LOADGEN_PORT);
+    fprintf(stderr, "  -c clients  Synthetic clients, 1 to %d (default: 8)\n", LOADGEN_MAX_CLIENTS);
+    fprintf(stderr, "  -t threads  Threads driving them (default: 2)\n");
+    fprintf(stderr, "  -d seconds  Measured duration (default: 10)\n");
+    fprintf(stderr, "  -W seconds  Warm-up before measuring (default: 1)\n");
+    fprintf(stderr, "  -s bytes    IP packet size, %d to %d (default: 1400)\n", LOADGEN_MIN_PACKET, LOADGEN_MAX_PACKET);
+    fprintf(stderr, "  -n window   Requests each client keeps in flight (default: 16)\n");
+    fprintf(stderr, "  -P pid      Server process, for its CPU time\n");
+    fprintf(stderr, "  -T profile  Socket tuning of the clients, as tunnel_server's (default: %s)\n", SOCKTUNE_DEFAULT);
+}
+
+int main(int argc, char *argv[]) {
+    static struct loader loaders[LOADGEN_MAX_THREADS];
+    static struct client clients[LOADGEN_MAX_CLIENTS];
+    char tuning[160];
+    int c;
+
+    socktune_parse(&opt.tune, SOCKTUNE_DEFAULT);
+    while ((c = getopt(argc, argv, "H:p:c:t:d:W:s:n:P:T:h")) != -1) {
+        switch (c) {
+        case 'H':
+            opt.host = optarg;
+            break;
+        case 'p':
+            opt.port = atoi(optarg);
+            break;
+        case 'c':
+            opt.nclients = atoi(optarg);
+            break;
+        case 't':
+            opt.nthreads = atoi(optarg);
+            break;
+        case 'd':
+            opt.seconds = atoi(optarg);
+            break;
+        case 'W':
+            opt.warmup = atoi(optarg);
+            break;
+        case 's':
+            opt.size = (size_t)atol(optarg);
+            break;
+        case 'n':
+            opt.window = atoi(optarg);
+            break;
+        case 'P':
+            opt.server_pid = atol(optarg);
+            break;
+        case 'T':
+            if (socktune_parse(&opt.tune, optarg) < 0) {
+                fprintf(stderr, "Invalid socket tuning profile: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (opt.port <= 0 || opt.port > 65535 || opt.nclients < 1 || opt.nclients > LOADGEN_MAX_CLIENTS ||
+        opt.nthreads < 1 || opt.nthreads > LOADGEN_MAX_THREADS || opt.seconds < 1 || opt.warmup < 0 ||
+        opt.size < LOADGEN_MIN_PACKET || opt.size > LOADGEN_MAX_PACKET || opt.window < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.nthreads > opt.nclients) {
+        opt.nthreads = opt.nclients;
+    }
+
+    // Clients are dealt out to the threads in contiguous runs
+    for (int t = 0, next = 0; t < opt.nthreads; t++) {
+        struct loader *l = &loaders[t];
+        l->clients = &clients[next];
+        l->nclients = opt.nclients / opt.nthreads + (t < opt.nclients % opt.nthreads);
+        l->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (l->epfd < 0) {
+            perror("epoll_create1");
+            return 1;
+        }
+        for (int i = 0; i < l->nclients; i++) {
+            if (client_open(l, &l->clients[i], next + i) < 0) {
+                return 1;
+            }
+        }
+        next += l->nclients;
+    }
+
+    printf("loadgen: %d clients on %d threads, %zu byte packets, %d in flight each, %d s after %d s warm-up\n",
+           opt.nclients, opt.nthreads, opt.size, opt.window, opt.seconds, opt.warmup);
+    socktune_describe(&opt.tune, SOCKTUNE_NODELAY | SOCKTUNE_LOWAT | SOCKTUNE_BUFFERS | SOCKTUNE_BUSY_POLL |
+                      SOCKTUNE_CONGESTION, tuning, sizeof(tuning));
+    printf("loadgen: client socket tuning %s\n", tuning);
+    for (int t = 0; t < opt.nthreads; t++) {
+        if (pthread_create(&loaders[t].thread, NULL, loader_main, &loaders[t]) != 0) {
+            fprintf(stderr, "Error creating load thread\n");
+            return 1;
+        }
+    }
+
+    sleep((unsigned)opt.warmup);
+    uint64_t server_start = process_cpu_ns(opt.server_pid), system_start = system_cpu_ns();
+    uint64_t self_start = bench_cpu_ns(), start = bench_now_ns();
+    __atomic_store_n(&opt.phase, PHASE_MEASURE, __ATOMIC_RELEASE);
+
+    sleep((unsigned)opt.seconds);
+    __atomic_store_n(&opt.phase, PHASE_STOP, __ATOMIC_RELEASE);
+    uint64_t elapsed = bench_now_ns() - start;
+    uint64_t server_cpu = process_cpu_ns(opt.server_pid) - server_start;
+    uint64_t system_cpu = system_cpu_ns() - system_start;
+    uint64_t self_cpu = bench_cpu_ns() - self_start;
+
+    struct metrics_hist rtt;
+    uint64_t packets = 0, bytes = 0, lost = 0;
+    int failed = 0;
+    memset(&rtt, 0, sizeof(rtt));
+    for (int t = 0; t < opt.nthreads; t++) {
+        struct loader *l = &loaders[t];
+        pthread_join(l->thread, NULL);
+        failed |= l->failed;
+        packets += l->packets_sent + l->packets_received;
+        bytes += l->bytes_sent + l->bytes_received;
+        lost += l->lost;
+        for (size_t b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            rtt.buckets[b] += l->rtt.buckets[b];
+        }
+        rtt.sum_ns += l->rtt.sum_ns;
+    }
+    for (int i = 0; i < opt.nclients; i++) {
+        close(clients[i].fd);
+        free(clients[i].rx_buf);
+        free(clients[i].tx);
+    }
+    if (failed) {
+        return 1;
+    }
+
+    // Both directions: every request and every reply crossed the server
+    double secs = (double)elapsed / 1e9;
+    double gbits = (double)bytes * 8 / 1e9;
+    printf("%-14s %14.0f   (both directions)\n", "packets/s", (double)packets / secs);
+    printf("%-14s %14.3f\n", "Gbit/s", gbits / secs);
+    printf("%-14s %14.1f us   p99 %.1f us   p99.9 %.1f us\n", "rtt p50", metrics_hist_quantile(&rtt, 0.5) / 1e3,
+           metrics_hist_quantile(&rtt, 0.99) / 1e3, metrics_hist_quantile(&rtt, 0.999) / 1e3);
+    if (opt.server_pid > 0) {
+        printf("%-14s %14.2f cores  %.3f cpu-s per Gbit\n", "server cpu", (double)server_cpu / (double)elapsed,
+               gbits > 0 ? (double)server_cpu / 1e9 / gbits : 0.0);
+    }
+    printf("%-14s %14.2f cores  %.3f cpu-s per Gbit\n", "system cpu", (double)system_cpu / (double)elapsed,
+           gbits > 0 ? (double)system_cpu / 1e9 / gbits : 0.0);
+    printf("%-14s %14.2f cores\n", "loadgen cpu", (double)self_cpu / (double)elapsed);
+    printf("%-14s %14llu\n", "lost", (unsigned long long)lost);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Net-Rewire loopback load test
+# Starts tunnel_server, drives it with loadgen over 127.0.0.1 and stops it
+# again. The server needs root for its TUN device; without it the test is
+# skipped. Options pass through the environment, e.g.
+#   SERVER_ARGS="-w 4 -e uring" LOADGEN_ARGS="-c 32 -t 4 -s 576" ./bench/loopback.sh
+# Socket tuning settings are compared by giving both sides the same -T, e.g.
+#   SERVER_ARGS="-w 2 -T nodelay,cc=bbr" LOADGEN_ARGS="-c 8 -T nodelay,cc=bbr" ./bench/loopback.sh
+
+cd "$(dirname "$0")/.."
+
+SERVER_ARGS=${SERVER_ARGS:--w 2}
+LOADGEN_ARGS=${LOADGEN_ARGS:--c 8 -t 2 -d 10}
+
+if [[ "$(uname)" != "Linux" || $(id -u) -ne 0 || ! -c /dev/net/tun ]]; then
+    echo "Skipping loopback load test (needs Linux, root and /dev/net/tun)"
+    exit 0
+fi
+if pgrep -x tunnel_server > /dev/null; then
+    echo "tunnel_server is already running; stop it first" >&2
+    exit 1
+fi
+
+log=$(mktemp)
+# Line-buffered, so the log shows startup as it happens
+# shellcheck disable=SC2086
+stdbuf -oL ./ubuntu/tunnel_server $SERVER_ARGS > "$log" 2>&1 &
+pid=$!
+trap 'kill -INT $pid 2>/dev/null || true; wait $pid 2>/dev/null || true; rm -f "$log"' EXIT
+
+for _ in $(seq 50); do
+    grep -q "^Started" "$log" && break
+    if ! kill -0 $pid 2>/dev/null; then
+        cat "$log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+echo "loopback: $(git describe --always --dirty 2>/dev/null || echo unknown), $(uname -r), $(nproc) CPUs, server $SERVER_ARGS"
+grep "^Socket tuning" "$log" | sed 's/^/loopback: server /' || true
+# shellcheck disable=SC2086
+./bench/loadgen -P $pid $LOADGEN_ARGS
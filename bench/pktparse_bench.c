@@ -0,0 +1,185 @@
+//
+//  pktparse_bench.c
+//  Net-Rewire benchmarks
+//
+//  Classifier cost per packet: pkt_parse() one packet at a time, the
+//  batched pkt_parse_batch(), pkt_rules_classify() with a typical rule set,
+//  and pkt_flow_classify() as the extension's read loop runs it, with every
+//  flow of the mix already in the table, over each packet mix.
+//
+
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "pktparse.h"
+#include "pktrules.h"
+#include "pktflow.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Packets per call of the batched classifiers, as read from packetFlow
+#define BENCH_BATCH 64
+
+#define BENCH_RULES "25 465 587 !10.0.0.0/8"
+
+// Keeps the compiler from dropping the work
+static volatile unsigned sink;
+
+static const struct pkt_rules *rules;
+
+// Sized for every packet of a mix to be a flow of its own
+static struct pkt_flow_table flows;
+
+static void run_parse(void *arg) {
+    const struct bench_mix *m = arg;
+    struct pkt_info info;
+    unsigned tcp = 0;
+    for (size_t i = 0; i < m->count; i++) {
+        if (pkt_parse(m->bufs[i], m->lens[i], &info) && info.is_tcp && ntohs(info.tcp_dst) == PKT_CAPTURE_PORT) {
+            tcp++;
+        }
+    }
+    sink += tcp;
+}
+
+static void run_batch(void *arg) {
+    const struct bench_mix *m = arg;
+    uint8_t verdicts[BENCH_BATCH];
+    for (size_t i = 0; i < m->count; i += BENCH_BATCH) {
+        size_t n = m->count - i < BENCH_BATCH ? m->count - i : BENCH_BATCH;
+        pkt_parse_batch(m->bufs + i, m->lens + i, n, verdicts);
+        sink += verdicts[0];
+    }
+}
+
+static void run_rules(void *arg) {
+    const struct bench_mix *m = arg;
+    uint8_t verdicts[BENCH_BATCH];
+    for (size_t i = 0; i < m->count; i += BENCH_BATCH) {
+        size_t n = m->count - i < BENCH_BATCH ? m->count - i : BENCH_BATCH;
+        pkt_rules_classify(rules, m->bufs + i, m->lens + i, n, verdicts);
+        sink += verdicts[0];
+    }
+}
+
+static void run_flows(void *arg) {
+    const struct bench_mix *m = arg;
+    uint8_t verdicts[BENCH_BATCH], conns[BENCH_BATCH];
+    uint64_t now = bench_now_ns();
+    for (size_t i = 0; i < m->count; i += BENCH_BATCH) {
+        size_t n = m->count - i < BENCH_BATCH ? m->count - i : BENCH_BATCH;
+        pkt_flow_classify(&flows, rules, m->bufs + i, m->lens + i, n, verdicts, conns, now);
+        sink += verdicts[0];
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void *arg);
+} methods[] = {
+    { "pkt_parse", run_parse },
+    { "pkt_parse_batch", run_batch },
+    { "pkt_rules_classify", run_rules },
+    { "pkt_flow_classify", run_flows },
+};
+
+static void bench_mix(const struct bench_mix *m) {
+    pkt_flow_clear(&flows);
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        double ns = bench_measure(methods[i].run, (void *)m, m->count);
+        printf("%-12s %-20s %10.2f %10.2f\n", m->name, methods[i].name, ns, 1e3 / ns);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m mix] [-r capture.pcap] [-n packets] [-s seed]\n", prog);
+    fprintf(stderr, "  -m mix      Synthetic mix to run: %s (default: all)\n", BENCH_MIXES);
+    fprintf(stderr, "  -r file     Run over the IP packets of a pcap or pcapng capture instead\n");
+    fprintf(stderr, "  -n packets  Packets per synthetic mix (default: %d)\n", BENCH_MIX_PACKETS);
+    fprintf(stderr, "  -s seed     Seed of the synthetic mixes (default: 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *mix_name = NULL, *capture = NULL;
+    long count = BENCH_MIX_PACKETS;
+    unsigned long seed = 1;
+    struct bench_mix m;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:r:n:s:h")) != -1) {
+        switch (c) {
+        case 'm':
+            mix_name = optarg;
+            break;
+        case 'r':
+            capture = optarg;
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (count <= 0 || seed == 0 || seed > UINT32_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct pkt_rules *compiled = pkt_rules_compile_string(BENCH_RULES, NULL);
+    if (!compiled) {
+        fprintf(stderr, "Error compiling rules\n");
+        return 1;
+    }
+    rules = compiled;
+    if (pkt_flow_init(&flows, 2 * (size_t)count, 1) < 0) {
+        fprintf(stderr, "Error allocating the flow table\n");
+        pkt_rules_free(compiled);
+        return 1;
+    }
+
+    printf("pktparse: best of %d trials, %d packets per batch, rules \"%s\"\n", BENCH_TRIALS, BENCH_BATCH, BENCH_RULES);
+    printf("%-12s %-20s %10s %10s\n", "mix", "method", "ns/pkt", "Mpkt/s");
+    if (capture) {
+        if (bench_mix_pcap(&m, capture) < 0) {
+            pkt_flow_free(&flows);
+            pkt_rules_free(compiled);
+            return 1;
+        }
+        bench_mix(&m);
+        bench_mix_free(&m);
+    } else {
+        char names[] = BENCH_MIXES;
+        int ran = 0;
+        for (char *name = strtok(names, " "); name; name = strtok(NULL, " ")) {
+            if (mix_name && strcmp(mix_name, name) != 0) {
+                continue;
+            }
+            if (bench_mix_synthetic(&m, name, (size_t)count, (uint32_t)seed) < 0) {
+                fprintf(stderr, "Error building mix %s\n", name);
+                pkt_flow_free(&flows);
+                pkt_rules_free(compiled);
+                return 1;
+            }
+            bench_mix(&m);
+            bench_mix_free(&m);
+            ran++;
+        }
+        if (!ran) {
+            fprintf(stderr, "Unknown mix: %s\n", mix_name);
+            pkt_flow_free(&flows);
+            pkt_rules_free(compiled);
+            return 1;
+        }
+    }
+    pkt_flow_free(&flows);
+    pkt_rules_free(compiled);
+    return 0;
+}
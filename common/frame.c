@@ -0,0 +1,286 @@
+//
+//  frame.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "frame.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void frame_decoder_init(struct frame_decoder *d, uint8_t *buf, size_t cap) {
+    d->buf = buf;
+    d->cap = cap;
+    frame_decoder_reset(d);
+}
+
+void frame_decoder_reset(struct frame_decoder *d) {
+    d->head = 0;
+    d->tail = 0;
+    d->state = FRAME_STATE_HEADER;
+    d->payload_len = 0;
+    d->payload_type = FRAME_TYPE_DATA;
+}
+
+// Bytes the frame at head still needs beyond what is buffered
+static size_t frame_missing(const struct frame_decoder *d) {
+    size_t have = d->tail - d->head;
+    size_t want = FRAME_HEADER_LEN;
+    if (d->state == FRAME_STATE_PAYLOAD) {
+        want += d->payload_len;
+    }
+    return want > have ? want - have : 0;
+}
+
+int frame_decoder_compacts(const struct frame_decoder *d) {
+    // Slide the partial frame to the front once the tail gets short; it is
+    // usually a few bytes, and a full buffer always holds a whole frame.
+    // Consumed bytes are never overwritten before that.
+    return d->head > 0 && (d->cap - d->tail < d->cap / 4 || d->cap - d->tail < frame_missing(d));
+}
+
+uint8_t *frame_decoder_space(struct frame_decoder *d, size_t *space) {
+    if (frame_decoder_compacts(d)) {
+        size_t pending = d->tail - d->head;
+        memmove(d->buf, d->buf + d->head, pending);
+        d->head = 0;
+        d->tail = pending;
+    }
+    *space = d->cap - d->tail;
+    return d->buf + d->tail;
+}
+
+void frame_decoder_commit(struct frame_decoder *d, size_t len) {
+    d->tail += len;
+}
+
+ssize_t frame_decoder_recv(struct frame_decoder *d, int fd) {
+    size_t space;
+    uint8_t *dst = frame_decoder_space(d, &space);
+    if (space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        n = recv(fd, dst, space, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) {
+        d->tail += n;
+    }
+    return n;
+}
+
+int frame_decoder_peek(struct frame_decoder *d, struct frame *out) {
+    size_t have = d->tail - d->head;
+
+    if (d->state == FRAME_STATE_ERROR) {
+        return -1;
+    }
+
+    if (d->state == FRAME_STATE_HEADER) {
+        if (have < FRAME_HEADER_LEN) {
+            return 0;
+        }
+        const uint8_t *p = d->buf + d->head;
+        uint32_t len = ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        if (p[0] > FRAME_TYPE_MAX || len == 0 || len > FRAME_MAX_PAYLOAD) {
+            d->state = FRAME_STATE_ERROR;
+            d->payload_len = ((uint32_t)p[0] << 24) | len;
+            return -1;
+        }
+        d->payload_len = len;
+        d->payload_type = p[0];
+        d->state = FRAME_STATE_PAYLOAD;
+    }
+
+    if (have < FRAME_HEADER_LEN + d->payload_len) {
+        return 0;
+    }
+
+    out->data = d->buf + d->head + FRAME_HEADER_LEN;
+    out->len = d->payload_len;
+    out->type = (enum frame_type)d->payload_type;
+    return 1;
+}
+
+void frame_decoder_consume(struct frame_decoder *d) {
+    if (d->state != FRAME_STATE_PAYLOAD) {
+        return;
+    }
+    d->head += FRAME_HEADER_LEN + d->payload_len;
+    d->state = FRAME_STATE_HEADER;
+}
+
+int frame_decoder_next(struct frame_decoder *d, struct frame *out) {
+    int rc = frame_decoder_peek(d, out);
+    if (rc == 1) {
+        frame_decoder_consume(d);
+    }
+    return rc;
+}
+
+void frame_decoder_rebase(struct frame_decoder *d, uint8_t *buf, size_t cap) {
+    size_t pending = d->tail - d->head;
+    memcpy(buf, d->buf + d->head, pending);
+    d->buf = buf;
+    d->cap = cap;
+    d->head = 0;
+    d->tail = pending;
+}
+
+size_t frame_decoder_pending(const struct frame_decoder *d) {
+    return d->tail - d->head;
+}
+
+void frame_encode_header(uint8_t out[FRAME_HEADER_LEN], size_t len) {
+    frame_encode_typed_header(out, FRAME_TYPE_DATA, len);
+}
+
+void frame_encode_typed_header(uint8_t out[FRAME_HEADER_LEN], enum frame_type type, size_t len) {
+    out[0] = (uint8_t)type;
+    out[1] = (uint8_t)(len >> 16);
+    out[2] = (uint8_t)(len >> 8);
+    out[3] = (uint8_t)len;
+}
+
+void frame_put_u64(uint8_t out[8], uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        out[i] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+uint64_t frame_get_u64(const uint8_t in[8]) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | in[i];
+    }
+    return v;
+}
+
+void frame_put_u32(uint8_t out[4], uint32_t v) {
+    out[0] = (uint8_t)(v >> 24);
+    out[1] = (uint8_t)(v >> 16);
+    out[2] = (uint8_t)(v >> 8);
+    out[3] = (uint8_t)v;
+}
+
+uint32_t frame_get_u32(const uint8_t in[4]) {
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+void frame_put_u16(uint8_t out[2], uint16_t v) {
+    out[0] = (uint8_t)(v >> 8);
+    out[1] = (uint8_t)v;
+}
+
+uint16_t frame_get_u16(const uint8_t in[2]) {
+    return (uint16_t)(in[0] << 8 | in[1]);
+}
+
+void frame_batch_init(struct frame_batch *b) {
+    b->count = 0;
+    b->next = 0;
+    b->bytes = 0;
+}
+
+int frame_batch_add(struct frame_batch *b, const void *data, size_t len) {
+    return frame_batch_add_typed(b, FRAME_TYPE_DATA, data, len);
+}
+
+int frame_batch_add_typed(struct frame_batch *b, enum frame_type type, const void *data, size_t len) {
+    if (b->count == FRAME_BATCH_MAX || len == 0 || len > FRAME_MAX_PAYLOAD) {
+        return -1;
+    }
+    uint8_t *header = b->headers[b->count];
+    frame_encode_typed_header(header, type, len);
+
+    struct iovec *iov = &b->iov[2 * b->count];
+    iov[0].iov_base = header;
+    iov[0].iov_len = FRAME_HEADER_LEN;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    b->count++;
+    b->bytes += FRAME_HEADER_LEN + len;
+    return 0;
+}
+
+int frame_batch_full(const struct frame_batch *b) {
+    return b->count == FRAME_BATCH_MAX;
+}
+
+ssize_t frame_batch_write(struct frame_batch *b, int fd) {
+    if (b->bytes == 0) {
+        return 0;
+    }
+
+    ssize_t n;
+    do {
+        n = writev(fd, b->iov + b->next, 2 * b->count - b->next);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return -1;
+    }
+
+    // Step over what went out; the first iovec left may be cut
+    size_t left = n;
+    b->bytes -= left;
+    while (left > 0) {
+        struct iovec *iov = &b->iov[b->next];
+        if (left < iov->iov_len) {
+            iov->iov_base = (uint8_t *)iov->iov_base + left;
+            iov->iov_len -= left;
+            break;
+        }
+        left -= iov->iov_len;
+        b->next++;
+    }
+
+    if (b->bytes == 0) {
+        frame_batch_init(b);
+    }
+    return n;
+}
+
+int frame_batch_flush(struct frame_batch *b, int fd) {
+    while (b->bytes > 0) {
+        if (frame_batch_write(b, fd) < 0) {
+            frame_batch_init(b);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+size_t frame_batch_pending(const struct frame_batch *b) {
+    return b->bytes;
+}
+
+size_t frame_batch_partial(const struct frame_batch *b) {
+    if (b->bytes == 0) {
+        return 0;
+    }
+    const struct iovec *iov = &b->iov[b->next];
+    if (b->next % 2 == 1) {
+        return iov[0].iov_len;
+    }
+    if (iov[0].iov_len < FRAME_HEADER_LEN) {
+        return iov[0].iov_len + iov[1].iov_len;
+    }
+    return 0;
+}
+
+void frame_batch_copy(const struct frame_batch *b, uint8_t *dst, size_t len) {
+    for (int i = b->next; len > 0 && i < 2 * b->count; i++) {
+        size_t chunk = b->iov[i].iov_len < len ? b->iov[i].iov_len : len;
+        memcpy(dst, b->iov[i].iov_base, chunk);
+        dst += chunk;
+        len -= chunk;
+    }
+}
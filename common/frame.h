@@ -0,0 +1,264 @@
+//
+//  frame.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Streaming decoder for the length-prefixed tunnel protocol, shared by the
+//  Ubuntu server and the macOS extension. Each frame is a 4-byte big-endian
+//  length followed by that many bytes of IP packet. The top byte of the
+//  length word is the frame type; data frames leave it zero, so they are
+//  encoded exactly as before control frames existed.
+//
+//  The decoder owns no memory: it parses frames out of a caller-supplied
+//  receive buffer that is filled with large reads and compacted only when
+//  the tail runs short, so one recv() typically yields many frames and a
+//  short read never costs frame sync. Until a compaction, consumed frames
+//  stay where they are and may be used in place.
+//
+//  The batch writer goes the other way: it gathers the headers and payloads
+//  of many packets into one iovec array, so a burst leaves in one writev().
+//
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define FRAME_HEADER_LEN 4
+#define FRAME_MAX_PAYLOAD 65535
+#define FRAME_MAX_LEN (FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD)
+
+// Receive buffer size that fits two maximum frames, so a large frame never
+// has to wait for a compaction to make room
+#define FRAME_RX_BUFFER_SIZE (2 * FRAME_MAX_LEN)
+
+enum frame_type {
+    FRAME_TYPE_DATA = 0,    // one IP packet
+    FRAME_TYPE_HELLO = 1,   // session handshake: u64 session id, u64 data frames received,
+                            // optionally u32 features, then with FRAME_FEATURE_STRIPE a
+                            // client's u8 connection index and u8 pool size (stripe.h)
+    FRAME_TYPE_ACK = 2,     // u64 data frames received so far
+    FRAME_TYPE_GSO = 3,     // data frame: u16 segment payload size, then an IPv4 TCP or UDP
+                            // super-packet to cut into segments (gso.h); only sent to
+                            // clients announcing FRAME_FEATURE_GSO
+    FRAME_TYPE_LZ = 4,      // a chunk of frames compressed against the connection's
+                            // earlier ones (lz.h); only once both HELLOs named
+                            // FRAME_FEATURE_LZ
+    FRAME_TYPE_KEY = 5,     // opens an encrypted connection: u8 cipher suite, then a random
+                            // (seal.h); the server answers with its own
+    FRAME_TYPE_SEALED = 6,  // u64 sequence number, encrypted frames, tag; after the KEY
+                            // exchange every frame travels in one of these
+};
+
+#define FRAME_TYPE_MAX FRAME_TYPE_SEALED
+#define FRAME_HELLO_LEN 16
+#define FRAME_HELLO_FEATURES_LEN 20
+#define FRAME_HELLO_STRIPE_LEN 22
+#define FRAME_ACK_LEN 8
+#define FRAME_GSO_PREFIX_LEN 2
+
+// Client features, announced in its HELLO. The server's HELLO carries the
+// ones it agreed to when that includes FRAME_FEATURE_LZ or
+// FRAME_FEATURE_STRIPE.
+#define FRAME_FEATURE_GSO 0x1
+#define FRAME_FEATURE_LZ 0x2
+#define FRAME_FEATURE_STRIPE 0x4
+
+enum frame_state {
+    FRAME_STATE_HEADER,     // waiting for a complete length prefix
+    FRAME_STATE_PAYLOAD,    // length known, waiting for the payload
+    FRAME_STATE_ERROR,      // invalid length seen; the stream is unusable
+};
+
+struct frame_decoder {
+    uint8_t *buf;
+    size_t cap;
+    size_t head;            // first byte not yet consumed
+    size_t tail;            // end of received data
+    enum frame_state state;
+    uint32_t payload_len;   // valid in FRAME_STATE_PAYLOAD
+    uint8_t payload_type;   // valid in FRAME_STATE_PAYLOAD
+};
+
+struct frame {
+    const uint8_t *data;
+    size_t len;
+    enum frame_type type;
+};
+
+// Frames per batch; at two iovecs each a full batch stays well under IOV_MAX
+#define FRAME_BATCH_MAX 64
+
+struct frame_batch {
+    struct iovec iov[2 * FRAME_BATCH_MAX];
+    uint8_t headers[FRAME_BATCH_MAX][FRAME_HEADER_LEN];
+    int count;              // frames queued
+    int next;               // first iovec not completely written
+    size_t bytes;           // bytes not yet written, headers included
+};
+
+/**
+ * Attach a decoder to a receive buffer
+ * @param d Decoder
+ * @param buf Buffer of at least FRAME_MAX_LEN bytes
+ * @param cap Buffer size
+ */
+void frame_decoder_init(struct frame_decoder *d, uint8_t *buf, size_t cap);
+
+/**
+ * Forget any buffered data and clear an error
+ */
+void frame_decoder_reset(struct frame_decoder *d);
+
+/**
+ * Perform a single recv() into all free space
+ * @param d Decoder
+ * @param fd Stream socket
+ * @return Bytes received, 0 on EOF, -1 on error (errno set; EAGAIN included)
+ */
+ssize_t frame_decoder_recv(struct frame_decoder *d, int fd);
+
+/**
+ * Free space for callers that receive by other means; compacts if needed
+ * @param d Decoder
+ * @param space Output: writable bytes at the returned pointer
+ * @return Where the next received bytes go
+ */
+uint8_t *frame_decoder_space(struct frame_decoder *d, size_t *space);
+
+/**
+ * Whether the next space or recv call will move buffered bytes to the front,
+ * overwriting frames already consumed. Callers that keep pointers into the
+ * buffer rebase onto a fresh one instead.
+ */
+int frame_decoder_compacts(const struct frame_decoder *d);
+
+/**
+ * Account for bytes written at frame_decoder_space()
+ */
+void frame_decoder_commit(struct frame_decoder *d, size_t len);
+
+/**
+ * Look at the next complete frame without consuming it
+ * @param d Decoder
+ * @param out Output frame; points into the receive buffer and stays valid
+ *            until a recv or space call compacts it (frame_decoder_compacts)
+ * @return 1 if a frame is available, 0 if more data is needed, -1 on a
+ *         protocol error (invalid length or type)
+ */
+int frame_decoder_peek(struct frame_decoder *d, struct frame *out);
+
+/**
+ * Drop the frame returned by the last successful peek
+ */
+void frame_decoder_consume(struct frame_decoder *d);
+
+/**
+ * Peek and consume in one step
+ * @return Same as frame_decoder_peek
+ */
+int frame_decoder_next(struct frame_decoder *d, struct frame *out);
+
+/**
+ * Move buffered, unconsumed bytes into a new receive buffer, e.g. when the
+ * old one must stay untouched because decoded frames still point into it
+ * @param d Decoder
+ * @param buf New buffer of at least FRAME_MAX_LEN bytes, or when it only
+ *            holds the bytes until the next rebase, at least
+ *            frame_decoder_pending() bytes
+ * @param cap New buffer size
+ */
+void frame_decoder_rebase(struct frame_decoder *d, uint8_t *buf, size_t cap);
+
+/**
+ * Bytes received but not yet consumed
+ */
+size_t frame_decoder_pending(const struct frame_decoder *d);
+
+/**
+ * Write the length prefix for a payload
+ * @param out 4-byte output
+ * @param len Payload length, at most FRAME_MAX_PAYLOAD
+ */
+void frame_encode_header(uint8_t out[FRAME_HEADER_LEN], size_t len);
+
+/**
+ * Write the header of a frame of any type
+ * @param out 4-byte output
+ * @param type Frame type
+ * @param len Payload length, at most FRAME_MAX_PAYLOAD
+ */
+void frame_encode_typed_header(uint8_t out[FRAME_HEADER_LEN], enum frame_type type, size_t len);
+
+/**
+ * Big-endian fields of control frames
+ */
+void frame_put_u64(uint8_t out[8], uint64_t v);
+uint64_t frame_get_u64(const uint8_t in[8]);
+void frame_put_u32(uint8_t out[4], uint32_t v);
+uint32_t frame_get_u32(const uint8_t in[4]);
+void frame_put_u16(uint8_t out[2], uint16_t v);
+uint16_t frame_get_u16(const uint8_t in[2]);
+
+/**
+ * Empty a batch
+ */
+void frame_batch_init(struct frame_batch *b);
+
+/**
+ * Queue one packet; the batch points at data until it is written or cleared
+ * @param b Batch
+ * @param data Payload
+ * @param len Payload length, 1 to FRAME_MAX_PAYLOAD
+ * @return 0 on success, -1 if the batch is full or the length is invalid
+ */
+int frame_batch_add(struct frame_batch *b, const void *data, size_t len);
+
+/**
+ * Queue a frame of any type, e.g. a control frame
+ * @return Same as frame_batch_add
+ */
+int frame_batch_add_typed(struct frame_batch *b, enum frame_type type, const void *data, size_t len);
+
+/**
+ * Whether the batch has no room for another packet
+ */
+int frame_batch_full(const struct frame_batch *b);
+
+/**
+ * Write as much of the batch as one writev() takes and advance past it;
+ * a fully written batch is emptied
+ * @param b Batch
+ * @param fd Stream socket
+ * @return Bytes written, or -1 on error (errno set; EAGAIN included)
+ */
+ssize_t frame_batch_write(struct frame_batch *b, int fd);
+
+/**
+ * Write the whole batch to a blocking socket
+ * @return 0 on success, -1 on error (errno set); the batch is emptied either way
+ */
+int frame_batch_flush(struct frame_batch *b, int fd);
+
+/**
+ * Bytes not yet written
+ */
+size_t frame_batch_pending(const struct frame_batch *b);
+
+/**
+ * Bytes still owed for the frame a short write stopped inside, 0 if it
+ * stopped on a frame boundary. These must be sent before anything else.
+ */
+size_t frame_batch_partial(const struct frame_batch *b);
+
+/**
+ * Copy the first len unwritten bytes, e.g. into a send queue
+ * @param b Batch
+ * @param dst Output
+ * @param len At most frame_batch_pending()
+ */
+void frame_batch_copy(const struct frame_batch *b, uint8_t *dst, size_t len);
+
+#endif
@@ -0,0 +1,372 @@
+//
+//  frame_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "frame.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+static uint8_t rx_buf[FRAME_RX_BUFFER_SIZE];
+
+// Append one frame of len bytes, each byte set to fill
+static size_t put_frame(uint8_t *out, size_t len, uint8_t fill) {
+    frame_encode_header(out, len);
+    memset(out + FRAME_HEADER_LEN, fill, len);
+    return FRAME_HEADER_LEN + len;
+}
+
+static void feed(struct frame_decoder *d, const uint8_t *data, size_t len) {
+    size_t space;
+    uint8_t *dst = frame_decoder_space(d, &space);
+    assert(space >= len);
+    memcpy(dst, data, len);
+    frame_decoder_commit(d, len);
+}
+
+void test_byte_at_a_time() {
+    static uint8_t stream[3 * FRAME_MAX_LEN];
+    size_t len = 0;
+    len += put_frame(stream + len, 1, 0x11);
+    len += put_frame(stream + len, 1400, 0x22);
+    len += put_frame(stream + len, FRAME_MAX_PAYLOAD, 0x33);
+
+    struct frame_decoder d;
+    struct frame f;
+    size_t sizes[3] = { 1, 1400, FRAME_MAX_PAYLOAD };
+    uint8_t fills[3] = { 0x11, 0x22, 0x33 };
+    int got = 0;
+
+    frame_decoder_init(&d, rx_buf, sizeof(rx_buf));
+    for (size_t i = 0; i < len; i++) {
+        feed(&d, stream + i, 1);
+        while (frame_decoder_next(&d, &f) == 1) {
+            assert(f.len == sizes[got]);
+            assert(f.data[0] == fills[got] && f.data[f.len - 1] == fills[got]);
+            got++;
+        }
+    }
+    assert(got == 3);
+    assert(frame_decoder_pending(&d) == 0);
+
+    printf("✓ Byte-at-a-time reassembly test passed\n");
+}
+
+void test_many_frames_per_recv() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    uint8_t stream[64 * (FRAME_HEADER_LEN + 100)];
+    size_t len = 0;
+    for (int i = 0; i < 64; i++) {
+        len += put_frame(stream + len, 100, (uint8_t)i);
+    }
+    assert(write(sv[0], stream, len) == (ssize_t)len);
+
+    struct frame_decoder d;
+    struct frame f;
+    frame_decoder_init(&d, rx_buf, sizeof(rx_buf));
+
+    assert(frame_decoder_recv(&d, sv[1]) == (ssize_t)len);
+    int got = 0;
+    while (frame_decoder_next(&d, &f) == 1) {
+        assert(f.len == 100 && f.data[0] == got);
+        got++;
+    }
+    assert(got == 64);
+
+    close(sv[0]);
+    assert(frame_decoder_recv(&d, sv[1]) == 0);
+    close(sv[1]);
+
+    printf("✓ Many frames per recv test passed\n");
+}
+
+void test_nonblocking_short_reads() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+    struct frame_decoder d;
+    struct frame f;
+    frame_decoder_init(&d, rx_buf, sizeof(rx_buf));
+
+    uint8_t stream[FRAME_HEADER_LEN + 1500];
+    size_t len = put_frame(stream, 1500, 0x5a);
+
+    // Header split across writes, payload split mid-way
+    size_t cuts[] = { 2, 3, 700, len };
+    size_t off = 0;
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+        assert(write(sv[0], stream + off, cuts[i] - off) == (ssize_t)(cuts[i] - off));
+        off = cuts[i];
+        assert(frame_decoder_recv(&d, sv[1]) > 0);
+        int rc = frame_decoder_next(&d, &f);
+        assert(rc == (off == len ? 1 : 0));
+    }
+    assert(f.len == 1500 && f.data[1499] == 0x5a);
+
+    assert(frame_decoder_recv(&d, sv[1]) == -1 && errno == EAGAIN);
+    close(sv[0]);
+    close(sv[1]);
+
+    printf("✓ Non-blocking short read test passed\n");
+}
+
+void test_compaction_keeps_sync() {
+    static uint8_t stream[FRAME_RX_BUFFER_SIZE];
+    struct frame_decoder d;
+    struct frame f;
+    frame_decoder_init(&d, rx_buf, sizeof(rx_buf));
+
+    // Fill most of the buffer with frames, leave a partial large frame at
+    // the end, then complete it after the tail has run out
+    size_t len = 0;
+    while (len + FRAME_HEADER_LEN + 1000 < sizeof(rx_buf) - 100) {
+        len += put_frame(stream + len, 1000, 0x01);
+    }
+    uint8_t big[FRAME_MAX_LEN];
+    size_t big_len = put_frame(big, 60000, 0x77);
+    feed(&d, stream, len);
+    feed(&d, big, 50);
+
+    int got = 0;
+    while (frame_decoder_next(&d, &f) == 1) {
+        assert(f.len == 1000);
+        got++;
+    }
+    assert(got > 0);
+    assert(frame_decoder_pending(&d) == 50);
+    assert(d.tail > sizeof(rx_buf) - 2000);
+
+    feed(&d, big + 50, big_len - 50);
+    assert(d.head == 0);
+    assert(frame_decoder_next(&d, &f) == 1);
+    assert(f.len == 60000 && f.data[0] == 0x77 && f.data[59999] == 0x77);
+
+    printf("✓ Compaction sync test passed\n");
+}
+
+void test_invalid_length() {
+    struct frame_decoder d;
+    struct frame f;
+    uint8_t zero[FRAME_HEADER_LEN] = { 0, 0, 0, 0 };
+    uint8_t huge[FRAME_HEADER_LEN] = { 0, 1, 0, 0 };
+
+    frame_decoder_init(&d, rx_buf, sizeof(rx_buf));
+    feed(&d, zero, sizeof(zero));
+    assert(frame_decoder_next(&d, &f) == -1);
+    assert(frame_decoder_next(&d, &f) == -1);
+
+    frame_decoder_reset(&d);
+    feed(&d, huge, sizeof(huge));
+    assert(frame_decoder_next(&d, &f) == -1);
+
+    printf("✓ Invalid length test passed\n");
+}
+
+void test_typed_frames() {
+    struct frame_decoder d;
+    struct frame f;
+    uint8_t stream[64];
+    uint8_t hello[FRAME_HELLO_LEN], ack[FRAME_ACK_LEN];
+    uint8_t bad[FRAME_HEADER_LEN + 1] = { FRAME_TYPE_MAX + 1, 0, 0, 1, 0 };
+    size_t len = 0;
+
+    frame_put_u64(hello, 0x0123456789abcdefull);
+    frame_put_u64(hello + 8, 42);
+    frame_put_u64(ack, 1ull << 40);
+
+    frame_encode_typed_header(stream, FRAME_TYPE_HELLO, sizeof(hello));
+    memcpy(stream + FRAME_HEADER_LEN, hello, sizeof(hello));
+    len += FRAME_HEADER_LEN + sizeof(hello);
+    len += put_frame(stream + len, 3, 0x33);
+    frame_encode_typed_header(stream + len, FRAME_TYPE_ACK, sizeof(ack));
+    memcpy(stream + len + FRAME_HEADER_LEN, ack, sizeof(ack));
+    len += FRAME_HEADER_LEN + sizeof(ack);
+
+    // A data header is the plain four-byte length
+    assert(stream[FRAME_HEADER_LEN + sizeof(hello)] == 0);
+
+    frame_decoder_init(&d, rx_buf, sizeof(rx_buf));
+    feed(&d, stream, len);
+    assert(frame_decoder_next(&d, &f) == 1);
+    assert(f.type == FRAME_TYPE_HELLO && f.len == FRAME_HELLO_LEN);
+    assert(frame_get_u64(f.data) == 0x0123456789abcdefull && frame_get_u64(f.data + 8) == 42);
+    assert(frame_decoder_next(&d, &f) == 1);
+    assert(f.type == FRAME_TYPE_DATA && f.len == 3 && f.data[2] == 0x33);
+    assert(frame_decoder_next(&d, &f) == 1);
+    assert(f.type == FRAME_TYPE_ACK && frame_get_u64(f.data) == 1ull << 40);
+    assert(frame_decoder_next(&d, &f) == 0);
+
+    // Narrower fields are big-endian too
+    uint8_t field[4];
+    frame_put_u32(field, 0x01020304);
+    assert(field[0] == 1 && field[3] == 4 && frame_get_u32(field) == 0x01020304);
+    frame_put_u16(field, 1400);
+    assert(field[0] == 0x05 && field[1] == 0x78 && frame_get_u16(field) == 1400);
+
+    // Unknown types are a protocol error
+    feed(&d, bad, sizeof(bad));
+    assert(frame_decoder_next(&d, &f) == -1);
+
+    printf("✓ Typed frames test passed\n");
+}
+
+void test_peek_and_rebase() {
+    static uint8_t other[FRAME_RX_BUFFER_SIZE];
+    uint8_t stream[2 * (FRAME_HEADER_LEN + 64)];
+    size_t len = put_frame(stream, 64, 0xa1);
+    len += put_frame(stream + len, 64, 0xa2);
+
+    struct frame_decoder d;
+    struct frame f;
+    frame_decoder_init(&d, rx_buf, sizeof(rx_buf));
+    feed(&d, stream, len - 10);
+
+    assert(frame_decoder_peek(&d, &f) == 1 && f.data[0] == 0xa1);
+    assert(frame_decoder_peek(&d, &f) == 1 && f.data[0] == 0xa1);
+    frame_decoder_consume(&d);
+
+    // The partial second frame moves; the first stays where it was
+    frame_decoder_rebase(&d, other, sizeof(other));
+    assert(rx_buf[FRAME_HEADER_LEN] == 0xa1);
+    feed(&d, stream + len - 10, 10);
+    assert(frame_decoder_next(&d, &f) == 1);
+    assert(f.data >= other && f.data < other + sizeof(other));
+    assert(f.len == 64 && f.data[63] == 0xa2);
+
+    printf("✓ Peek and rebase test passed\n");
+}
+
+void test_consumed_frames_stay() {
+    struct frame_decoder d;
+    struct frame f;
+    uint8_t stream[FRAME_HEADER_LEN + 500];
+    size_t len = put_frame(stream, 500, 0x3c);
+
+    frame_decoder_init(&d, rx_buf, sizeof(rx_buf));
+    feed(&d, stream, len);
+    assert(frame_decoder_next(&d, &f) == 1);
+    const uint8_t *first = f.data;
+
+    // Later data lands behind the consumed frame until the tail runs short
+    while (!frame_decoder_compacts(&d)) {
+        feed(&d, stream, len);
+        assert(frame_decoder_next(&d, &f) == 1);
+        assert(f.data > first && first[0] == 0x3c && first[499] == 0x3c);
+    }
+    assert(sizeof(rx_buf) - d.tail < sizeof(rx_buf) / 4);
+
+    printf("✓ Consumed frames stay test passed\n");
+}
+
+void test_batch_single_writev() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    static uint8_t payloads[FRAME_BATCH_MAX][200];
+    struct frame_batch b;
+    frame_batch_init(&b);
+    for (int i = 0; i < FRAME_BATCH_MAX; i++) {
+        memset(payloads[i], i, sizeof(payloads[i]));
+        assert(frame_batch_add(&b, payloads[i], 1 + i) == 0);
+    }
+    assert(frame_batch_full(&b));
+    assert(frame_batch_add(&b, payloads[0], 10) == -1);
+
+    size_t total = frame_batch_pending(&b);
+    assert(frame_batch_write(&b, sv[0]) == (ssize_t)total);
+    assert(frame_batch_pending(&b) == 0 && !frame_batch_full(&b));
+
+    struct frame_decoder d;
+    struct frame f;
+    frame_decoder_init(&d, rx_buf, sizeof(rx_buf));
+    assert(frame_decoder_recv(&d, sv[1]) == (ssize_t)total);
+    for (int i = 0; i < FRAME_BATCH_MAX; i++) {
+        assert(frame_decoder_next(&d, &f) == 1);
+        assert(f.len == (size_t)(1 + i) && f.data[0] == i);
+    }
+    assert(frame_decoder_next(&d, &f) == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+
+    printf("✓ Batch single writev test passed\n");
+}
+
+void test_batch_short_write() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    int sndbuf = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    static uint8_t big[3][FRAME_MAX_PAYLOAD];
+    struct frame_batch b;
+    frame_batch_init(&b);
+    for (int i = 0; i < 3; i++) {
+        memset(big[i], 0xc0 + i, sizeof(big[i]));
+        assert(frame_batch_add(&b, big[i], sizeof(big[i])) == 0);
+    }
+
+    // The socket takes only part of the batch; the rest is what a caller
+    // would queue, starting with the tail of the frame that was cut
+    ssize_t n = frame_batch_write(&b, sv[0]);
+    assert(n > 0 && (size_t)n < 3 * FRAME_MAX_LEN);
+    size_t pending = frame_batch_pending(&b);
+    assert(pending == 3 * FRAME_MAX_LEN - (size_t)n);
+    size_t partial = frame_batch_partial(&b);
+    assert(partial == (FRAME_MAX_LEN - (size_t)n % FRAME_MAX_LEN) % FRAME_MAX_LEN);
+
+    static uint8_t rest[3 * FRAME_MAX_LEN];
+    frame_batch_copy(&b, rest, pending);
+
+    // Reassemble what was written and what was copied; it must decode cleanly
+    static uint8_t stream[3 * FRAME_MAX_LEN];
+    size_t got = 0;
+    while (got < (size_t)n) {
+        ssize_t r = recv(sv[1], stream + got, n - got, 0);
+        assert(r > 0);
+        got += r;
+    }
+    memcpy(stream + got, rest, pending);
+
+    struct frame_decoder d;
+    struct frame f;
+    static uint8_t buf[4 * FRAME_MAX_LEN];
+    frame_decoder_init(&d, buf, sizeof(buf));
+    feed(&d, stream, sizeof(stream));
+    for (int i = 0; i < 3; i++) {
+        assert(frame_decoder_next(&d, &f) == 1);
+        assert(f.len == FRAME_MAX_PAYLOAD && f.data[0] == 0xc0 + i && f.data[f.len - 1] == 0xc0 + i);
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+
+    printf("✓ Batch short write test passed\n");
+}
+
+int main() {
+    printf("Running frame codec unit tests...\n");
+
+    test_byte_at_a_time();
+    test_many_frames_per_recv();
+    test_nonblocking_short_reads();
+    test_compaction_keeps_sync();
+    test_invalid_length();
+    test_typed_frames();
+    test_peek_and_rebase();
+    test_consumed_frames_stay();
+    test_batch_single_writev();
+    test_batch_short_write();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,149 @@
+//
+//  gso.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "gso.h"
+
+#include <string.h>
+
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+// Ones' complement sum of big-endian 16-bit words, not yet folded
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, size_t len) {
+    while (len > 1) {
+        sum += get16(p);
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        sum += (uint32_t)p[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+int gso_iter_init(struct gso_iter *g, const uint8_t *pkt, size_t len, size_t mss) {
+    if (len < 20 || (pkt[0] >> 4) != 4 || mss == 0) {
+        return -1;
+    }
+    size_t ihl = (size_t)(pkt[0] & 0x0f) * 4;
+    if (ihl < 20 || get16(pkt + 2) != len || (get16(pkt + 6) & 0x3fff) != 0) {
+        return -1;
+    }
+
+    size_t l4_len;
+    if (pkt[9] == IP_PROTO_TCP) {
+        if (len < ihl + 20) {
+            return -1;
+        }
+        l4_len = (size_t)(pkt[ihl + 12] >> 4) * 4;
+        if (l4_len < 20) {
+            return -1;
+        }
+    } else if (pkt[9] == IP_PROTO_UDP) {
+        l4_len = 8;
+    } else {
+        return -1;
+    }
+    if (len < ihl + l4_len) {
+        return -1;
+    }
+
+    g->pkt = pkt;
+    g->len = len;
+    g->hdr_len = ihl + l4_len;
+    g->mss = mss;
+    g->off = 0;
+    g->count = 0;
+    g->proto = pkt[9];
+    return 0;
+}
+
+size_t gso_iter_max_segment(const struct gso_iter *g) {
+    return g->hdr_len + g->mss;
+}
+
+size_t gso_iter_segments(const struct gso_iter *g) {
+    size_t payload = g->len - g->hdr_len;
+    return payload == 0 ? 1 : (payload + g->mss - 1) / g->mss;
+}
+
+size_t gso_iter_next(struct gso_iter *g, uint8_t *out) {
+    size_t payload = g->len - g->hdr_len;
+    if (g->off >= payload && (payload > 0 || g->count > 0)) {
+        return 0;
+    }
+    size_t chunk = payload - g->off < g->mss ? payload - g->off : g->mss;
+    int last = g->off + chunk == payload;
+    size_t ihl = (size_t)(g->pkt[0] & 0x0f) * 4;
+    size_t seg_len = g->hdr_len + chunk;
+    uint8_t *l4 = out + ihl;
+
+    memcpy(out, g->pkt, g->hdr_len);
+    memcpy(out + g->hdr_len, g->pkt + g->hdr_len + g->off, chunk);
+
+    // IP: own length and id, fresh header checksum
+    put16(out + 2, (uint16_t)seg_len);
+    put16(out + 4, (uint16_t)(get16(g->pkt + 4) + g->count));
+    put16(out + 10, 0);
+    put16(out + 10, csum_fold(csum_add(0, out, ihl)));
+
+    // Pseudo-header for the transport checksum
+    size_t l4_len = seg_len - ihl;
+    uint32_t sum = csum_add(0, out + 12, 8) + g->proto + (uint32_t)l4_len;
+
+    if (g->proto == IP_PROTO_TCP) {
+        uint32_t seq = ((uint32_t)get16(l4 + 4) << 16 | get16(l4 + 6)) + (uint32_t)g->off;
+        put16(l4 + 4, (uint16_t)(seq >> 16));
+        put16(l4 + 6, (uint16_t)seq);
+        // FIN and PSH end the burst; CWR answers congestion once
+        if (!last) {
+            l4[13] &= (uint8_t)~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        }
+        if (g->count > 0) {
+            l4[13] &= (uint8_t)~TCP_FLAG_CWR;
+        }
+        put16(l4 + 16, 0);
+        put16(l4 + 16, csum_fold(csum_add(sum, l4, l4_len)));
+    } else {
+        put16(l4 + 4, (uint16_t)l4_len);
+        put16(l4 + 6, 0);
+        uint16_t csum = csum_fold(csum_add(sum, l4, l4_len));
+        put16(l4 + 6, csum ? csum : 0xffff);
+    }
+
+    g->off += chunk;
+    g->count++;
+    return seg_len;
+}
+
+int gso_finish_checksum(uint8_t *pkt, size_t len, size_t start, size_t offset) {
+    if (start >= len || offset + 2 > len - start) {
+        return -1;
+    }
+    // The field holds the pseudo-header sum, so it is simply summed along
+    uint16_t csum = csum_fold(csum_add(0, pkt + start, len - start));
+    put16(pkt + start + offset, csum ? csum : 0xffff);
+    return 0;
+}
@@ -0,0 +1,71 @@
+//
+//  gso.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Software segmentation of IPv4 TCP and UDP super-packets, the up to 64 KB
+//  packets a TUN device with offloads hands out in one read. Each segment
+//  gets its own copy of the IP and transport headers with the lengths,
+//  IP id, TCP sequence number and flags, and every checksum fixed up, so
+//  it is exactly what the sender's stack would have put on the wire.
+//
+//  The server segments for peers that cannot take super-packets; the
+//  extension segments the ones it receives before injecting them.
+//
+
+#ifndef GSO_H
+#define GSO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct gso_iter {
+    const uint8_t *pkt;
+    size_t len;
+    size_t hdr_len;     // IP and transport headers, repeated in every segment
+    size_t mss;         // payload bytes per segment
+    size_t off;         // payload bytes already emitted
+    unsigned count;     // segments emitted
+    uint8_t proto;
+};
+
+/**
+ * Start cutting a super-packet into segments
+ * @param g Iterator
+ * @param pkt IPv4 packet with a TCP or UDP payload; must stay untouched
+ *            until the last segment is made
+ * @param len Packet length
+ * @param mss Payload bytes per segment
+ * @return 0 on success, -1 if the packet cannot be segmented
+ */
+int gso_iter_init(struct gso_iter *g, const uint8_t *pkt, size_t len, size_t mss);
+
+/**
+ * Largest segment gso_iter_next() writes
+ */
+size_t gso_iter_max_segment(const struct gso_iter *g);
+
+/**
+ * Number of segments the packet is cut into
+ */
+size_t gso_iter_segments(const struct gso_iter *g);
+
+/**
+ * Write the next segment
+ * @param g Iterator
+ * @param out At least gso_iter_max_segment() bytes
+ * @return Segment length, or 0 once every segment was made
+ */
+size_t gso_iter_next(struct gso_iter *g, uint8_t *out);
+
+/**
+ * Complete a checksum the sender left partial: fold the bytes from start
+ * to the end of the packet into the seed stored at start + offset
+ * @param pkt Packet
+ * @param len Packet length
+ * @param start First byte covered
+ * @param offset Position of the checksum field, relative to start
+ * @return 0 on success, -1 if the positions are outside the packet
+ */
+int gso_finish_checksum(uint8_t *pkt, size_t len, size_t start, size_t offset);
+
+#endif
@@ -0,0 +1,169 @@
+//
+//  gso_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "gso.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+static uint8_t pkt[65535];
+static uint8_t seg[2048];
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// Ones' complement sum over data plus a pseudo-header; 0xffff when valid
+static uint16_t sum(const uint8_t *p, size_t len, uint32_t acc) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        acc += get16(p + i);
+    }
+    if (len & 1) {
+        acc += (uint32_t)p[len - 1] << 8;
+    }
+    while (acc >> 16) {
+        acc = (acc & 0xffff) + (acc >> 16);
+    }
+    return (uint16_t)acc;
+}
+
+static uint32_t pseudo(const uint8_t *ip, size_t l4_len) {
+    uint32_t acc = ip[9] + (uint32_t)l4_len;
+    for (int i = 12; i < 20; i += 2) {
+        acc += get16(ip + i);
+    }
+    return acc;
+}
+
+// 10.8.0.1 -> 10.8.0.33, IP id 0x1000, DF, the given transport header size
+static size_t build(uint8_t proto, size_t l4_hdr, size_t payload) {
+    size_t len = 20 + l4_hdr + payload;
+    memset(pkt, 0, 20 + l4_hdr);
+    pkt[0] = 0x45;
+    pkt[2] = (uint8_t)(len >> 8);
+    pkt[3] = (uint8_t)len;
+    pkt[4] = 0x10;
+    pkt[6] = 0x40;
+    pkt[8] = 64;
+    pkt[9] = proto;
+    pkt[12] = 10, pkt[13] = 8, pkt[15] = 1;
+    pkt[16] = 10, pkt[17] = 8, pkt[19] = 33;
+    for (size_t i = 0; i < payload; i++) {
+        pkt[20 + l4_hdr + i] = (uint8_t)(i * 7);
+    }
+    return len;
+}
+
+void test_tcp_segments() {
+    struct gso_iter g;
+    size_t len = build(6, 32, 3000);
+    uint8_t *tcp = pkt + 20;
+    tcp[0] = 0x00, tcp[1] = 25;             // source port 25
+    tcp[4] = 0xff, tcp[5] = 0xff, tcp[6] = 0xff, tcp[7] = 0x00;    // seq wraps
+    tcp[12] = 8 << 4;                       // 32-byte header
+    tcp[13] = 0x80 | 0x10 | 0x08 | 0x01;    // CWR ACK PSH FIN
+    tcp[20] = 1, tcp[21] = 1;               // options travel along
+
+    assert(gso_iter_init(&g, pkt, len, 1000) == 0);
+    assert(gso_iter_segments(&g) == 3);
+    assert(gso_iter_max_segment(&g) == 52 + 1000);
+
+    size_t n, total = 0;
+    unsigned i = 0;
+    while ((n = gso_iter_next(&g, seg)) > 0) {
+        assert(n == 52 + 1000);
+        assert(get16(seg + 2) == n && get16(seg + 4) == 0x1000 + i);
+        assert(sum(seg, 20, 0) == 0xffff);
+        assert(sum(seg + 20, n - 20, pseudo(seg, n - 20)) == 0xffff);
+
+        uint8_t *t = seg + 20;
+        uint32_t seq = (uint32_t)get16(t + 4) << 16 | get16(t + 6);
+        assert(seq == 0xffffff00u + 1000 * i);
+        assert(t[20] == 1 && t[21] == 1);
+        assert((t[13] & 0x10) && !!(t[13] & 0x80) == (i == 0));
+        assert(!!(t[13] & 0x09) == (i == 2) && (i < 2 || (t[13] & 0x09) == 0x09));
+        assert(seg[52] == (uint8_t)(total * 7) && seg[n - 1] == (uint8_t)((total + 999) * 7));
+        total += n - 52;
+        i++;
+    }
+    assert(i == 3 && total == 3000);
+    assert(gso_iter_next(&g, seg) == 0);
+
+    printf("✓ TCP segmentation test passed\n");
+}
+
+void test_udp_segments() {
+    struct gso_iter g;
+    size_t len = build(17, 8, 2500);
+
+    assert(gso_iter_init(&g, pkt, len, 1200) == 0);
+    assert(gso_iter_segments(&g) == 3);
+
+    size_t sizes[] = { 1200, 1200, 100 };
+    for (int i = 0; i < 3; i++) {
+        size_t n = gso_iter_next(&g, seg);
+        assert(n == 28 + sizes[i]);
+        assert(get16(seg + 24) == 8 + sizes[i]);
+        assert(sum(seg, 20, 0) == 0xffff);
+        assert(sum(seg + 20, n - 20, pseudo(seg, n - 20)) == 0xffff);
+    }
+    assert(gso_iter_next(&g, seg) == 0);
+
+    printf("✓ UDP segmentation test passed\n");
+}
+
+void test_small_and_invalid() {
+    struct gso_iter g;
+
+    // A packet within the segment size comes out once, checksummed
+    size_t len = build(6, 20, 100);
+    pkt[20 + 12] = 5 << 4;
+    assert(gso_iter_init(&g, pkt, len, 1400) == 0);
+    assert(gso_iter_next(&g, seg) == len);
+    assert(sum(seg + 20, len - 20, pseudo(seg, len - 20)) == 0xffff);
+    assert(gso_iter_next(&g, seg) == 0);
+
+    // Not segmentable: other protocols, fragments, wrong lengths
+    len = build(1, 8, 100);
+    assert(gso_iter_init(&g, pkt, len, 1400) == -1);
+    len = build(17, 8, 100);
+    pkt[6] = 0x20;
+    assert(gso_iter_init(&g, pkt, len, 1400) == -1);
+    len = build(17, 8, 100);
+    assert(gso_iter_init(&g, pkt, len - 1, 1400) == -1);
+    assert(gso_iter_init(&g, pkt, len, 0) == -1);
+
+    printf("✓ Small and invalid packet test passed\n");
+}
+
+void test_finish_checksum() {
+    size_t len = build(6, 20, 333);
+    uint8_t *tcp = pkt + 20;
+    tcp[12] = 5 << 4;
+
+    // The sender leaves the folded pseudo-header sum in the field
+    uint16_t seed = sum(NULL, 0, pseudo(pkt, len - 20));
+    tcp[16] = (uint8_t)(seed >> 8);
+    tcp[17] = (uint8_t)seed;
+    assert(gso_finish_checksum(pkt, len, 20, 16) == 0);
+    assert(sum(tcp, len - 20, pseudo(pkt, len - 20)) == 0xffff);
+
+    assert(gso_finish_checksum(pkt, len, len, 0) == -1);
+    assert(gso_finish_checksum(pkt, len, 20, len - 21) == -1);
+
+    printf("✓ Checksum completion test passed\n");
+}
+
+int main() {
+    printf("Running segmentation unit tests...\n");
+
+    test_tcp_segments();
+    test_udp_segments();
+    test_small_and_invalid();
+    test_finish_checksum();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,65 @@
+//
+//  ip6.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "ip6.h"
+
+// Next header values of the extension headers skipped
+#define IP6_HOPOPTS 0
+#define IP6_ROUTING 43
+#define IP6_FRAGMENT 44
+#define IP6_AUTH 51
+#define IP6_DSTOPTS 60
+
+int ip6_upper_layer(const uint8_t *pkt, size_t len, uint8_t *proto, size_t *offset) {
+    if (len < IP6_HEADER_LEN || (pkt[0] >> 4) != 6) {
+        return 0;
+    }
+
+    uint8_t next = pkt[6];
+    size_t off = IP6_HEADER_LEN;
+    for (int i = 0; i <= IP6_MAX_EXT_HEADERS; i++) {
+        size_t ext_len;
+        switch (next) {
+        case IP6_HOPOPTS:
+        case IP6_ROUTING:
+        case IP6_DSTOPTS:
+            if (len - off < 8) {
+                return 0;
+            }
+            ext_len = ((size_t)pkt[off + 1] + 1) * 8;
+            break;
+        case IP6_FRAGMENT:
+            if (len - off < 8) {
+                return 0;
+            }
+            // Only the first fragment holds the upper-layer header
+            if (((pkt[off + 2] << 8 | pkt[off + 3]) & 0xfff8) != 0) {
+                return 0;
+            }
+            ext_len = 8;
+            break;
+        case IP6_AUTH:
+            if (len - off < 8) {
+                return 0;
+            }
+            ext_len = ((size_t)pkt[off + 1] + 2) * 4;
+            break;
+        default:
+            // ESP and no next header end the chain with nothing to parse
+            if (next == 50 || next == 59) {
+                return 0;
+            }
+            *proto = next;
+            *offset = off;
+            return 1;
+        }
+        if (len - off < ext_len) {
+            return 0;
+        }
+        next = pkt[off];
+        off += ext_len;
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+//
+//  ip6.h
+//  Net-Rewire shared tunnel protocol
+//
+//  IPv6 header helpers shared by the classifier, the flow hash and the
+//  server. Extension headers are walked in place, a bounded number of them
+//  and never past the buffer, so a crafted chain costs no more than a few
+//  loads. Tunnel addresses are the IPv4 ones embedded under IP6_TUNNEL_PREFIX
+//  (10.8.0.33 is fd00:8::a08:21), which lets the server key an IPv6 client
+//  by the same 32-bit address as its IPv4 traffic.
+//
+
+#ifndef IP6_H
+#define IP6_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define IP6_HEADER_LEN 40
+
+// Extension headers walked before giving up on finding the upper layer
+#define IP6_MAX_EXT_HEADERS 8
+
+// fd00:8::/96, the first 12 bytes of every tunnel address
+#define IP6_TUNNEL_PREFIX "\xfd\x00\x00\x08\x00\x00\x00\x00\x00\x00\x00\x00"
+#define IP6_TUNNEL_PREFIX_LEN 96
+
+/**
+ * Find the upper-layer header of an IPv6 packet, skipping hop-by-hop,
+ * routing, fragment, destination and authentication headers
+ * @param pkt Packet, starting at the IPv6 header
+ * @param len Packet length
+ * @param proto Output, upper-layer protocol (IPPROTO_TCP, ...)
+ * @param offset Output, where its header starts; at most len
+ * @return 1 if found, 0 for a packet that is not IPv6, is truncated, has
+ *         more than IP6_MAX_EXT_HEADERS, carries no upper layer (no next
+ *         header, ESP) or is a fragment other than the first
+ */
+int ip6_upper_layer(const uint8_t *pkt, size_t len, uint8_t *proto, size_t *offset);
+
+/**
+ * IPv4 address a tunnel address embeds
+ * @param addr IPv6 address, 16 bytes
+ * @param v4 Output, address in network byte order
+ * @return 1 if addr is under IP6_TUNNEL_PREFIX, 0 otherwise
+ */
+static inline int ip6_tunnel_v4(const uint8_t *addr, uint32_t *v4) {
+    if (memcmp(addr, IP6_TUNNEL_PREFIX, 12) != 0) {
+        return 0;
+    }
+    memcpy(v4, addr + 12, sizeof(*v4));
+    return 1;
+}
+
+/**
+ * Fold an IPv6 address into 32 bits for hashing; the four words are
+ * XORed, so an embedded IPv4 address still spreads flows
+ * @param addr IPv6 address, 16 bytes
+ * @return Folded address, in no particular byte order
+ */
+static inline uint32_t ip6_fold(const uint8_t *addr) {
+    uint32_t w[4];
+    memcpy(w, addr, sizeof(w));
+    return w[0] ^ w[1] ^ w[2] ^ w[3];
+}
+
+#endif
@@ -0,0 +1,115 @@
+//
+//  ip6_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "ip6.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// IPv6 header with first_next, then each of the chain's headers 8 bytes long
+static size_t make_packet(uint8_t *pkt, uint8_t first_next, const uint8_t *chain, int count) {
+    size_t len = 40 + (size_t)count * 8 + 20;
+    memset(pkt, 0, len);
+    pkt[0] = 0x60;
+    pkt[6] = first_next;
+    for (int i = 0; i < count; i++) {
+        pkt[40 + i * 8] = chain[i];
+    }
+    return len;
+}
+
+void test_upper_layer() {
+    uint8_t pkt[256], proto;
+    size_t off;
+
+    make_packet(pkt, 6, NULL, 0);
+    assert(ip6_upper_layer(pkt, 60, &proto, &off) == 1 && proto == 6 && off == 40);
+
+    // Hop-by-hop, routing, destination options, each 8 bytes
+    const uint8_t chain[] = { 43, 60, 17 };
+    make_packet(pkt, 0, chain, 3);
+    assert(ip6_upper_layer(pkt, 84, &proto, &off) == 1 && proto == 17 && off == 64);
+
+    // Length fields count in 8-byte units, and in 4-byte units for AH
+    const uint8_t ah[] = { 6 };
+    make_packet(pkt, 51, ah, 1);
+    pkt[41] = 1;
+    assert(ip6_upper_layer(pkt, 80, &proto, &off) == 1 && proto == 6 && off == 52);
+    pkt[6] = 60;
+    assert(ip6_upper_layer(pkt, 80, &proto, &off) == 1 && off == 56);
+
+    // Nothing to parse behind ESP or no next header
+    make_packet(pkt, 50, NULL, 0);
+    assert(ip6_upper_layer(pkt, 60, &proto, &off) == 0);
+    make_packet(pkt, 59, NULL, 0);
+    assert(ip6_upper_layer(pkt, 60, &proto, &off) == 0);
+
+    // Not IPv6, or cut short
+    make_packet(pkt, 6, NULL, 0);
+    pkt[0] = 0x45;
+    assert(ip6_upper_layer(pkt, 60, &proto, &off) == 0);
+    pkt[0] = 0x60;
+    assert(ip6_upper_layer(pkt, 39, &proto, &off) == 0);
+    make_packet(pkt, 0, ah, 1);
+    assert(ip6_upper_layer(pkt, 47, &proto, &off) == 0);
+
+    // The upper layer may start right at the end
+    assert(ip6_upper_layer(pkt, 48, &proto, &off) == 1 && off == 48);
+
+    printf("✓ Upper layer test passed\n");
+}
+
+void test_ext_limit() {
+    uint8_t pkt[256], chain[IP6_MAX_EXT_HEADERS + 1], proto;
+    size_t off;
+
+    memset(chain, 60, sizeof(chain));
+    chain[IP6_MAX_EXT_HEADERS - 1] = 6;
+    size_t len = make_packet(pkt, 60, chain, IP6_MAX_EXT_HEADERS);
+    assert(ip6_upper_layer(pkt, len, &proto, &off) == 1 && proto == 6);
+
+    chain[IP6_MAX_EXT_HEADERS - 1] = 60;
+    chain[IP6_MAX_EXT_HEADERS] = 6;
+    len = make_packet(pkt, 60, chain, IP6_MAX_EXT_HEADERS + 1);
+    assert(ip6_upper_layer(pkt, len, &proto, &off) == 0);
+
+    // A fragment header counts, and only the first fragment goes through
+    const uint8_t frag[] = { 6 };
+    len = make_packet(pkt, 44, frag, 1);
+    pkt[43] = 0x01;
+    assert(ip6_upper_layer(pkt, len, &proto, &off) == 1 && off == 48);
+    pkt[42] = 0x01;
+    assert(ip6_upper_layer(pkt, len, &proto, &off) == 0);
+
+    printf("✓ Extension limit test passed\n");
+}
+
+void test_tunnel_addr() {
+    uint8_t addr[16], other[16];
+    uint32_t v4;
+
+    assert(inet_pton(AF_INET6, "fd00:8::a08:21", addr) == 1);
+    assert(ip6_tunnel_v4(addr, &v4) == 1 && v4 == inet_addr("10.8.0.33"));
+    assert(inet_pton(AF_INET6, "fd00:9::a08:21", other) == 1);
+    assert(ip6_tunnel_v4(other, &v4) == 0);
+
+    // Folding keeps the embedded address apart from its neighbours
+    assert(inet_pton(AF_INET6, "fd00:8::a08:22", other) == 1);
+    assert(ip6_fold(addr) != ip6_fold(other));
+
+    printf("✓ Tunnel address test passed\n");
+}
+
+int main() {
+    printf("Running IPv6 header unit tests...\n");
+
+    test_upper_layer();
+    test_ext_limit();
+    test_tunnel_addr();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,252 @@
+//
+//  lz.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "lz.h"
+
+#include <string.h>
+
+// LZ4 block rules: matches are at least 4 bytes, the last match starts at
+// least 12 bytes before the end and the last 5 bytes are always literals
+#define LZ_MIN_MATCH 4
+#define LZ_MF_LIMIT 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(const uint8_t *p) {
+    return (read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Keep only the last LZ_WINDOW bytes once the next chunk might not fit
+static size_t lz_slide(uint8_t *window, size_t pos) {
+    if (pos <= LZ_WINDOW) {
+        return 0;
+    }
+    size_t shift = pos - LZ_WINDOW;
+    memmove(window, window + shift, LZ_WINDOW);
+    return shift;
+}
+
+void lz_encoder_init(struct lz_encoder *e, void *mem) {
+    e->table = mem;
+    e->window = (uint8_t *)mem + (sizeof(uint32_t) << LZ_HASH_BITS);
+    e->pos = 0;
+    memset(e->table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+}
+
+uint8_t *lz_encoder_chunk(struct lz_encoder *e) {
+    size_t shift = lz_slide(e->window, e->pos);
+    if (shift > 0) {
+        e->pos -= shift;
+        for (size_t i = 0; i < (1u << LZ_HASH_BITS); i++) {
+            e->table[i] = e->table[i] > shift ? e->table[i] - (uint32_t)shift : 0;
+        }
+    }
+    return e->window + e->pos;
+}
+
+// Lengths past 15 continue in bytes of 255 and a remainder
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) {
+        op = put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) {
+        return op;
+    }
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match_len -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(match_len < 15 ? match_len : 15);
+    if (match_len >= 15) {
+        op = put_length(op, match_len - 15);
+    }
+    return op;
+}
+
+size_t lz_encoder_compress(struct lz_encoder *e, size_t len, uint8_t *out) {
+    uint8_t *window = e->window;
+    const uint8_t *ip = window + e->pos;
+    const uint8_t *anchor = ip;
+    const uint8_t *end = ip + len;
+    uint8_t *op = out;
+
+    if (len > LZ_MF_LIMIT) {
+        const uint8_t *mf_limit = end - LZ_MF_LIMIT;
+        const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+
+        while (ip < mf_limit) {
+            uint32_t h = lz_hash(ip);
+            uint32_t ref = e->table[h];
+            e->table[h] = (uint32_t)(ip - window) + 1;
+
+            // Entries past the history were left by a chunk that was not
+            // kept; they are only a candidate if the bytes agree
+            const uint8_t *match = ref ? window + ref - 1 : ip;
+            if (match >= ip || ip - match > LZ_MAX_OFFSET || read32(match) != read32(ip)) {
+                // Skip faster through data that keeps missing
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t match_len = LZ_MIN_MATCH;
+            while (ip + match_len < match_limit && match[match_len] == ip[match_len]) {
+                match_len++;
+            }
+            op = put_sequence(op, anchor, (size_t)(ip - anchor), (size_t)(ip - match), match_len);
+            ip += match_len;
+            anchor = ip;
+            if (ip < mf_limit) {
+                e->table[lz_hash(ip - 2)] = (uint32_t)(ip - 2 - window) + 1;
+            }
+        }
+    }
+    op = put_sequence(op, anchor, (size_t)(end - anchor), 0, 0);
+
+    size_t n = (size_t)(op - out);
+    if (n >= len) {
+        return 0;
+    }
+    e->pos += len;
+    return n;
+}
+
+void lz_decoder_init(struct lz_decoder *d, void *mem) {
+    d->window = mem;
+    d->pos = 0;
+}
+
+// A length continued in bytes of 255; -1 if the input ends inside it
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+long lz_decoder_decompress(struct lz_decoder *d, const uint8_t *in, size_t len, const uint8_t **out) {
+    d->pos -= lz_slide(d->window, d->pos);
+
+    uint8_t *start = d->window + d->pos;
+    uint8_t *op = start;
+    uint8_t *op_end = start + LZ_CHUNK_MAX;
+    const uint8_t *ip = in;
+    const uint8_t *end = in + len;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, end, &lit_len) < 0) {
+            return -1;
+        }
+        if (lit_len > (size_t)(end - ip) || lit_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, end, &match_len) < 0) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - d->window) || match_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+        // Byte by byte: a match may overlap the bytes it produces
+        const uint8_t *match = op - offset;
+        for (size_t i = 0; i < match_len; i++) {
+            op[i] = match[i];
+        }
+        op += match_len;
+    }
+
+    d->pos += (size_t)(op - start);
+    *out = start;
+    return (long)(op - start);
+}
+
+// Compress the frames from first to last, serialized at chunk, into one
+// frame; if that does not pay, queue them as they are
+static uint8_t *lz_emit(struct lz_encoder *e, const struct frame_batch *in, int first, int last,
+                        size_t len, struct frame_batch *out, uint8_t *scratch) {
+    size_t n = len >= LZ_CHUNK_MIN ? lz_encoder_compress(e, len, scratch) : 0;
+    if (n > 0) {
+        frame_batch_add_typed(out, FRAME_TYPE_LZ, scratch, n);
+        return scratch + n;
+    }
+    for (int i = first; i < last; i++) {
+        const struct iovec *iov = &in->iov[2 * i];
+        const uint8_t *header = iov[0].iov_base;
+        frame_batch_add_typed(out, (enum frame_type)header[0], iov[1].iov_base, iov[1].iov_len);
+    }
+    return scratch;
+}
+
+void lz_compress_batch(struct lz_encoder *e, struct frame_batch *in, struct frame_batch *out, uint8_t *scratch) {
+    uint8_t *chunk = lz_encoder_chunk(e);
+    size_t len = 0;
+    int first = 0;
+
+    frame_batch_init(out);
+    for (int i = 0; i < in->count; i++) {
+        const struct iovec *iov = &in->iov[2 * i];
+        size_t frame_len = iov[0].iov_len + iov[1].iov_len;
+
+        if (len > 0 && (len + frame_len > LZ_CHUNK_MAX || frame_len > LZ_CHUNK_MAX)) {
+            scratch = lz_emit(e, in, first, i, len, out, scratch);
+            chunk = lz_encoder_chunk(e);
+            len = 0;
+        }
+        if (frame_len > LZ_CHUNK_MAX) {
+            const uint8_t *header = iov[0].iov_base;
+            frame_batch_add_typed(out, (enum frame_type)header[0], iov[1].iov_base, iov[1].iov_len);
+            first = i + 1;
+            continue;
+        }
+        if (len == 0) {
+            first = i;
+        }
+        memcpy(chunk + len, iov[0].iov_base, iov[0].iov_len);
+        memcpy(chunk + len + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+        len += frame_len;
+    }
+    if (len > 0) {
+        lz_emit(e, in, first, in->count, len, out, scratch);
+    }
+    frame_batch_init(in);
+}
@@ -0,0 +1,107 @@
+//
+//  lz.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Streaming compression of frame batches for links that pay by the byte.
+//  Runs of frames are compressed in chunks of up to LZ_CHUNK_MAX bytes in
+//  the LZ4 block format, and every chunk may refer back into the last
+//  LZ_WINDOW bytes of the ones before it on the same connection, so the
+//  headers and boilerplate of a mail transfer compress across packets, not
+//  only within them. Each side keeps one encoder and one decoder per
+//  connection; both work in memory the caller hands over once, so nothing
+//  is allocated per frame.
+//
+//  A chunk that would not shrink is left out of the history and its frames
+//  go as they are, so incompressible traffic costs nothing but the attempt.
+//
+
+#ifndef LZ_H
+#define LZ_H
+
+#include "frame.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_WINDOW (32 * 1024)
+#define LZ_CHUNK_MAX (16 * 1024)
+
+// Chunks shorter than this are not worth a compressed frame
+#define LZ_CHUNK_MIN 64
+
+// Largest compressed form of len bytes
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+#define LZ_HASH_BITS 12
+#define LZ_ENCODER_MEM ((sizeof(uint32_t) << LZ_HASH_BITS) + LZ_WINDOW + LZ_CHUNK_MAX)
+#define LZ_DECODER_MEM (LZ_WINDOW + LZ_CHUNK_MAX)
+
+// Scratch lz_compress_batch() writes compressed frames to: every frame of a
+// full batch could end a chunk of its own
+#define LZ_BATCH_SCRATCH (FRAME_BATCH_MAX * LZ_BOUND(LZ_CHUNK_MAX))
+
+struct lz_encoder {
+    uint32_t *table;        // window offset + 1 of the last position with each hash
+    uint8_t *window;        // history, then the chunk being compressed
+    size_t pos;             // end of history
+};
+
+struct lz_decoder {
+    uint8_t *window;
+    size_t pos;
+};
+
+/**
+ * Start an encoder with empty history, e.g. for a new connection
+ * @param e Encoder
+ * @param mem LZ_ENCODER_MEM bytes, suitably aligned for uint32_t; owned
+ *            by the caller
+ */
+void lz_encoder_init(struct lz_encoder *e, void *mem);
+
+/**
+ * Where the next chunk's bytes go; older history may be moved to make room
+ * @return LZ_CHUNK_MAX writable bytes
+ */
+uint8_t *lz_encoder_chunk(struct lz_encoder *e);
+
+/**
+ * Compress the chunk written at lz_encoder_chunk()
+ * @param e Encoder
+ * @param len Chunk length, at most LZ_CHUNK_MAX
+ * @param out At least LZ_BOUND(len) bytes
+ * @return Compressed length; 0 if it would not be shorter, in which case the
+ *         chunk stays out of the history and must be sent as it is
+ */
+size_t lz_encoder_compress(struct lz_encoder *e, size_t len, uint8_t *out);
+
+/**
+ * Start a decoder with empty history
+ * @param d Decoder
+ * @param mem LZ_DECODER_MEM bytes; owned by the caller
+ */
+void lz_decoder_init(struct lz_decoder *d, void *mem);
+
+/**
+ * Decompress one chunk and add it to the history
+ * @param d Decoder
+ * @param in Compressed chunk
+ * @param len Compressed length
+ * @param out Output: the chunk, valid until the next call
+ * @return Chunk length, or -1 if the input is corrupt; the history is
+ *         unusable afterwards
+ */
+long lz_decoder_decompress(struct lz_decoder *d, const uint8_t *in, size_t len, const uint8_t **out);
+
+/**
+ * Compress a batch: runs of frames become FRAME_TYPE_LZ frames, while
+ * frames larger than a chunk and runs that would not shrink keep their own
+ * frames, in order
+ * @param e Encoder
+ * @param in Batch nothing was written from yet; emptied
+ * @param out Output batch; points into scratch and at in's payloads
+ * @param scratch At least LZ_BATCH_SCRATCH bytes
+ */
+void lz_compress_batch(struct lz_encoder *e, struct frame_batch *in, struct frame_batch *out, uint8_t *scratch);
+
+#endif
@@ -0,0 +1,212 @@
+//
+//  lz_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "lz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+static uint32_t enc_mem[LZ_ENCODER_MEM / sizeof(uint32_t)];
+static uint8_t dec_mem[LZ_DECODER_MEM];
+static uint8_t out[LZ_BOUND(LZ_CHUNK_MAX)];
+static uint8_t scratch[LZ_BATCH_SCRATCH];
+
+static struct lz_encoder enc;
+static struct lz_decoder dec;
+
+// A line of a mail body, different on every call
+static size_t mail_line(char *dst, unsigned n) {
+    return (size_t)sprintf(dst, "Subject: quarterly report %u\r\nContent-Type: text/plain; charset=utf-8\r\n"
+                                "Please find the figures for region %u attached.\r\n", n, n * 7);
+}
+
+// Compress one chunk and check the decoder reproduces it
+static size_t round_trip(const uint8_t *data, size_t len) {
+    memcpy(lz_encoder_chunk(&enc), data, len);
+    size_t n = lz_encoder_compress(&enc, len, out);
+    if (n == 0) {
+        return 0;
+    }
+    const uint8_t *got;
+    assert(lz_decoder_decompress(&dec, out, n, &got) == (long)len);
+    assert(memcmp(got, data, len) == 0);
+    return n;
+}
+
+void test_round_trip() {
+    char text[LZ_CHUNK_MAX];
+    size_t len = 0;
+    unsigned line = 0;
+
+    lz_encoder_init(&enc, enc_mem);
+    lz_decoder_init(&dec, dec_mem);
+    while (len + 200 < sizeof(text)) {
+        len += mail_line(text + len, line++);
+    }
+    size_t first = round_trip((uint8_t *)text, len);
+    assert(first > 0 && first < len / 3);
+
+    // The same text again refers back to the history almost entirely
+    size_t again = round_trip((uint8_t *)text, len);
+    assert(again > 0 && again < first / 4);
+
+    printf("✓ Round trip test passed\n");
+}
+
+void test_window_slides() {
+    char text[4096];
+    unsigned line = 0;
+
+    lz_encoder_init(&enc, enc_mem);
+    lz_decoder_init(&dec, dec_mem);
+
+    // Far more than the window, in chunks of varying size
+    for (int i = 0; i < 200; i++) {
+        size_t len = 0;
+        size_t want = 500 + (size_t)(i * 37) % 3000;
+        while (len < want) {
+            len += mail_line(text + len, line++ % 50);
+        }
+        assert(round_trip((uint8_t *)text, len) > 0);
+    }
+    assert(enc.pos <= LZ_WINDOW + LZ_CHUNK_MAX && dec.pos == enc.pos);
+
+    printf("✓ Window slide test passed\n");
+}
+
+void test_incompressible() {
+    uint8_t noise[2000];
+    char text[2000];
+    size_t len = 0;
+
+    lz_encoder_init(&enc, enc_mem);
+    lz_decoder_init(&dec, dec_mem);
+    srand(7);
+    for (size_t i = 0; i < sizeof(noise); i++) {
+        noise[i] = (uint8_t)rand();
+    }
+    while (len + 200 < sizeof(text)) {
+        len += mail_line(text + len, 3);
+    }
+
+    // Noise stays out of the history, so the decoder keeps up without it
+    assert(round_trip((uint8_t *)text, len) > 0);
+    assert(round_trip(noise, sizeof(noise)) == 0);
+    assert(enc.pos == dec.pos);
+    assert(round_trip((uint8_t *)text, len) > 0);
+
+    printf("✓ Incompressible data test passed\n");
+}
+
+void test_corrupt_input() {
+    const uint8_t *got;
+
+    lz_decoder_init(&dec, dec_mem);
+
+    // A match reaching before the start of the history
+    uint8_t far[] = { 0x14, 'a', 0x10, 0x00, 0x00 };
+    assert(lz_decoder_decompress(&dec, far, sizeof(far), &got) == -1);
+
+    // Literals running past the input
+    lz_decoder_init(&dec, dec_mem);
+    uint8_t short_lit[] = { 0x50, 'a', 'b' };
+    assert(lz_decoder_decompress(&dec, short_lit, sizeof(short_lit), &got) == -1);
+
+    // Output longer than a chunk
+    lz_decoder_init(&dec, dec_mem);
+    uint8_t big[80];
+    size_t n = 0;
+    big[n++] = 0x1f;
+    big[n++] = 'x';
+    big[n++] = 1;
+    big[n++] = 0;
+    for (int i = 0; i < 70; i++) {
+        big[n++] = 255;
+    }
+    big[n++] = 0;
+    assert(lz_decoder_decompress(&dec, big, n, &got) == -1);
+
+    // A plain literal run is fine
+    lz_decoder_init(&dec, dec_mem);
+    uint8_t lit[] = { 0x30, 'a', 'b', 'c' };
+    assert(lz_decoder_decompress(&dec, lit, sizeof(lit), &got) == 3 && memcmp(got, "abc", 3) == 0);
+
+    printf("✓ Corrupt input test passed\n");
+}
+
+void test_batch() {
+    static uint8_t big[LZ_CHUNK_MAX + 100];
+    char lines[8][256];
+    size_t lens[8];
+    struct frame_batch in, outb;
+
+    lz_encoder_init(&enc, enc_mem);
+    lz_decoder_init(&dec, dec_mem);
+    memset(big, 'z', sizeof(big));
+
+    // Four small frames, one too big for a chunk, four more and a tiny ACK
+    frame_batch_init(&in);
+    for (int i = 0; i < 4; i++) {
+        lens[i] = mail_line(lines[i], i);
+        frame_batch_add(&in, lines[i], lens[i]);
+    }
+    frame_batch_add_typed(&in, FRAME_TYPE_GSO, big, sizeof(big));
+    for (int i = 4; i < 8; i++) {
+        lens[i] = mail_line(lines[i], i);
+        frame_batch_add(&in, lines[i], lens[i]);
+    }
+    lz_compress_batch(&enc, &in, &outb, scratch);
+    assert(in.count == 0 && in.bytes == 0);
+    assert(outb.count == 3);
+
+    int line = 0;
+    for (int k = 0; k < 3; k++) {
+        const uint8_t *header = outb.iov[2 * k].iov_base;
+        const uint8_t *payload = outb.iov[2 * k + 1].iov_base;
+        size_t len = outb.iov[2 * k + 1].iov_len;
+        if (k == 1) {
+            assert(header[0] == FRAME_TYPE_GSO && payload == big && len == sizeof(big));
+            continue;
+        }
+        assert(header[0] == FRAME_TYPE_LZ);
+
+        // A compressed frame holds whole frames
+        const uint8_t *chunk;
+        long n = lz_decoder_decompress(&dec, payload, len, &chunk);
+        assert(n > 0);
+        struct frame_decoder d;
+        struct frame f;
+        frame_decoder_init(&d, (uint8_t *)chunk, (size_t)n);
+        frame_decoder_commit(&d, (size_t)n);
+        for (int i = 0; i < 4; i++, line++) {
+            assert(frame_decoder_next(&d, &f) == 1);
+            assert(f.type == FRAME_TYPE_DATA && f.len == lens[line] && memcmp(f.data, lines[line], f.len) == 0);
+        }
+        assert(frame_decoder_pending(&d) == 0);
+    }
+
+    // Too little to be worth compressing goes as it is
+    uint8_t ack[FRAME_ACK_LEN] = { 0 };
+    frame_batch_add_typed(&in, FRAME_TYPE_ACK, ack, sizeof(ack));
+    lz_compress_batch(&enc, &in, &outb, scratch);
+    assert(outb.count == 1 && ((uint8_t *)outb.iov[0].iov_base)[0] == FRAME_TYPE_ACK);
+    assert(outb.iov[1].iov_base == ack);
+
+    printf("✓ Batch compression test passed\n");
+}
+
+int main() {
+    printf("Running compression unit tests...\n");
+
+    test_round_trip();
+    test_window_slides();
+    test_incompressible();
+    test_corrupt_input();
+    test_batch();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,189 @@
+//
+//  metrics.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// Exported histogram buckets: every power of two from about 1 us to 34 s
+#define METRICS_EXPORT_MIN_BITS 10
+#define METRICS_EXPORT_MAX_BITS 35
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[METRICS_COUNTERS] = {
+    [METRICS_TUN_TO_SOCKET_PACKETS] = { "tun_to_socket_packets_total", "Packets read from the TUN device and queued for the tunnel" },
+    [METRICS_TUN_TO_SOCKET_BYTES] = { "tun_to_socket_bytes_total", "Bytes of those packets" },
+    [METRICS_SOCKET_TO_TUN_PACKETS] = { "socket_to_tun_packets_total", "Packets received from the tunnel and written to the TUN device" },
+    [METRICS_SOCKET_TO_TUN_BYTES] = { "socket_to_tun_bytes_total", "Bytes of those packets" },
+    [METRICS_DROPS] = { "drops_total", "Packets dropped in either direction" },
+    [METRICS_RATE_LIMITED] = { "rate_limited_total", "Of those, packets from clients over their rate caps" },
+    [METRICS_SHORT_READS] = { "short_reads_total", "Reads too short to hold an IP packet" },
+    [METRICS_INVALID_LENGTHS] = { "invalid_lengths_total", "Frames with a length the tunnel cannot carry" },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} path_info[METRICS_PATHS] = {
+    [METRICS_TUN_TO_SOCKET] = { "tun_to_socket_latency_seconds", "From reading a packet off the TUN device to sending it" },
+    [METRICS_SOCKET_TO_TUN] = { "socket_to_tun_latency_seconds", "From receiving packets to writing them to the TUN device" },
+};
+
+static const double export_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+size_t metrics_hist_bucket(uint64_t ns) {
+    if (ns < (1u << METRICS_HIST_SUB_BITS)) {
+        return (size_t)ns;
+    }
+    int k = 63 - __builtin_clzll(ns);
+    if (k >= METRICS_HIST_MAX_BITS) {
+        return METRICS_HIST_BUCKETS - 1;
+    }
+    size_t sub = (size_t)(ns >> (k - METRICS_HIST_SUB_BITS)) & ((1u << METRICS_HIST_SUB_BITS) - 1);
+    return ((size_t)(k - METRICS_HIST_SUB_BITS + 1) << METRICS_HIST_SUB_BITS) + sub;
+}
+
+uint64_t metrics_hist_floor(size_t bucket) {
+    size_t group = bucket >> METRICS_HIST_SUB_BITS;
+    uint64_t sub = bucket & ((1u << METRICS_HIST_SUB_BITS) - 1);
+    if (group == 0) {
+        return sub;
+    }
+    return ((1u << METRICS_HIST_SUB_BITS) + sub) << (group - 1);
+}
+
+void metrics_record(struct metrics *m, enum metrics_path path, uint64_t ns) {
+    struct metrics_hist *h = &m->latency[path];
+    size_t b = metrics_hist_bucket(ns);
+    __atomic_store_n(&h->buckets[b], __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum_ns, __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) + ns, __ATOMIC_RELAXED);
+}
+
+void metrics_merge(struct metrics *into, const struct metrics *from) {
+    for (int c = 0; c < METRICS_COUNTERS; c++) {
+        into->counters[c] += __atomic_load_n(&from->counters[c], __ATOMIC_RELAXED);
+    }
+    for (int p = 0; p < METRICS_PATHS; p++) {
+        for (size_t b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            into->latency[p].buckets[b] += __atomic_load_n(&from->latency[p].buckets[b], __ATOMIC_RELAXED);
+        }
+        into->latency[p].sum_ns += __atomic_load_n(&from->latency[p].sum_ns, __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t hist_count(const struct metrics_hist *h) {
+    uint64_t n = 0;
+    for (size_t b = 0; b < METRICS_HIST_BUCKETS; b++) {
+        n += h->buckets[b];
+    }
+    return n;
+}
+
+uint64_t metrics_hist_quantile(const struct metrics_hist *h, double q) {
+    uint64_t count = hist_count(h);
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > count) {
+        rank = count;
+    }
+
+    uint64_t seen = 0;
+    size_t b = 0;
+    for (; b < METRICS_HIST_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    uint64_t lo = metrics_hist_floor(b);
+    if (b == METRICS_HIST_BUCKETS - 1) {
+        return lo;
+    }
+    return lo + (metrics_hist_floor(b + 1) - lo) / 2;
+}
+
+void metrics_put(struct metrics_text *t, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    size_t room = t->len < t->cap ? t->cap - t->len : 0;
+    int n = vsnprintf(room ? t->buf + t->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        t->len += (size_t)n;
+    }
+}
+
+static void put_header(struct metrics_text *t, const char *name, const char *help, const char *type) {
+    metrics_put(t, "# HELP netrewire_%s %s\n# TYPE netrewire_%s %s\n", name, help, name, type);
+}
+
+static void put_histogram(struct metrics_text *t, const struct metrics_hist *h, const char *name, const char *help) {
+    uint64_t below = 0;
+    size_t b = 0;
+
+    put_header(t, name, help, "histogram");
+    for (int e = METRICS_EXPORT_MIN_BITS; e <= METRICS_EXPORT_MAX_BITS; e++) {
+        size_t end = metrics_hist_bucket((uint64_t)1 << e);
+        for (; b < end; b++) {
+            below += h->buckets[b];
+        }
+        metrics_put(t, "netrewire_%s_bucket{le=\"%.12g\"} %llu\n", name, (double)((uint64_t)1 << e) / 1e9,
+            (unsigned long long)below);
+    }
+    metrics_put(t, "netrewire_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)hist_count(h));
+    metrics_put(t, "netrewire_%s_sum %.9f\n", name, (double)h->sum_ns / 1e9);
+    metrics_put(t, "netrewire_%s_count %llu\n", name, (unsigned long long)hist_count(h));
+}
+
+// The histogram's own precision, which the exported buckets lose
+static void put_quantiles(struct metrics_text *t, const struct metrics_hist *h, const char *name) {
+    char quantile_name[96];
+    snprintf(quantile_name, sizeof(quantile_name), "%.*s_quantile_seconds", (int)(strlen(name) - strlen("_seconds")),
+             name);
+    put_header(t, quantile_name, "Latency quantiles, to within 12.5%", "gauge");
+    for (size_t i = 0; i < sizeof(export_quantiles) / sizeof(export_quantiles[0]); i++) {
+        metrics_put(t, "netrewire_%s{quantile=\"%g\"} %.9f\n", quantile_name, export_quantiles[i],
+            (double)metrics_hist_quantile(h, export_quantiles[i]) / 1e9);
+    }
+}
+
+size_t metrics_format(char *buf, size_t cap, const struct metrics *const *sets, int count, const char *label) {
+    struct metrics_text t = { buf, cap, 0 };
+    struct metrics total;
+
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < count; i++) {
+        metrics_merge(&total, sets[i]);
+    }
+
+    for (int c = 0; c < METRICS_COUNTERS; c++) {
+        put_header(&t, counter_info[c].name, counter_info[c].help, "counter");
+        if (!label) {
+            metrics_put(&t, "netrewire_%s %llu\n", counter_info[c].name, (unsigned long long)total.counters[c]);
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            metrics_put(&t, "netrewire_%s{%s=\"%d\"} %llu\n", counter_info[c].name, label, i,
+                (unsigned long long)__atomic_load_n(&sets[i]->counters[c], __ATOMIC_RELAXED));
+        }
+    }
+    for (int p = 0; p < METRICS_PATHS; p++) {
+        put_histogram(&t, &total.latency[p], path_info[p].name, path_info[p].help);
+        put_quantiles(&t, &total.latency[p], path_info[p].name);
+    }
+
+    if (cap > 0) {
+        buf[t.len < cap ? t.len : cap - 1] = '\0';
+    }
+    return t.len;
+}
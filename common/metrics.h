@@ -0,0 +1,126 @@
+//
+//  metrics.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Counters and latency histograms for the forwarding paths, cheap enough
+//  to update for every packet. Each set has exactly one writing thread (a
+//  server worker, or one of the extension's threads), so an update is a
+//  relaxed load and store with no lock and no atomic read-modify-write;
+//  any other thread may read a set at the same time and sees every value
+//  as it was at some recent instant.
+//
+//  The histograms are HDR-style: log-linear buckets with 8 per power of
+//  two, so any latency from a nanosecond to about 18 minutes is kept to
+//  within 12.5%. metrics_format() renders sets as Prometheus text.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum metrics_counter {
+    METRICS_TUN_TO_SOCKET_PACKETS,  // read from the TUN device, sent to the peer
+    METRICS_TUN_TO_SOCKET_BYTES,
+    METRICS_SOCKET_TO_TUN_PACKETS,  // received from the peer, written to the TUN device
+    METRICS_SOCKET_TO_TUN_BYTES,
+    METRICS_DROPS,                  // packets given up on, either way
+    METRICS_RATE_LIMITED,           // of those, packets from clients over their caps
+    METRICS_SHORT_READS,            // reads too short to hold an IP packet
+    METRICS_INVALID_LENGTHS,        // frames with a length the stream cannot carry
+    METRICS_COUNTERS,
+};
+
+enum metrics_path {
+    METRICS_TUN_TO_SOCKET,
+    METRICS_SOCKET_TO_TUN,
+    METRICS_PATHS,
+};
+
+// Values below 1 << METRICS_HIST_SUB_BITS get a bucket each; above, every
+// power of two up to 1 << METRICS_HIST_MAX_BITS is split into as many
+#define METRICS_HIST_SUB_BITS 3
+#define METRICS_HIST_MAX_BITS 40
+#define METRICS_HIST_BUCKETS ((METRICS_HIST_MAX_BITS - METRICS_HIST_SUB_BITS + 1) << METRICS_HIST_SUB_BITS)
+
+struct metrics_hist {
+    uint64_t buckets[METRICS_HIST_BUCKETS];
+    uint64_t sum_ns;
+};
+
+struct metrics {
+    uint64_t counters[METRICS_COUNTERS];
+    struct metrics_hist latency[METRICS_PATHS];
+};
+
+/**
+ * Writer: add to a counter
+ */
+static inline void metrics_add(struct metrics *m, enum metrics_counter c, uint64_t n) {
+    __atomic_store_n(&m->counters[c], __atomic_load_n(&m->counters[c], __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Bucket a latency falls in; latencies past the last bucket count in it
+ */
+size_t metrics_hist_bucket(uint64_t ns);
+
+/**
+ * Smallest latency of a bucket
+ */
+uint64_t metrics_hist_floor(size_t bucket);
+
+/**
+ * Writer: record one latency on a path
+ * @param m Set
+ * @param path Path the latency was measured on
+ * @param ns Latency in nanoseconds
+ */
+void metrics_record(struct metrics *m, enum metrics_path path, uint64_t ns);
+
+/**
+ * Reader: add a set, as it is now, to a snapshot
+ * @param into Snapshot; start from a zeroed one
+ * @param from Set, possibly being written
+ */
+void metrics_merge(struct metrics *into, const struct metrics *from);
+
+/**
+ * Latency below which a fraction of a snapshot's samples fall
+ * @param h Histogram of a snapshot
+ * @param q Fraction, 0 to 1
+ * @return Nanoseconds, the middle of the bucket the quantile falls in; 0
+ *         without samples
+ */
+uint64_t metrics_hist_quantile(const struct metrics_hist *h, double q);
+
+/**
+ * Render sets as Prometheus text exposition format. Counters are given per
+ * set, labelled with its index; histograms are merged.
+ * @param buf Output
+ * @param cap Output capacity
+ * @param sets Sets, possibly being written
+ * @param count Number of sets
+ * @param label Label name for the set index, e.g. "worker"; NULL merges
+ *              counters too
+ * @return Length of the whole text, which was cut short if cap was not
+ *         more than that
+ */
+size_t metrics_format(char *buf, size_t cap, const struct metrics *const *sets, int count, const char *label);
+
+/** Text being rendered; past cap only the length grows, as with snprintf */
+struct metrics_text {
+    char *buf;
+    size_t cap;
+    size_t len;
+};
+
+/**
+ * Append formatted text, for renderers of other metrics in the same format
+ * @param t Text so far
+ * @param fmt printf format
+ */
+void metrics_put(struct metrics_text *t, const char *fmt, ...);
+
+#endif
@@ -0,0 +1,118 @@
+//
+//  metrics_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+void test_buckets() {
+    // Small values are exact
+    for (uint64_t v = 0; v < 8; v++) {
+        assert(metrics_hist_bucket(v) == v);
+        assert(metrics_hist_floor(v) == v);
+    }
+
+    // Every bucket holds its floor and ends where the next begins, within 12.5%
+    for (size_t b = 0; b + 1 < METRICS_HIST_BUCKETS; b++) {
+        uint64_t lo = metrics_hist_floor(b), hi = metrics_hist_floor(b + 1);
+        assert(hi > lo);
+        assert(metrics_hist_bucket(lo) == b);
+        assert(metrics_hist_bucket(hi - 1) == b);
+        assert(lo < 8 || (hi - lo) * 8 <= lo);
+    }
+    assert(metrics_hist_bucket(1000) == metrics_hist_bucket(1023));
+    assert(metrics_hist_bucket(1023) + 1 == metrics_hist_bucket(1024));
+
+    // Past the range everything lands in the last bucket
+    assert(metrics_hist_bucket((uint64_t)1 << METRICS_HIST_MAX_BITS) == METRICS_HIST_BUCKETS - 1);
+    assert(metrics_hist_bucket(UINT64_MAX) == METRICS_HIST_BUCKETS - 1);
+
+    printf("✓ Bucket test passed\n");
+}
+
+void test_quantiles() {
+    static struct metrics m, snap;
+    memset(&m, 0, sizeof(m));
+
+    struct metrics_hist empty;
+    memset(&empty, 0, sizeof(empty));
+    assert(metrics_hist_quantile(&empty, 0.5) == 0);
+
+    // 1..1000 us
+    for (uint64_t us = 1; us <= 1000; us++) {
+        metrics_record(&m, METRICS_TUN_TO_SOCKET, us * 1000);
+    }
+    metrics_merge(&snap, &m);
+    const struct metrics_hist *h = &snap.latency[METRICS_TUN_TO_SOCKET];
+    assert(h->sum_ns == 1000ull * 1001 / 2 * 1000);
+
+    uint64_t p50 = metrics_hist_quantile(h, 0.5), p99 = metrics_hist_quantile(h, 0.99);
+    assert(p50 > 500000 * 7 / 8 && p50 < 500000 * 9 / 8);
+    assert(p99 > 990000 * 7 / 8 && p99 < 990000 * 9 / 8);
+    assert(metrics_hist_quantile(h, 0) <= 1100);
+    assert(metrics_hist_quantile(h, 1) >= 1000000 * 7 / 8);
+
+    // The other path saw nothing
+    assert(metrics_hist_quantile(&snap.latency[METRICS_SOCKET_TO_TUN], 0.5) == 0);
+
+    printf("✓ Quantile test passed\n");
+}
+
+void test_format() {
+    static struct metrics a, b;
+    static char text[16384];
+    const struct metrics *sets[2] = { &a, &b };
+
+    metrics_add(&a, METRICS_TUN_TO_SOCKET_PACKETS, 3);
+    metrics_add(&a, METRICS_TUN_TO_SOCKET_PACKETS, 4);
+    metrics_add(&b, METRICS_TUN_TO_SOCKET_PACKETS, 5);
+    metrics_add(&b, METRICS_DROPS, 1);
+    metrics_record(&a, METRICS_SOCKET_TO_TUN, 1500);
+    metrics_record(&b, METRICS_SOCKET_TO_TUN, 3000000);
+
+    size_t len = metrics_format(text, sizeof(text), sets, 2, "worker");
+    assert(len == strlen(text));
+    assert(strstr(text, "# TYPE netrewire_tun_to_socket_packets_total counter\n"));
+    assert(strstr(text, "netrewire_tun_to_socket_packets_total{worker=\"0\"} 7\n"));
+    assert(strstr(text, "netrewire_tun_to_socket_packets_total{worker=\"1\"} 5\n"));
+    assert(strstr(text, "netrewire_drops_total{worker=\"1\"} 1\n"));
+
+    // Histograms are merged and cumulative
+    assert(strstr(text, "# TYPE netrewire_socket_to_tun_latency_seconds histogram\n"));
+    assert(strstr(text, "netrewire_socket_to_tun_latency_seconds_bucket{le=\"1.024e-06\"} 0\n"));
+    assert(strstr(text, "netrewire_socket_to_tun_latency_seconds_bucket{le=\"2.048e-06\"} 1\n"));
+    assert(strstr(text, "netrewire_socket_to_tun_latency_seconds_bucket{le=\"0.004194304\"} 2\n"));
+    assert(strstr(text, "netrewire_socket_to_tun_latency_seconds_bucket{le=\"+Inf\"} 2\n"));
+    assert(strstr(text, "netrewire_socket_to_tun_latency_seconds_count 2\n"));
+    assert(strstr(text, "netrewire_socket_to_tun_latency_seconds_sum 0.003001500\n"));
+    assert(strstr(text, "netrewire_socket_to_tun_latency_quantile_seconds{quantile=\"0.99\"} 0.003"));
+    assert(strstr(text, "netrewire_tun_to_socket_latency_seconds_count 0\n"));
+
+    // Without a label the counters are merged
+    metrics_format(text, sizeof(text), sets, 2, NULL);
+    assert(strstr(text, "netrewire_tun_to_socket_packets_total 12\n"));
+    assert(!strstr(text, "worker="));
+
+    // A short buffer still learns the whole length
+    char small[64];
+    assert(metrics_format(small, sizeof(small), sets, 2, "worker") == len);
+    assert(strlen(small) == sizeof(small) - 1);
+    assert(metrics_format(NULL, 0, sets, 2, "worker") == len);
+
+    printf("✓ Format test passed\n");
+}
+
+int main() {
+    printf("Running metrics unit tests...\n");
+
+    test_buckets();
+    test_quantiles();
+    test_format();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,268 @@
+//
+//  pcapng.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#define _GNU_SOURCE
+
+#include "pcapng.h"
+#include "ip6.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define BLOCK_SHB 0x0a0d0d0a
+#define BLOCK_IDB 0x00000001
+#define BLOCK_EPB 0x00000006
+// Fills the rest of a sealed chunk; readers skip block types they do not
+// know, and this one is in the range kept for local use
+#define BLOCK_PAD 0x80000000u
+
+#define BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define LINKTYPE_RAW 101
+
+#define OPT_END 0
+#define OPT_IF_TSRESOL 9
+#define OPT_EPB_FLAGS 2
+
+// Section header, then one interface with nanosecond timestamps
+#define SHB_LEN 28
+#define IDB_LEN 32
+#define HEADER_LEN (SHB_LEN + IDB_LEN)
+
+// Enhanced packet block around the packet bytes: 28 bytes of fields, the
+// epb_flags option, the end of options and the trailing length
+#define EPB_OVERHEAD 44
+#define PAD_MIN 12
+
+static void put32(uint8_t *p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static void write_headers(uint8_t *p) {
+    put32(p, BLOCK_SHB);
+    put32(p + 4, SHB_LEN);
+    put32(p + 8, BYTE_ORDER_MAGIC);
+    put16(p + 12, 1);
+    put16(p + 14, 0);
+    memset(p + 16, 0xff, 8);            // section length unknown
+    put32(p + 24, SHB_LEN);
+
+    p += SHB_LEN;
+    put32(p, BLOCK_IDB);
+    put32(p + 4, IDB_LEN);
+    put16(p + 8, LINKTYPE_RAW);
+    put16(p + 10, 0);
+    put32(p + 12, PCAPNG_SNAPLEN);
+    put16(p + 16, OPT_IF_TSRESOL);
+    put16(p + 18, 1);
+    put32(p + 20, 0);
+    p[20] = 9;                          // 10^-9 s, then padding
+    put32(p + 24, OPT_END);
+    put32(p + 28, IDB_LEN);
+}
+
+// Preallocated, so a full disk fails the open rather than a store into the
+// mapping
+static int allocate(int fd, size_t size) {
+#ifdef F_PREALLOCATE
+    fstore_t store = { .fst_flags = F_ALLOCATEALL, .fst_posmode = F_PEOFPOSMODE, .fst_length = (off_t)size };
+    if (fcntl(fd, F_PREALLOCATE, &store) < 0) {
+        return -1;
+    }
+    return ftruncate(fd, (off_t)size);
+#else
+    int err = posix_fallocate(fd, 0, (off_t)size);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+int pcapng_open(struct pcapng *c, const char *path, size_t size) {
+    int err;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    if (size < HEADER_LEN + PCAPNG_CHUNK_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->nchunks = (size - HEADER_LEN) / PCAPNG_CHUNK_SIZE;
+    c->size = HEADER_LEN + c->nchunks * PCAPNG_CHUNK_SIZE;
+
+    c->held = calloc(c->nchunks, 1);
+    if (!c->held) {
+        return -1;
+    }
+    c->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (c->fd < 0 || allocate(c->fd, c->size) < 0) {
+        goto fail;
+    }
+    c->map = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+        goto fail;
+    }
+    write_headers(c->map);
+    return 0;
+
+fail:
+    err = errno;
+    if (c->fd >= 0) {
+        close(c->fd);
+        unlink(path);
+    }
+    free(c->held);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    errno = err;
+    return -1;
+}
+
+void pcapng_close(struct pcapng *c) {
+    if (c->map) {
+        munmap(c->map, c->size);
+    }
+    if (c->fd >= 0) {
+        size_t written = c->next < c->nchunks ? c->next : c->nchunks;
+        if (ftruncate(c->fd, (off_t)(HEADER_LEN + written * PCAPNG_CHUNK_SIZE)) < 0) {
+            // Left at full size: readers stop at the zeros of the unused chunks
+        }
+        close(c->fd);
+    }
+    free(c->held);
+    c->map = NULL;
+    c->held = NULL;
+    c->fd = -1;
+}
+
+void pcapng_writer_init(struct pcapng_writer *w, struct pcapng *c) {
+    memset(w, 0, sizeof(*w));
+    w->cap = c;
+}
+
+// Take the next chunk round the ring that no other writer holds
+static int claim(struct pcapng_writer *w) {
+    struct pcapng *c = w->cap;
+    for (size_t tries = 0; tries < c->nchunks; tries++) {
+        size_t k = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED) % c->nchunks;
+        if (!__atomic_exchange_n(&c->held[k], 1, __ATOMIC_ACQUIRE)) {
+            w->index = k;
+            w->chunk = c->map + HEADER_LEN + k * PCAPNG_CHUNK_SIZE;
+            w->used = 0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Cover the rest of the chunk, along with whatever an earlier round left
+// there, with one padding block and give it back
+static void seal(struct pcapng_writer *w) {
+    uint32_t left = (uint32_t)(PCAPNG_CHUNK_SIZE - w->used);
+    put32(w->chunk + w->used, BLOCK_PAD);
+    put32(w->chunk + w->used + 4, left);
+    put32(w->chunk + PCAPNG_CHUNK_SIZE - 4, left);
+    __atomic_store_n(&w->cap->held[w->index], 0, __ATOMIC_RELEASE);
+    w->chunk = NULL;
+}
+
+void pcapng_write(struct pcapng_writer *w, const uint8_t *pkt, size_t len, uint32_t direction) {
+    size_t keep = pcapng_header_len(pkt, len);
+    size_t padded = (keep + 3) & ~(size_t)3;
+    size_t rec = EPB_OVERHEAD + padded;
+
+    // A chunk always keeps room for the padding that seals it
+    if (!w->chunk || w->used + rec + PAD_MIN > PCAPNG_CHUNK_SIZE) {
+        if (w->chunk) {
+            seal(w);
+        }
+        if (claim(w) < 0) {
+            w->dropped++;
+            return;
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+
+    uint8_t *p = w->chunk + w->used;
+    put32(p, BLOCK_EPB);
+    put32(p + 4, (uint32_t)rec);
+    put32(p + 8, 0);
+    put32(p + 12, (uint32_t)(ns >> 32));
+    put32(p + 16, (uint32_t)ns);
+    put32(p + 20, (uint32_t)keep);
+    put32(p + 24, (uint32_t)len);
+    memcpy(p + 28, pkt, keep);
+    memset(p + 28 + keep, 0, padded - keep);
+    p += 28 + padded;
+    put16(p, OPT_EPB_FLAGS);
+    put16(p + 2, 4);
+    put32(p + 4, direction);
+    put32(p + 8, OPT_END);
+    put32(p + 12, (uint32_t)rec);
+
+    w->used += rec;
+    w->packets++;
+}
+
+void pcapng_writer_flush(struct pcapng_writer *w) {
+    if (!w->cap) {
+        return;
+    }
+    if (w->chunk) {
+        seal(w);
+    }
+    __atomic_fetch_add(&w->cap->packets, w->packets, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->cap->dropped, w->dropped, __ATOMIC_RELAXED);
+    w->packets = 0;
+    w->dropped = 0;
+}
+
+size_t pcapng_header_len(const uint8_t *pkt, size_t len) {
+    size_t off, keep;
+    uint8_t proto;
+
+    if (len >= 20 && (pkt[0] >> 4) == 4) {
+        off = (size_t)(pkt[0] & 0x0f) * 4;
+        proto = pkt[9];
+        // Later fragments have no transport header
+        if (off < 20 || ((pkt[6] & 0x1f) | pkt[7]) != 0) {
+            proto = 0;
+        }
+    } else if (!ip6_upper_layer(pkt, len, &proto, &off)) {
+        off = 40;
+        proto = 0;
+    }
+
+    switch (proto) {
+    case 6:
+        keep = len >= off + 13 ? off + (size_t)(pkt[off + 12] >> 4) * 4 : len;
+        keep = keep < off + 20 ? off + 20 : keep;
+        break;
+    case 17:
+    case 1:
+    case 58:
+        keep = off + 8;             // UDP, ICMP, ICMPv6
+        break;
+    default:
+        keep = off;
+        break;
+    }
+    keep = keep < len ? keep : len;
+    return keep < PCAPNG_SNAPLEN ? keep : PCAPNG_SNAPLEN;
+}
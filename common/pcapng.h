@@ -0,0 +1,102 @@
+//
+//  pcapng.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Opt-in packet capture into a memory-mapped pcapng file, cheap enough to
+//  leave on in production. The file is a ring of fixed-size chunks after
+//  the section and interface headers: every writing thread (a server
+//  worker, one of the extension's threads) claims a chunk of its own with
+//  one atomic increment, fills it with no further synchronization and
+//  seals it with a padding block when it is full. Once the ring has gone
+//  round, the oldest chunk is claimed again, so the file always holds the
+//  most recent traffic; a chunk another writer still holds is skipped.
+//
+//  Only headers are kept: each packet is cut after its TCP or UDP header
+//  (at most PCAPNG_SNAPLEN bytes), so mail never reaches the disk, and its
+//  original length, a nanosecond timestamp and its direction are recorded.
+//  Packets are raw IP (LINKTYPE_RAW), in host byte order. Chunks are not in
+//  time order after the ring wraps, and writers interleave; readers sort by
+//  timestamp.
+//
+
+#ifndef PCAPNG_H
+#define PCAPNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PCAPNG_CHUNK_SIZE (256 * 1024)
+#define PCAPNG_SNAPLEN 256
+
+// Directions, as epb_flags has them: a packet that came out of the tunnel
+// from the other end is inbound, one sent into it outbound
+#define PCAPNG_INBOUND 1
+#define PCAPNG_OUTBOUND 2
+
+struct pcapng {
+    int fd;
+    uint8_t *map;
+    size_t size;            // mapped bytes
+    size_t nchunks;
+    size_t next;            // chunks claimed so far; atomic
+    uint8_t *held;          // per chunk: a writer holds it; atomic
+    uint64_t packets;       // written and dropped by flushed writers; atomic
+    uint64_t dropped;
+};
+
+// One writing thread's place in a capture
+struct pcapng_writer {
+    struct pcapng *cap;     // NULL: not capturing
+    uint8_t *chunk;         // chunk being filled, or NULL
+    size_t index;
+    size_t used;
+    uint64_t packets;
+    uint64_t dropped;       // no chunk was free
+};
+
+/**
+ * Create a capture file and map it
+ * @param c Capture
+ * @param path File, replaced if it exists
+ * @param size Largest size of the file; at least one chunk past the headers
+ * @return 0 on success, -1 with errno set
+ */
+int pcapng_open(struct pcapng *c, const char *path, size_t size);
+
+/**
+ * Cut the file down to the chunks written, and unmap it; every writer must
+ * have been flushed
+ */
+void pcapng_close(struct pcapng *c);
+
+/**
+ * Start a writer
+ * @param w Writer
+ * @param c Capture, or NULL for a writer that is never called
+ */
+void pcapng_writer_init(struct pcapng_writer *w, struct pcapng *c);
+
+/**
+ * Record a packet's headers
+ * @param w Writer of the calling thread
+ * @param pkt IP packet
+ * @param len Packet length
+ * @param direction PCAPNG_INBOUND or PCAPNG_OUTBOUND
+ */
+void pcapng_write(struct pcapng_writer *w, const uint8_t *pkt, size_t len, uint32_t direction);
+
+/**
+ * Seal the writer's chunk, give it back and add its counts to the capture
+ */
+void pcapng_writer_flush(struct pcapng_writer *w);
+
+/**
+ * Bytes of a packet that are kept: its IP and TCP or UDP headers, or the
+ * IP header alone for other protocols and later fragments
+ * @param pkt IP packet
+ * @param len Packet length
+ * @return At most len and PCAPNG_SNAPLEN
+ */
+size_t pcapng_header_len(const uint8_t *pkt, size_t len);
+
+#endif
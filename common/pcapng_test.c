@@ -0,0 +1,225 @@
+//
+//  pcapng_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#define _GNU_SOURCE
+
+#include "pcapng.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HEADER_LEN 60
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// What a file holds: original length, IP id byte and flags of each packet
+struct contents {
+    size_t packets;
+    size_t pads;
+    uint32_t lens[4096];
+    uint32_t ids[4096];
+    uint32_t flags[4096];
+};
+
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    fseek(f, 0, SEEK_END);
+    *size = (size_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = malloc(*size);
+    assert(buf && fread(buf, 1, *size, f) == *size);
+    fclose(f);
+    return buf;
+}
+
+// Walk every block, checking lengths, and collect the packets
+static void walk(const char *path, struct contents *out) {
+    size_t size;
+    uint8_t *file = read_file(path, &size);
+    memset(out, 0, sizeof(*out));
+
+    assert(size >= HEADER_LEN && (size - HEADER_LEN) % PCAPNG_CHUNK_SIZE == 0);
+    assert(get32(file) == 0x0a0d0d0a && get32(file + 8) == 0x1a2b3c4d);
+    assert(get32(file + 28) == 1 && (get32(file + 36) & 0xffff) == 101 && file[48] == 9);
+    for (size_t off = HEADER_LEN; off < size;) {
+        uint32_t type = get32(file + off), len = get32(file + off + 4);
+        assert(len >= 12 && len % 4 == 0 && off + len <= size);
+        assert(get32(file + off + len - 4) == len);
+        if (type == 6) {
+            const uint8_t *b = file + off;
+            uint32_t caplen = get32(b + 20);
+            assert(out->packets < 4096 && caplen <= PCAPNG_SNAPLEN && caplen <= get32(b + 24));
+            out->lens[out->packets] = get32(b + 24);
+            out->ids[out->packets] = b[28 + 4];
+            out->flags[out->packets] = get32(b + 28 + ((caplen + 3) & ~3u) + 4);
+            out->packets++;
+        } else {
+            out->pads++;
+        }
+        off += len;
+    }
+    free(file);
+}
+
+// A TCP/IPv4 packet with a 20-byte TCP header and payload; byte 4 (IP id)
+// carries n
+static size_t make_packet(uint8_t *pkt, size_t len, uint8_t n) {
+    memset(pkt, 0xee, len);
+    memset(pkt, 0, 40);
+    pkt[0] = 0x45;
+    pkt[2] = (uint8_t)(len >> 8);
+    pkt[3] = (uint8_t)len;
+    pkt[4] = n;
+    pkt[9] = 6;
+    pkt[32] = 5 << 4;
+    return len;
+}
+
+void test_header_len() {
+    uint8_t pkt[1500];
+
+    // TCP keeps its options, and nothing of the payload
+    make_packet(pkt, 1500, 0);
+    assert(pcapng_header_len(pkt, 1500) == 40);
+    pkt[32] = 8 << 4;
+    assert(pcapng_header_len(pkt, 1500) == 52);
+    assert(pcapng_header_len(pkt, 45) == 45);
+
+    // UDP and ICMP keep 8 bytes; later fragments the IP header alone
+    pkt[9] = 17;
+    assert(pcapng_header_len(pkt, 1500) == 28);
+    pkt[9] = 6;
+    pkt[7] = 1;
+    assert(pcapng_header_len(pkt, 1500) == 20);
+
+    // IPv6
+    memset(pkt, 0, 100);
+    pkt[0] = 0x60;
+    pkt[5] = 60;
+    pkt[6] = 6;
+    pkt[52] = 5 << 4;
+    assert(pcapng_header_len(pkt, 100) == 60);
+    pkt[6] = 50;
+    assert(pcapng_header_len(pkt, 100) == 40);
+
+    // Garbage is cut at the snap length
+    memset(pkt, 0x55, sizeof(pkt));
+    assert(pcapng_header_len(pkt, sizeof(pkt)) <= PCAPNG_SNAPLEN);
+
+    printf("✓ Header length test passed\n");
+}
+
+void test_write() {
+    char path[] = "/tmp/pcapng_test.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    struct pcapng c;
+    struct pcapng_writer a, b;
+    uint8_t pkt[1500];
+    struct contents got;
+
+    assert(pcapng_open(&c, path, HEADER_LEN + 4 * PCAPNG_CHUNK_SIZE + 100) == 0);
+    assert(c.nchunks == 4);
+    pcapng_writer_init(&a, &c);
+    pcapng_writer_init(&b, &c);
+    for (int i = 0; i < 10; i++) {
+        pcapng_write(&a, pkt, make_packet(pkt, 1500, (uint8_t)i), PCAPNG_OUTBOUND);
+        pcapng_write(&b, pkt, make_packet(pkt, 100, (uint8_t)(100 + i)), PCAPNG_INBOUND);
+    }
+
+    // Each writer fills a chunk of its own; unused chunks are cut off
+    assert(a.index != b.index && a.packets == 10 && b.packets == 10);
+    pcapng_writer_flush(&a);
+    pcapng_writer_flush(&b);
+    assert(c.packets == 20 && c.dropped == 0);
+    pcapng_close(&c);
+    walk(path, &got);
+    assert(got.packets == 20 && got.pads == 2);
+    for (size_t i = 0; i < got.packets; i++) {
+        int inbound = got.ids[i] >= 100;
+        assert(got.lens[i] == (inbound ? 100u : 1500u));
+        assert(got.flags[i] == (inbound ? (uint32_t)PCAPNG_INBOUND : (uint32_t)PCAPNG_OUTBOUND));
+    }
+
+    unlink(path);
+    printf("✓ Capture write test passed\n");
+}
+
+void test_ring() {
+    char path[] = "/tmp/pcapng_test.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    struct pcapng c;
+    struct pcapng_writer a, b;
+    uint8_t pkt[100];
+    struct contents got;
+
+    // Two chunks, one held by a writer that stays quiet: the other goes
+    // round and round the chunk left
+    assert(pcapng_open(&c, path, HEADER_LEN + 2 * PCAPNG_CHUNK_SIZE) == 0);
+    pcapng_writer_init(&a, &c);
+    pcapng_writer_init(&b, &c);
+    pcapng_write(&a, pkt, make_packet(pkt, 100, 1), PCAPNG_INBOUND);
+    size_t per_chunk = PCAPNG_CHUNK_SIZE / (44 + 40);
+    for (size_t i = 0; i < 3 * per_chunk; i++) {
+        pcapng_write(&b, pkt, make_packet(pkt, 100, 2), PCAPNG_OUTBOUND);
+    }
+    assert(b.index != a.index && b.dropped == 0);
+
+    // With every chunk held, packets are dropped
+    struct pcapng_writer d;
+    pcapng_writer_init(&d, &c);
+    pcapng_write(&d, pkt, make_packet(pkt, 100, 3), PCAPNG_OUTBOUND);
+    assert(d.dropped == 1 && d.packets == 0);
+
+    pcapng_writer_flush(&a);
+    pcapng_writer_flush(&b);
+    pcapng_writer_flush(&d);
+    assert(c.dropped == 1);
+    pcapng_close(&c);
+
+    // The quiet writer's packet and the newest ones are there
+    walk(path, &got);
+    assert(got.packets > 1 && got.packets <= per_chunk + 1 && got.pads == 2);
+    size_t quiet = 0;
+    for (size_t i = 0; i < got.packets; i++) {
+        quiet += got.ids[i] == 1;
+    }
+    assert(quiet == 1);
+
+    unlink(path);
+    printf("✓ Capture ring test passed\n");
+}
+
+void test_open_errors() {
+    struct pcapng c;
+    assert(pcapng_open(&c, "/tmp/pcapng_small", PCAPNG_CHUNK_SIZE) < 0);
+    assert(access("/tmp/pcapng_small", F_OK) < 0);
+    assert(pcapng_open(&c, "/nonexistent/dir/capture.pcapng", 2 * PCAPNG_CHUNK_SIZE) < 0);
+    printf("✓ Capture open errors test passed\n");
+}
+
+int main() {
+    printf("Running pcapng capture unit tests...\n");
+
+    test_header_len();
+    test_write();
+    test_ring();
+    test_open_errors();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+//
+//  pmtu.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "pmtu.h"
+#include "ip6.h"
+
+#include <string.h>
+
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_FLAG_SYN 0x02
+
+void pmtu_search_init(struct pmtu_search *s, uint16_t floor, uint16_t ceiling) {
+    memset(s, 0, sizeof(*s));
+    s->floor = floor;
+    s->lo = floor;
+    s->hi = (uint16_t)(ceiling + 1);
+}
+
+size_t pmtu_search_probe(struct pmtu_search *s, uint8_t *buf) {
+    if (s->size && s->tries >= PMTU_PROBE_TRIES) {
+        pmtu_search_too_big(s);
+    }
+    if (!s->size) {
+        if (pmtu_search_done(s)) {
+            return 0;
+        }
+        // Halve what is left; the floor until the server has answered once
+        s->size = s->answered ? (uint16_t)(s->lo + (s->hi - s->lo) / 2) : s->floor;
+        s->tries = 0;
+        s->id++;
+    }
+    s->tries++;
+
+    memset(buf, 0, s->size);
+    buf[1] = PMTU_PROBE_TYPE;
+    buf[2] = (uint8_t)(s->size >> 8);
+    buf[3] = (uint8_t)s->size;
+    buf[4] = (uint8_t)(s->id >> 24);
+    buf[5] = (uint8_t)(s->id >> 16);
+    buf[6] = (uint8_t)(s->id >> 8);
+    buf[7] = (uint8_t)s->id;
+    return s->size;
+}
+
+int pmtu_search_answer(struct pmtu_search *s, const uint8_t *buf, size_t len) {
+    if (!s->size || len != s->size || !pmtu_is_probe(buf, len)) {
+        return 0;
+    }
+    uint32_t id = (uint32_t)buf[4] << 24 | (uint32_t)buf[5] << 16 | (uint32_t)buf[6] << 8 | buf[7];
+    if (id != s->id) {
+        return 0;
+    }
+    s->lo = s->size;
+    s->answered = 1;
+    s->size = 0;
+    return 1;
+}
+
+void pmtu_search_too_big(struct pmtu_search *s) {
+    if (s->size) {
+        s->hi = s->size;
+        s->size = 0;
+    }
+}
+
+int pmtu_is_probe(const uint8_t *buf, size_t len) {
+    return len >= PMTU_PROBE_HEADER_LEN && buf[0] == 0 && buf[1] == PMTU_PROBE_TYPE &&
+           ((size_t)buf[2] << 8 | buf[3]) == len;
+}
+
+// Offset of the MSS value of a SYN that announces more than fits the MTU,
+// with its TCP header's and the largest MSS that fits; 0 if there is none
+static size_t mss_over(const uint8_t *pkt, size_t len, uint16_t mtu, size_t *tcp, uint16_t *limit) {
+    size_t off;
+    if (len >= 20 && (pkt[0] >> 4) == 4) {
+        off = (size_t)(pkt[0] & 0x0f) * 4;
+        // Only the first fragment holds the TCP header
+        if (pkt[9] != 6 || off < 20 || ((pkt[6] & 0x1f) | pkt[7]) != 0) {
+            return 0;
+        }
+        *limit = (uint16_t)(mtu - 40);
+    } else {
+        uint8_t proto;
+        if (!ip6_upper_layer(pkt, len, &proto, &off) || proto != 6) {
+            return 0;
+        }
+        *limit = (uint16_t)(mtu - 60);
+    }
+    if (len < off + 20 || !(pkt[off + 13] & TCP_FLAG_SYN)) {
+        return 0;
+    }
+    size_t end = off + (size_t)(pkt[off + 12] >> 4) * 4;
+    if (end < off + 20 || end > len) {
+        return 0;
+    }
+
+    for (size_t i = off + 20; i < end;) {
+        uint8_t kind = pkt[i];
+        if (kind == TCP_OPT_END) {
+            break;
+        }
+        if (kind == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (end - i < 2 || pkt[i + 1] < 2 || pkt[i + 1] > end - i) {
+            break;
+        }
+        if (kind == TCP_OPT_MSS && pkt[i + 1] == 4) {
+            uint16_t mss = (uint16_t)(pkt[i + 2] << 8 | pkt[i + 3]);
+            if (mss <= *limit) {
+                return 0;
+            }
+            *tcp = off;
+            return i + 2;
+        }
+        i += pkt[i + 1];
+    }
+    return 0;
+}
+
+int pmtu_mss_over(const uint8_t *pkt, size_t len, uint16_t mtu) {
+    size_t tcp;
+    uint16_t limit;
+    return mss_over(pkt, len, mtu, &tcp, &limit) != 0;
+}
+
+int pmtu_clamp_mss(uint8_t *pkt, size_t len, uint16_t mtu) {
+    size_t tcp;
+    uint16_t limit;
+    size_t at = mss_over(pkt, len, mtu, &tcp, &limit);
+    if (!at) {
+        return 0;
+    }
+
+    // HC' = ~(~HC + ~m + m'). A value at an odd offset adds to the sum
+    // with its bytes swapped, which the sum's byte order allows for.
+    uint16_t old = (uint16_t)(pkt[at] << 8 | pkt[at + 1]);
+    uint16_t mss = limit;
+    if ((at - tcp) & 1) {
+        old = (uint16_t)(old << 8 | old >> 8);
+        mss = (uint16_t)(mss << 8 | mss >> 8);
+    }
+    uint16_t check = (uint16_t)(pkt[tcp + 16] << 8 | pkt[tcp + 17]);
+    uint32_t sum = (uint32_t)(uint16_t)~check + (uint16_t)~old + mss;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    check = (uint16_t)~sum;
+
+    pkt[at] = (uint8_t)(limit >> 8);
+    pkt[at + 1] = (uint8_t)limit;
+    pkt[tcp + 16] = (uint8_t)(check >> 8);
+    pkt[tcp + 17] = (uint8_t)check;
+    return 1;
+}
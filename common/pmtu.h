@@ -0,0 +1,120 @@
+//
+//  pmtu.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Tunnel MTU: finding the largest packet the path to the server carries,
+//  and holding TCP connections to it by clamping the MSS their SYNs
+//  announce.
+//
+//  Over the datagram transport the client searches for it with probes:
+//  datagrams of the size being tried, sent with fragmentation forbidden,
+//  which the server echoes as they are. A probe starts with a zero byte, so
+//  it can never be taken for an IP packet. Over a stream, the outer TCP
+//  finds its own path MTU and the tunnel MTU follows its segment size.
+//
+//  The clamp rewrites the MSS option of a SYN in place and updates the TCP
+//  checksum incrementally (RFC 1624), so connections opened before the host
+//  takes up a new tunnel MTU fit it as well.
+//
+
+#ifndef PMTU_H
+#define PMTU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The IPv6 minimum, which the IPv6 tunnel needs, up to what the server
+// forwards to the Internet unfragmented
+#define PMTU_MIN 1280
+#define PMTU_MAX 1500
+#define PMTU_DEFAULT 1400
+
+// Probes: u8 0, u8 PMTU_PROBE_TYPE, u16 size, u32 id, zeros up to the size
+#define PMTU_PROBE_TYPE 1
+#define PMTU_PROBE_HEADER_LEN 8
+
+// A size is taken as too big after this many unanswered probes, each given
+// PMTU_PROBE_TIMEOUT_MS; the search ends once it is this close
+#define PMTU_PROBE_TRIES 3
+#define PMTU_PROBE_TIMEOUT_MS 250
+#define PMTU_PROBE_STEP 8
+
+struct pmtu_search {
+    uint16_t floor;
+    uint16_t lo;            // largest size answered, or the floor
+    uint16_t hi;            // smallest size taken as too big, or one past the ceiling
+    uint16_t size;          // probe in flight, 0 if none
+    uint8_t tries;          // probes of that size sent
+    uint8_t answered;       // any probe was
+    uint32_t id;            // of the probe in flight
+};
+
+/**
+ * Start a search; the floor is probed first, to learn whether the server
+ * answers at all
+ * @param s Search
+ * @param floor Smallest size tried, at least PMTU_PROBE_HEADER_LEN
+ * @param ceiling Largest size tried
+ */
+void pmtu_search_init(struct pmtu_search *s, uint16_t floor, uint16_t ceiling);
+
+/**
+ * The probe to send now: the next size, or the one in flight again when its
+ * answer is overdue. Call once at the start, then after each answer and
+ * each PMTU_PROBE_TIMEOUT_MS without one.
+ * @param s Search
+ * @param buf Output, room for the ceiling
+ * @return Probe length, 0 once the search is over
+ */
+size_t pmtu_search_probe(struct pmtu_search *s, uint8_t *buf);
+
+/**
+ * Take a datagram that may answer the probe in flight
+ * @return 1 if it did, 0 otherwise
+ */
+int pmtu_search_answer(struct pmtu_search *s, const uint8_t *buf, size_t len);
+
+/**
+ * The probe in flight could not be sent at its size (EMSGSIZE)
+ */
+void pmtu_search_too_big(struct pmtu_search *s);
+
+/**
+ * Whether the search is over
+ */
+static inline int pmtu_search_done(const struct pmtu_search *s) {
+    return s->size == 0 && (s->answered ? s->hi - s->lo <= PMTU_PROBE_STEP : s->hi <= s->floor);
+}
+
+/**
+ * The largest size answered once the search is over, 0 if the server never
+ * answered
+ */
+static inline uint16_t pmtu_search_result(const struct pmtu_search *s) {
+    return s->answered ? s->lo : 0;
+}
+
+/**
+ * Whether a datagram is a probe, and not a packet
+ */
+int pmtu_is_probe(const uint8_t *buf, size_t len);
+
+/**
+ * Whether a packet is a TCP SYN announcing a larger MSS than fits the MTU
+ * @param pkt IPv4 or IPv6 packet
+ * @param len Packet length
+ * @param mtu Tunnel MTU
+ */
+int pmtu_mss_over(const uint8_t *pkt, size_t len, uint16_t mtu);
+
+/**
+ * Lower the MSS a TCP SYN announces to what fits the MTU, and update its
+ * checksum; other packets are left alone
+ * @param pkt IPv4 or IPv6 packet, changed in place
+ * @param len Packet length
+ * @param mtu Tunnel MTU
+ * @return 1 if the MSS was lowered, 0 otherwise
+ */
+int pmtu_clamp_mss(uint8_t *pkt, size_t len, uint16_t mtu);
+
+#endif
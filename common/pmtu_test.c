@@ -0,0 +1,195 @@
+//
+//  pmtu_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "pmtu.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// Ones' complement sum over data plus a pseudo-header; 0xffff when valid
+static uint16_t sum(const uint8_t *p, size_t len, uint32_t acc) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        acc += get16(p + i);
+    }
+    if (len & 1) {
+        acc += (uint32_t)p[len - 1] << 8;
+    }
+    while (acc >> 16) {
+        acc = (acc & 0xffff) + (acc >> 16);
+    }
+    return (uint16_t)acc;
+}
+
+// Pseudo-header sum of a packet's addresses, protocol and TCP length
+static uint32_t pseudo(const uint8_t *pkt, size_t tcp, size_t len) {
+    uint32_t acc = 6 + (uint32_t)(len - tcp);
+    size_t addrs = (pkt[0] >> 4) == 4 ? 12 : 8, addr_len = (pkt[0] >> 4) == 4 ? 8 : 32;
+    for (size_t i = 0; i < addr_len; i += 2) {
+        acc += get16(pkt + addrs + i);
+    }
+    return acc;
+}
+
+static void fill_checksum(uint8_t *pkt, size_t tcp, size_t len) {
+    pkt[tcp + 16] = pkt[tcp + 17] = 0;
+    uint16_t check = (uint16_t)~sum(pkt + tcp, len - tcp, pseudo(pkt, tcp, len));
+    pkt[tcp + 16] = (uint8_t)(check >> 8);
+    pkt[tcp + 17] = (uint8_t)check;
+}
+
+static int checksum_ok(const uint8_t *pkt, size_t tcp, size_t len) {
+    return sum(pkt + tcp, len - tcp, pseudo(pkt, tcp, len)) == 0xffff;
+}
+
+// A SYN with the given options, a few payload bytes after them
+static size_t make_syn(uint8_t *pkt, int v6, const uint8_t *opts, size_t opts_len) {
+    size_t tcp = v6 ? 40 : 20, len = tcp + 20 + opts_len + 3;
+    memset(pkt, 0, len);
+    if (v6) {
+        pkt[0] = 0x60;
+        pkt[4] = (uint8_t)((len - 40) >> 8);
+        pkt[5] = (uint8_t)(len - 40);
+        pkt[6] = 6;
+        pkt[8] = 0xfd;
+        pkt[23] = 0x21;
+        pkt[24] = 0x2a;
+        pkt[39] = 0x19;
+    } else {
+        pkt[0] = 0x45;
+        pkt[3] = (uint8_t)len;
+        pkt[9] = 6;
+        memcpy(pkt + 12, "\x0a\x08\x00\x21\xc0\x00\x02\x19", 8);
+    }
+    pkt[tcp + 1] = 50;
+    pkt[tcp + 3] = 25;
+    pkt[tcp + 12] = (uint8_t)((20 + opts_len) / 4 << 4);
+    pkt[tcp + 13] = 0x02;
+    memcpy(pkt + tcp + 20, opts, opts_len);
+    memcpy(pkt + tcp + 20 + opts_len, "abc", 3);
+    fill_checksum(pkt, tcp, len);
+    return len;
+}
+
+void test_clamp_ipv4() {
+    uint8_t pkt[128];
+
+    // MSS 1460 becomes 1360 for a 1400-byte MTU, with the checksum kept valid
+    const uint8_t opts[] = { 2, 4, 0x05, 0xb4, 1, 3, 3, 7 };
+    size_t len = make_syn(pkt, 0, opts, sizeof(opts));
+    assert(pmtu_mss_over(pkt, len, 1400));
+    assert(pmtu_clamp_mss(pkt, len, 1400) == 1);
+    assert(get16(pkt + 42) == 1360 && checksum_ok(pkt, 20, len));
+    assert(!pmtu_mss_over(pkt, len, 1400) && pmtu_clamp_mss(pkt, len, 1400) == 0);
+
+    // An MSS that already fits stays
+    assert(pmtu_clamp_mss(pkt, len, 1500) == 0 && get16(pkt + 42) == 1360);
+
+    // At an odd offset, after a window scale option
+    const uint8_t odd[] = { 3, 3, 7, 2, 4, 0x05, 0xb4, 0, 0, 0, 0, 0 };
+    len = make_syn(pkt, 0, odd, sizeof(odd));
+    assert(pmtu_clamp_mss(pkt, len, 1280) == 1);
+    assert(get16(pkt + 45) == 1240 && checksum_ok(pkt, 20, len));
+
+    // Only SYNs, and only first fragments
+    len = make_syn(pkt, 0, opts, sizeof(opts));
+    pkt[33] = 0x10;
+    fill_checksum(pkt, 20, len);
+    assert(pmtu_clamp_mss(pkt, len, 1400) == 0);
+    pkt[33] = 0x12;
+    pkt[7] = 1;
+    assert(pmtu_clamp_mss(pkt, len, 1400) == 0);
+
+    // Options running past the header are not read
+    len = make_syn(pkt, 0, opts, sizeof(opts));
+    assert(!pmtu_mss_over(pkt, 38, 1400));
+    pkt[41] = 12;
+    assert(!pmtu_mss_over(pkt, len, 1400));
+
+    printf("✓ IPv4 MSS clamp test passed\n");
+}
+
+void test_clamp_ipv6() {
+    uint8_t pkt[128];
+
+    // IPv6 headers take 20 bytes more
+    const uint8_t opts[] = { 2, 4, 0x05, 0xa0 };
+    size_t len = make_syn(pkt, 1, opts, sizeof(opts));
+    assert(pmtu_clamp_mss(pkt, len, 1400) == 1);
+    assert(get16(pkt + 62) == 1340 && checksum_ok(pkt, 40, len));
+
+    // Not TCP
+    len = make_syn(pkt, 1, opts, sizeof(opts));
+    pkt[6] = 17;
+    assert(pmtu_clamp_mss(pkt, len, 1400) == 0);
+
+    printf("✓ IPv6 MSS clamp test passed\n");
+}
+
+// Search a path that carries datagrams up to mtu, refusing some locally
+static uint16_t search(uint16_t mtu, uint16_t local, int *probes) {
+    static uint8_t buf[PMTU_MAX];
+    struct pmtu_search s;
+    size_t n;
+
+    pmtu_search_init(&s, PMTU_MIN, PMTU_MAX);
+    *probes = 0;
+    while ((n = pmtu_search_probe(&s, buf)) > 0) {
+        assert(n >= PMTU_MIN && n <= PMTU_MAX && pmtu_is_probe(buf, n));
+        (*probes)++;
+        if (n > local) {
+            pmtu_search_too_big(&s);
+        } else if (n <= mtu) {
+            assert(pmtu_search_answer(&s, buf, n) == 1);
+        }
+    }
+    assert(pmtu_search_done(&s));
+    return pmtu_search_result(&s);
+}
+
+void test_search() {
+    int probes;
+
+    // Within a step below the path MTU, in a handful of answered probes
+    uint16_t mtu = search(1472, PMTU_MAX, &probes);
+    assert(mtu <= 1472 && mtu > 1472 - PMTU_PROBE_STEP && probes < 25);
+    mtu = search(1400, 1420, &probes);
+    assert(mtu <= 1400 && mtu > 1400 - PMTU_PROBE_STEP);
+    assert(search(PMTU_MAX, PMTU_MAX, &probes) > PMTU_MAX - PMTU_PROBE_STEP);
+    assert(search(PMTU_MIN, PMTU_MAX, &probes) == PMTU_MIN);
+
+    // A server that never answers gets the floor PMTU_PROBE_TRIES times
+    assert(search(0, PMTU_MAX, &probes) == 0 && probes == PMTU_PROBE_TRIES);
+
+    // Stale, cut-short and foreign answers do not count
+    uint8_t buf[PMTU_MAX], old[PMTU_MAX];
+    struct pmtu_search s;
+    pmtu_search_init(&s, PMTU_MIN, PMTU_MAX);
+    size_t n = pmtu_search_probe(&s, buf);
+    memcpy(old, buf, n);
+    assert(pmtu_search_answer(&s, buf, n - 1) == 0);
+    buf[0] = 0x45;
+    assert(pmtu_search_answer(&s, buf, n) == 0);
+    assert(pmtu_search_answer(&s, old, n) == 1);
+    n = pmtu_search_probe(&s, buf);
+    assert(pmtu_search_answer(&s, old, PMTU_MIN) == 0);
+    assert(pmtu_search_answer(&s, buf, n) == 1);
+
+    printf("✓ Probe search test passed\n");
+}
+
+int main() {
+    printf("Running path MTU unit tests...\n");
+
+    test_clamp_ipv4();
+    test_clamp_ipv6();
+    test_search();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
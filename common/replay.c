@@ -0,0 +1,152 @@
+//
+//  replay.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "replay.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Each frame is stored as a 4-byte word holding its type in the top byte
+// and its length below, then its payload, padded to 4 bytes so the next
+// word is aligned. A frame never wraps: when it does
+// not fit before the end, a zero length (or fewer than 4 bytes left) sends
+// readers back to the start.
+#define RECORD_HEADER 4
+
+static size_t record_size(size_t len) {
+    return RECORD_HEADER + ((len + 3) & ~(size_t)3);
+}
+
+static uint32_t record_word(const struct replay *r, size_t off) {
+    uint32_t word;
+    memcpy(&word, r->buf + off, sizeof(word));
+    return word;
+}
+
+static uint32_t record_len(const struct replay *r, size_t off) {
+    return record_word(r, off) & 0xffffff;
+}
+
+// Offset of the record at off, following a wrap marker
+static size_t record_start(const struct replay *r, size_t off) {
+    if (r->cap - off < RECORD_HEADER || record_word(r, off) == 0) {
+        return 0;
+    }
+    return off;
+}
+
+int replay_init(struct replay *r, size_t cap) {
+    if (cap < REPLAY_MIN_CAP) {
+        return -1;
+    }
+    cap = (cap + 3) & ~(size_t)3;
+    r->buf = malloc(cap);
+    if (!r->buf) {
+        return -1;
+    }
+    r->cap = cap;
+    r->head = 0;
+    r->tail = 0;
+    r->count = 0;
+    r->bytes = 0;
+    r->first_seq = 0;
+    return 0;
+}
+
+void replay_free(struct replay *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
+
+static void replay_drop_oldest(struct replay *r) {
+    size_t off = record_start(r, r->head);
+    uint32_t len = record_len(r, off);
+
+    r->count--;
+    r->bytes -= len;
+    r->first_seq++;
+    if (r->count == 0) {
+        r->head = r->tail = 0;
+        return;
+    }
+    r->head = record_start(r, off + record_size(len));
+}
+
+void replay_push(struct replay *r, const void *data, size_t len) {
+    replay_push_typed(r, FRAME_TYPE_DATA, data, len);
+}
+
+void replay_push_typed(struct replay *r, enum frame_type type, const void *data, size_t len) {
+    size_t need = record_size(len);
+
+    for (;;) {
+        if (r->count == 0) {
+            r->head = r->tail = 0;
+            break;
+        }
+        if (r->tail > r->head) {
+            // Frames fill [head, tail): use the end, else wrap to the start
+            if (r->cap - r->tail >= need) {
+                break;
+            }
+            if (r->cap - r->tail >= RECORD_HEADER) {
+                memset(r->buf + r->tail, 0, RECORD_HEADER);
+            }
+            r->tail = 0;
+            continue;
+        }
+        // Wrapped, or full when tail == head: [tail, head) is free
+        if (r->head - r->tail >= need) {
+            break;
+        }
+        replay_drop_oldest(r);
+    }
+
+    uint32_t word = (uint32_t)type << 24 | (uint32_t)len;
+    memcpy(r->buf + r->tail, &word, sizeof(word));
+    memcpy(r->buf + r->tail + RECORD_HEADER, data, len);
+    r->tail += need;
+    r->count++;
+    r->bytes += len;
+}
+
+int replay_ack(struct replay *r, uint64_t seq) {
+    if (seq > replay_next_seq(r)) {
+        return -1;
+    }
+    while (r->first_seq < seq) {
+        replay_drop_oldest(r);
+    }
+    return 0;
+}
+
+uint64_t replay_next_seq(const struct replay *r) {
+    return r->first_seq + r->count;
+}
+
+void replay_renumber(struct replay *r, uint64_t first_seq) {
+    r->first_seq = first_seq;
+}
+
+void replay_cursor_init(const struct replay *r, struct replay_cursor *c) {
+    c->off = r->head;
+    c->left = r->count;
+}
+
+int replay_cursor_next(const struct replay *r, struct replay_cursor *c, struct frame *out) {
+    if (c->left == 0) {
+        return 0;
+    }
+    size_t off = record_start(r, c->off);
+    uint32_t word = record_word(r, off);
+    uint32_t len = word & 0xffffff;
+
+    out->data = r->buf + off + RECORD_HEADER;
+    out->len = len;
+    out->type = (enum frame_type)(word >> 24);
+    c->off = off + record_size(len);
+    c->left--;
+    return 1;
+}
@@ -0,0 +1,99 @@
+//
+//  replay.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Replay buffer for resumable sessions. Each side numbers the data frames
+//  it sends from 0 and keeps a copy of each in a fixed-size ring until the
+//  peer acknowledges it. After a reconnect the HELLO exchange tells each
+//  side how many frames the other received, and whatever is held past that
+//  point is sent again. A full ring drops its oldest frames: they are IP
+//  packets, so a gap costs the flow a TCP retransmission rather than a reset.
+//
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "frame.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Smallest ring that holds a maximum frame
+#define REPLAY_MIN_CAP (FRAME_HEADER_LEN + 65536)
+
+struct replay {
+    uint8_t *buf;
+    size_t cap;
+    size_t head;            // offset of the oldest frame
+    size_t tail;            // offset the next frame is written at
+    size_t count;           // frames held
+    size_t bytes;           // payload bytes held
+    uint64_t first_seq;     // sequence number of the oldest frame held
+};
+
+struct replay_cursor {
+    size_t off;
+    size_t left;
+};
+
+/**
+ * Allocate an empty ring; the first frame pushed gets sequence number 0
+ * @param r Replay buffer
+ * @param cap Ring size, at least REPLAY_MIN_CAP
+ * @return 0 on success, -1 on allocation failure or a too small cap
+ */
+int replay_init(struct replay *r, size_t cap);
+
+/**
+ * Free the ring
+ */
+void replay_free(struct replay *r);
+
+/**
+ * Keep a copy of the next frame sent, dropping the oldest frames for room
+ * @param r Replay buffer
+ * @param data Payload
+ * @param len Payload length, 1 to FRAME_MAX_PAYLOAD
+ */
+void replay_push(struct replay *r, const void *data, size_t len);
+
+/**
+ * Keep a copy of a data frame of another type, e.g. FRAME_TYPE_GSO; the
+ * cursor returns it with that type
+ */
+void replay_push_typed(struct replay *r, enum frame_type type, const void *data, size_t len);
+
+/**
+ * Drop the frames the peer has received
+ * @param r Replay buffer
+ * @param seq Data frames the peer has received in this session
+ * @return 0 on success, -1 if seq counts frames never sent
+ */
+int replay_ack(struct replay *r, uint64_t seq);
+
+/**
+ * Sequence number the next frame pushed gets
+ */
+uint64_t replay_next_seq(const struct replay *r);
+
+/**
+ * Renumber the frames held so the oldest is first_seq, e.g. to resend them
+ * in a new session that starts at 0
+ */
+void replay_renumber(struct replay *r, uint64_t first_seq);
+
+/**
+ * Start walking the frames held, oldest first
+ */
+void replay_cursor_init(const struct replay *r, struct replay_cursor *c);
+
+/**
+ * Step to the next frame
+ * @param r Replay buffer, not pushed to or acknowledged during the walk
+ * @param c Cursor
+ * @param out Output: a data frame pointing into the ring
+ * @return 1 if a frame was returned, 0 at the end
+ */
+int replay_cursor_next(const struct replay *r, struct replay_cursor *c, struct frame *out);
+
+#endif
@@ -0,0 +1,154 @@
+//
+//  replay_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "replay.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+static uint8_t payload[FRAME_MAX_PAYLOAD];
+
+// Frame seq is (seq % 1000) + 1 bytes of (uint8_t)seq
+static size_t frame_len(uint64_t seq) {
+    return (size_t)(seq % 1000) + 1;
+}
+
+static void push_seq(struct replay *r, uint64_t seq) {
+    assert(replay_next_seq(r) == seq);
+    memset(payload, (uint8_t)seq, frame_len(seq));
+    replay_push(r, payload, frame_len(seq));
+}
+
+// The ring holds exactly first_seq..next_seq-1, in order
+static void check_contents(const struct replay *r) {
+    struct replay_cursor c;
+    struct frame f;
+    uint64_t seq = r->first_seq;
+
+    replay_cursor_init(r, &c);
+    while (replay_cursor_next(r, &c, &f) == 1) {
+        assert(f.type == FRAME_TYPE_DATA);
+        assert(f.len == frame_len(seq));
+        assert(f.data[0] == (uint8_t)seq && f.data[f.len - 1] == (uint8_t)seq);
+        seq++;
+    }
+    assert(seq == replay_next_seq(r));
+}
+
+void test_push_ack() {
+    struct replay r;
+    assert(replay_init(&r, REPLAY_MIN_CAP) == 0);
+
+    for (uint64_t i = 0; i < 10; i++) {
+        push_seq(&r, i);
+    }
+    assert(r.count == 10 && r.first_seq == 0);
+    check_contents(&r);
+
+    assert(replay_ack(&r, 4) == 0);
+    assert(r.count == 6 && r.first_seq == 4);
+    check_contents(&r);
+
+    // Acknowledging again, or less, changes nothing
+    assert(replay_ack(&r, 2) == 0);
+    assert(r.count == 6);
+
+    // The peer cannot have received frames never sent
+    assert(replay_ack(&r, 11) == -1);
+
+    assert(replay_ack(&r, 10) == 0);
+    assert(r.count == 0 && r.bytes == 0 && replay_next_seq(&r) == 10);
+    push_seq(&r, 10);
+    check_contents(&r);
+
+    replay_free(&r);
+    printf("✓ Push and ack test passed\n");
+}
+
+void test_wrap_drops_oldest() {
+    struct replay r;
+    assert(replay_init(&r, REPLAY_MIN_CAP) == 0);
+
+    // Many times the capacity: the ring keeps the newest frames, in order
+    for (uint64_t i = 0; i < 100000; i++) {
+        push_seq(&r, i);
+        if (i % 97 == 0) {
+            check_contents(&r);
+        }
+        if (i % 1013 == 0) {
+            assert(replay_ack(&r, r.first_seq + r.count / 2) == 0);
+        }
+    }
+    check_contents(&r);
+    assert(r.bytes <= r.cap && r.bytes > r.cap / 2);
+
+    // Maximum frames always fit
+    for (uint64_t i = 0; i < 10; i++) {
+        memset(payload, (uint8_t)i, sizeof(payload));
+        replay_push(&r, payload, sizeof(payload));
+        assert(r.count >= 1);
+    }
+
+    replay_free(&r);
+    printf("✓ Wrap and drop test passed\n");
+}
+
+void test_renumber() {
+    struct replay r;
+    struct replay_cursor c;
+    struct frame f;
+    assert(replay_init(&r, REPLAY_MIN_CAP) == 0);
+
+    for (uint64_t i = 0; i < 8; i++) {
+        push_seq(&r, i);
+    }
+    assert(replay_ack(&r, 5) == 0);
+
+    // A new session resends what is held as its first frames
+    replay_renumber(&r, 0);
+    assert(replay_next_seq(&r) == 3);
+    replay_cursor_init(&r, &c);
+    assert(replay_cursor_next(&r, &c, &f) == 1 && f.len == frame_len(5));
+    assert(replay_ack(&r, 1) == 0);
+    assert(r.count == 2);
+
+    assert(replay_init(&r, REPLAY_MIN_CAP - 4) == -1);
+    replay_free(&r);
+    printf("✓ Renumber test passed\n");
+}
+
+void test_typed_frames() {
+    struct replay r;
+    struct replay_cursor c;
+    struct frame f;
+    assert(replay_init(&r, 2 * REPLAY_MIN_CAP) == 0);
+
+    memset(payload, 0x5a, sizeof(payload));
+    replay_push(&r, payload, 100);
+    replay_push_typed(&r, FRAME_TYPE_GSO, payload, FRAME_MAX_PAYLOAD);
+    assert(r.count == 2 && r.bytes == 100 + FRAME_MAX_PAYLOAD);
+
+    // Types come back with their frames and do not count as length
+    replay_cursor_init(&r, &c);
+    assert(replay_cursor_next(&r, &c, &f) == 1 && f.type == FRAME_TYPE_DATA && f.len == 100);
+    assert(replay_cursor_next(&r, &c, &f) == 1 && f.type == FRAME_TYPE_GSO && f.len == FRAME_MAX_PAYLOAD);
+    assert(replay_ack(&r, 1) == 0 && r.bytes == FRAME_MAX_PAYLOAD);
+
+    replay_free(&r);
+    printf("✓ Typed frames test passed\n");
+}
+
+int main() {
+    printf("Running replay buffer unit tests...\n");
+
+    test_push_ack();
+    test_wrap_drops_oldest();
+    test_renumber();
+    test_typed_frames();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,309 @@
+//
+//  seal.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "seal.h"
+
+#include <string.h>
+
+#define SEAL_INFO_CLIENT "net-rewire seal client"
+#define SEAL_INFO_SERVER "net-rewire seal server"
+
+// Compare MACs in time independent of where they differ
+static int seal_equal(const uint8_t *a, const uint8_t *b, size_t len) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < len; i++) {
+        diff |= (uint8_t)(a[i] ^ b[i]);
+    }
+    return diff == 0;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+int seal_parse_key(const char *text, size_t len, uint8_t key[SEAL_KEY_LEN]) {
+    size_t digits = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            continue;
+        }
+        int v = hex_digit(c);
+        if (v < 0 || digits == 2 * SEAL_KEY_LEN) {
+            return -1;
+        }
+        if (digits % 2 == 0) {
+            key[digits / 2] = (uint8_t)(v << 4);
+        } else {
+            key[digits / 2] |= (uint8_t)v;
+        }
+        digits++;
+    }
+    return digits == 2 * SEAL_KEY_LEN ? 0 : -1;
+}
+
+int seal_key_frame(uint8_t payload[SEAL_KEY_FRAME_LEN]) {
+    payload[0] = SEAL_SUITE_AES_256_GCM;
+    return seal_random(payload + 1, SEAL_RANDOM_LEN);
+}
+
+void seal_hkdf(const uint8_t *salt, size_t salt_len, const uint8_t *ikm, size_t ikm_len,
+               const uint8_t *info, size_t info_len, uint8_t out[32]) {
+    uint8_t prk[32];
+    uint8_t block[64 + 1];
+
+    seal_hmac_sha256(salt, salt_len, ikm, ikm_len, prk);
+    if (info_len > sizeof(block) - 1) {
+        info_len = sizeof(block) - 1;
+    }
+    memcpy(block, info, info_len);
+    block[info_len] = 1;
+    seal_hmac_sha256(prk, sizeof(prk), block, info_len + 1, out);
+    memset(prk, 0, sizeof(prk));
+}
+
+// The key for one direction; the salt is both KEY frames, so suites and
+// randoms are bound to it
+static struct seal_aead *seal_derive(const uint8_t psk[SEAL_KEY_LEN], const uint8_t *salt, const char *info) {
+    uint8_t key[SEAL_KEY_LEN];
+    seal_hkdf(salt, 2 * SEAL_KEY_FRAME_LEN, psk, SEAL_KEY_LEN, (const uint8_t *)info, strlen(info), key);
+    struct seal_aead *a = seal_aead_create(key);
+    memset(key, 0, sizeof(key));
+    return a;
+}
+
+int seal_start(const uint8_t psk[SEAL_KEY_LEN], const uint8_t client_key[SEAL_KEY_FRAME_LEN],
+               const uint8_t server_key[SEAL_KEY_FRAME_LEN], int is_client,
+               struct seal_stream *tx, struct seal_stream *rx) {
+    uint8_t salt[2 * SEAL_KEY_FRAME_LEN];
+
+    tx->aead = rx->aead = NULL;
+    tx->seq = rx->seq = 0;
+    tx->window = rx->window = 0;
+    if (client_key[0] != SEAL_SUITE_AES_256_GCM || server_key[0] != SEAL_SUITE_AES_256_GCM) {
+        return -1;
+    }
+    memcpy(salt, client_key, SEAL_KEY_FRAME_LEN);
+    memcpy(salt + SEAL_KEY_FRAME_LEN, server_key, SEAL_KEY_FRAME_LEN);
+
+    struct seal_aead *client = seal_derive(psk, salt, SEAL_INFO_CLIENT);
+    struct seal_aead *server = seal_derive(psk, salt, SEAL_INFO_SERVER);
+    if (!client || !server) {
+        seal_aead_free(client);
+        seal_aead_free(server);
+        return -1;
+    }
+    tx->aead = is_client ? client : server;
+    rx->aead = is_client ? server : client;
+    return 0;
+}
+
+void seal_stream_free(struct seal_stream *st) {
+    seal_aead_free(st->aead);
+    st->aead = NULL;
+}
+
+// Directions have keys of their own, so the nonce only needs the sequence
+static void seal_nonce(uint8_t nonce[SEAL_NONCE_LEN], uint64_t seq) {
+    memset(nonce, 0, SEAL_NONCE_LEN - 8);
+    frame_put_u64(nonce + SEAL_NONCE_LEN - 8, seq);
+}
+
+// Encrypt the frames serialized behind the sequence number at record and
+// queue the record; the frame header is the additional data
+static int seal_emit(struct seal_stream *st, uint8_t *record, size_t len, struct frame_batch *out) {
+    uint8_t nonce[SEAL_NONCE_LEN];
+    uint8_t aad[FRAME_HEADER_LEN];
+    size_t record_len = SEAL_OVERHEAD + len;
+
+    frame_put_u64(record, st->seq);
+    seal_nonce(nonce, st->seq);
+    frame_encode_typed_header(aad, FRAME_TYPE_SEALED, record_len);
+    if (seal_aead_encrypt(st->aead, nonce, aad, sizeof(aad), record + SEAL_SEQ_LEN, len,
+                          record + SEAL_SEQ_LEN + len) < 0) {
+        return -1;
+    }
+    st->seq++;
+    return frame_batch_add_typed(out, FRAME_TYPE_SEALED, record, record_len);
+}
+
+int seal_batch(struct seal_stream *st, struct frame_batch *in, struct frame_batch *out, uint8_t *scratch) {
+    uint8_t *record = scratch;
+    size_t len = 0;
+    int rc = 0;
+
+    frame_batch_init(out);
+    for (int i = 0; i < in->count && rc == 0; i++) {
+        const struct iovec *iov = &in->iov[2 * i];
+        size_t frame_len = iov[0].iov_len + iov[1].iov_len;
+
+        if (frame_len > SEAL_RECORD_MAX) {
+            rc = -1;
+            break;
+        }
+        if (len + frame_len > SEAL_RECORD_MAX) {
+            rc = seal_emit(st, record, len, out);
+            record += SEAL_OVERHEAD + len;
+            len = 0;
+        }
+        uint8_t *dst = record + SEAL_SEQ_LEN + len;
+        memcpy(dst, iov[0].iov_base, iov[0].iov_len);
+        memcpy(dst + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+        len += frame_len;
+    }
+    if (rc == 0 && len > 0) {
+        rc = seal_emit(st, record, len, out);
+    }
+    frame_batch_init(in);
+    return rc;
+}
+
+long seal_open(struct seal_stream *st, uint8_t *record, size_t len, uint8_t **plain) {
+    uint8_t nonce[SEAL_NONCE_LEN];
+    uint8_t aad[FRAME_HEADER_LEN];
+
+    if (len <= SEAL_OVERHEAD) {
+        return -1;
+    }
+    uint64_t seq = frame_get_u64(record);
+    if (seq < st->seq) {
+        return -1;
+    }
+    size_t plain_len = len - SEAL_OVERHEAD;
+    seal_nonce(nonce, seq);
+    frame_encode_typed_header(aad, FRAME_TYPE_SEALED, len);
+    if (seal_aead_decrypt(st->aead, nonce, aad, sizeof(aad), record + SEAL_SEQ_LEN, plain_len,
+                          record + SEAL_SEQ_LEN + plain_len) < 0) {
+        return -1;
+    }
+    st->seq = seq + 1;
+    *plain = record + SEAL_SEQ_LEN;
+    return (long)plain_len;
+}
+
+int seal_dgram_hello(const uint8_t psk[SEAL_KEY_LEN], uint8_t key[SEAL_KEY_FRAME_LEN],
+                     uint8_t out[SEAL_DGRAM_HELLO_LEN]) {
+    if (seal_key_frame(key) < 0) {
+        return -1;
+    }
+    out[0] = SEAL_DGRAM_HELLO;
+    memcpy(out + 1, key, SEAL_KEY_FRAME_LEN);
+    seal_hmac_sha256(psk, SEAL_KEY_LEN, out, 1 + SEAL_KEY_FRAME_LEN, out + 1 + SEAL_KEY_FRAME_LEN);
+    return 0;
+}
+
+int seal_dgram_hello_check(const uint8_t psk[SEAL_KEY_LEN], const uint8_t *dgram, size_t len,
+                           uint8_t key[SEAL_KEY_FRAME_LEN]) {
+    uint8_t mac[SEAL_MAC_LEN];
+
+    if (len != SEAL_DGRAM_HELLO_LEN || dgram[0] != SEAL_DGRAM_HELLO) {
+        return -1;
+    }
+    seal_hmac_sha256(psk, SEAL_KEY_LEN, dgram, 1 + SEAL_KEY_FRAME_LEN, mac);
+    if (!seal_equal(mac, dgram + 1 + SEAL_KEY_FRAME_LEN, SEAL_MAC_LEN)) {
+        return -1;
+    }
+    memcpy(key, dgram + 1, SEAL_KEY_FRAME_LEN);
+    return 0;
+}
+
+// MAC of an ACCEPT: its type, peer id and KEY frame payload, then the HELLO's
+static void seal_accept_mac(const uint8_t psk[SEAL_KEY_LEN], const uint8_t *dgram,
+                            const uint8_t client_key[SEAL_KEY_FRAME_LEN], uint8_t mac[SEAL_MAC_LEN]) {
+    uint8_t signed_part[1 + 4 + 2 * SEAL_KEY_FRAME_LEN];
+
+    memcpy(signed_part, dgram, 1 + 4 + SEAL_KEY_FRAME_LEN);
+    memcpy(signed_part + 1 + 4 + SEAL_KEY_FRAME_LEN, client_key, SEAL_KEY_FRAME_LEN);
+    seal_hmac_sha256(psk, SEAL_KEY_LEN, signed_part, sizeof(signed_part), mac);
+}
+
+int seal_dgram_accept(const uint8_t psk[SEAL_KEY_LEN], const uint8_t client_key[SEAL_KEY_FRAME_LEN], uint32_t peer,
+                      uint8_t key[SEAL_KEY_FRAME_LEN], uint8_t out[SEAL_DGRAM_ACCEPT_LEN]) {
+    if (seal_key_frame(key) < 0) {
+        return -1;
+    }
+    out[0] = SEAL_DGRAM_ACCEPT;
+    frame_put_u32(out + 1, peer);
+    memcpy(out + 1 + 4, key, SEAL_KEY_FRAME_LEN);
+    seal_accept_mac(psk, out, client_key, out + 1 + 4 + SEAL_KEY_FRAME_LEN);
+    return 0;
+}
+
+int seal_dgram_accept_check(const uint8_t psk[SEAL_KEY_LEN], const uint8_t client_key[SEAL_KEY_FRAME_LEN],
+                            const uint8_t *dgram, size_t len, uint32_t *peer, uint8_t key[SEAL_KEY_FRAME_LEN]) {
+    uint8_t mac[SEAL_MAC_LEN];
+
+    if (len != SEAL_DGRAM_ACCEPT_LEN || dgram[0] != SEAL_DGRAM_ACCEPT) {
+        return -1;
+    }
+    seal_accept_mac(psk, dgram, client_key, mac);
+    if (!seal_equal(mac, dgram + 1 + 4 + SEAL_KEY_FRAME_LEN, SEAL_MAC_LEN) || frame_get_u32(dgram + 1) == 0) {
+        return -1;
+    }
+    *peer = frame_get_u32(dgram + 1);
+    memcpy(key, dgram + 1 + 4, SEAL_KEY_FRAME_LEN);
+    return 0;
+}
+
+uint32_t seal_dgram_peer(const uint8_t *dgram, size_t len) {
+    if (len < SEAL_DGRAM_OVERHEAD || dgram[0] != SEAL_DGRAM_DATA) {
+        return 0;
+    }
+    return frame_get_u32(dgram + 1);
+}
+
+size_t seal_dgram_seal(struct seal_stream *st, uint32_t peer, uint8_t *dgram, size_t len) {
+    uint8_t nonce[SEAL_NONCE_LEN];
+
+    dgram[0] = SEAL_DGRAM_DATA;
+    frame_put_u32(dgram + 1, peer);
+    frame_put_u64(dgram + 1 + 4, st->seq);
+    seal_nonce(nonce, st->seq);
+    if (seal_aead_encrypt(st->aead, nonce, dgram, SEAL_DGRAM_HEADER_LEN, dgram + SEAL_DGRAM_HEADER_LEN, len,
+                          dgram + SEAL_DGRAM_HEADER_LEN + len) < 0) {
+        return 0;
+    }
+    st->seq++;
+    return SEAL_DGRAM_OVERHEAD + len;
+}
+
+long seal_dgram_open(struct seal_stream *st, uint8_t *dgram, size_t len, uint8_t **plain) {
+    uint8_t nonce[SEAL_NONCE_LEN];
+
+    if (seal_dgram_peer(dgram, len) == 0) {
+        return -1;
+    }
+    uint64_t seq = frame_get_u64(dgram + 1 + 4);
+    uint64_t behind = st->seq - 1 - seq;    // bit of seq in the window, if below the top
+    if (seq < st->seq && (behind >= SEAL_DGRAM_WINDOW || (st->window >> behind & 1))) {
+        return -1;
+    }
+    size_t plain_len = len - SEAL_DGRAM_OVERHEAD;
+    seal_nonce(nonce, seq);
+    if (seal_aead_decrypt(st->aead, nonce, dgram, SEAL_DGRAM_HEADER_LEN, dgram + SEAL_DGRAM_HEADER_LEN, plain_len,
+                          dgram + SEAL_DGRAM_HEADER_LEN + plain_len) < 0) {
+        return -1;
+    }
+    if (seq < st->seq) {
+        st->window |= (uint64_t)1 << behind;
+    } else {
+        uint64_t ahead = seq + 1 - st->seq;
+        st->window = ahead >= SEAL_DGRAM_WINDOW ? 0 : st->window << ahead;
+        st->window |= 1;
+        st->seq = seq + 1;
+    }
+    *plain = dgram + SEAL_DGRAM_HEADER_LEN;
+    return (long)plain_len;
+}
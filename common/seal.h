@@ -0,0 +1,255 @@
+//
+//  seal.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Authenticated encryption of a stream connection with a pre-shared key.
+//  The client opens the connection with a KEY frame carrying a random
+//  value, the server answers with one of its own, and both derive a fresh
+//  AES-256-GCM key for each direction from the pre-shared key and the two
+//  randoms, so no key or nonce is ever used on two connections. Only a
+//  peer holding the pre-shared key can produce a record the other accepts.
+//
+//  Every frame after the KEY exchange travels inside FRAME_TYPE_SEALED
+//  records: a whole batch of frames is encrypted as one record, so the
+//  cipher runs once per writev rather than once per packet. A record
+//  carries its sequence number and is refused unless that is above the
+//  last one accepted, so records may be dropped but never replayed or
+//  reordered. Frames never straddle records.
+//
+//  The datagram transport seals every packet on its own, as DTLS does. A
+//  handshake of two datagrams, each authenticated with the pre-shared key,
+//  agrees the keys the same way, and the server names the client by a peer
+//  id every sealed datagram carries. Datagrams may be lost or reordered, so
+//  each sequence number is accepted once within a window below the highest
+//  one seen.
+//
+//  The cipher itself comes from the platform: OpenSSL's libcrypto on the
+//  server (seal_openssl.c), CommonCrypto in the macOS extension
+//  (seal_commoncrypto.c). libcrypto runs all of GCM on the AES and
+//  carry-less multiply instructions of the CPU. CommonCrypto offers AES
+//  alone, which runs on the AES instructions; GHASH is then computed in
+//  code, in constant time, with carry-less multiply instructions only where
+//  the compiler targets them.
+//
+
+#ifndef SEAL_H
+#define SEAL_H
+
+#include "frame.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEAL_KEY_LEN 32
+#define SEAL_NONCE_LEN 12
+#define SEAL_TAG_LEN 16
+#define SEAL_RANDOM_LEN 16
+
+// KEY frame payload: u8 cipher suite, then the sender's random
+#define SEAL_SUITE_AES_256_GCM 1
+#define SEAL_KEY_FRAME_LEN (1 + SEAL_RANDOM_LEN)
+
+// A record is a u64 sequence number, the encrypted frames and the tag
+#define SEAL_SEQ_LEN 8
+#define SEAL_OVERHEAD (SEAL_SEQ_LEN + SEAL_TAG_LEN)
+#define SEAL_RECORD_MAX (FRAME_MAX_PAYLOAD - SEAL_OVERHEAD)
+
+// Largest payload of a frame that still fits a record
+#define SEAL_FRAME_MAX_PAYLOAD (SEAL_RECORD_MAX - FRAME_HEADER_LEN)
+
+// Datagrams start with a type byte no IP packet (version 4 or 6) or MTU
+// probe (0) starts with. The MAC is HMAC-SHA256 under the pre-shared key of
+// what precedes it; an ACCEPT's also covers the HELLO's KEY frame payload.
+#define SEAL_DGRAM_HELLO 0x10       // client: type, KEY frame payload, MAC
+#define SEAL_DGRAM_ACCEPT 0x11      // server: type, u32 peer id, KEY frame payload, MAC
+#define SEAL_DGRAM_DATA 0x12        // either: type, u32 peer id, u64 seq, packet, tag
+#define SEAL_MAC_LEN 32
+#define SEAL_DGRAM_HELLO_LEN (1 + SEAL_KEY_FRAME_LEN + SEAL_MAC_LEN)
+#define SEAL_DGRAM_ACCEPT_LEN (1 + 4 + SEAL_KEY_FRAME_LEN + SEAL_MAC_LEN)
+#define SEAL_DGRAM_HEADER_LEN (1 + 4 + SEAL_SEQ_LEN)
+#define SEAL_DGRAM_OVERHEAD (SEAL_DGRAM_HEADER_LEN + SEAL_TAG_LEN)
+
+// Sequence numbers below the highest seen that a datagram may still carry
+#define SEAL_DGRAM_WINDOW 64
+
+// Scratch seal_batch() writes the records of a batch of this many bytes to:
+// every frame could end a record of its own
+#define SEAL_BATCH_SCRATCH(bytes) ((bytes) + FRAME_BATCH_MAX * SEAL_OVERHEAD)
+
+struct seal_aead;
+
+// One direction of a sealed connection
+struct seal_stream {
+    struct seal_aead *aead;     // NULL while the direction is not sealed
+    uint64_t seq;               // sending: next record; receiving: lowest acceptable
+                                // (datagrams: one past the highest accepted)
+    uint64_t window;            // receiving datagrams: bit i set once seq - 1 - i is accepted
+};
+
+/**
+ * Read a key written as 64 hex digits; whitespace is ignored
+ * @param text Key text, e.g. a key file or Keychain item
+ * @param len Text length
+ * @param key Output key
+ * @return 0 on success, -1 if the text is not a key
+ */
+int seal_parse_key(const char *text, size_t len, uint8_t key[SEAL_KEY_LEN]);
+
+/**
+ * Write a KEY frame payload with a fresh random
+ * @param payload Output: SEAL_KEY_FRAME_LEN bytes
+ * @return 0 on success, -1 if no random bytes were available
+ */
+int seal_key_frame(uint8_t payload[SEAL_KEY_FRAME_LEN]);
+
+/**
+ * Derive both directions of a connection from the two KEY frames
+ * @param psk Pre-shared key
+ * @param client_key Payload of the client's KEY frame
+ * @param server_key Payload of the server's KEY frame
+ * @param is_client Whether we are the client
+ * @param tx Output: the direction we send
+ * @param rx Output: the direction we receive
+ * @return 0 on success, -1 on an unknown cipher suite or allocation failure
+ */
+int seal_start(const uint8_t psk[SEAL_KEY_LEN], const uint8_t client_key[SEAL_KEY_FRAME_LEN],
+               const uint8_t server_key[SEAL_KEY_FRAME_LEN], int is_client,
+               struct seal_stream *tx, struct seal_stream *rx);
+
+/**
+ * Release a direction; it is unsealed afterwards
+ */
+void seal_stream_free(struct seal_stream *st);
+
+/**
+ * Seal a batch: its frames are packed, in order, into as few records as fit
+ * @param st Sending direction
+ * @param in Batch nothing was written from yet, every payload at most
+ *           SEAL_FRAME_MAX_PAYLOAD bytes; emptied
+ * @param out Output batch of FRAME_TYPE_SEALED frames; points into scratch
+ * @param scratch At least SEAL_BATCH_SCRATCH(frame_batch_pending(in)) bytes
+ * @return 0 on success, -1 if a frame is too large or the cipher failed
+ */
+int seal_batch(struct seal_stream *st, struct frame_batch *in, struct frame_batch *out, uint8_t *scratch);
+
+/**
+ * Authenticate and decrypt a record in place
+ * @param st Receiving direction
+ * @param record Payload of a FRAME_TYPE_SEALED frame
+ * @param len Payload length
+ * @param plain Output: the record's frames, inside record
+ * @return Length of the frames, or -1 if the record is forged, corrupt or
+ *         a replay; the connection must be dropped then
+ */
+long seal_open(struct seal_stream *st, uint8_t *record, size_t len, uint8_t **plain);
+
+/**
+ * Client: write a HELLO datagram with a fresh KEY frame payload
+ * @param psk Pre-shared key
+ * @param key Output: the KEY frame payload, for seal_dgram_accept_check()
+ *            and seal_start()
+ * @param out Output datagram
+ * @return 0 on success, -1 if no random bytes were available
+ */
+int seal_dgram_hello(const uint8_t psk[SEAL_KEY_LEN], uint8_t key[SEAL_KEY_FRAME_LEN],
+                     uint8_t out[SEAL_DGRAM_HELLO_LEN]);
+
+/**
+ * Server: check a HELLO datagram
+ * @param key Output: the client's KEY frame payload
+ * @return 0 if it was made with the pre-shared key, -1 otherwise
+ */
+int seal_dgram_hello_check(const uint8_t psk[SEAL_KEY_LEN], const uint8_t *dgram, size_t len,
+                           uint8_t key[SEAL_KEY_FRAME_LEN]);
+
+/**
+ * Server: write the ACCEPT answering a HELLO, with a fresh KEY frame payload
+ * @param client_key The HELLO's KEY frame payload
+ * @param peer Id the client's sealed datagrams will carry, never 0
+ * @param key Output: our KEY frame payload, for seal_start()
+ * @param out Output datagram
+ * @return 0 on success, -1 if no random bytes were available
+ */
+int seal_dgram_accept(const uint8_t psk[SEAL_KEY_LEN], const uint8_t client_key[SEAL_KEY_FRAME_LEN], uint32_t peer,
+                      uint8_t key[SEAL_KEY_FRAME_LEN], uint8_t out[SEAL_DGRAM_ACCEPT_LEN]);
+
+/**
+ * Client: check the ACCEPT answering our HELLO
+ * @param client_key Our HELLO's KEY frame payload
+ * @param peer Output: our peer id
+ * @param key Output: the server's KEY frame payload
+ * @return 0 if it answers that HELLO and was made with the pre-shared key,
+ *         -1 otherwise
+ */
+int seal_dgram_accept_check(const uint8_t psk[SEAL_KEY_LEN], const uint8_t client_key[SEAL_KEY_FRAME_LEN],
+                            const uint8_t *dgram, size_t len, uint32_t *peer, uint8_t key[SEAL_KEY_FRAME_LEN]);
+
+/**
+ * Peer id of a sealed datagram, before it is opened
+ * @return Peer id, or 0 if the datagram is not SEAL_DGRAM_DATA
+ */
+uint32_t seal_dgram_peer(const uint8_t *dgram, size_t len);
+
+/**
+ * Seal a packet into a datagram in place
+ * @param st Sending direction
+ * @param peer Peer id
+ * @param dgram The packet at dgram + SEAL_DGRAM_HEADER_LEN, with
+ *              SEAL_TAG_LEN bytes of room after it
+ * @param len Packet length
+ * @return Datagram length, or 0 if the cipher failed
+ */
+size_t seal_dgram_seal(struct seal_stream *st, uint32_t peer, uint8_t *dgram, size_t len);
+
+/**
+ * Authenticate and decrypt a sealed datagram in place
+ * @param st Receiving direction
+ * @param dgram Datagram
+ * @param len Datagram length
+ * @param plain Output: the packet, inside dgram
+ * @return Packet length, or -1 if the datagram is forged, corrupt, a replay
+ *         or too far behind; unlike a record, it is just dropped
+ */
+long seal_dgram_open(struct seal_stream *st, uint8_t *dgram, size_t len, uint8_t **plain);
+
+/**
+ * HKDF-SHA256 (RFC 5869) with one block of output
+ */
+void seal_hkdf(const uint8_t *salt, size_t salt_len, const uint8_t *ikm, size_t ikm_len,
+               const uint8_t *info, size_t info_len, uint8_t out[32]);
+
+/*
+ * Provided by the platform's crypto library
+ */
+
+/**
+ * Set up AES-256-GCM with a key
+ * @return Cipher state, or NULL on allocation failure
+ */
+struct seal_aead *seal_aead_create(const uint8_t key[SEAL_KEY_LEN]);
+
+void seal_aead_free(struct seal_aead *a);
+
+/**
+ * Encrypt len bytes in place and compute the tag over aad and them
+ * @return 0 on success, -1 on failure
+ */
+int seal_aead_encrypt(struct seal_aead *a, const uint8_t nonce[SEAL_NONCE_LEN], const uint8_t *aad,
+                      size_t aad_len, uint8_t *buf, size_t len, uint8_t tag[SEAL_TAG_LEN]);
+
+/**
+ * Check the tag and decrypt len bytes in place
+ * @return 0 on success, -1 if the tag does not match
+ */
+int seal_aead_decrypt(struct seal_aead *a, const uint8_t nonce[SEAL_NONCE_LEN], const uint8_t *aad,
+                      size_t aad_len, uint8_t *buf, size_t len, const uint8_t tag[SEAL_TAG_LEN]);
+
+void seal_hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t len, uint8_t out[32]);
+
+/**
+ * Fill buf from the system's secure random source
+ * @return 0 on success, -1 on failure
+ */
+int seal_random(uint8_t *buf, size_t len);
+
+#endif
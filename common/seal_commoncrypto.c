@@ -0,0 +1,271 @@
+//
+//  seal_commoncrypto.c
+//  Net-Rewire shared tunnel protocol
+//
+//  seal.h cipher on CommonCrypto, for the macOS extension. CommonCrypto's
+//  public API has no GCM, so the mode is built here on its AES, which runs
+//  on the AES instructions of Intel and Apple silicon Macs alike: counter
+//  blocks are encrypted in bulk by an ECB cryptor and XORed in, and the tag
+//  is GHASH (NIST SP 800-38D). Its multiplications never branch on or index
+//  by secret data: they use the carry-less multiply instruction where the
+//  compiler targets one (PMULL on Apple silicon, PCLMULQDQ with -mpclmul),
+//  and otherwise integer multiplications with the carries masked off.
+//
+
+#include "seal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <CommonCrypto/CommonCryptor.h>
+#include <CommonCrypto/CommonHMAC.h>
+#include <CommonCrypto/CommonRandom.h>
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define CLMUL_PMULL 1
+#include <arm_neon.h>
+#elif defined(__x86_64__) && defined(__PCLMUL__)
+#define CLMUL_PCLMUL 1
+#include <wmmintrin.h>
+#endif
+
+#define BLOCK 16
+
+// Counter blocks encrypted per call
+#define CTR_CHUNK (256 * BLOCK)
+
+struct seal_aead {
+    CCCryptorRef enc;           // AES-ECB of the sending direction,
+    CCCryptorRef dec;           // and of the receiving one
+    uint64_t hh, hl;            // the hash key H, big-endian halves
+};
+
+static uint64_t get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+static int aes_blocks(CCCryptorRef ref, uint8_t *buf, size_t len) {
+    size_t moved;
+    return CCCryptorUpdate(ref, buf, len, buf, len, &moved) == kCCSuccess && moved == len ? 0 : -1;
+}
+
+#if !defined(CLMUL_PMULL) && !defined(CLMUL_PCLMUL)
+// Low half of the carry-less product: integer products of the operands'
+// every fourth bit, so carries land only in bits that are masked off
+static uint64_t bmul64(uint64_t x, uint64_t y) {
+    const uint64_t m0 = 0x1111111111111111ull, m1 = m0 << 1, m2 = m0 << 2, m3 = m0 << 3;
+    uint64_t x0 = x & m0, x1 = x & m1, x2 = x & m2, x3 = x & m3;
+    uint64_t y0 = y & m0, y1 = y & m1, y2 = y & m2, y3 = y & m3;
+    uint64_t z0 = (x0 * y0) ^ (x1 * y3) ^ (x2 * y2) ^ (x3 * y1);
+    uint64_t z1 = (x0 * y1) ^ (x1 * y0) ^ (x2 * y3) ^ (x3 * y2);
+    uint64_t z2 = (x0 * y2) ^ (x1 * y1) ^ (x2 * y0) ^ (x3 * y3);
+    uint64_t z3 = (x0 * y3) ^ (x1 * y2) ^ (x2 * y1) ^ (x3 * y0);
+    return (z0 & m0) | (z1 & m1) | (z2 & m2) | (z3 & m3);
+}
+
+static uint64_t rev64(uint64_t x) {
+    x = (x & 0x5555555555555555ull) << 1 | (x >> 1 & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) << 2 | (x >> 2 & 0x3333333333333333ull);
+    x = (x & 0x0f0f0f0f0f0f0f0full) << 4 | (x >> 4 & 0x0f0f0f0f0f0f0f0full);
+    x = (x & 0x00ff00ff00ff00ffull) << 8 | (x >> 8 & 0x00ff00ff00ff00ffull);
+    x = (x & 0x0000ffff0000ffffull) << 16 | (x >> 16 & 0x0000ffff0000ffffull);
+    return x << 32 | x >> 32;
+}
+#endif
+
+// 128-bit carry-less product of x and y
+static void clmul64(uint64_t x, uint64_t y, uint64_t *hi, uint64_t *lo) {
+#if defined(CLMUL_PMULL)
+    uint64x2_t p = vreinterpretq_u64_p128(vmull_p64((poly64_t)x, (poly64_t)y));
+    *lo = vgetq_lane_u64(p, 0);
+    *hi = vgetq_lane_u64(p, 1);
+#elif defined(CLMUL_PCLMUL)
+    __m128i p = _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long)x), _mm_cvtsi64_si128((long long)y), 0x00);
+    *lo = (uint64_t)_mm_cvtsi128_si64(p);
+    *hi = (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(p, p));
+#else
+    // The high half is the low half of the product of the reversed
+    // operands, reversed
+    *lo = bmul64(x, y);
+    *hi = rev64(bmul64(rev64(x), rev64(y))) >> 1;
+#endif
+}
+
+static void ghash_init(struct seal_aead *a, const uint8_t h[BLOCK]) {
+    a->hh = get_u64(h);
+    a->hl = get_u64(h + 8);
+}
+
+// x = x * H in GF(2^128). GHASH reflects the bits of its blocks, so the
+// product of the big-endian halves, shifted left by one, is the reflected
+// product before reduction by x^128 + x^7 + x^2 + x + 1.
+static void ghash_mult(const struct seal_aead *a, uint8_t x[BLOCK]) {
+    uint64_t xh = get_u64(x), xl = get_u64(x + 8);
+    uint64_t lh, ll, hh, hl, mh, ml;
+
+    // Karatsuba: three 64-bit products make the 256-bit one
+    clmul64(xl, a->hl, &lh, &ll);
+    clmul64(xh, a->hh, &hh, &hl);
+    clmul64(xl ^ xh, a->hl ^ a->hh, &mh, &ml);
+    mh ^= lh ^ hh;
+    ml ^= ll ^ hl;
+
+    uint64_t v0 = ll, v1 = lh ^ ml, v2 = hl ^ mh, v3 = hh;
+    v3 = v3 << 1 | v2 >> 63;
+    v2 = v2 << 1 | v1 >> 63;
+    v1 = v1 << 1 | v0 >> 63;
+    v0 <<= 1;
+
+    // Fold the low 128 bits into the high ones
+    v2 ^= v0 ^ v0 >> 1 ^ v0 >> 2 ^ v0 >> 7;
+    v1 ^= v0 << 63 ^ v0 << 62 ^ v0 << 57;
+    v3 ^= v1 ^ v1 >> 1 ^ v1 >> 2 ^ v1 >> 7;
+    v2 ^= v1 << 63 ^ v1 << 62 ^ v1 << 57;
+    put_u64(x, v3);
+    put_u64(x + 8, v2);
+}
+
+// Absorb data, zero-padded to whole blocks
+static void ghash_update(const struct seal_aead *a, uint8_t y[BLOCK], const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t n = len < BLOCK ? len : BLOCK;
+        for (size_t i = 0; i < n; i++) {
+            y[i] ^= data[i];
+        }
+        ghash_mult(a, y);
+        data += n;
+        len -= n;
+    }
+}
+
+// The tag before it is masked: GHASH of aad, the ciphertext and their lengths
+static void ghash(const struct seal_aead *a, const uint8_t *aad, size_t aad_len, const uint8_t *ct, size_t len,
+                  uint8_t y[BLOCK]) {
+    uint8_t lens[BLOCK];
+
+    memset(y, 0, BLOCK);
+    ghash_update(a, y, aad, aad_len);
+    ghash_update(a, y, ct, len);
+    put_u64(lens, (uint64_t)aad_len * 8);
+    put_u64(lens + 8, (uint64_t)len * 8);
+    ghash_update(a, y, lens, BLOCK);
+}
+
+// E(K, J0), J0 being the nonce and a counter of 1, masks the tag
+static int tag_mask(CCCryptorRef ref, const uint8_t nonce[SEAL_NONCE_LEN], uint8_t mask[BLOCK]) {
+    memcpy(mask, nonce, SEAL_NONCE_LEN);
+    memset(mask + SEAL_NONCE_LEN, 0, BLOCK - SEAL_NONCE_LEN);
+    mask[BLOCK - 1] = 1;
+    return aes_blocks(ref, mask, BLOCK);
+}
+
+// XOR len bytes with the key stream from counter block J0 + 1 on
+static int gctr(CCCryptorRef ref, const uint8_t nonce[SEAL_NONCE_LEN], uint8_t *buf, size_t len) {
+    uint8_t stream[CTR_CHUNK];
+    uint32_t counter = 1;
+
+    while (len > 0) {
+        size_t n = len < CTR_CHUNK ? len : CTR_CHUNK;
+        size_t blocks = (n + BLOCK - 1) / BLOCK;
+        for (size_t b = 0; b < blocks; b++) {
+            uint8_t *cb = stream + b * BLOCK;
+            counter++;
+            memcpy(cb, nonce, SEAL_NONCE_LEN);
+            cb[12] = (uint8_t)(counter >> 24);
+            cb[13] = (uint8_t)(counter >> 16);
+            cb[14] = (uint8_t)(counter >> 8);
+            cb[15] = (uint8_t)counter;
+        }
+        if (aes_blocks(ref, stream, blocks * BLOCK) < 0) {
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            buf[i] ^= stream[i];
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+struct seal_aead *seal_aead_create(const uint8_t key[SEAL_KEY_LEN]) {
+    uint8_t h[BLOCK] = { 0 };
+    struct seal_aead *a = calloc(1, sizeof(*a));
+    if (!a) {
+        return NULL;
+    }
+    if (CCCryptorCreate(kCCEncrypt, kCCAlgorithmAES, kCCOptionECBMode, key, SEAL_KEY_LEN, NULL, &a->enc) != kCCSuccess ||
+        CCCryptorCreate(kCCEncrypt, kCCAlgorithmAES, kCCOptionECBMode, key, SEAL_KEY_LEN, NULL, &a->dec) != kCCSuccess ||
+        aes_blocks(a->enc, h, BLOCK) < 0) {
+        seal_aead_free(a);
+        return NULL;
+    }
+    ghash_init(a, h);
+    memset(h, 0, sizeof(h));
+    return a;
+}
+
+void seal_aead_free(struct seal_aead *a) {
+    if (!a) {
+        return;
+    }
+    if (a->enc) {
+        CCCryptorRelease(a->enc);
+    }
+    if (a->dec) {
+        CCCryptorRelease(a->dec);
+    }
+    memset(a, 0, sizeof(*a));
+    free(a);
+}
+
+int seal_aead_encrypt(struct seal_aead *a, const uint8_t nonce[SEAL_NONCE_LEN], const uint8_t *aad,
+                      size_t aad_len, uint8_t *buf, size_t len, uint8_t tag[SEAL_TAG_LEN]) {
+    uint8_t y[BLOCK], mask[BLOCK];
+
+    if (tag_mask(a->enc, nonce, mask) < 0 || gctr(a->enc, nonce, buf, len) < 0) {
+        return -1;
+    }
+    ghash(a, aad, aad_len, buf, len, y);
+    for (int i = 0; i < SEAL_TAG_LEN; i++) {
+        tag[i] = y[i] ^ mask[i];
+    }
+    return 0;
+}
+
+// The tag is checked before anything is decrypted, so a forged record
+// leaves buf as it came
+int seal_aead_decrypt(struct seal_aead *a, const uint8_t nonce[SEAL_NONCE_LEN], const uint8_t *aad,
+                      size_t aad_len, uint8_t *buf, size_t len, const uint8_t tag[SEAL_TAG_LEN]) {
+    uint8_t y[BLOCK], mask[BLOCK], diff = 0;
+
+    ghash(a, aad, aad_len, buf, len, y);
+    if (tag_mask(a->dec, nonce, mask) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < SEAL_TAG_LEN; i++) {
+        diff |= (uint8_t)(y[i] ^ mask[i] ^ tag[i]);
+    }
+    if (diff != 0) {
+        return -1;
+    }
+    return gctr(a->dec, nonce, buf, len);
+}
+
+void seal_hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t len, uint8_t out[32]) {
+    CCHmac(kCCHmacAlgSHA256, key, key_len, data, len, out);
+}
+
+int seal_random(uint8_t *buf, size_t len) {
+    return CCRandomGenerateBytes(buf, len) == kCCSuccess ? 0 : -1;
+}
@@ -0,0 +1,81 @@
+//
+//  seal_openssl.c
+//  Net-Rewire shared tunnel protocol
+//
+//  seal.h cipher on OpenSSL's libcrypto, for the Ubuntu server. EVP picks
+//  the AES-NI and PCLMULQDQ (or ARMv8 crypto extension) code paths itself.
+//  One context per direction keeps the expanded key; each record only sets
+//  a new nonce.
+//
+
+#include "seal.h"
+
+#include <stdlib.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+struct seal_aead {
+    EVP_CIPHER_CTX *enc;
+    EVP_CIPHER_CTX *dec;
+};
+
+struct seal_aead *seal_aead_create(const uint8_t key[SEAL_KEY_LEN]) {
+    struct seal_aead *a = calloc(1, sizeof(*a));
+    if (!a) {
+        return NULL;
+    }
+    a->enc = EVP_CIPHER_CTX_new();
+    a->dec = EVP_CIPHER_CTX_new();
+    if (!a->enc || !a->dec ||
+        EVP_EncryptInit_ex(a->enc, EVP_aes_256_gcm(), NULL, key, NULL) != 1 ||
+        EVP_DecryptInit_ex(a->dec, EVP_aes_256_gcm(), NULL, key, NULL) != 1) {
+        seal_aead_free(a);
+        return NULL;
+    }
+    return a;
+}
+
+void seal_aead_free(struct seal_aead *a) {
+    if (!a) {
+        return;
+    }
+    EVP_CIPHER_CTX_free(a->enc);
+    EVP_CIPHER_CTX_free(a->dec);
+    free(a);
+}
+
+int seal_aead_encrypt(struct seal_aead *a, const uint8_t nonce[SEAL_NONCE_LEN], const uint8_t *aad,
+                      size_t aad_len, uint8_t *buf, size_t len, uint8_t tag[SEAL_TAG_LEN]) {
+    int n;
+    if (EVP_EncryptInit_ex(a->enc, NULL, NULL, NULL, nonce) != 1 ||
+        EVP_EncryptUpdate(a->enc, NULL, &n, aad, (int)aad_len) != 1 ||
+        EVP_EncryptUpdate(a->enc, buf, &n, buf, (int)len) != 1 ||
+        EVP_EncryptFinal_ex(a->enc, buf + n, &n) != 1 ||
+        EVP_CIPHER_CTX_ctrl(a->enc, EVP_CTRL_GCM_GET_TAG, SEAL_TAG_LEN, tag) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+int seal_aead_decrypt(struct seal_aead *a, const uint8_t nonce[SEAL_NONCE_LEN], const uint8_t *aad,
+                      size_t aad_len, uint8_t *buf, size_t len, const uint8_t tag[SEAL_TAG_LEN]) {
+    int n;
+    if (EVP_DecryptInit_ex(a->dec, NULL, NULL, NULL, nonce) != 1 ||
+        EVP_DecryptUpdate(a->dec, NULL, &n, aad, (int)aad_len) != 1 ||
+        EVP_DecryptUpdate(a->dec, buf, &n, buf, (int)len) != 1 ||
+        EVP_CIPHER_CTX_ctrl(a->dec, EVP_CTRL_GCM_SET_TAG, SEAL_TAG_LEN, (void *)tag) != 1 ||
+        EVP_DecryptFinal_ex(a->dec, buf + n, &n) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+void seal_hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t len, uint8_t out[32]) {
+    unsigned int out_len = 32;
+    HMAC(EVP_sha256(), key, (int)key_len, data, len, out, &out_len);
+}
+
+int seal_random(uint8_t *buf, size_t len) {
+    return RAND_bytes(buf, (int)len) == 1 ? 0 : -1;
+}
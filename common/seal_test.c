@@ -0,0 +1,346 @@
+//
+//  seal_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "seal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+static uint8_t scratch[SEAL_BATCH_SCRATCH(FRAME_BATCH_MAX * FRAME_MAX_LEN)];
+
+static size_t unhex(const char *hex, uint8_t *out) {
+    size_t n = 0;
+    for (; hex[0] && hex[1]; hex += 2) {
+        unsigned v;
+        sscanf(hex, "%2x", &v);
+        out[n++] = (uint8_t)v;
+    }
+    return n;
+}
+
+// GCM specification test cases 13 to 16, the AES-256 ones NIST SP 800-38D
+// validation draws on: nothing at all, one block, whole blocks without
+// additional data, and a partial block with it
+static const struct {
+    const char *key, *iv, *aad, *plain, *cipher, *tag;
+} gcm_vectors[] = {
+    { "0000000000000000000000000000000000000000000000000000000000000000", "000000000000000000000000", "", "", "",
+      "530f8afbc74536b9a963b4f1c4cb738b" },
+    { "0000000000000000000000000000000000000000000000000000000000000000", "000000000000000000000000", "",
+      "00000000000000000000000000000000", "cea7403d4d606b6e074ec5d3baf39d18", "d0d1c8a799996bf0265b98b5d48ab919" },
+    { "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+      "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+      "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+      "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+      "b094dac5d93471bdec1a502270e3cc6c" },
+    { "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+      "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+      "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+      "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+      "76fc6ece0f4e1768cddf8853bb2d551b" },
+};
+
+void test_aes_gcm_vectors() {
+    for (size_t v = 0; v < sizeof(gcm_vectors) / sizeof(gcm_vectors[0]); v++) {
+        uint8_t key[32], iv[12], aad[20], plain[64], buf[64], expect[64], tag[16], expect_tag[16];
+        assert(unhex(gcm_vectors[v].key, key) == sizeof(key));
+        assert(unhex(gcm_vectors[v].iv, iv) == sizeof(iv));
+        size_t aad_len = unhex(gcm_vectors[v].aad, aad);
+        size_t len = unhex(gcm_vectors[v].plain, plain);
+        assert(unhex(gcm_vectors[v].cipher, expect) == len);
+        assert(unhex(gcm_vectors[v].tag, expect_tag) == sizeof(expect_tag));
+
+        struct seal_aead *a = seal_aead_create(key);
+        assert(a);
+        memcpy(buf, plain, len);
+        assert(seal_aead_encrypt(a, iv, aad, aad_len, buf, len, tag) == 0);
+        assert(memcmp(buf, expect, len) == 0);
+        assert(memcmp(tag, expect_tag, sizeof(tag)) == 0);
+
+        // Decrypting restores the plaintext; a wrong tag is refused
+        assert(seal_aead_decrypt(a, iv, aad, aad_len, buf, len, tag) == 0);
+        assert(memcmp(buf, plain, len) == 0);
+        assert(seal_aead_encrypt(a, iv, aad, aad_len, buf, len, tag) == 0);
+        tag[3] ^= 1;
+        assert(seal_aead_decrypt(a, iv, aad, aad_len, buf, len, tag) == -1);
+        seal_aead_free(a);
+    }
+
+    printf("✓ AES-GCM vector test passed\n");
+}
+
+void test_hkdf_vector() {
+    // RFC 5869, test case 1; one block is the first 32 bytes of its output
+    uint8_t ikm[22], salt[13], info[10], okm[32], expect[32];
+    memset(ikm, 0x0b, sizeof(ikm));
+    unhex("000102030405060708090a0b0c", salt);
+    unhex("f0f1f2f3f4f5f6f7f8f9", info);
+    unhex("3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf", expect);
+
+    seal_hkdf(salt, sizeof(salt), ikm, sizeof(ikm), info, sizeof(info), okm);
+    assert(memcmp(okm, expect, sizeof(okm)) == 0);
+
+    printf("✓ HKDF vector test passed\n");
+}
+
+void test_parse_key() {
+    uint8_t key[SEAL_KEY_LEN];
+    const char *text = "00112233445566778899aabbccddeeff\n00112233445566778899AABBCCDDEEFF\n";
+
+    assert(seal_parse_key(text, strlen(text), key) == 0);
+    assert(key[0] == 0x00 && key[1] == 0x11 && key[15] == 0xff && key[31] == 0xff);
+    assert(seal_parse_key(text, 40, key) == -1);
+    assert(seal_parse_key("zz", 2, key) == -1);
+
+    // One digit too many
+    char longer[80];
+    snprintf(longer, sizeof(longer), "%s0", text);
+    assert(seal_parse_key(longer, strlen(longer), key) == -1);
+
+    printf("✓ Key parsing test passed\n");
+}
+
+// Both ends of one connection
+static void handshake(const uint8_t *client_psk, const uint8_t *server_psk,
+                      struct seal_stream *c_tx, struct seal_stream *c_rx,
+                      struct seal_stream *s_tx, struct seal_stream *s_rx) {
+    uint8_t client_key[SEAL_KEY_FRAME_LEN], server_key[SEAL_KEY_FRAME_LEN];
+    assert(seal_key_frame(client_key) == 0);
+    assert(seal_key_frame(server_key) == 0);
+    assert(memcmp(client_key, server_key, SEAL_KEY_FRAME_LEN) != 0);
+    assert(seal_start(client_psk, client_key, server_key, 1, c_tx, c_rx) == 0);
+    assert(seal_start(server_psk, client_key, server_key, 0, s_tx, s_rx) == 0);
+}
+
+// Open every record of a sealed batch and check the frames come out in order
+static void open_batch(struct seal_stream *rx, struct frame_batch *records, uint8_t **payloads, size_t *lens,
+                       int count) {
+    int next = 0;
+    for (int r = 0; r < records->count; r++) {
+        const uint8_t *header = records->iov[2 * r].iov_base;
+        assert(header[0] == FRAME_TYPE_SEALED);
+        uint8_t *plain;
+        long n = seal_open(rx, records->iov[2 * r + 1].iov_base, records->iov[2 * r + 1].iov_len, &plain);
+        assert(n > 0);
+
+        struct frame_decoder d;
+        struct frame f;
+        frame_decoder_init(&d, plain, (size_t)n);
+        frame_decoder_commit(&d, (size_t)n);
+        while (frame_decoder_next(&d, &f) == 1) {
+            assert(next < count && f.len == lens[next] && memcmp(f.data, payloads[next], f.len) == 0);
+            next++;
+        }
+        assert(frame_decoder_pending(&d) == 0);
+    }
+    assert(next == count);
+}
+
+void test_round_trip() {
+    static uint8_t data[8][SEAL_FRAME_MAX_PAYLOAD];
+    uint8_t *payloads[8];
+    size_t lens[8] = { 100, 1400, SEAL_FRAME_MAX_PAYLOAD, 40000, 30000, 8, 1400, 1 };
+    struct seal_stream c_tx, c_rx, s_tx, s_rx;
+    struct frame_batch in, out;
+    uint8_t psk[SEAL_KEY_LEN];
+
+    memset(psk, 0x42, sizeof(psk));
+    handshake(psk, psk, &c_tx, &c_rx, &s_tx, &s_rx);
+
+    frame_batch_init(&in);
+    for (int i = 0; i < 8; i++) {
+        payloads[i] = data[i];
+        memset(data[i], 'a' + i, lens[i]);
+        frame_batch_add(&in, data[i], lens[i]);
+    }
+    size_t bytes = frame_batch_pending(&in);
+    assert(seal_batch(&c_tx, &in, &out, scratch) == 0);
+    assert(in.count == 0);
+
+    // The big frames each need a record; the small ones share
+    assert(out.count == 4);
+    assert(frame_batch_pending(&out) == bytes + 4 * (FRAME_HEADER_LEN + SEAL_OVERHEAD));
+    const uint8_t *record = out.iov[1].iov_base;
+    assert(memcmp(record + SEAL_SEQ_LEN + FRAME_HEADER_LEN, data[0], 8) != 0);
+    open_batch(&s_rx, &out, payloads, lens, 8);
+
+    // The other direction has a key of its own
+    frame_batch_add(&in, data[0], lens[0]);
+    assert(seal_batch(&s_tx, &in, &out, scratch) == 0);
+    uint8_t *plain;
+    uint8_t copy[256];
+    memcpy(copy, out.iov[1].iov_base, out.iov[1].iov_len);
+    assert(seal_open(&s_rx, copy, out.iov[1].iov_len, &plain) == -1);
+    open_batch(&c_rx, &out, payloads, lens, 1);
+
+    // A frame too large for a record is refused
+    static uint8_t huge[FRAME_MAX_PAYLOAD];
+    frame_batch_add(&in, huge, sizeof(huge));
+    assert(seal_batch(&c_tx, &in, &out, scratch) == -1);
+
+    seal_stream_free(&c_tx);
+    seal_stream_free(&c_rx);
+    seal_stream_free(&s_tx);
+    seal_stream_free(&s_rx);
+    printf("✓ Round trip test passed\n");
+}
+
+void test_forgery_and_replay() {
+    uint8_t msg[3][64];
+    uint8_t records[3][256];
+    size_t record_lens[3];
+    struct seal_stream c_tx, c_rx, s_tx, s_rx;
+    struct frame_batch in, out;
+    uint8_t psk[SEAL_KEY_LEN], other[SEAL_KEY_LEN];
+    uint8_t *plain;
+
+    memset(psk, 7, sizeof(psk));
+    handshake(psk, psk, &c_tx, &c_rx, &s_tx, &s_rx);
+    for (int i = 0; i < 3; i++) {
+        memset(msg[i], '0' + i, sizeof(msg[i]));
+        frame_batch_init(&in);
+        frame_batch_add(&in, msg[i], sizeof(msg[i]));
+        assert(seal_batch(&c_tx, &in, &out, scratch) == 0 && out.count == 1);
+        record_lens[i] = out.iov[1].iov_len;
+        memcpy(records[i], out.iov[1].iov_base, record_lens[i]);
+    }
+
+    // A flipped bit anywhere fails, sequence number included
+    uint8_t bad[256];
+    for (size_t at = 0; at < record_lens[0]; at += 13) {
+        memcpy(bad, records[0], record_lens[0]);
+        bad[at] ^= 0x80;
+        assert(seal_open(&s_rx, bad, record_lens[0], &plain) == -1);
+    }
+
+    // Records may go missing, but never come back or arrive late
+    memcpy(bad, records[1], record_lens[1]);
+    assert(seal_open(&s_rx, bad, record_lens[1], &plain) == FRAME_HEADER_LEN + 64);
+    assert(memcmp(plain + FRAME_HEADER_LEN, msg[1], 64) == 0);
+    memcpy(bad, records[1], record_lens[1]);
+    assert(seal_open(&s_rx, bad, record_lens[1], &plain) == -1);
+    assert(seal_open(&s_rx, records[0], record_lens[0], &plain) == -1);
+    assert(seal_open(&s_rx, records[2], record_lens[2], &plain) > 0);
+
+    // A peer with another key gets nothing through
+    memset(other, 8, sizeof(other));
+    seal_stream_free(&s_tx);
+    seal_stream_free(&s_rx);
+    struct seal_stream o_tx, o_rx;
+    handshake(psk, other, &c_tx, &c_rx, &o_tx, &o_rx);
+    frame_batch_init(&in);
+    frame_batch_add(&in, msg[0], sizeof(msg[0]));
+    assert(seal_batch(&c_tx, &in, &out, scratch) == 0);
+    assert(seal_open(&o_rx, out.iov[1].iov_base, out.iov[1].iov_len, &plain) == -1);
+
+    // An unknown cipher suite is refused
+    uint8_t client_key[SEAL_KEY_FRAME_LEN], server_key[SEAL_KEY_FRAME_LEN];
+    seal_key_frame(client_key);
+    seal_key_frame(server_key);
+    server_key[0] = 9;
+    struct seal_stream x_tx, x_rx;
+    assert(seal_start(psk, client_key, server_key, 0, &x_tx, &x_rx) == -1);
+    assert(x_tx.aead == NULL && x_rx.aead == NULL);
+
+    seal_stream_free(&c_tx);
+    seal_stream_free(&c_rx);
+    seal_stream_free(&o_tx);
+    seal_stream_free(&o_rx);
+    printf("✓ Forgery and replay test passed\n");
+}
+
+void test_datagrams() {
+    uint8_t psk[SEAL_KEY_LEN], other[SEAL_KEY_LEN];
+    uint8_t hello[SEAL_DGRAM_HELLO_LEN], accept[SEAL_DGRAM_ACCEPT_LEN];
+    uint8_t client_key[SEAL_KEY_FRAME_LEN], server_key[SEAL_KEY_FRAME_LEN], key[SEAL_KEY_FRAME_LEN];
+    struct seal_stream c_tx, c_rx, s_tx, s_rx;
+    uint32_t peer;
+    uint8_t *plain;
+
+    memset(psk, 7, sizeof(psk));
+    memset(other, 8, sizeof(other));
+
+    // Handshake: both datagrams hold only with the pre-shared key
+    assert(seal_dgram_hello(psk, client_key, hello) == 0);
+    assert(seal_dgram_hello_check(other, hello, sizeof(hello), key) == -1);
+    hello[5] ^= 1;
+    assert(seal_dgram_hello_check(psk, hello, sizeof(hello), key) == -1);
+    hello[5] ^= 1;
+    assert(seal_dgram_hello_check(psk, hello, sizeof(hello), key) == 0);
+    assert(memcmp(key, client_key, sizeof(key)) == 0);
+    assert(seal_dgram_accept(psk, key, 0x01020304, server_key, accept) == 0);
+    assert(seal_dgram_accept_check(other, client_key, accept, sizeof(accept), &peer, key) == -1);
+    uint8_t stale[SEAL_KEY_FRAME_LEN];
+    seal_key_frame(stale);
+    assert(seal_dgram_accept_check(psk, stale, accept, sizeof(accept), &peer, key) == -1);
+    assert(seal_dgram_accept_check(psk, client_key, accept, sizeof(accept), &peer, key) == 0);
+    assert(peer == 0x01020304 && memcmp(key, server_key, sizeof(key)) == 0);
+    assert(seal_start(psk, client_key, key, 1, &c_tx, &c_rx) == 0);
+    assert(seal_start(psk, client_key, server_key, 0, &s_tx, &s_rx) == 0);
+
+    // Sealed both ways, each carrying the peer id
+    uint8_t dgrams[80][SEAL_DGRAM_OVERHEAD + 64];
+    size_t lens[80];
+    for (int i = 0; i < 80; i++) {
+        memset(dgrams[i] + SEAL_DGRAM_HEADER_LEN, i, 64);
+        lens[i] = seal_dgram_seal(&c_tx, peer, dgrams[i], 64);
+        assert(lens[i] == SEAL_DGRAM_OVERHEAD + 64);
+        assert(seal_dgram_peer(dgrams[i], lens[i]) == peer);
+    }
+    uint8_t back[SEAL_DGRAM_OVERHEAD + 5];
+    memcpy(back + SEAL_DGRAM_HEADER_LEN, "hello", 5);
+    size_t back_len = seal_dgram_seal(&s_tx, peer, back, 5);
+    assert(seal_dgram_open(&c_rx, back, back_len, &plain) == 5 && memcmp(plain, "hello", 5) == 0);
+
+    // Out of order is fine within the window; each datagram counts once
+    uint8_t copy[SEAL_DGRAM_OVERHEAD + 64];
+    memcpy(copy, dgrams[70], lens[70]);
+    assert(seal_dgram_open(&s_rx, copy, lens[70], &plain) == 64 && plain[0] == 70);
+    memcpy(copy, dgrams[70], lens[70]);
+    assert(seal_dgram_open(&s_rx, copy, lens[70], &plain) == -1);
+    memcpy(copy, dgrams[10], lens[10]);
+    assert(seal_dgram_open(&s_rx, copy, lens[10], &plain) == 64 && plain[0] == 10);
+    assert(seal_dgram_open(&s_rx, dgrams[5], lens[5], &plain) == -1);
+    assert(seal_dgram_open(&s_rx, dgrams[79], lens[79], &plain) == 64 && plain[0] == 79);
+    assert(seal_dgram_open(&s_rx, dgrams[71], lens[71], &plain) == 64 && plain[0] == 71);
+    memcpy(copy, dgrams[10], lens[10]);
+    assert(seal_dgram_open(&s_rx, copy, lens[10], &plain) == -1);
+
+    // A flipped bit anywhere fails, peer id included, and leaves the window be
+    for (size_t at = 0; at < lens[20]; at += 7) {
+        memcpy(copy, dgrams[20], lens[20]);
+        copy[at] ^= 0x40;
+        assert(seal_dgram_open(&s_rx, copy, lens[20], &plain) == -1);
+    }
+    assert(seal_dgram_open(&s_rx, dgrams[20], lens[20], &plain) == 64 && plain[0] == 20);
+
+    // Nothing without the header and tag is a sealed datagram
+    assert(seal_dgram_peer(dgrams[0], SEAL_DGRAM_OVERHEAD - 1) == 0);
+    assert(seal_dgram_peer(hello, sizeof(hello)) == 0);
+
+    seal_stream_free(&c_tx);
+    seal_stream_free(&c_rx);
+    seal_stream_free(&s_tx);
+    seal_stream_free(&s_rx);
+    printf("✓ Datagram test passed\n");
+}
+
+int main() {
+    printf("Running encryption unit tests...\n");
+
+    test_aes_gcm_vectors();
+    test_hkdf_vector();
+    test_parse_key();
+    test_round_trip();
+    test_forgery_and_replay();
+    test_datagrams();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
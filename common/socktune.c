@@ -0,0 +1,272 @@
+//
+//  socktune.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#define _GNU_SOURCE
+
+#include "socktune.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Bounds of the numeric settings
+#define LOWAT_MAX (64 * 1024 * 1024)
+#define BUSY_POLL_MAX 1000000
+#define LINK_MBIT_MAX 400000
+
+// A setting's value: absent (a bare name) means on
+static int parse_value(const char *value, size_t len, long max, long *out) {
+    char text[16];
+    char *end;
+
+    if (!value) {
+        *out = 1;
+        return 0;
+    }
+    if (len == 0 || len >= sizeof(text)) {
+        return -1;
+    }
+    memcpy(text, value, len);
+    text[len] = '\0';
+    errno = 0;
+    long v = strtol(text, &end, 10);
+    if (errno || *end || v < 0 || v > max) {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int is(const char *name, size_t len, const char *want) {
+    return len == strlen(want) && memcmp(name, want, len) == 0;
+}
+
+// One name[=value] item of a profile
+static int parse_item(struct socktune *t, const char *item, size_t len) {
+    const char *eq = memchr(item, '=', len);
+    size_t name_len = eq ? (size_t)(eq - item) : len;
+    const char *value = eq ? eq + 1 : NULL;
+    size_t value_len = eq ? len - name_len - 1 : 0;
+    long v;
+
+    if (is(item, name_len, "cc")) {
+        if (!value || value_len == 0 || value_len >= sizeof(t->congestion)) {
+            return -1;
+        }
+        memcpy(t->congestion, value, value_len);
+        t->congestion[value_len] = '\0';
+        if (strcmp(t->congestion, "0") == 0) {
+            t->congestion[0] = '\0';
+        }
+        return 0;
+    }
+    if (is(item, name_len, "buf") && value && is(value, value_len, "auto")) {
+        t->buf_auto = 1;
+        t->buf_bytes = 0;
+        return 0;
+    }
+
+    if (is(item, name_len, "nodelay") && parse_value(value, value_len, 1, &v) == 0) {
+        t->nodelay = (int)v;
+    } else if (is(item, name_len, "reuseport") && parse_value(value, value_len, 1, &v) == 0) {
+        t->reuseport = (int)v;
+    } else if (is(item, name_len, "lowat") && value && parse_value(value, value_len, LOWAT_MAX, &v) == 0) {
+        t->notsent_lowat = (int)v;
+    } else if (is(item, name_len, "buf") && value && parse_value(value, value_len, SOCKTUNE_BUF_MAX, &v) == 0) {
+        t->buf_bytes = (int)v;
+        t->buf_auto = 0;
+    } else if (is(item, name_len, "link") && value && parse_value(value, value_len, LINK_MBIT_MAX, &v) == 0 && v > 0) {
+        t->link_mbit = (unsigned)v;
+    } else if (is(item, name_len, "busypoll") && value && parse_value(value, value_len, BUSY_POLL_MAX, &v) == 0) {
+        t->busy_poll_us = (int)v;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int socktune_parse(struct socktune *t, const char *spec) {
+    memset(t, 0, sizeof(*t));
+    t->link_mbit = SOCKTUNE_LINK_MBIT;
+    if (strcmp(spec, "none") == 0) {
+        return 0;
+    }
+
+    for (const char *p = spec; *p;) {
+        size_t len = strcspn(p, ",");
+        if (parse_item(t, p, len) < 0) {
+            memset(t, 0, sizeof(*t));
+            t->link_mbit = SOCKTUNE_LINK_MBIT;
+            errno = EINVAL;
+            return -1;
+        }
+        p += len;
+        p += *p == ',';
+    }
+    return 0;
+}
+
+unsigned socktune_settings(const struct socktune *t) {
+    return (t->nodelay ? SOCKTUNE_NODELAY : 0) |
+           (t->notsent_lowat ? SOCKTUNE_LOWAT : 0) |
+           (t->buf_bytes || t->buf_auto ? SOCKTUNE_BUFFERS : 0) |
+           (t->busy_poll_us ? SOCKTUNE_BUSY_POLL : 0) |
+           (t->congestion[0] ? SOCKTUNE_CONGESTION : 0) |
+           (t->reuseport ? SOCKTUNE_REUSEPORT : 0);
+}
+
+// Past net.core.wmem_max and rmem_max where the process may (Linux, as
+// root); elsewhere the kernel caps the size at its limit
+static int set_buffers(int fd, int bytes) {
+    int rc = 0;
+#ifdef SO_SNDBUFFORCE
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &bytes, sizeof(bytes)) == 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) == 0) {
+        return 0;
+    }
+#endif
+    rc |= setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+    rc |= setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    return rc < 0 ? -1 : 0;
+}
+
+unsigned socktune_apply(int fd, const struct socktune *t) {
+    unsigned failed = 0;
+
+    if (t->nodelay) {
+        int on = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+            failed |= SOCKTUNE_NODELAY;
+        }
+    }
+    if (t->notsent_lowat) {
+#ifdef TCP_NOTSENT_LOWAT
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &t->notsent_lowat, sizeof(t->notsent_lowat)) < 0)
+#endif
+        {
+            failed |= SOCKTUNE_LOWAT;
+        }
+    }
+    if (t->buf_bytes && set_buffers(fd, t->buf_bytes) < 0) {
+        failed |= SOCKTUNE_BUFFERS;
+    }
+    if (t->busy_poll_us) {
+#ifdef SO_BUSY_POLL
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &t->busy_poll_us, sizeof(t->busy_poll_us)) < 0)
+#endif
+        {
+            failed |= SOCKTUNE_BUSY_POLL;
+        }
+    }
+    if (t->congestion[0]) {
+#ifdef TCP_CONGESTION
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, t->congestion, (socklen_t)strlen(t->congestion)) < 0)
+#endif
+        {
+            failed |= SOCKTUNE_CONGESTION;
+        }
+    }
+    return failed;
+}
+
+// Smoothed RTT of a connected socket in microseconds
+static int read_rtt(int fd, uint32_t *rtt_us) {
+#if defined(TCP_CONNECTION_INFO)
+    struct tcp_connection_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &len) < 0) {
+        return -1;
+    }
+    *rtt_us = info.tcpi_srtt * 1000;        // milliseconds
+    return 0;
+#elif defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return -1;
+    }
+    *rtt_us = info.tcpi_rtt;
+    return 0;
+#else
+    (void)fd;
+    (void)rtt_us;
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+size_t socktune_bdp_size(uint32_t rtt_us, unsigned link_mbit) {
+    // Mbit/s x us = bits; twice the product, in bytes
+    uint64_t bytes = (uint64_t)rtt_us * link_mbit / 4;
+    if (bytes < SOCKTUNE_BUF_MIN) {
+        return SOCKTUNE_BUF_MIN;
+    }
+    return bytes > SOCKTUNE_BUF_MAX ? SOCKTUNE_BUF_MAX : (size_t)bytes;
+}
+
+long socktune_fit_buffers(int fd, const struct socktune *t) {
+    uint32_t rtt_us;
+
+    if (!t->buf_auto) {
+        return 0;
+    }
+    if (read_rtt(fd, &rtt_us) < 0) {
+        return -1;
+    }
+    size_t bytes = socktune_bdp_size(rtt_us, t->link_mbit);
+    if (set_buffers(fd, (int)bytes) < 0) {
+        return -1;
+    }
+    return (long)bytes;
+}
+
+void socktune_describe(const struct socktune *t, unsigned which, char *buf, size_t len) {
+    size_t used = 0;
+    char item[64];
+
+    buf[0] = '\0';
+    which &= socktune_settings(t);
+    for (unsigned bit = 1; bit <= SOCKTUNE_REUSEPORT; bit <<= 1) {
+        if (!(which & bit)) {
+            continue;
+        }
+        switch (bit) {
+        case SOCKTUNE_NODELAY:
+            snprintf(item, sizeof(item), "nodelay");
+            break;
+        case SOCKTUNE_LOWAT:
+            snprintf(item, sizeof(item), "lowat %d", t->notsent_lowat);
+            break;
+        case SOCKTUNE_BUFFERS:
+            if (t->buf_auto) {
+                snprintf(item, sizeof(item), "buffers at BDP for %u Mbit/s", t->link_mbit);
+            } else {
+                snprintf(item, sizeof(item), "buffers %d", t->buf_bytes);
+            }
+            break;
+        case SOCKTUNE_BUSY_POLL:
+            snprintf(item, sizeof(item), "busypoll %d us", t->busy_poll_us);
+            break;
+        case SOCKTUNE_CONGESTION:
+            snprintf(item, sizeof(item), "cc %s", t->congestion);
+            break;
+        default:
+            snprintf(item, sizeof(item), "reuseport");
+            break;
+        }
+        int n = snprintf(buf + used, len - used, "%s%s", used ? ", " : "", item);
+        if (n < 0 || (size_t)n >= len - used) {
+            return;
+        }
+        used += (size_t)n;
+    }
+    if (used == 0) {
+        snprintf(buf, len, "none");
+    }
+}
@@ -0,0 +1,112 @@
+//
+//  socktune.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Socket tuning profile for the stream transport, the same on the server,
+//  the extension and the load generator. A profile is written as a list of
+//  comma-separated settings, so each can be switched on its own and
+//  measured (bench/loopback.sh):
+//
+//    nodelay        TCP_NODELAY: frames leave without waiting on Nagle
+//    lowat=BYTES    TCP_NOTSENT_LOWAT: unsent bytes the socket holds before
+//                   it stops being writable, so batches wait in our queues,
+//                   where the scheduler can still order them
+//    buf=BYTES      SO_SNDBUF and SO_RCVBUF, instead of kernel autotuning
+//    buf=auto       Both sized once connected to twice the bandwidth-delay
+//                   product: the measured RTT at link= Mbit/s (default 1000)
+//    busypoll=USEC  SO_BUSY_POLL (Linux): blocking reads spin on the device
+//                   queue this long before sleeping
+//    cc=NAME        TCP_CONGESTION (Linux), e.g. bbr
+//    reuseport      Server: one SO_REUSEPORT listener per worker, each with
+//                   its own accept queue
+//
+//  A setting takes =0 to turn it off; "none" is the empty profile. What the
+//  platform lacks fails when applied, and the rest still is.
+//
+
+#ifndef SOCKTUNE_H
+#define SOCKTUNE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SOCKTUNE_DEFAULT "nodelay,lowat=131072,reuseport"
+
+// Buffer sizes the BDP is kept between
+#define SOCKTUNE_BUF_MIN (64 * 1024)
+#define SOCKTUNE_BUF_MAX (16 * 1024 * 1024)
+#define SOCKTUNE_LINK_MBIT 1000
+
+// Settings, as bits of what a profile holds and what failed to apply
+#define SOCKTUNE_NODELAY 0x01
+#define SOCKTUNE_LOWAT 0x02
+#define SOCKTUNE_BUFFERS 0x04
+#define SOCKTUNE_BUSY_POLL 0x08
+#define SOCKTUNE_CONGESTION 0x10
+#define SOCKTUNE_REUSEPORT 0x20
+
+struct socktune {
+    int nodelay;
+    int notsent_lowat;      // bytes; 0: kernel default
+    int buf_bytes;          // 0: kernel autotuning
+    int buf_auto;           // size to the measured BDP
+    unsigned link_mbit;     // bandwidth the BDP assumes
+    int busy_poll_us;       // 0: off
+    char congestion[16];    // "": kernel default
+    int reuseport;
+};
+
+/**
+ * Parse a profile
+ * @param t Profile, filled in
+ * @param spec Comma-separated settings, as above
+ * @return 0 on success, -1 with errno EINVAL for an unknown setting or value
+ */
+int socktune_parse(struct socktune *t, const char *spec);
+
+/**
+ * Settings a profile turns on
+ * @param t Profile
+ * @return SOCKTUNE_* bits
+ */
+unsigned socktune_settings(const struct socktune *t);
+
+/**
+ * Apply a profile to a TCP socket before it connects or listens; sockets
+ * accepted from a listener get it again, so nothing rests on inheritance.
+ * Automatic buffer sizing waits for socktune_fit_buffers().
+ * @param fd TCP socket
+ * @param t Profile
+ * @return SOCKTUNE_* bits of the settings that failed
+ */
+unsigned socktune_apply(int fd, const struct socktune *t);
+
+/**
+ * Size a connected socket's buffers to the bandwidth-delay product, when
+ * the profile asks for it
+ * @param fd Connected TCP socket
+ * @param t Profile
+ * @return Bytes each buffer was given, 0 when not sized, -1 on error
+ */
+long socktune_fit_buffers(int fd, const struct socktune *t);
+
+/**
+ * Buffer size for a path: twice its bandwidth-delay product, so one
+ * window can be in flight while the next is queued
+ * @param rtt_us Round-trip time in microseconds
+ * @param link_mbit Bandwidth in Mbit/s
+ * @return Bytes, between SOCKTUNE_BUF_MIN and SOCKTUNE_BUF_MAX
+ */
+size_t socktune_bdp_size(uint32_t rtt_us, unsigned link_mbit);
+
+/**
+ * Describe some of a profile's settings for the log, e.g.
+ * "nodelay, lowat 131072, cc bbr"
+ * @param t Profile
+ * @param which SOCKTUNE_* bits to describe
+ * @param buf Output, always terminated
+ * @param len Size of buf
+ */
+void socktune_describe(const struct socktune *t, unsigned which, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,162 @@
+//
+//  socktune_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#define _GNU_SOURCE
+
+#include "socktune.h"
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+void test_parse() {
+    struct socktune t;
+
+    assert(socktune_parse(&t, SOCKTUNE_DEFAULT) == 0);
+    assert(t.nodelay && t.notsent_lowat == 131072 && t.reuseport);
+    assert(!t.buf_bytes && !t.buf_auto && !t.busy_poll_us && !t.congestion[0]);
+    assert(socktune_settings(&t) == (SOCKTUNE_NODELAY | SOCKTUNE_LOWAT | SOCKTUNE_REUSEPORT));
+
+    assert(socktune_parse(&t, "buf=auto,link=10000,busypoll=50,cc=bbr,nodelay=0") == 0);
+    assert(t.buf_auto && t.link_mbit == 10000 && t.busy_poll_us == 50 && strcmp(t.congestion, "bbr") == 0);
+    assert(!t.nodelay && socktune_settings(&t) == (SOCKTUNE_BUFFERS | SOCKTUNE_BUSY_POLL | SOCKTUNE_CONGESTION));
+
+    // The last of two settings wins, and a fixed size replaces auto
+    assert(socktune_parse(&t, "buf=auto,buf=262144,cc=bbr,cc=0") == 0);
+    assert(!t.buf_auto && t.buf_bytes == 262144 && !t.congestion[0]);
+
+    // Empty profiles
+    assert(socktune_parse(&t, "none") == 0 && socktune_settings(&t) == 0);
+    assert(socktune_parse(&t, "") == 0 && socktune_settings(&t) == 0 && t.link_mbit == SOCKTUNE_LINK_MBIT);
+
+    printf("✓ Profile parse test passed\n");
+}
+
+void test_parse_errors() {
+    struct socktune t;
+    const char *bad[] = {
+        "nagle", "nodelay=2", "lowat", "lowat=-1", "lowat=12k", "buf=99999999999", "link=0",
+        "busypoll=", "cc=", "cc=averyveryverylongname", "nodelay,,lowat=1", "=1",
+    };
+
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        errno = 0;
+        assert(socktune_parse(&t, bad[i]) < 0 && errno == EINVAL);
+        assert(socktune_settings(&t) == 0);
+    }
+
+    printf("✓ Profile parse errors test passed\n");
+}
+
+void test_bdp_size() {
+    // 20 ms at 1 Gbit/s is 2.5 MB in flight, twice that buffered
+    assert(socktune_bdp_size(20000, 1000) == 5000000);
+    assert(socktune_bdp_size(30, 1000) == SOCKTUNE_BUF_MIN);
+    assert(socktune_bdp_size(0, 1000) == SOCKTUNE_BUF_MIN);
+    assert(socktune_bdp_size(2000000, 100000) == SOCKTUNE_BUF_MAX);
+
+    printf("✓ BDP size test passed\n");
+}
+
+void test_describe() {
+    struct socktune t;
+    char buf[128];
+
+    assert(socktune_parse(&t, "nodelay,lowat=16384,buf=auto,link=100,cc=bbr") == 0);
+    socktune_describe(&t, ~0u, buf, sizeof(buf));
+    assert(strcmp(buf, "nodelay, lowat 16384, buffers at BDP for 100 Mbit/s, cc bbr") == 0);
+    socktune_describe(&t, SOCKTUNE_CONGESTION | SOCKTUNE_BUSY_POLL, buf, sizeof(buf));
+    assert(strcmp(buf, "cc bbr") == 0);
+    socktune_describe(&t, 0, buf, sizeof(buf));
+    assert(strcmp(buf, "none") == 0);
+
+    // Cut short, but terminated
+    socktune_describe(&t, ~0u, buf, 12);
+    assert(strlen(buf) < 12);
+
+    printf("✓ Describe test passed\n");
+}
+
+static int getint(int fd, int level, int name) {
+    int v = 0;
+    socklen_t len = sizeof(v);
+    assert(getsockopt(fd, level, name, &v, &len) == 0);
+    return v;
+}
+
+void test_apply() {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    struct socktune t;
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(lfd >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(lfd, 1) == 0);
+    assert(getsockname(lfd, (struct sockaddr *)&addr, &addr_len) == 0);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(socktune_parse(&t, "nodelay,lowat=16384,buf=auto") == 0);
+    assert(socktune_apply(fd, &t) == 0);
+    assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(getint(fd, IPPROTO_TCP, TCP_NODELAY) != 0);
+#ifdef TCP_NOTSENT_LOWAT
+    assert(getint(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT) == 16384);
+#endif
+
+    // Loopback RTTs are tiny: the buffers get about the floor
+    long bytes = socktune_fit_buffers(fd, &t);
+    assert(bytes >= SOCKTUNE_BUF_MIN && bytes < 4 * SOCKTUNE_BUF_MIN);
+    assert(getint(fd, SOL_SOCKET, SO_SNDBUF) >= bytes);
+
+    // Without auto sizing nothing is done
+    t.buf_auto = 0;
+    assert(socktune_fit_buffers(fd, &t) == 0);
+    t.buf_auto = 1;
+    int accepted = accept(lfd, NULL, NULL);
+    assert(accepted >= 0);
+
+    // An unknown congestion control fails alone
+#ifdef TCP_CONGESTION
+    assert(socktune_parse(&t, "nodelay,cc=nosuchcc") == 0);
+    assert(socktune_apply(accepted, &t) == SOCKTUNE_CONGESTION);
+    assert(socktune_parse(&t, "cc=reno") == 0);
+    assert(socktune_apply(accepted, &t) == 0);
+    char cc[16] = { 0 };
+    socklen_t cc_len = sizeof(cc);
+    assert(getsockopt(accepted, IPPROTO_TCP, TCP_CONGESTION, cc, &cc_len) == 0 && strcmp(cc, "reno") == 0);
+#endif
+
+    // A socket that is not TCP takes none of it
+    int udp = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(socktune_parse(&t, "nodelay,lowat=16384") == 0);
+    assert(socktune_apply(udp, &t) == (SOCKTUNE_NODELAY | SOCKTUNE_LOWAT));
+
+    close(udp);
+    close(accepted);
+    close(fd);
+    close(lfd);
+    printf("✓ Apply test passed\n");
+}
+
+int main() {
+    printf("Running socket tuning unit tests...\n");
+
+    test_parse();
+    test_parse_errors();
+    test_bdp_size();
+    test_describe();
+    test_apply();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,124 @@
+//
+//  spsc_ring.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "spsc_ring.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+int spsc_ring_init(struct spsc_ring *r, size_t capacity) {
+    size_t cap = 2;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+
+    r->slots = calloc(cap, sizeof(*r->slots));
+    if (!r->slots) {
+        return -1;
+    }
+    r->mask = cap - 1;
+    r->head = 0;
+    r->tail = 0;
+    r->waiting = 0;
+    r->closed = 0;
+    r->notified = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    return 0;
+}
+
+void spsc_ring_destroy(struct spsc_ring *r) {
+    free(r->slots);
+    r->slots = NULL;
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+}
+
+int spsc_ring_push(struct spsc_ring *r, const struct ring_desc *desc) {
+    size_t tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask) {
+        return -1;
+    }
+    r->slots[tail & r->mask] = *desc;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void spsc_ring_wake(struct spsc_ring *r) {
+    // Pairs with the fence in spsc_ring_wait: either the consumer sees the
+    // new tail, or we see it waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&r->waiting, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+size_t spsc_ring_pop(struct spsc_ring *r, struct ring_desc *out, size_t max) {
+    size_t head = r->head;
+    size_t avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+    size_t n = avail < max ? avail : max;
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = r->slots[(head + i) & r->mask];
+    }
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+static int ring_empty(struct spsc_ring *r) {
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->head;
+}
+
+int spsc_ring_wait(struct spsc_ring *r, int timeout_ms) {
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        // CLOCK_REALTIME: what pthread_cond_timedwait uses everywhere
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long long ns = (long long)now.tv_usec * 1000 + (long long)timeout_ms * 1000000;
+        deadline.tv_sec = now.tv_sec + (time_t)(ns / 1000000000);
+        deadline.tv_nsec = (long)(ns % 1000000000);
+    }
+
+    int rc = 1;
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (ring_empty(r) && !r->notified) {
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+            rc = -1;
+            break;
+        }
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        } else if (pthread_cond_timedwait(&r->cond, &r->lock, &deadline) == ETIMEDOUT) {
+            rc = ring_empty(r) && !r->notified ? 0 : 1;
+            break;
+        }
+    }
+    r->notified = 0;
+    __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&r->lock);
+    return rc;
+}
+
+void spsc_ring_notify(struct spsc_ring *r) {
+    pthread_mutex_lock(&r->lock);
+    r->notified = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void spsc_ring_close(struct spsc_ring *r) {
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
@@ -0,0 +1,94 @@
+//
+//  spsc_ring.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Bounded single-producer/single-consumer ring of packet descriptors. Push
+//  and pop are lock-free; the mutex and condition variable are only used
+//  when the consumer has run dry and goes to sleep, so a busy ring costs no
+//  syscalls on either side.
+//
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct ring_desc {
+    const uint8_t *data;
+    size_t len;
+    void *owner;                // keeps data alive; released by the consumer
+    uint64_t time;              // when the producer queued it, for latency
+};
+
+struct spsc_ring {
+    // Producer and consumer indices on separate cache lines; padded rather
+    // than aligned so the ring can be embedded in any allocation
+    size_t tail;
+    char tail_pad[64 - sizeof(size_t)];
+    size_t head;
+    char head_pad[64 - sizeof(size_t)];
+
+    int waiting;                // consumer is asleep or about to be
+    int closed;
+    int notified;               // spsc_ring_notify since the last wait returned
+
+    size_t mask;
+    struct ring_desc *slots;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/**
+ * Set up a ring
+ * @param r Ring
+ * @param capacity Slots, rounded up to a power of two
+ * @return 0 on success, -1 on allocation failure
+ */
+int spsc_ring_init(struct spsc_ring *r, size_t capacity);
+
+/**
+ * Release the slots; both threads must be done with the ring
+ */
+void spsc_ring_destroy(struct spsc_ring *r);
+
+/**
+ * Producer: append one descriptor
+ * @return 0 on success, -1 if the ring is full
+ */
+int spsc_ring_push(struct spsc_ring *r, const struct ring_desc *desc);
+
+/**
+ * Producer: wake the consumer if it sleeps; call after a burst of pushes
+ */
+void spsc_ring_wake(struct spsc_ring *r);
+
+/**
+ * Consumer: take up to max descriptors
+ * @return Number taken
+ */
+size_t spsc_ring_pop(struct spsc_ring *r, struct ring_desc *out, size_t max);
+
+/**
+ * Consumer: sleep until the ring is non-empty, closed, or the timeout passes
+ * @param r Ring
+ * @param timeout_ms Milliseconds, or -1 to wait indefinitely
+ * @return 1 if descriptors are available or spsc_ring_notify was called,
+ *         0 on timeout, -1 if closed and empty
+ */
+int spsc_ring_wait(struct spsc_ring *r, int timeout_ms);
+
+/**
+ * Any thread: make the consumer's current or next wait return, for work
+ * signalled outside the ring
+ */
+void spsc_ring_notify(struct spsc_ring *r);
+
+/**
+ * Either side: stop the consumer once it has drained the ring
+ */
+void spsc_ring_close(struct spsc_ring *r);
+
+#endif
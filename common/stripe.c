@@ -0,0 +1,62 @@
+//
+//  stripe.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "stripe.h"
+#include "ip6.h"
+
+#include <string.h>
+
+// Final mix of MurmurHash3: every input bit reaches every output bit, so
+// stripe_pick() can take the top bits
+static uint32_t stripe_mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+uint32_t stripe_hash(uint32_t addr_a, uint32_t addr_b, uint16_t port_a, uint16_t port_b) {
+    // The lower endpoint goes first, whichever side sent the packet
+    if (addr_a > addr_b || (addr_a == addr_b && port_a > port_b)) {
+        uint32_t addr = addr_a;
+        uint16_t port = port_a;
+        addr_a = addr_b;
+        port_a = port_b;
+        addr_b = addr;
+        port_b = port;
+    }
+    uint32_t h = stripe_mix(addr_a * 0x9E3779B1u ^ addr_b);
+    return stripe_mix(h ^ ((uint32_t)port_a << 16 | port_b));
+}
+
+uint32_t stripe_packet_hash(const uint8_t *pkt, size_t len) {
+    uint32_t src, dst;
+    uint16_t sport = 0, dport = 0;
+
+    if (len >= IP6_HEADER_LEN && (pkt[0] >> 4) == 6) {
+        uint8_t proto;
+        size_t off;
+        if (ip6_upper_layer(pkt, len, &proto, &off) && proto == 6 && len - off >= 20) {
+            memcpy(&sport, pkt + off, sizeof(sport));
+            memcpy(&dport, pkt + off + 2, sizeof(dport));
+        }
+        return stripe_hash(ip6_fold(pkt + 8), ip6_fold(pkt + 24), sport, dport);
+    }
+
+    if (len < 20) {
+        return 0;
+    }
+    memcpy(&src, pkt + 12, sizeof(src));
+    memcpy(&dst, pkt + 16, sizeof(dst));
+
+    size_t ihl = (size_t)(pkt[0] & 0x0f) * 4;
+    if (pkt[9] == 6 && ihl >= 20 && len >= ihl + 20) {
+        memcpy(&sport, pkt + ihl, sizeof(sport));
+        memcpy(&dport, pkt + ihl + 2, sizeof(dport));
+    }
+    return stripe_hash(src, dst, sport, dport);
+}
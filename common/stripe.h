@@ -0,0 +1,53 @@
+//
+//  stripe.h
+//  Net-Rewire shared tunnel protocol
+//
+//  Flow striping over a pool of connections. A client may open several
+//  connections for one tunnel address, each a resumable session of its own,
+//  and name in each HELLO its place in the pool (FRAME_FEATURE_STRIPE). Every
+//  packet then goes on the connection its flow hashes to, so a flow's
+//  packets stay in order while a segment lost on one connection stalls only
+//  the flows that hash there. The server picks the connection for return
+//  traffic with the same hash, which either direction of a flow gives alike.
+//
+
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Connections in a pool
+#define STRIPE_MAX 8
+
+/**
+ * Hash a flow by its endpoints; swapping the two gives the same hash
+ * @param addr_a One IPv4 address, network byte order
+ * @param addr_b The other
+ * @param port_a TCP port of addr_a in network byte order, 0 for other protocols
+ * @param port_b TCP port of addr_b
+ * @return Flow hash
+ */
+uint32_t stripe_hash(uint32_t addr_a, uint32_t addr_b, uint16_t port_a, uint16_t port_b);
+
+/**
+ * Hash an IPv4 or IPv6 packet's flow: ports are taken for TCP with a
+ * complete header and IPv6 addresses folded, as pkt_parse() does, so the
+ * hash matches one made from its output
+ * @param pkt IP packet
+ * @param len Packet length
+ * @return Flow hash, 0 for a packet too short to have addresses
+ */
+uint32_t stripe_packet_hash(const uint8_t *pkt, size_t len);
+
+/**
+ * Connection of a pool a flow goes on
+ * @param hash Flow hash
+ * @param count Connections in the pool, at least 1
+ * @return Index below count
+ */
+static inline unsigned stripe_pick(uint32_t hash, unsigned count) {
+    return (unsigned)(((uint64_t)hash * count) >> 32);
+}
+
+#endif
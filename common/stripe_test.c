@@ -0,0 +1,127 @@
+//
+//  stripe_test.c
+//  Net-Rewire shared tunnel protocol
+//
+
+#include "stripe.h"
+#include "ip6.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// IPv4 header for proto, followed by TCP ports when tcp_len allows
+static size_t make_packet(uint8_t *pkt, uint8_t proto, uint32_t src, uint32_t dst,
+                          uint16_t sport, uint16_t dport, size_t tcp_len) {
+    memset(pkt, 0, 20 + tcp_len);
+    pkt[0] = 0x45;
+    pkt[9] = proto;
+    memcpy(pkt + 12, &src, sizeof(src));
+    memcpy(pkt + 16, &dst, sizeof(dst));
+    if (tcp_len >= 4) {
+        memcpy(pkt + 20, &sport, sizeof(sport));
+        memcpy(pkt + 22, &dport, sizeof(dport));
+    }
+    return 20 + tcp_len;
+}
+
+void test_symmetric() {
+    uint32_t a = inet_addr("10.8.0.33"), b = inet_addr("192.0.2.25");
+    uint16_t pa = htons(51234), pb = htons(25);
+
+    assert(stripe_hash(a, b, pa, pb) == stripe_hash(b, a, pb, pa));
+    assert(stripe_hash(a, a, pa, pb) == stripe_hash(a, a, pb, pa));
+
+    // Another port or address is another flow
+    assert(stripe_hash(a, b, pa, pb) != stripe_hash(a, b, htons(51235), pb));
+    assert(stripe_hash(a, b, pa, pb) != stripe_hash(a, inet_addr("192.0.2.26"), pa, pb));
+    assert(stripe_hash(a, b, pa, pb) != stripe_hash(a, b, pb, pa));
+
+    printf("✓ Symmetry test passed\n");
+}
+
+void test_packet_hash() {
+    uint8_t out[64], back[64];
+    uint32_t a = inet_addr("10.8.0.33"), b = inet_addr("192.0.2.25");
+    uint16_t pa = htons(51234), pb = htons(587);
+
+    // Both directions of a TCP flow, as the client and the server see them
+    size_t n = make_packet(out, 6, a, b, pa, pb, 20);
+    size_t m = make_packet(back, 6, b, a, pb, pa, 20);
+    assert(stripe_packet_hash(out, n) == stripe_hash(a, b, pa, pb));
+    assert(stripe_packet_hash(back, m) == stripe_packet_hash(out, n));
+
+    // IP options move the ports
+    memmove(out + 24, out + 20, 20);
+    memset(out + 20, 1, 4);
+    out[0] = 0x46;
+    assert(stripe_packet_hash(out, n + 4) == stripe_hash(a, b, pa, pb));
+
+    // No ports without a whole TCP header, or for other protocols
+    n = make_packet(out, 6, a, b, pa, pb, 19);
+    assert(stripe_packet_hash(out, n) == stripe_hash(a, b, 0, 0));
+    n = make_packet(out, 17, a, b, pa, pb, 8);
+    assert(stripe_packet_hash(out, n) == stripe_hash(a, b, 0, 0));
+
+    assert(stripe_packet_hash(out, 19) == 0);
+
+    printf("✓ Packet hash test passed\n");
+}
+
+void test_packet_hash_ipv6() {
+    uint8_t out[80], back[80], a[16], b[16];
+    uint16_t pa = htons(51234), pb = htons(25);
+
+    assert(inet_pton(AF_INET6, "fd00:8::a08:21", a) == 1);
+    assert(inet_pton(AF_INET6, "2001:db8::19", b) == 1);
+    memset(out, 0, sizeof(out));
+    memset(back, 0, sizeof(back));
+    out[0] = back[0] = 0x60;
+    out[6] = back[6] = 0;       // hop-by-hop options, then TCP
+    out[40] = back[40] = 6;
+    memcpy(out + 8, a, 16), memcpy(out + 24, b, 16);
+    memcpy(back + 8, b, 16), memcpy(back + 24, a, 16);
+    memcpy(out + 48, &pa, 2), memcpy(out + 50, &pb, 2);
+    memcpy(back + 48, &pb, 2), memcpy(back + 50, &pa, 2);
+
+    uint32_t h = stripe_hash(ip6_fold(a), ip6_fold(b), pa, pb);
+    assert(stripe_packet_hash(out, 68) == h);
+    assert(stripe_packet_hash(back, 68) == h);
+
+    // Without the whole TCP header only the addresses count
+    assert(stripe_packet_hash(out, 67) == stripe_hash(ip6_fold(a), ip6_fold(b), 0, 0));
+
+    printf("✓ IPv6 packet hash test passed\n");
+}
+
+void test_pick() {
+    unsigned counts[STRIPE_MAX] = {0};
+    uint32_t a = inet_addr("10.8.0.33"), b = inet_addr("192.0.2.25");
+
+    assert(stripe_pick(0, 1) == 0 && stripe_pick(0xffffffffu, 1) == 0);
+    assert(stripe_pick(0xffffffffu, STRIPE_MAX) == STRIPE_MAX - 1);
+
+    // Client ports of one mail server's flows spread evenly
+    for (unsigned port = 49152; port < 49152 + 8000; port++) {
+        unsigned i = stripe_pick(stripe_hash(a, b, htons((uint16_t)port), htons(25)), STRIPE_MAX);
+        assert(i < STRIPE_MAX);
+        counts[i]++;
+    }
+    for (int i = 0; i < STRIPE_MAX; i++) {
+        assert(counts[i] > 800 && counts[i] < 1200);
+    }
+
+    printf("✓ Pick test passed\n");
+}
+
+int main() {
+    printf("Running stripe unit tests...\n");
+
+    test_symmetric();
+    test_packet_hash();
+    test_packet_hash_ipv6();
+    test_pick();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
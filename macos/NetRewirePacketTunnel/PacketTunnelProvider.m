@@ -7,50 +7,419 @@
 
 #import "PacketTunnelProvider.h"
 #import "pktparse.h"
+#import "pktflow.h"
+#import "pktrules.h"
+#import "pktsched.h"
+#import "frame.h"
+#import "gso.h"
+#import "lz.h"
+#import "metrics.h"
+#import "pcapng.h"
+#import "pmtu.h"
+#import "replay.h"
+#import "seal.h"
+#import "socktune.h"
+#import "slab.h"
+#import "spsc_ring.h"
+#import "stripe.h"
 #import <NetworkExtension/NetworkExtension.h>
 #import <Security/Security.h>
 
 // Tunnel configuration
+// The server is the protocol's serverAddress, an IPv4 address, and the
+// serverPort provider configuration key; these are used without them
 #define TUNNEL_SERVER_IP @"10.8.0.1"
 #define TUNNEL_CLIENT_IP @"10.8.0.33"
 #define TUNNEL_SERVER_PORT 12345
+#define TUNNEL_SERVER_PORT_CONFIG @"serverPort"
 #define TUNNEL_SUBNET_MASK @"255.255.255.0"
 
+// The client address under the IPv6 tunnel prefix (ip6.h), in a /120 that
+// mirrors the IPv4 subnet. IPv6 is routed only when the capture rules can
+// match it, i.e. they have no (IPv4) include prefixes.
+#define TUNNEL_CLIENT_IP6 @"fd00:8::a08:21"
+#define TUNNEL_CLIENT_IP6_PREFIX_LEN 120
+
+// Traffic sent through the tunnel: SMTP, SMTPS and submission. Overridable
+// with the "captureRules" key of the provider configuration; see pktrules.h
+// for the syntax, e.g. @"25 465 587 !10.0.0.0/8".
+#define TUNNEL_CAPTURE_RULES @"25 465 587"
+
+// Send batching: packets bound for the tunnel are gathered into one writev.
+// A batch goes out once it holds TUNNEL_BATCH_BYTES, else as soon as the
+// send ring runs dry, or up to TUNNEL_BATCH_DELAY_MS later if non-zero.
+// Both can be overridden with the "batchBytes" and "batchDelayMs" keys of
+// the provider configuration.
+#define TUNNEL_BATCH_BYTES (64 * 1024)
+#define TUNNEL_BATCH_DELAY_MS 0
+
+// Packets waiting for the writer thread; more than that are dropped. The
+// writer moves them on to a scheduler of the same size, which sends
+// handshakes, ACKs and SMTP commands ahead of bulk data (pktsched.h).
+#define TUNNEL_TX_RING_SLOTS 4096
+
+// Receive slabs kept for reuse while packets handed to packetFlow still
+// point into older ones
+#define RX_SLAB_CACHE 8
+
+// Session resumption: packets sent and not yet acknowledged by the server
+// are kept for resending after a reconnect, and the server is told what
+// arrived every TUNNEL_ACK_FRAMES frames or TUNNEL_ACK_BYTES bytes
+#define TUNNEL_REPLAY_BYTES (256 * 1024)
+#define TUNNEL_ACK_FRAMES 64
+#define TUNNEL_ACK_BYTES (32 * 1024)
+
+// Reconnect delays after failed attempts double from the minimum up to the
+// maximum, with jitter; a lost connection is retried at once
+#define TUNNEL_RECONNECT_MIN 0.25
+#define TUNNEL_RECONNECT_MAX 30.0
+
+// Transport: framed packets over a TCP stream, or with the "transport"
+// provider configuration key set to "udp", one packet per UDP datagram
+// (the server's -u). Datagrams avoid stacking TCP retransmissions on a
+// lossy link; lost packets are left to the inner TCP, so there is nothing
+// to resume. The tunnel MTU keeps every datagram within one server receive
+// slot (DGRAM_SLOT_SIZE).
+#define TUNNEL_TRANSPORT_UDP @"udp"
+
+// Sealed datagrams: the HELLO goes out up to TUNNEL_DGRAM_HELLO_TRIES times,
+// TUNNEL_DGRAM_HELLO_TIMEOUT_MS apart, until the server ACCEPTs. A keepalive
+// every TUNNEL_DGRAM_KEEPALIVE_MS keeps our peer id at the server, which
+// answers each; a server silent for TUNNEL_DGRAM_SILENCE_MS has forgotten
+// it, and we shake hands again.
+#define TUNNEL_DGRAM_HELLO_TRIES 3
+#define TUNNEL_DGRAM_HELLO_TIMEOUT_MS 1000
+#define TUNNEL_DGRAM_KEEPALIVE_MS 15000
+#define TUNNEL_DGRAM_SILENCE_MS 40000
+
+// Compression: with the "compression" provider configuration key set, the
+// HELLO asks for FRAME_FEATURE_LZ, and a server started with -z compresses
+// the connection both ways (lz.h). Mail is mostly text, so a metered link
+// carries a fraction of the bytes.
+
+// Encryption: with a pre-shared key configured, the connection opens with a
+// KEY exchange and everything after it is sealed with AES-256-GCM (seal.h),
+// for a server started with -k and the same key. Over UDP a HELLO and an
+// ACCEPT datagram agree the keys, and every packet is sealed on its own
+// datagram. The key is 64 hex digits,
+// kept in the Keychain item the configuration's passwordReference names,
+// or else given as the "presharedKey" provider configuration key.
+#define TUNNEL_KEY_CONFIG @"presharedKey"
+
+// Connection pool: with the "connections" provider configuration key set
+// above 1, up to STRIPE_MAX, the tunnel opens that many connections, each a
+// session of its own, and every packet goes on the one its flow hashes to
+// (stripe.h). A segment lost on one connection then stalls only the flows
+// on it, and each connection grows its own congestion window. Streams only,
+// to a server that knows FRAME_FEATURE_STRIPE.
+#define TUNNEL_CONNECTIONS 1
+
+// Socket tuning: stream connections take the "socketTuning" provider
+// configuration key, a profile as the server's -T takes it (socktune.h),
+// or SOCKTUNE_DEFAULT. Busy polling and the congestion control are Linux
+// settings; here they are logged as not applied.
+#define TUNNEL_SOCKET_TUNING_CONFIG @"socketTuning"
+
+// Flows the capture remembers, with their verdicts, pool connections and
+// counters (pktflow.h); 64 bytes each
+#define TUNNEL_FLOWS 1024
+
+// Tunnel MTU: PMTU_DEFAULT until the first connection has measured the path
+// to the server, then what fits it (pmtu.h). Over a stream that is the
+// outer TCP's segment size less a frame header, over datagrams the largest
+// probe the server echoed. The network settings are applied again with the
+// new MTU, and meanwhile SYNs either way have their MSS clamped to it. The
+// "mtu" provider configuration key fixes it instead.
+#define TUNNEL_MTU_CONFIG @"mtu"
+
+// Capture: the "capture" provider configuration key asks for the most
+// recent this many MiB of packet headers, both ways, in a pcapng file in
+// the extension's temporary directory (pcapng.h). Each connection and
+// writer thread records what it handles; the last of them to exit closes
+// the file, which bench/capture_replay plays back.
+#define TUNNEL_CAPTURE_CONFIG @"capture"
+#define TUNNEL_CAPTURE_FILE @"net-rewire.pcapng"
+#define TUNNEL_CAPTURE_MB_MAX 1024
+
+// Metrics: the containing app sends this message and gets the counters and
+// latency histograms back as Prometheus text (metrics.h), the same the
+// server's -m endpoint serves. Each thread below writes a set of its own.
+#define TUNNEL_MESSAGE_METRICS @"metrics"
+
+// Reload: a message that is a property list dictionary is a new provider
+// configuration. These keys take effect at once, for every session; the
+// others when the tunnel is next started. The reply is "OK" or the reason
+// the configuration was refused.
+#define TUNNEL_RELOAD_KEYS @[@"captureRules", @"batchBytes", @"batchDelayMs"]
+
+// One connection of the pool and the session it carries. Its connection
+// thread and writer thread share only what the handover, the atomics and
+// the send ring pass between them.
+struct tunnel_connection {
+    unsigned index;                 // place in the pool
+    struct metrics rxMetrics;       // connection thread
+    struct metrics txMetrics;       // writer thread
+    int tunnelSocket;               // the connection thread's socket; stop shuts it down
+
+    // Connection thread: connects, resumes the session and receives
+    uint64_t sessionId;             // 0 until the server assigns one
+    uint64_t rxSeq;                 // data frames received in this session
+    uint64_t rxAckedSeq;
+    size_t rxUnackedBytes;
+    uint64_t ackSeq;                // atomic: rxSeq for the writer to acknowledge
+    BOOL rxCompressed;              // this connection is compressed
+    struct lz_decoder rxLz;
+    void *rxLzMem;
+    uint8_t clientKey[SEAL_KEY_FRAME_LEN];  // our KEY frame on this connection
+    struct seal_stream rxSeal;
+    struct seal_stream connTxSeal;  // sending direction, until the writer takes it
+    uint32_t dgramPeer;             // sealed datagrams: our id, as the server's ACCEPT named it
+    struct pcapng_writer rxCapture;
+
+    // A new connection, handed from the connection thread to the writer
+    pthread_mutex_t connLock;
+    int connPending;                // atomic
+    int pendingSocket;
+    BOOL pendingRestart;            // the server started a new session
+    BOOL pendingCompressed;         // the server agreed to compress
+    struct seal_stream pendingSeal;
+    uint32_t pendingDgramPeer;
+    uint64_t pendingPeerSeq;        // data frames the server had received
+    uint64_t peerAckSeq;            // atomic: latest ACK from the server
+    int keepaliveDue;               // atomic: sealed datagrams, the connection thread wants one sent
+    int txShutdown;                 // atomic: the writer shut the socket down after a send error
+
+    // Capture -> writer thread; produced only from the packet flow callback
+    struct spsc_ring txRing;
+
+    // Writer thread only: the packets taken off the ring and not sent yet,
+    // the socket they go on, and every frame sent since the server last
+    // acknowledged
+    struct pkt_sched txSched;
+    int txSocket;
+    BOOL txBroken;
+    struct replay txReplay;
+    uint64_t ackSentSeq;
+    uint8_t ackPayload[FRAME_ACK_LEN];
+    BOOL txCompressed;
+    struct lz_encoder txLz;
+    void *txLzMem;
+    uint8_t *txLzOut;               // compressed frames of the batch being sent
+    struct frame_batch txLzBatch;
+    struct seal_stream txSeal;
+    uint32_t txDgramPeer;
+    uint8_t *txSealOut;             // sealed records of the batch being sent, or the datagram
+    struct frame_batch txSealBatch;
+    struct pcapng_writer txCapture;
+};
+
 @interface PacketTunnelProvider () {
     BOOL _running;
-    int _tunnelSocket;
-    dispatch_queue_t _packetQueue;
+    struct metrics _captureMetrics;     // packet flow callback
+    BOOL _datagram;                 // UDP transport
+    uint32_t _tunnelMTU;            // atomic: set by connection 0, read by every path
+    BOOL _fixedMTU;                 // configured, not measured
+    struct socktune _tune;
+    struct pcapng _capture;
+    int _captureWriters;            // atomic: threads yet to finish with _capture
     NSMutableArray *_packetBuffer;
-}
+    struct pkt_rules *_captureRules;    // atomic: replaced by a reload
+    uint64_t _rulesGen;                 // atomic: counts the reloads
+    int _rulesReaders;                  // atomic: threads that may hold _captureRules
+    NSMutableArray<NSValue *> *_retiredRules;   // replaced, freed once no thread may hold them
+    NSDictionary *_providerConfig;      // as last started or reloaded
+    struct sockaddr_in _serverAddr;
+    NSString *_serverHost;
+    struct pkt_flow_table _flows;       // packet flow callback
+    uint64_t _flowRulesGen;             // packet flow callback: the rules _flows was filled by
+    BOOL _compress;                 // ask the server to compress
+    BOOL _encrypt;                  // a key is configured
+    uint8_t _psk[SEAL_KEY_LEN];
+    size_t _batchBytes;             // atomic: replaced by a reload
+    uint64_t _batchDelayMs;         // atomic
 
-@property (strong) NSTimer *reconnectTimer;
+    // The pool, each connection with a connection thread and a writer
+    // thread of its own
+    struct tunnel_connection *_connections;
+    unsigned _connectionCount;
+    NSMutableArray<NSThread *> *_threads;
+}
 
 @end
 
 @implementation PacketTunnelProvider
 
+// Protocol number packetFlow takes for a packet the server sent
+static NSNumber *packet_protocol(const uint8_t *pkt, size_t len) {
+    return len > 0 && (pkt[0] >> 4) == 6 ? @(AF_INET6) : @(AF_INET);
+}
+
+// Record what a connection thread hands to the host
+static void capture_packets(struct pcapng_writer *w, NSArray<NSData *> *packets) {
+    if (!w->cap) {
+        return;
+    }
+    for (NSData *packet in packets) {
+        pcapng_write(w, packet.bytes, packet.length, PCAPNG_INBOUND);
+    }
+}
+
+// Release what setUpConnection allocated
+static void tunnel_connection_free(struct tunnel_connection *conn) {
+    free(conn->rxLzMem);
+    free(conn->txLzMem);
+    free(conn->txLzOut);
+    free(conn->txSealOut);
+    replay_free(&conn->txReplay);
+    pkt_sched_free(&conn->txSched);
+}
+
+- (void)dealloc {
+    // Kept until here: a packet flow callback may still be classifying, and
+    // the writer threads retain us until they have drained their rings
+    pkt_rules_free(_captureRules);
+    for (NSValue *rules in _retiredRules) {
+        pkt_rules_free(rules.pointerValue);
+    }
+    pkt_flow_free(&_flows);
+    for (unsigned i = 0; i < _connectionCount; i++) {
+        tunnel_connection_free(&_connections[i]);
+        spsc_ring_destroy(&_connections[i].txRing);
+        pthread_mutex_destroy(&_connections[i].connLock);
+    }
+    free(_connections);
+}
+
 - (void)startTunnelWithOptions:(NSDictionary *)options completionHandler:(void (^)(NSError *))completionHandler {
     NSLog(@"Starting Net-Rewire tunnel...");
 
-    // Initialize packet processing queue
-    _packetQueue = dispatch_queue_create("com.netrewire.packet_queue", DISPATCH_QUEUE_SERIAL);
+    NSDictionary *providerConfig = ((NETunnelProviderProtocol *)self.protocolConfiguration).providerConfiguration;
+
+    NSString *ruleError = nil;
+    struct pkt_rules *rules = [self compileCaptureRules:providerConfig reason:&ruleError];
+    if (!rules) {
+        NSLog(@"%@", ruleError);
+        completionHandler([NSError errorWithDomain:NEVPNErrorDomain
+                                              code:NEVPNErrorConfigurationInvalid
+                                          userInfo:@{NSLocalizedDescriptionKey: ruleError}]);
+        return;
+    }
+    pkt_rules_free(_captureRules);
+    _captureRules = rules;
+    _providerConfig = providerConfig;
+
+    // The server every connection goes to
+    NSString *host = self.protocolConfiguration.serverAddress.length > 0 ? self.protocolConfiguration.serverAddress
+                                                                         : TUNNEL_SERVER_IP;
+    NSNumber *port = providerConfig[TUNNEL_SERVER_PORT_CONFIG] ?: @TUNNEL_SERVER_PORT;
+    memset(&_serverAddr, 0, sizeof(_serverAddr));
+    _serverAddr.sin_family = AF_INET;
+    _serverAddr.sin_port = htons(port.unsignedShortValue);
+    if (inet_pton(AF_INET, host.UTF8String, &_serverAddr.sin_addr) != 1 || port.unsignedIntValue < 1 ||
+        port.unsignedIntValue > 65535) {
+        NSString *reason = [NSString stringWithFormat:@"Invalid server %@ port %@ (an IPv4 address and 1 to 65535)", host, port];
+        NSLog(@"%@", reason);
+        completionHandler([NSError errorWithDomain:NEVPNErrorDomain
+                                              code:NEVPNErrorConfigurationInvalid
+                                          userInfo:@{NSLocalizedDescriptionKey: reason}]);
+        return;
+    }
+    _serverHost = host;
+
     _packetBuffer = [NSMutableArray array];
 
-    // Configure tunnel network settings
-    NEPacketTunnelNetworkSettings *settings = [[NEPacketTunnelNetworkSettings alloc] initWithTunnelRemoteAddress:TUNNEL_SERVER_IP];
+    [self setBatching:providerConfig];
+    _datagram = [providerConfig[@"transport"] isEqual:TUNNEL_TRANSPORT_UDP];
 
-    // Configure IPv4 settings
-    NEIPv4Settings *ipv4 = [[NEIPv4Settings alloc] initWithAddresses:@[TUNNEL_CLIENT_IP] subnetMasks:@[TUNNEL_SUBNET_MASK]];
+    // One history each way per connection, reset on every reconnect
+    _compress = !_datagram && [providerConfig[@"compression"] boolValue];
 
-    // Don't set default route - we only want to capture specific traffic
-    ipv4.includedRoutes = @[];
-    settings.IPv4Settings = ipv4;
-    settings.MTU = @1400;
+    // With a key, every connection is encrypted or not made at all
+    NSData *keyText = [self tunnelKeyText:providerConfig];
+    _encrypt = keyText != nil;
+    if (_encrypt && seal_parse_key(keyText.bytes, keyText.length, _psk) < 0) {
+        NSString *reason = @"Invalid tunnel key";
+        NSLog(@"%@", reason);
+        completionHandler([NSError errorWithDomain:NEVPNErrorDomain
+                                              code:NEVPNErrorConfigurationInvalid
+                                          userInfo:@{NSLocalizedDescriptionKey: reason}]);
+        return;
+    }
+
+    NSNumber *mtu = providerConfig[TUNNEL_MTU_CONFIG];
+    if (mtu && (mtu.unsignedIntValue < PMTU_MIN || mtu.unsignedIntValue > PMTU_MAX)) {
+        NSString *reason = [NSString stringWithFormat:@"Invalid MTU %@ (%d to %d)", mtu, PMTU_MIN, PMTU_MAX];
+        NSLog(@"%@", reason);
+        completionHandler([NSError errorWithDomain:NEVPNErrorDomain
+                                              code:NEVPNErrorConfigurationInvalid
+                                          userInfo:@{NSLocalizedDescriptionKey: reason}]);
+        return;
+    }
+    _fixedMTU = mtu != nil;
+    __atomic_store_n(&_tunnelMTU, mtu ? mtu.unsignedIntValue : PMTU_DEFAULT, __ATOMIC_RELAXED);
+
+    NSString *tuning = providerConfig[TUNNEL_SOCKET_TUNING_CONFIG] ?: @SOCKTUNE_DEFAULT;
+    if (socktune_parse(&_tune, tuning.UTF8String) < 0) {
+        NSString *reason = [NSString stringWithFormat:@"Invalid socket tuning profile %@", tuning];
+        NSLog(@"%@", reason);
+        completionHandler([NSError errorWithDomain:NEVPNErrorDomain
+                                              code:NEVPNErrorConfigurationInvalid
+                                          userInfo:@{NSLocalizedDescriptionKey: reason}]);
+        return;
+    }
+
+    // Datagrams have no stream to block, so they need no pool
+    NSNumber *connections = providerConfig[@"connections"];
+    unsigned count = connections ? connections.unsignedIntValue : TUNNEL_CONNECTIONS;
+    if (count < 1 || count > STRIPE_MAX || (_datagram && count > 1)) {
+        NSString *reason = [NSString stringWithFormat:@"Invalid connection count %u (1 to %d, 1 for UDP)", count, STRIPE_MAX];
+        NSLog(@"%@", reason);
+        completionHandler([NSError errorWithDomain:NEVPNErrorDomain
+                                              code:NEVPNErrorConfigurationInvalid
+                                          userInfo:@{NSLocalizedDescriptionKey: reason}]);
+        return;
+    }
+
+    // The writer threads own the tunnel send path
+    if (!_connections) {
+        _connections = calloc(count, sizeof(*_connections));
+        for (unsigned i = 0; _connections && i < count; i++) {
+            if (![self setUpConnection:&_connections[i] index:i]) {
+                break;
+            }
+            _connectionCount = i + 1;
+        }
+        if (_connectionCount < count) {
+            completionHandler([NSError errorWithDomain:NSPOSIXErrorDomain code:ENOMEM userInfo:nil]);
+            return;
+        }
+    }
+
+    // Flows kept from an earlier start have the old rules' verdicts
+    if (!_flows.flows && pkt_flow_init(&_flows, TUNNEL_FLOWS, _connectionCount) < 0) {
+        completionHandler([NSError errorWithDomain:NSPOSIXErrorDomain code:ENOMEM userInfo:nil]);
+        return;
+    }
+    pkt_flow_clear(&_flows);
+    _flowRulesGen = __atomic_load_n(&_rulesGen, __ATOMIC_RELAXED);
+    [self startCapture:providerConfig[TUNNEL_CAPTURE_CONFIG]];
+    _threads = [NSMutableArray array];
+    for (unsigned i = 0; i < _connectionCount; i++) {
+        NSThread *writer = [[NSThread alloc] initWithTarget:self selector:@selector(writerLoop:) object:@(i)];
+        writer.name = [NSString stringWithFormat:@"com.netrewire.tunnel_writer.%u", i];
+        writer.qualityOfService = NSQualityOfServiceUserInteractive;
+        [_threads addObject:writer];
+        [writer start];
+    }
 
     // Apply network settings
-    [self setTunnelNetworkSettings:settings completionHandler:^(NSError *error) {
+    [self setTunnelNetworkSettings:[self tunnelNetworkSettings] completionHandler:^(NSError *error) {
         if (error) {
             NSLog(@"Error setting tunnel network settings: %@", error);
+            // The connection threads never start
+            for (unsigned i = 0; i < _connectionCount; i++) {
+                [self finishCapture:&_connections[i].rxCapture];
+            }
             completionHandler(error);
             return;
         }
@@ -59,7 +428,7 @@
         _running = YES;
 
         // Connect to tunnel server
-        [self connectToTunnelServer];
+        [self startConnectionThreads];
 
         // Start packet processing loop
         [self startPacketCaptureLoop];
@@ -69,99 +438,952 @@
     }];
 }
 
-- (void)connectToTunnelServer {
-    dispatch_async(_packetQueue, ^{
-        [self setupTunnelSocket];
-    });
+// Compile the capture rules once; classification then costs the same
+// however many there are
+- (struct pkt_rules *)compileCaptureRules:(NSDictionary *)providerConfig reason:(NSString **)reason {
+    NSString *ruleSpec = providerConfig[@"captureRules"] ?: TUNNEL_CAPTURE_RULES;
+    size_t badRule = 0;
+    struct pkt_rules *rules = pkt_rules_compile_string(ruleSpec.UTF8String, &badRule);
+    if (!rules) {
+        *reason = [NSString stringWithFormat:@"Invalid capture rule at offset %zu: %@", badRule, ruleSpec];
+    }
+    return rules;
 }
 
-- (void)setupTunnelSocket {
-    // Create socket to tunnel server
-    _tunnelSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (_tunnelSocket < 0) {
-        NSLog(@"Error creating tunnel socket");
+// Tunnel send batching; the writer threads pick it up at their next batch
+- (void)setBatching:(NSDictionary *)providerConfig {
+    NSNumber *batchBytes = providerConfig[@"batchBytes"];
+    NSNumber *batchDelay = providerConfig[@"batchDelayMs"];
+    __atomic_store_n(&_batchBytes, batchBytes.unsignedIntegerValue > 0 ? batchBytes.unsignedIntegerValue : TUNNEL_BATCH_BYTES,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&_batchDelayMs, batchDelay ? batchDelay.unsignedLongLongValue : TUNNEL_BATCH_DELAY_MS,
+                     __ATOMIC_RELAXED);
+}
+
+// Take a new provider configuration while the tunnel runs: swap in the
+// capture rules, which the packet flow callback notices at its next read,
+// and the batching, then route by the new rules. Connections stay up.
+// Returns nil, or why the configuration was refused.
+- (NSString *)reloadConfiguration:(NSDictionary *)providerConfig {
+    NSString *reason = nil;
+    struct pkt_rules *rules = [self compileCaptureRules:providerConfig reason:&reason];
+    if (!rules) {
+        NSLog(@"Configuration not reloaded: %@", reason);
+        return reason;
+    }
+
+    // A reader may still hold the old rules, or those of an earlier reload.
+    // One that takes the rules after the exchange gets the new ones, so with
+    // no reader left after it, none holds a retired set.
+    struct pkt_rules *old = __atomic_exchange_n(&_captureRules, rules, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&_rulesGen, 1, __ATOMIC_RELEASE);
+    if (!_retiredRules) {
+        _retiredRules = [NSMutableArray array];
+    }
+    [_retiredRules addObject:[NSValue valueWithPointer:old]];
+    if (__atomic_load_n(&_rulesReaders, __ATOMIC_SEQ_CST) == 0) {
+        for (NSValue *retired in _retiredRules) {
+            pkt_rules_free(retired.pointerValue);
+        }
+        [_retiredRules removeAllObjects];
+    }
+    [self setBatching:providerConfig];
+
+    NSMutableArray<NSString *> *later = [NSMutableArray array];
+    NSMutableSet<NSString *> *keys = [NSMutableSet setWithArray:providerConfig.allKeys];
+    [keys addObjectsFromArray:_providerConfig.allKeys];
+    for (NSString *key in keys) {
+        if (![TUNNEL_RELOAD_KEYS containsObject:key] && ![providerConfig[key] isEqual:_providerConfig[key]]) {
+            [later addObject:key];
+        }
+    }
+    _providerConfig = providerConfig;
+    NSLog(@"Configuration reloaded%@%@", later.count > 0 ? @"; on restart: " : @"",
+          [[later sortedArrayUsingSelector:@selector(compare:)] componentsJoinedByString:@", "]);
+
+    [self setTunnelNetworkSettings:[self tunnelNetworkSettings] completionHandler:^(NSError *error) {
+        if (error) {
+            NSLog(@"Error applying the reloaded routes: %@", error);
+        }
+    }];
+    return nil;
+}
+
+// Open the capture, if one is asked for, and give every thread its writer
+- (void)startCapture:(NSNumber *)megabytes {
+    BOOL capturing = NO;
+    if (megabytes.unsignedIntValue > 0 && __atomic_load_n(&_captureWriters, __ATOMIC_ACQUIRE) != 0) {
+        NSLog(@"Not capturing: the last capture is still being closed");
+    } else if (megabytes.unsignedIntValue > 0) {
+        NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:TUNNEL_CAPTURE_FILE];
+        size_t size = (size_t)MIN(megabytes.unsignedIntValue, TUNNEL_CAPTURE_MB_MAX) << 20;
+        if (pcapng_open(&_capture, path.fileSystemRepresentation, size) < 0) {
+            NSLog(@"Error opening capture %@: %s", path, strerror(errno));
+        } else {
+            NSLog(@"Capturing packet headers to %@", path);
+            __atomic_store_n(&_captureWriters, 2 * _connectionCount, __ATOMIC_RELAXED);
+            capturing = YES;
+        }
+    }
+    for (unsigned i = 0; i < _connectionCount; i++) {
+        pcapng_writer_init(&_connections[i].rxCapture, capturing ? &_capture : NULL);
+        pcapng_writer_init(&_connections[i].txCapture, capturing ? &_capture : NULL);
+    }
+}
+
+// A thread is done with its writer; the last one closes the file
+- (void)finishCapture:(struct pcapng_writer *)writer {
+    if (!writer->cap) {
+        return;
+    }
+    pcapng_writer_flush(writer);
+    writer->cap = NULL;
+    if (__atomic_sub_fetch(&_captureWriters, 1, __ATOMIC_ACQ_REL) == 0) {
+        NSLog(@"Capture: %llu packets, %llu dropped", (unsigned long long)_capture.packets,
+              (unsigned long long)_capture.dropped);
+        pcapng_close(&_capture);
+    }
+}
+
+// Addresses, routes and MTU of the tunnel interface
+- (NEPacketTunnelNetworkSettings *)tunnelNetworkSettings {
+    NEPacketTunnelNetworkSettings *settings = [[NEPacketTunnelNetworkSettings alloc] initWithTunnelRemoteAddress:_serverHost];
+    __atomic_add_fetch(&_rulesReaders, 1, __ATOMIC_SEQ_CST);
+    const struct pkt_rules *rules = __atomic_load_n(&_captureRules, __ATOMIC_SEQ_CST);
+
+    // Configure IPv4 settings
+    NEIPv4Settings *ipv4 = [[NEIPv4Settings alloc] initWithAddresses:@[TUNNEL_CLIENT_IP] subnetMasks:@[TUNNEL_SUBNET_MASK]];
+
+    // Route only destinations the capture rules name. Routes cannot select
+    // ports, and what else reaches us can only be handed back as inbound
+    // traffic, so without include prefixes nothing is routed here
+    ipv4.includedRoutes = [self routesForRules:rules kind:PKT_RULE_INCLUDE];
+    ipv4.excludedRoutes = [self routesForRules:rules kind:PKT_RULE_EXCLUDE];
+    settings.IPv4Settings = ipv4;
+
+    // Configure IPv6 settings, for mail servers reached over IPv6. Capture
+    // prefixes are IPv4, so no IPv6 destination is routed here: the address
+    // only lets the interface take what the tunnel addresses to it
+    if (pkt_rules_ipv6(rules)) {
+        NEIPv6Settings *ipv6 = [[NEIPv6Settings alloc] initWithAddresses:@[TUNNEL_CLIENT_IP6]
+                                                    networkPrefixLengths:@[@TUNNEL_CLIENT_IP6_PREFIX_LEN]];
+        ipv6.includedRoutes = @[];
+        settings.IPv6Settings = ipv6;
+    }
+    __atomic_sub_fetch(&_rulesReaders, 1, __ATOMIC_RELEASE);
+    settings.MTU = @(__atomic_load_n(&_tunnelMTU, __ATOMIC_RELAXED));
+
+    return settings;
+}
+
+// Take up a measured MTU: clamp SYNs to it at once, and have the interface
+// use it once the settings are applied again
+- (void)updateTunnelMTU:(unsigned)mtu {
+    unsigned old = __atomic_exchange_n(&_tunnelMTU, mtu, __ATOMIC_RELAXED);
+    if (mtu == old || !_running) {
         return;
     }
+    NSLog(@"Tunnel MTU %u (was %u)", mtu, old);
+    [self setTunnelNetworkSettings:[self tunnelNetworkSettings] completionHandler:^(NSError *error) {
+        if (error) {
+            NSLog(@"Error applying tunnel MTU %u: %@", mtu, error);
+        }
+    }];
+}
+
+// Allocate a connection's send ring and scheduler, its replay buffer and
+// its scratch for compression and encryption
+- (BOOL)setUpConnection:(struct tunnel_connection *)conn index:(unsigned)index {
+    conn->index = index;
+    conn->tunnelSocket = -1;
+    conn->pendingSocket = -1;
+    conn->txSocket = -1;
+    if (_compress) {
+        conn->rxLzMem = malloc(LZ_DECODER_MEM);
+        conn->txLzMem = malloc(LZ_ENCODER_MEM);
+        conn->txLzOut = malloc(LZ_BATCH_SCRATCH);
+    }
+    if (_encrypt) {
+        // Only as much of the scratch as a batch holds is ever touched
+        conn->txSealOut = malloc(SEAL_BATCH_SCRATCH(FRAME_BATCH_MAX * FRAME_MAX_LEN));
+    }
+    if ((_compress && (!conn->rxLzMem || !conn->txLzMem || !conn->txLzOut)) || (_encrypt && !conn->txSealOut) ||
+        replay_init(&conn->txReplay, TUNNEL_REPLAY_BYTES) < 0 || pkt_sched_init(&conn->txSched, TUNNEL_TX_RING_SLOTS) < 0) {
+        tunnel_connection_free(conn);
+        return NO;
+    }
+    if (spsc_ring_init(&conn->txRing, TUNNEL_TX_RING_SLOTS) < 0) {
+        tunnel_connection_free(conn);
+        return NO;
+    }
+    pthread_mutex_init(&conn->connLock, NULL);
+    return YES;
+}
+
+// The pre-shared key's text, or nil if none is configured. A Keychain item
+// that cannot be read gives an empty key rather than none, so the tunnel
+// never falls back to the clear.
+- (NSData *)tunnelKeyText:(NSDictionary *)providerConfig {
+    NSData *ref = self.protocolConfiguration.passwordReference;
+    if (ref) {
+        NSDictionary *query = @{
+            (__bridge id)kSecClass: (__bridge id)kSecClassGenericPassword,
+            (__bridge id)kSecValuePersistentRef: ref,
+            (__bridge id)kSecReturnData: @YES,
+        };
+        CFTypeRef data = NULL;
+        OSStatus status = SecItemCopyMatching((__bridge CFDictionaryRef)query, &data);
+        if (status != errSecSuccess) {
+            NSLog(@"Error reading tunnel key from the Keychain: %d", (int)status);
+            return [NSData data];
+        }
+        return CFBridgingRelease(data);
+    }
+    NSString *text = providerConfig[TUNNEL_KEY_CONFIG];
+    return [text dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+- (NSArray<NEIPv4Route *> *)routesForRules:(const struct pkt_rules *)rules kind:(enum pkt_rule_kind)kind {
+    size_t count = pkt_rules_prefixes(rules, kind, NULL, 0);
+    struct pkt_rule *prefixes = calloc(count ? count : 1, sizeof(*prefixes));
+    NSMutableArray<NEIPv4Route *> *routes = [NSMutableArray array];
+
+    if (!prefixes) {
+        return routes;
+    }
+    pkt_rules_prefixes(rules, kind, prefixes, count);
+
+    for (size_t i = 0; i < count; i++) {
+        char addr[INET_ADDRSTRLEN], mask[INET_ADDRSTRLEN];
+        uint32_t netmask = prefixes[i].prefix_len ? htonl(0xffffffffu << (32 - prefixes[i].prefix_len)) : 0;
+        inet_ntop(AF_INET, &prefixes[i].prefix, addr, sizeof(addr));
+        inet_ntop(AF_INET, &netmask, mask, sizeof(mask));
+        [routes addObject:[[NEIPv4Route alloc] initWithDestinationAddress:@(addr) subnetMask:@(mask)]];
+    }
+
+    free(prefixes);
+    return routes;
+}
+
+- (void)startConnectionThreads {
+    // Connecting and receiving block; each thread owns its connection's
+    // lifecycle, so reconnects need no run loop or timer
+    for (unsigned i = 0; i < _connectionCount; i++) {
+        NSThread *thread = [[NSThread alloc] initWithTarget:self selector:@selector(connectionLoop:) object:@(i)];
+        thread.name = [NSString stringWithFormat:@"com.netrewire.tunnel_receiver.%u", i];
+        thread.qualityOfService = NSQualityOfServiceUserInteractive;
+        [_threads addObject:thread];
+        [thread start];
+    }
+}
+
+- (void)connectionLoop:(NSNumber *)index {
+    struct tunnel_connection *conn = &_connections[index.unsignedIntValue];
+    NSTimeInterval backoff = TUNNEL_RECONNECT_MIN;
+
+    while (_running) {
+        int sock = [self connectToServer:conn];
+        if (sock >= 0) {
+            CFAbsoluteTime connected = CFAbsoluteTimeGetCurrent();
+            BOOL established = _datagram ? [self receiveDatagramsFromSocket:sock connection:conn]
+                                         : [self receiveFromSocket:sock connection:conn];
+            conn->tunnelSocket = -1;
+
+            // A connection that worked for a while is retried right away;
+            // one dropped straight after the handshake backs off as well
+            if (established && CFAbsoluteTimeGetCurrent() - connected >= 1.0) {
+                backoff = TUNNEL_RECONNECT_MIN;
+                continue;
+            }
+        }
+        if (!_running) {
+            break;
+        }
+
+        // Jitter keeps clients that lost the server together from
+        // reconnecting in lockstep
+        NSTimeInterval delay = backoff * (0.75 + 0.5 * arc4random_uniform(1000) / 1000.0);
+        NSLog(@"Reconnecting to tunnel server in %.2f s", delay);
+        [NSThread sleepForTimeInterval:delay];
+        backoff = MIN(backoff * 2, TUNNEL_RECONNECT_MAX);
+    }
+    [self finishCapture:&conn->rxCapture];
+}
+
+// Connect; on a stream, send the HELLO that opens or resumes the session
+- (int)connectToServer:(struct tunnel_connection *)conn {
+    int sock = socket(AF_INET, _datagram ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (sock < 0) {
+        NSLog(@"Error creating tunnel socket");
+        return -1;
+    }
+    unsigned failed = _datagram ? 0 : socktune_apply(sock, &_tune);
+    if (failed) {
+        char text[160];
+        socktune_describe(&_tune, failed, text, sizeof(text));
+        NSLog(@"Socket tuning not applied: %s", text);
+    }
 
-    // Configure server address
-    struct sockaddr_in serverAddr;
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(TUNNEL_SERVER_PORT);
-    inet_pton(AF_INET, [TUNNEL_SERVER_IP UTF8String], &serverAddr.sin_addr);
+    struct sockaddr_in serverAddr = _serverAddr;
 
-    // Connect to server
-    int result = connect(_tunnelSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
-    if (result < 0) {
+    // Connect to server; for UDP this only fixes the peer, so the socket
+    // takes datagrams from the server alone
+    if (connect(sock, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
         NSLog(@"Error connecting to tunnel server: %s", strerror(errno));
-        close(_tunnelSocket);
-        _tunnelSocket = -1;
+        close(sock);
+        return -1;
+    }
+
+    // No session: in the clear the server learns our address from the first
+    // datagram, sealed from the handshake. Datagrams too big for the path
+    // are refused rather than fragmented, which the MTU probes rely on.
+    if (_datagram) {
+        int on = 1;
+        setsockopt(sock, IPPROTO_IP, IP_DONTFRAG, &on, sizeof(on));
+        if (_encrypt && ![self agreeDatagramKeys:sock connection:conn]) {
+            close(sock);
+            return -1;
+        }
+        NSLog(@"Sending %@datagrams to tunnel server", _encrypt ? @"sealed " : @"");
+        __atomic_store_n(&conn->txShutdown, 0, __ATOMIC_RELAXED);
+        conn->tunnelSocket = sock;
+        [self handOverSocket:sock restart:NO peerSeq:0 compressed:NO seal:&conn->connTxSeal connection:conn];
+        return sock;
+    }
+
+    // The RTT of the handshake sizes the buffers, if the profile says so
+    long buffers = socktune_fit_buffers(sock, &_tune);
+    if (buffers > 0) {
+        NSLog(@"Socket buffers: %ld bytes", buffers);
+    }
+
+    // An encrypted connection says HELLO once the keys are agreed
+    BOOL sent;
+    if (_encrypt) {
+        struct frame_batch batch;
+        frame_batch_init(&batch);
+        sent = seal_key_frame(conn->clientKey) == 0 &&
+               frame_batch_add_typed(&batch, FRAME_TYPE_KEY, conn->clientKey, sizeof(conn->clientKey)) == 0 &&
+               frame_batch_flush(&batch, sock) == 0;
+    } else {
+        sent = [self sendHello:sock connection:conn];
+    }
+    if (!sent) {
+        NSLog(@"Error sending handshake: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    NSLog(@"Connected to tunnel server (connection %u of %u)", conn->index + 1, _connectionCount);
+    conn->tunnelSocket = sock;
+    return sock;
+}
+
+// Sealed datagrams: HELLO until the server ACCEPTs, as either may be lost,
+// and agree on the keys and our peer id. Anything else that arrives is
+// ignored; only the server's answer to this HELLO passes the check.
+- (BOOL)agreeDatagramKeys:(int)sock connection:(struct tunnel_connection *)conn {
+    uint8_t hello[SEAL_DGRAM_HELLO_LEN];
+    uint8_t accept[SEAL_DGRAM_ACCEPT_LEN];
+    uint8_t serverKey[SEAL_KEY_FRAME_LEN];
+    struct timeval timeout = { .tv_usec = TUNNEL_DGRAM_HELLO_TIMEOUT_MS * 1000 };
+    struct timeval none = { 0 };
+
+    if (seal_dgram_hello(_psk, conn->clientKey, hello) < 0) {
+        NSLog(@"Error starting encryption");
+        return NO;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for (int i = 0; i < TUNNEL_DGRAM_HELLO_TRIES && _running; i++) {
+        if (send(sock, hello, sizeof(hello), 0) < 0 && errno != ECONNREFUSED && errno != ENOBUFS) {
+            NSLog(@"Error sending handshake: %s", strerror(errno));
+            return NO;
+        }
+        uint64_t deadline = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) + TUNNEL_DGRAM_HELLO_TIMEOUT_MS * NSEC_PER_MSEC;
+        ssize_t n;
+        while (clock_gettime_nsec_np(CLOCK_UPTIME_RAW) < deadline &&
+               ((n = recv(sock, accept, sizeof(accept), 0)) >= 0 || errno == EINTR)) {
+            if (n >= 0 &&
+                seal_dgram_accept_check(_psk, conn->clientKey, accept, (size_t)n, &conn->dgramPeer, serverKey) == 0) {
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+                if (seal_start(_psk, conn->clientKey, serverKey, 1, &conn->connTxSeal, &conn->rxSeal) < 0) {
+                    NSLog(@"Error starting encryption");
+                    return NO;
+                }
+                return YES;
+            }
+        }
+    }
+    NSLog(@"Tunnel server did not agree on encryption");
+    return NO;
+}
+
+// The HELLO that opens or resumes the session, and names the connection's
+// place in a pool. The writer does not know this socket yet, so nothing can
+// interleave. We cut super-packets ourselves, so the server may send them
+// whole.
+- (BOOL)sendHello:(int)sock connection:(struct tunnel_connection *)conn {
+    uint8_t hello[FRAME_HELLO_STRIPE_LEN];
+    uint8_t sealed[SEAL_BATCH_SCRATCH(FRAME_HEADER_LEN + FRAME_HELLO_STRIPE_LEN)];
+    struct frame_batch batch, records;
+    size_t len = FRAME_HELLO_FEATURES_LEN;
+    uint32_t features = FRAME_FEATURE_GSO | (_compress ? FRAME_FEATURE_LZ : 0);
+    if (_connectionCount > 1) {
+        features |= FRAME_FEATURE_STRIPE;
+        hello[FRAME_HELLO_FEATURES_LEN] = (uint8_t)conn->index;
+        hello[FRAME_HELLO_FEATURES_LEN + 1] = (uint8_t)_connectionCount;
+        len = FRAME_HELLO_STRIPE_LEN;
+    }
+    frame_put_u64(hello, conn->sessionId);
+    frame_put_u64(hello + 8, conn->rxSeq);
+    frame_put_u32(hello + FRAME_HELLO_LEN, features);
+    frame_batch_init(&batch);
+    frame_batch_add_typed(&batch, FRAME_TYPE_HELLO, hello, len);
+    if (!conn->connTxSeal.aead) {
+        return frame_batch_flush(&batch, sock) == 0;
+    }
+    return seal_batch(&conn->connTxSeal, &batch, &records, sealed) == 0 && frame_batch_flush(&records, sock) == 0;
+}
+
+// The server's KEY frame: agree on the connection's keys, then say HELLO
+- (BOOL)handleKey:(const struct frame *)frame socket:(int)sock connection:(struct tunnel_connection *)conn {
+    if (frame->type != FRAME_TYPE_KEY || frame->len != SEAL_KEY_FRAME_LEN ||
+        seal_start(_psk, conn->clientKey, frame->data, 1, &conn->connTxSeal, &conn->rxSeal) < 0) {
+        NSLog(@"Tunnel server did not agree on encryption");
+        return NO;
+    }
+    if (![self sendHello:sock connection:conn]) {
+        NSLog(@"Error sending handshake: %s", strerror(errno));
+        return NO;
+    }
+    return YES;
+}
+
+// The server's HELLO names the session and says how many of our frames it
+// has; the writer takes the socket over from here and resends the rest.
+// Frames after it are compressed if it says so.
+- (BOOL)handleHello:(const struct frame *)frame socket:(int)sock connection:(struct tunnel_connection *)conn {
+    if (frame->len != FRAME_HELLO_LEN && frame->len != FRAME_HELLO_FEATURES_LEN) {
+        return NO;
+    }
+    uint64_t sessionId = frame_get_u64(frame->data);
+    uint64_t peerSeq = frame_get_u64(frame->data + 8);
+    BOOL restart = sessionId != conn->sessionId;
+    uint32_t features = frame->len == FRAME_HELLO_FEATURES_LEN ? frame_get_u32(frame->data + FRAME_HELLO_LEN) : 0;
+
+    conn->rxCompressed = _compress && (features & FRAME_FEATURE_LZ);
+    if (conn->rxCompressed) {
+        lz_decoder_init(&conn->rxLz, conn->rxLzMem);
+    }
+
+    if (restart) {
+        NSLog(@"Tunnel session %016llx started", sessionId);
+        conn->sessionId = sessionId;
+        conn->rxSeq = 0;
+        conn->rxAckedSeq = 0;
+        conn->rxUnackedBytes = 0;
+        __atomic_store_n(&conn->ackSeq, 0, __ATOMIC_RELAXED);
+    } else {
+        NSLog(@"Tunnel session %016llx resumed", sessionId);
+    }
+    __atomic_store_n(&conn->peerAckSeq, peerSeq, __ATOMIC_RELAXED);
+    [self handOverSocket:sock restart:restart peerSeq:peerSeq compressed:conn->rxCompressed seal:&conn->connTxSeal
+              connection:conn];
+    if (conn->index == 0 && !_fixedMTU) {
+        [self measureStreamMTU:sock];
+    }
+    return YES;
+}
 
-        // Schedule reconnect
-        [self scheduleReconnect];
+// The outer TCP keeps its segments to the path MTU; a packet that fills a
+// segment, frame header and all, never spills into a second one
+- (void)measureStreamMTU:(int)sock {
+    int mss = 0;
+    socklen_t len = sizeof(mss);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &mss, &len) < 0 || mss <= FRAME_HEADER_LEN) {
         return;
     }
+    [self updateTunnelMTU:MIN(MAX(mss - FRAME_HEADER_LEN, PMTU_MIN), PMTU_MAX)];
+}
 
-    NSLog(@"Connected to tunnel server");
+// Give the writer a new connection to send on, and the sending direction
+// of its encryption if it has any
+- (void)handOverSocket:(int)sock
+               restart:(BOOL)restart
+               peerSeq:(uint64_t)peerSeq
+            compressed:(BOOL)compressed
+                  seal:(struct seal_stream *)seal
+            connection:(struct tunnel_connection *)conn {
+    pthread_mutex_lock(&conn->connLock);
+    if (conn->pendingSocket >= 0) {
+        // The writer never got to the previous connection
+        close(conn->pendingSocket);
+    }
+    seal_stream_free(&conn->pendingSeal);
+    conn->pendingSocket = sock;
+    conn->pendingRestart = conn->pendingRestart || restart;
+    conn->pendingPeerSeq = peerSeq;
+    conn->pendingCompressed = compressed;
+    conn->pendingDgramPeer = conn->dgramPeer;
+    if (seal) {
+        conn->pendingSeal = *seal;
+        seal->aead = NULL;
+    }
+    __atomic_store_n(&conn->connPending, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&conn->connLock);
 
-    // Start receiving packets from server
-    [self startReceivingFromServer];
+    spsc_ring_notify(&conn->txRing);
 }
 
-- (void)scheduleReconnect {
-    if (_reconnectTimer) {
-        [_reconnectTimer invalidate];
+// Cut a super-packet from the server into the segments the host stack
+// expects, written one after another into a slab of their own. A frame that
+// cannot be segmented is dropped like any other bad packet; it was counted.
+- (void)segmentFrame:(const struct frame *)frame
+                pool:(struct slab_pool *)pool
+             packets:(NSMutableArray<NSData *> *)packets
+           protocols:(NSMutableArray<NSNumber *> *)protocols
+          connection:(struct tunnel_connection *)conn {
+    struct gso_iter gso;
+    if (frame->len < FRAME_GSO_PREFIX_LEN ||
+        gso_iter_init(&gso, frame->data + FRAME_GSO_PREFIX_LEN, frame->len - FRAME_GSO_PREFIX_LEN,
+                      frame_get_u16(frame->data)) < 0) {
+        metrics_add(&conn->rxMetrics, METRICS_DROPS, 1);
+        return;
+    }
+    size_t room = gso_iter_segments(&gso) * gso_iter_max_segment(&gso);
+    struct slab *segments = slab_get(pool);
+    if (!segments || room > segments->cap) {
+        metrics_add(&conn->rxMetrics, METRICS_DROPS, 1);
+        if (segments) {
+            slab_release(segments);
+        }
+        return;
     }
 
-    _reconnectTimer = [NSTimer scheduledTimerWithTimeInterval:5.0
-                                                       target:self
-                                                     selector:@selector(connectToTunnelServer)
-                                                     userInfo:nil
-                                                      repeats:NO];
+    size_t used = 0, n;
+    while ((n = gso_iter_next(&gso, segments->data + used)) > 0) {
+        slab_retain(segments);
+        NSData *packet = [[NSData alloc] initWithBytesNoCopy:segments->data + used
+                                                      length:n
+                                                 deallocator:^(void *bytes, NSUInteger length) {
+            slab_release(segments);
+        }];
+        [packets addObject:packet];
+        [protocols addObject:@(AF_INET)];
+        metrics_add(&conn->rxMetrics, METRICS_SOCKET_TO_TUN_PACKETS, 1);
+        metrics_add(&conn->rxMetrics, METRICS_SOCKET_TO_TUN_BYTES, n);
+        used += n;
+    }
+    slab_release(segments);
 }
 
-- (void)startReceivingFromServer {
-    dispatch_async(_packetQueue, ^{
-        [self receiveLoop];
-    });
+// A data, GSO or ACK frame from the server; data is handed on as a view
+// into the slab it lies in. Returns NO for any other frame.
+- (BOOL)takeFrame:(const struct frame *)frame
+             slab:(struct slab *)slab
+             pool:(struct slab_pool *)pool
+          packets:(NSMutableArray<NSData *> *)packets
+        protocols:(NSMutableArray<NSNumber *> *)protocols
+       connection:(struct tunnel_connection *)conn {
+    if (frame->type == FRAME_TYPE_ACK && frame->len == FRAME_ACK_LEN) {
+        __atomic_store_n(&conn->peerAckSeq, frame_get_u64(frame->data), __ATOMIC_RELAXED);
+        return YES;
+    }
+    if (frame->type == FRAME_TYPE_GSO) {
+        conn->rxSeq++;
+        conn->rxUnackedBytes += frame->len;
+        [self segmentFrame:frame pool:pool packets:packets protocols:protocols connection:conn];
+        return YES;
+    }
+    if (frame->type != FRAME_TYPE_DATA) {
+        return NO;
+    }
+
+    conn->rxSeq++;
+    conn->rxUnackedBytes += frame->len;
+
+    // A SYN-ACK tells the host how much it may send us; the slab is ours
+    pmtu_clamp_mss((uint8_t *)frame->data, frame->len, (uint16_t)__atomic_load_n(&_tunnelMTU, __ATOMIC_RELAXED));
+    slab_retain(slab);
+    NSData *packet = [[NSData alloc] initWithBytesNoCopy:(void *)frame->data
+                                                  length:frame->len
+                                             deallocator:^(void *bytes, NSUInteger length) {
+        slab_release(slab);
+    }];
+    [packets addObject:packet];
+    [protocols addObject:packet_protocol(frame->data, frame->len)];
+    metrics_add(&conn->rxMetrics, METRICS_SOCKET_TO_TUN_PACKETS, 1);
+    metrics_add(&conn->rxMetrics, METRICS_SOCKET_TO_TUN_BYTES, frame->len);
+    return YES;
 }
 
-- (void)receiveLoop {
-    while (_running && _tunnelSocket >= 0) {
-        // Read packet length (4 bytes)
-        uint32_t packetLength = 0;
-        ssize_t bytesRead = recv(_tunnelSocket, &packetLength, 4, 0);
+// Decompress a chunk of frames. The decoder's history is overwritten by
+// later chunks, so the frames are copied into a slab of their own for the
+// views handed to packetFlow.
+- (BOOL)inflateFrame:(const struct frame *)frame
+                pool:(struct slab_pool *)pool
+             packets:(NSMutableArray<NSData *> *)packets
+           protocols:(NSMutableArray<NSNumber *> *)protocols
+          connection:(struct tunnel_connection *)conn {
+    const uint8_t *chunk;
+    long n = lz_decoder_decompress(&conn->rxLz, frame->data, frame->len, &chunk);
+    if (n <= 0) {
+        NSLog(@"Invalid compressed frame from server");
+        return NO;
+    }
+    struct slab *slab = slab_get(pool);
+    if (!slab) {
+        NSLog(@"Error allocating receive buffer");
+        return NO;
+    }
+    memcpy(slab->data, chunk, (size_t)n);
 
-        if (bytesRead <= 0) {
-            NSLog(@"Connection to server lost");
-            close(_tunnelSocket);
-            _tunnelSocket = -1;
-            [self scheduleReconnect];
+    struct frame_decoder frames;
+    struct frame inner;
+    int rc;
+    frame_decoder_init(&frames, slab->data, (size_t)n);
+    frame_decoder_commit(&frames, (size_t)n);
+    while ((rc = frame_decoder_next(&frames, &inner)) == 1) {
+        if (![self takeFrame:&inner slab:slab pool:pool packets:packets protocols:protocols connection:conn]) {
             break;
         }
+    }
+    slab_release(slab);
+    // A chunk holds whole frames and nothing else
+    return rc == 0 && frame_decoder_pending(&frames) == 0;
+}
+
+// One frame of the session: the HELLO first, then packets, acknowledgements
+// and compressed chunks of them
+- (BOOL)dispatchFrame:(const struct frame *)frame
+               socket:(int)sock
+           handedOver:(BOOL *)handedOver
+                 slab:(struct slab *)slab
+                 pool:(struct slab_pool *)pool
+              packets:(NSMutableArray<NSData *> *)packets
+            protocols:(NSMutableArray<NSNumber *> *)protocols
+           connection:(struct tunnel_connection *)conn {
+    if (frame->type == FRAME_TYPE_HELLO && !*handedOver) {
+        *handedOver = [self handleHello:frame socket:sock connection:conn];
+        return *handedOver;
+    }
+    if (frame->type == FRAME_TYPE_LZ && *handedOver && conn->rxCompressed) {
+        return [self inflateFrame:frame pool:pool packets:packets protocols:protocols connection:conn];
+    }
+    return *handedOver && [self takeFrame:frame slab:slab pool:pool packets:packets protocols:protocols
+                               connection:conn];
+}
+
+// Open a sealed record where it lies in the slab, so its packets are still
+// handed to packetFlow without a copy
+- (BOOL)openRecord:(const struct frame *)frame
+            socket:(int)sock
+        handedOver:(BOOL *)handedOver
+              slab:(struct slab *)slab
+              pool:(struct slab_pool *)pool
+           packets:(NSMutableArray<NSData *> *)packets
+         protocols:(NSMutableArray<NSNumber *> *)protocols
+        connection:(struct tunnel_connection *)conn {
+    uint8_t *plain;
+    long n = frame->type == FRAME_TYPE_SEALED ? seal_open(&conn->rxSeal, (uint8_t *)frame->data, frame->len, &plain) : -1;
+    if (n < 0) {
+        NSLog(@"Invalid encrypted record from server");
+        return NO;
+    }
+
+    struct frame_decoder frames;
+    struct frame inner;
+    int rc;
+    frame_decoder_init(&frames, plain, (size_t)n);
+    frame_decoder_commit(&frames, (size_t)n);
+    while ((rc = frame_decoder_next(&frames, &inner)) == 1) {
+        if (![self dispatchFrame:&inner socket:sock handedOver:handedOver slab:slab pool:pool
+                         packets:packets protocols:protocols connection:conn]) {
+            return NO;
+        }
+    }
+    // A record holds whole frames and nothing else
+    return rc == 0 && frame_decoder_pending(&frames) == 0;
+}
 
-        // Convert network byte order to host byte order
-        packetLength = ntohl(packetLength);
+// Receive until the connection is lost; returns whether the handshake
+// completed, in which case the writer owns (and closes) the socket
+- (BOOL)receiveFromSocket:(int)sock connection:(struct tunnel_connection *)conn {
+    // Frames are decoded in place from a large receive slab and handed to
+    // packetFlow as no-copy views, so a single recv() can carry many packets
+    // without an allocation or copy per packet
+    struct slab_pool *pool = slab_pool_create(FRAME_RX_BUFFER_SIZE, RX_SLAB_CACHE);
+    struct slab *slab = pool ? slab_get(pool) : NULL;
+    if (!slab) {
+        NSLog(@"Error allocating receive buffer");
+        slab_pool_destroy(pool);
+        close(sock);
+        return NO;
+    }
+    struct frame_decoder decoder;
+    frame_decoder_init(&decoder, slab->data, slab->cap);
+    BOOL handedOver = NO;
 
-        if (packetLength > 65535 || packetLength == 0) {
-            NSLog(@"Invalid packet length: %u", packetLength);
-            continue;
+    while (_running) {
+        // Compacting would overwrite packets still referenced by earlier
+        // views; continue in a fresh slab and let those release the old one
+        if (frame_decoder_compacts(&decoder) && slab_shared(slab)) {
+            struct slab *fresh = slab_get(pool);
+            if (!fresh) {
+                NSLog(@"Error allocating receive buffer");
+                break;
+            }
+            frame_decoder_rebase(&decoder, fresh->data, fresh->cap);
+            slab_release(slab);
+            slab = fresh;
         }
 
-        // Read packet data
-        NSMutableData *packetData = [NSMutableData dataWithLength:packetLength];
-        bytesRead = recv(_tunnelSocket, [packetData mutableBytes], packetLength, 0);
+        ssize_t bytesRead = frame_decoder_recv(&decoder, sock);
 
         if (bytesRead <= 0) {
-            NSLog(@"Error reading packet data");
+            NSLog(@"Connection %u to server lost", conn->index + 1);
+            break;
+        }
+        uint64_t received = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+        NSMutableArray<NSData *> *packets = [NSMutableArray array];
+        NSMutableArray<NSNumber *> *protocols = [NSMutableArray array];
+        struct frame frame;
+        BOOL refused = NO;
+        int rc;
+
+        while ((rc = frame_decoder_next(&decoder, &frame)) == 1) {
+            BOOL ok;
+            if (!_encrypt) {
+                ok = [self dispatchFrame:&frame socket:sock handedOver:&handedOver slab:slab pool:pool
+                                 packets:packets protocols:protocols connection:conn];
+            } else if (!conn->rxSeal.aead) {
+                ok = [self handleKey:&frame socket:sock connection:conn];
+            } else {
+                ok = [self openRecord:&frame socket:sock handedOver:&handedOver slab:slab pool:pool
+                              packets:packets protocols:protocols connection:conn];
+            }
+            if (!ok) {
+                refused = YES;
+                rc = -1;
+                break;
+            }
+        }
+
+        // Inject packets back to host stack
+        if (packets.count > 0) {
+            capture_packets(&conn->rxCapture, packets);
+            [self.packetFlow writePackets:packets withProtocols:protocols];
+            metrics_record(&conn->rxMetrics, METRICS_SOCKET_TO_TUN, clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - received);
+        }
+
+        // Acknowledgements go out on the writer thread, which owns sending
+        if (conn->rxSeq - conn->rxAckedSeq >= TUNNEL_ACK_FRAMES || conn->rxUnackedBytes >= TUNNEL_ACK_BYTES) {
+            conn->rxAckedSeq = conn->rxSeq;
+            conn->rxUnackedBytes = 0;
+            __atomic_store_n(&conn->ackSeq, conn->rxSeq, __ATOMIC_RELAXED);
+            spsc_ring_notify(&conn->txRing);
+        }
+
+        if (rc < 0) {
+            // The stream cannot be resynchronized after a bad frame
+            if (!refused) {
+                metrics_add(&conn->rxMetrics, METRICS_INVALID_LENGTHS, 1);
+            }
+            NSLog(@"Invalid frame from server: %08x", decoder.payload_len);
+            break;
+        }
+    }
+
+    // Wake the writer out of any send; it closes the socket once it moves on
+    if (handedOver) {
+        shutdown(sock, SHUT_RDWR);
+    } else {
+        close(sock);
+    }
+    seal_stream_free(&conn->rxSeal);
+    seal_stream_free(&conn->connTxSeal);
+    slab_release(slab);
+    slab_pool_destroy(pool);
+    return handedOver;
+}
+
+// Datagram transport: every datagram is one packet. Each read blocks for
+// the first and then takes whatever else is queued, so a burst reaches
+// packetFlow in one call. The writer owns the socket from the start; the
+// first connection sends MTU probes on it too, and its reads time out
+// while a probe waits for its echo. Sealed, they also time out between
+// keepalives, and a server that stopped answering them ends the connection.
+- (BOOL)receiveDatagramsFromSocket:(int)sock connection:(struct tunnel_connection *)conn {
+    struct slab_pool *pool = slab_pool_create(FRAME_RX_BUFFER_SIZE, RX_SLAB_CACHE);
+    struct slab *slab = pool ? slab_get(pool) : NULL;
+    size_t used = 0;
+    struct pmtu_search search;
+    BOOL probing = conn->index == 0 && !_fixedMTU;
+    uint64_t probeAt = 0;
+    BOOL sealed = conn->rxSeal.aead != NULL;
+    struct timeval idle = { .tv_sec = sealed ? TUNNEL_DGRAM_KEEPALIVE_MS / 1000 : 0 };
+    uint64_t heard = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    uint64_t keepaliveAt = 0;
+
+    if (!slab) {
+        NSLog(@"Error allocating receive buffer");
+    }
+    pmtu_search_init(&search, PMTU_MIN, PMTU_MAX);
+    if (probing) {
+        struct timeval timeout = { .tv_usec = PMTU_PROBE_TIMEOUT_MS * 1000 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    } else {
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    }
+    while (slab && _running) {
+        uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        if (sealed && now - heard >= TUNNEL_DGRAM_SILENCE_MS * NSEC_PER_MSEC) {
+            NSLog(@"Tunnel server stopped answering keepalives");
+            break;
+        }
+        if (sealed && now >= keepaliveAt) {
+            // The writer owns the sending direction
+            __atomic_store_n(&conn->keepaliveDue, 1, __ATOMIC_RELAXED);
+            spsc_ring_notify(&conn->txRing);
+            keepaliveAt = now + TUNNEL_DGRAM_KEEPALIVE_MS * NSEC_PER_MSEC;
+        }
+        if (probing && now >= probeAt) {
+            probing = [self sendProbe:&search socket:sock];
+            probeAt = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) + PMTU_PROBE_TIMEOUT_MS * 1000000ull;
+            if (!probing) {
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+            }
+        }
+        NSMutableArray<NSData *> *packets = [NSMutableArray array];
+        NSMutableArray<NSNumber *> *protocols = [NSMutableArray array];
+        uint64_t received = 0;
+        int flags = 0;
+        ssize_t n;
+
+        for (;;) {
+            // Leave room for the largest datagram, so none is cut short;
+            // views of earlier packets keep their slab
+            if (slab->cap - used < FRAME_MAX_PAYLOAD) {
+                if (slab_shared(slab)) {
+                    struct slab *fresh = slab_get(pool);
+                    if (!fresh) {
+                        NSLog(@"Error allocating receive buffer");
+                        errno = ENOMEM;
+                        n = -1;
+                        break;
+                    }
+                    slab_release(slab);
+                    slab = fresh;
+                }
+                used = 0;
+            }
+
+            // A shut-down socket reads 0 as well, but only stopping or the
+            // writer shuts it down; otherwise 0 is an empty datagram
+            n = recv(sock, slab->data + used, slab->cap - used, flags);
+            if (n == 0 && _running && !__atomic_load_n(&conn->txShutdown, __ATOMIC_RELAXED)) {
+                metrics_add(&conn->rxMetrics, METRICS_SHORT_READS, 1);
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            if (!flags) {
+                received = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+            }
+            flags = MSG_DONTWAIT;
+            if (probing && pmtu_search_answer(&search, slab->data + used, (size_t)n)) {
+                probeAt = 0;
+                continue;
+            }
+            uint8_t *pkt = slab->data + used;
+            size_t len = (size_t)n;
+            if (sealed) {
+                long opened = seal_dgram_open(&conn->rxSeal, pkt, len, &pkt);
+                if (opened < 0) {
+                    metrics_add(&conn->rxMetrics, METRICS_DROPS, 1);
+                    continue;
+                }
+                heard = received;
+                len = (size_t)opened;
+                if (len == 0) {
+                    // The answer to a keepalive
+                    continue;
+                }
+            }
+            if (len < 20 || ((pkt[0] >> 4) != 4 && (pkt[0] >> 4) != 6)) {
+                metrics_add(&conn->rxMetrics, len < 20 ? METRICS_SHORT_READS : METRICS_DROPS, 1);
+                continue;
+            }
+            pmtu_clamp_mss(pkt, len, (uint16_t)__atomic_load_n(&_tunnelMTU, __ATOMIC_RELAXED));
+
+            struct slab *owner = slab;
+            slab_retain(owner);
+            NSData *packet = [[NSData alloc] initWithBytesNoCopy:pkt
+                                                          length:len
+                                                     deallocator:^(void *bytes, NSUInteger length) {
+                slab_release(owner);
+            }];
+            [packets addObject:packet];
+            [protocols addObject:packet_protocol(pkt, len)];
+            metrics_add(&conn->rxMetrics, METRICS_SOCKET_TO_TUN_PACKETS, 1);
+            metrics_add(&conn->rxMetrics, METRICS_SOCKET_TO_TUN_BYTES, len);
+            used += n;
+        }
+
+        // Inject packets back to host stack
+        if (packets.count > 0) {
+            capture_packets(&conn->rxCapture, packets);
+            [self.packetFlow writePackets:packets withProtocols:protocols];
+            metrics_record(&conn->rxMetrics, METRICS_SOCKET_TO_TUN, clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - received);
+        }
+
+        // The queue ran dry, or an earlier datagram was refused by ICMP
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        if (n < 0 && errno == ECONNREFUSED) {
+            NSLog(@"Tunnel server unreachable");
             continue;
         }
+        if (_running) {
+            NSLog(@"Datagram socket failed: %s", n < 0 ? strerror(errno) : "shut down after a send error");
+        }
+        break;
+    }
+
+    // Wake the writer out of any send; it closes the socket once it moves on
+    shutdown(sock, SHUT_RDWR);
+    seal_stream_free(&conn->rxSeal);
+    seal_stream_free(&conn->connTxSeal);
+    if (slab) {
+        slab_release(slab);
+    }
+    slab_pool_destroy(pool);
+    return YES;
+}
 
-        // Inject packet back to host stack
-        [self.packetFlow writePackets:@[packetData] withProtocols:@[@(AF_INET)]];
+// Send the search's next probe. Returns NO once the search is over, having
+// taken up the MTU it found, less what sealing adds to a datagram.
+- (BOOL)sendProbe:(struct pmtu_search *)search socket:(int)sock {
+    uint8_t probe[PMTU_MAX];
+    size_t n;
+    while ((n = pmtu_search_probe(search, probe)) > 0) {
+        if (send(sock, probe, n, 0) >= 0 || errno != EMSGSIZE) {
+            return YES;
+        }
+        pmtu_search_too_big(search);
+    }
 
-        NSLog(@"Received packet from server, length: %zu", bytesRead);
+    unsigned mtu = pmtu_search_result(search);
+    if (mtu == 0) {
+        NSLog(@"Tunnel server does not answer MTU probes; keeping MTU %u",
+              __atomic_load_n(&_tunnelMTU, __ATOMIC_RELAXED));
+        return NO;
     }
+    [self updateTunnelMTU:_encrypt ? MAX(mtu - SEAL_DGRAM_OVERHEAD, PMTU_MIN) : mtu];
+    return NO;
 }
 
 - (void)startPacketCaptureLoop {
@@ -183,55 +1405,426 @@
 }
 
 - (void)processPackets:(NSArray<NSData *> *)packets protocols:(NSArray<NSNumber *> *)protocols {
-    for (NSUInteger i = 0; i < packets.count; i++) {
-        NSData *packet = packets[i];
-
-        // Parse packet using C helper
-        struct pkt_info info;
-        const uint8_t *bytes = (const uint8_t *)packet.bytes;
-        size_t len = packet.length;
-
-        if (pkt_parse(bytes, len, &info) && info.is_tcp) {
-            // Check if destination port is 25 (SMTP)
-            if (ntohs(info.tcp_dst) == 25) {
-                NSLog(@"Forwarding TCP port 25 packet to tunnel");
-                [self sendPacketToTunnel:packet];
+    NSUInteger count = packets.count;
+
+    // Classify the whole read in one pass; packets of flows seen before
+    // take their verdicts from the flow table
+    const uint8_t **bufs = malloc(count * sizeof(*bufs));
+    size_t *lens = malloc(count * sizeof(*lens));
+    uint8_t *verdicts = malloc(count);
+    uint8_t *conns = malloc(count);
+    if (!bufs || !lens || !verdicts || !conns) {
+        free(bufs);
+        free(lens);
+        free(verdicts);
+        free(conns);
+        [self.packetFlow writePackets:packets withProtocols:protocols];
+        return;
+    }
+    for (NSUInteger i = 0; i < count; i++) {
+        bufs[i] = (const uint8_t *)packets[i].bytes;
+        lens[i] = packets[i].length;
+    }
+    // Flows classified by rules a reload replaced are classified again
+    uint64_t gen = __atomic_load_n(&_rulesGen, __ATOMIC_ACQUIRE);
+    if (gen != _flowRulesGen) {
+        pkt_flow_clear(&_flows);
+        _flowRulesGen = gen;
+    }
+    __atomic_add_fetch(&_rulesReaders, 1, __ATOMIC_SEQ_CST);
+    const struct pkt_rules *rules = __atomic_load_n(&_captureRules, __ATOMIC_SEQ_CST);
+    pkt_flow_classify(&_flows, rules, bufs, lens, count, verdicts, conns,
+                      clock_gettime_nsec_np(CLOCK_UPTIME_RAW));
+    __atomic_sub_fetch(&_rulesReaders, 1, __ATOMIC_RELEASE);
+
+    NSUInteger captured = 0;
+    for (NSUInteger i = 0; i < count; i++) {
+        captured += verdicts[i] == PKT_VERDICT_TUNNEL;
+    }
+
+    // The routes keep most non-matching traffic away; what still leaks
+    // through (other ports to routed destinations) goes back in one call
+    NSArray<NSData *> *tunnelPackets = packets;
+    if (captured < count) {
+        NSMutableArray<NSData *> *captureList = [NSMutableArray arrayWithCapacity:captured];
+        NSMutableArray<NSData *> *passPackets = [NSMutableArray arrayWithCapacity:count - captured];
+        NSMutableArray<NSNumber *> *passProtocols = [NSMutableArray arrayWithCapacity:count - captured];
+
+        for (NSUInteger i = 0; i < count; i++) {
+            if (verdicts[i] == PKT_VERDICT_TUNNEL) {
+                conns[captureList.count] = conns[i];
+                [captureList addObject:packets[i]];
             } else {
-                // Non-SMTP traffic - write back to host stack
-                [self.packetFlow writePackets:@[packet] withProtocols:@[protocols[i]]];
+                [passPackets addObject:packets[i]];
+                [passProtocols addObject:protocols[i]];
             }
+        }
+        [self.packetFlow writePackets:passPackets withProtocols:passProtocols];
+        tunnelPackets = captureList;
+    }
+
+    if (tunnelPackets.count > 0) {
+        [self sendPacketsToTunnel:tunnelPackets connections:conns];
+    }
+
+    free(bufs);
+    free(lens);
+    free(verdicts);
+    free(conns);
+}
+
+// Called from the packet flow callback only, which makes it the single
+// producer of every ring. Each packet goes to the connection its flow
+// hashes to, as the flow table picked it. Packets are queued while
+// disconnected too: the writer keeps them in the replay buffer until the
+// session resumes.
+- (void)sendPacketsToTunnel:(NSArray<NSData *> *)packets connections:(const uint8_t *)conns {
+    uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    uint64_t dropped = 0;
+    unsigned pushed = 0;            // bit per connection
+    NSUInteger index = 0;
+    uint16_t mtu = (uint16_t)__atomic_load_n(&_tunnelMTU, __ATOMIC_RELAXED);
+    for (NSData *captured in packets) {
+        struct tunnel_connection *conn = &_connections[conns[index++]];
+
+        // A SYN announces what the host's interface MTU allows, which may
+        // be more than the tunnel carries now; the packet flow's buffer is
+        // not ours to change, so it is clamped in a copy
+        NSData *packet = captured;
+        if (pmtu_mss_over(packet.bytes, packet.length, mtu)) {
+            NSMutableData *clamped = [packet mutableCopy];
+            pmtu_clamp_mss(clamped.mutableBytes, clamped.length, mtu);
+            packet = clamped;
+        }
+        if (packet.length < 20) {
+            metrics_add(&_captureMetrics, METRICS_SHORT_READS, 1);
+            continue;
+        }
+        // A record has room for a little less than a whole frame
+        if (packet.length > (_encrypt ? SEAL_FRAME_MAX_PAYLOAD : FRAME_MAX_PAYLOAD)) {
+            dropped++;
+            continue;
+        }
+        // The writer releases the packet once it is on the wire
+        struct ring_desc desc = {
+            .data = packet.bytes,
+            .len = packet.length,
+            .owner = (void *)CFBridgingRetain(packet),
+            .time = now,
+        };
+        if (spsc_ring_push(&conn->txRing, &desc) < 0) {
+            CFBridgingRelease(desc.owner);
+            dropped++;
         } else {
-            // Non-TCP traffic - write back to host stack
-            [self.packetFlow writePackets:@[packet] withProtocols:@[protocols[i]]];
+            pushed |= 1u << conn->index;
         }
     }
+    for (unsigned i = 0; i < _connectionCount; i++) {
+        if (pushed & (1u << i)) {
+            spsc_ring_wake(&_connections[i].txRing);
+        }
+    }
+    metrics_add(&_captureMetrics, METRICS_DROPS, dropped);
+}
+
+// Stop writing to a connection that failed; the connection thread sees
+// the shutdown, reconnects and hands over the next one
+- (void)breakTxSocket:(struct tunnel_connection *)conn {
+    conn->txBroken = YES;
+    __atomic_store_n(&conn->txShutdown, 1, __ATOMIC_RELAXED);
+    shutdown(conn->txSocket, SHUT_RDWR);
+}
+
+// Write a whole batch to the tunnel socket, compressed and then sealed if
+// the connection is
+- (int)sendBatch:(struct frame_batch *)batch connection:(struct tunnel_connection *)conn {
+    if (batch->count == 0) {
+        return 0;
+    }
+    if (conn->txCompressed) {
+        lz_compress_batch(&conn->txLz, batch, &conn->txLzBatch, conn->txLzOut);
+        batch = &conn->txLzBatch;
+    }
+    if (conn->txSeal.aead) {
+        if (seal_batch(&conn->txSeal, batch, &conn->txSealBatch, conn->txSealOut) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        batch = &conn->txSealBatch;
+    }
+    return frame_batch_flush(batch, conn->txSocket);
 }
 
-- (void)sendPacketToTunnel:(NSData *)packet {
-    if (_tunnelSocket < 0) {
-        NSLog(@"Tunnel socket not connected, dropping packet");
+// Send the frames the server is missing; a restarted session gets all of
+// them, renumbered from 0
+- (void)resendReplay:(struct tunnel_connection *)conn {
+    struct replay_cursor cursor;
+    struct frame frame;
+    struct frame_batch batch;
+    size_t count = 0;
+    int rc = 0;
+
+    frame_batch_init(&batch);
+    replay_cursor_init(&conn->txReplay, &cursor);
+    while (rc == 0 && replay_cursor_next(&conn->txReplay, &cursor, &frame) == 1) {
+        frame_batch_add_typed(&batch, frame.type, frame.data, frame.len);
+        count++;
+        if (frame_batch_full(&batch)) {
+            rc = [self sendBatch:&batch connection:conn];
+        }
+    }
+    if (rc < 0 || [self sendBatch:&batch connection:conn] < 0) {
+        NSLog(@"Error resending packets to tunnel: %s", strerror(errno));
+        [self breakTxSocket:conn];
         return;
     }
+    if (count > 0) {
+        NSLog(@"Resent %zu packets to tunnel", count);
+    }
+}
+
+// Switch to the connection the connection thread handed over, if any;
+// returns whether it did. Frames already in the replay buffer, including
+// any batch not yet written, go out on the new socket right away.
+- (BOOL)adoptPendingConnection:(struct tunnel_connection *)conn {
+    if (!__atomic_load_n(&conn->connPending, __ATOMIC_ACQUIRE)) {
+        return NO;
+    }
 
-    dispatch_async(_packetQueue, ^{
-        // Send packet length (4 bytes, network byte order)
-        uint32_t packetLength = htonl((uint32_t)packet.length);
-        ssize_t bytesSent = send(self->_tunnelSocket, &packetLength, 4, 0);
+    pthread_mutex_lock(&conn->connLock);
+    int sock = conn->pendingSocket;
+    BOOL restart = conn->pendingRestart;
+    uint64_t peerSeq = conn->pendingPeerSeq;
+    BOOL compressed = conn->pendingCompressed;
+    seal_stream_free(&conn->txSeal);
+    conn->txSeal = conn->pendingSeal;
+    conn->pendingSeal.aead = NULL;
+    conn->txDgramPeer = conn->pendingDgramPeer;
+    conn->pendingSocket = -1;
+    conn->pendingRestart = NO;
+    __atomic_store_n(&conn->connPending, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&conn->connLock);
 
-        if (bytesSent != 4) {
-            NSLog(@"Error sending packet length");
-            return;
+    if (conn->txSocket >= 0) {
+        close(conn->txSocket);
+    }
+    conn->txSocket = sock;
+    conn->txBroken = NO;
+    conn->txCompressed = compressed;
+    if (compressed) {
+        lz_encoder_init(&conn->txLz, conn->txLzMem);
+    }
+
+    if (_datagram) {
+        return YES;
+    }
+    if (restart) {
+        replay_renumber(&conn->txReplay, 0);
+        conn->ackSentSeq = 0;
+    } else if (replay_ack(&conn->txReplay, peerSeq) < 0) {
+        // The server counts more than we sent; continue from its count
+        replay_renumber(&conn->txReplay, peerSeq);
+    }
+    [self resendReplay:conn];
+    return YES;
+}
+
+// Tell the server how many of its frames arrived, so it can trim its
+// replay buffer
+- (void)sendAckIfDue:(struct tunnel_connection *)conn {
+    uint64_t seq = __atomic_load_n(&conn->ackSeq, __ATOMIC_RELAXED);
+    if (seq == conn->ackSentSeq || conn->txSocket < 0 || conn->txBroken) {
+        return;
+    }
+
+    struct frame_batch batch;
+    frame_put_u64(conn->ackPayload, seq);
+    frame_batch_init(&batch);
+    frame_batch_add_typed(&batch, FRAME_TYPE_ACK, conn->ackPayload, sizeof(conn->ackPayload));
+    if ([self sendBatch:&batch connection:conn] < 0) {
+        [self breakTxSocket:conn];
+        return;
+    }
+    conn->ackSentSeq = seq;
+}
+
+// Sealed datagrams: a keepalive, an empty sealed datagram, when the
+// connection thread asks for one
+- (void)sendKeepaliveIfDue:(struct tunnel_connection *)conn {
+    if (!__atomic_exchange_n(&conn->keepaliveDue, 0, __ATOMIC_RELAXED) || !conn->txSeal.aead || conn->txSocket < 0 ||
+        conn->txBroken) {
+        return;
+    }
+    size_t len = seal_dgram_seal(&conn->txSeal, conn->txDgramPeer, conn->txSealOut, 0);
+    if (len == 0 || (send(conn->txSocket, conn->txSealOut, len, 0) < 0 && errno != ENOBUFS && errno != EAGAIN &&
+                     errno != ECONNREFUSED && errno != EINTR)) {
+        NSLog(@"Error sending keepalive to tunnel: %s", len == 0 ? "encryption failed" : strerror(errno));
+        [self breakTxSocket:conn];
+    }
+}
+
+// Datagram transport: one send per packet, as macOS has no sendmmsg. A
+// packet the socket will not take is dropped for the inner TCP to resend.
+// Sealed, each is copied into txSealOut and sealed there.
+- (void)sendDatagrams:(const struct ring_desc *)packets count:(size_t)count connection:(struct tunnel_connection *)conn {
+    size_t sent = 0;
+
+    for (size_t i = 0; i < count && conn->txSocket >= 0 && !conn->txBroken; i++) {
+        const uint8_t *dgram = packets[i].data;
+        size_t len = packets[i].len;
+        if (conn->txSeal.aead) {
+            memcpy(conn->txSealOut + SEAL_DGRAM_HEADER_LEN, packets[i].data, packets[i].len);
+            dgram = conn->txSealOut;
+            if ((len = seal_dgram_seal(&conn->txSeal, conn->txDgramPeer, conn->txSealOut, packets[i].len)) == 0) {
+                continue;
+            }
         }
+        if (send(conn->txSocket, dgram, len, 0) >= 0) {
+            sent++;
+            metrics_add(&conn->txMetrics, METRICS_TUN_TO_SOCKET_PACKETS, 1);
+            metrics_add(&conn->txMetrics, METRICS_TUN_TO_SOCKET_BYTES, packets[i].len);
+        } else if (errno != ENOBUFS && errno != EAGAIN && errno != ECONNREFUSED && errno != EINTR) {
+            // E.g. the source address went away; a new socket picks another
+            NSLog(@"Error sending packets to tunnel: %s", strerror(errno));
+            [self breakTxSocket:conn];
+        }
+    }
+    metrics_add(&conn->txMetrics, METRICS_DROPS, count - sent);
+    if (sent > 0) {
+        metrics_record(&conn->txMetrics, METRICS_TUN_TO_SOCKET, clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - packets[0].time);
+    }
+}
 
-        // Send packet data
-        bytesSent = send(self->_tunnelSocket, packet.bytes, packet.length, 0);
+// Write a batch and release the packets it pointed at. Stream packets
+// count once in the replay buffer, whether or not they went out yet; the
+// latency is the wait of the oldest one, packets[0].
+- (void)flushTunnelBatch:(struct frame_batch *)batch
+                 packets:(struct ring_desc *)packets
+                   count:(size_t)count
+              connection:(struct tunnel_connection *)conn {
+    BOOL sent = NO;
 
-        if (bytesSent != packet.length) {
-            NSLog(@"Error sending packet data");
-        } else {
-            NSLog(@"Sent packet to tunnel, length: %zu", packet.length);
+    replay_ack(&conn->txReplay, __atomic_load_n(&conn->peerAckSeq, __ATOMIC_RELAXED));
+
+    if (_datagram) {
+        [self adoptPendingConnection:conn];
+        [self sendDatagrams:packets count:count connection:conn];
+        frame_batch_init(batch);
+    } else if ([self adoptPendingConnection:conn]) {
+        // The resend on the new connection included this batch
+        frame_batch_init(batch);
+        sent = !conn->txBroken;
+    } else if (conn->txSocket < 0 || conn->txBroken) {
+        // Kept in the replay buffer until the session resumes
+        frame_batch_init(batch);
+    } else if ([self sendBatch:batch connection:conn] < 0) {
+        NSLog(@"Error sending packets to tunnel: %s", strerror(errno));
+        [self breakTxSocket:conn];
+    } else {
+        sent = YES;
+    }
+    if (sent) {
+        metrics_record(&conn->txMetrics, METRICS_TUN_TO_SOCKET, clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - packets[0].time);
+    }
+    [self sendAckIfDue:conn];
+
+    for (size_t i = 0; i < count; i++) {
+        if (!_datagram) {
+            metrics_add(&conn->txMetrics, METRICS_TUN_TO_SOCKET_PACKETS, 1);
+            metrics_add(&conn->txMetrics, METRICS_TUN_TO_SOCKET_BYTES, packets[i].len);
         }
-    });
+        CFBridgingRelease(packets[i].owner);
+    }
+}
+
+- (void)writerLoop:(NSNumber *)index {
+    struct tunnel_connection *conn = &_connections[index.unsignedIntValue];
+    struct ring_desc descs[FRAME_BATCH_MAX];
+    struct ring_desc held_descs[FRAME_BATCH_MAX];
+    struct frame_batch batch;
+    size_t held = 0;
+    uint64_t deadline = 0;
+
+    frame_batch_init(&batch);
+
+    for (;;) {
+        // Connection changes, acknowledgements and keepalives arrive by notify
+        if (held == 0) {
+            [self adoptPendingConnection:conn];
+            [self sendAckIfDue:conn];
+            [self sendKeepaliveIfDue:conn];
+        }
+
+        // Everything the capture queued moves to the scheduler, so an
+        // urgent packet does not wait behind the bulk read before it
+        size_t n;
+        while ((n = spsc_ring_pop(&conn->txRing, descs, MIN(pkt_sched_room(&conn->txSched), FRAME_BATCH_MAX))) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                pkt_sched_push(&conn->txSched, &descs[i]);
+            }
+        }
+
+        n = pkt_sched_pop(&conn->txSched, descs, FRAME_BATCH_MAX - held);
+        for (size_t i = 0; i < n; i++) {
+            if (conn->txCapture.cap) {
+                pcapng_write(&conn->txCapture, descs[i].data, descs[i].len, PCAPNG_OUTBOUND);
+            }
+            frame_batch_add(&batch, descs[i].data, descs[i].len);
+            if (!_datagram) {
+                replay_push(&conn->txReplay, descs[i].data, descs[i].len);
+            }
+            held_descs[held++] = descs[i];
+        }
+
+        if (held == FRAME_BATCH_MAX || (held > 0 && frame_batch_pending(&batch) >= __atomic_load_n(&_batchBytes, __ATOMIC_RELAXED))) {
+            [self flushTunnelBatch:&batch packets:held_descs count:held connection:conn];
+            held = 0;
+            deadline = 0;
+            continue;
+        }
+        if (n > 0) {
+            continue;
+        }
+
+        // The ring and the scheduler ran dry: send now, or give more packets until the deadline
+        if (held > 0) {
+            uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+            if (deadline == 0) {
+                deadline = now + __atomic_load_n(&_batchDelayMs, __ATOMIC_RELAXED) * NSEC_PER_MSEC;
+            }
+            int rc = 0;
+            if (now < deadline) {
+                rc = spsc_ring_wait(&conn->txRing, (int)((deadline - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC));
+            }
+            if (rc <= 0) {
+                [self flushTunnelBatch:&batch packets:held_descs count:held connection:conn];
+                held = 0;
+                deadline = 0;
+            }
+            if (rc < 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (spsc_ring_wait(&conn->txRing, -1) < 0) {
+            break;
+        }
+    }
+
+    if (conn->txSocket >= 0) {
+        close(conn->txSocket);
+    }
+    pthread_mutex_lock(&conn->connLock);
+    if (conn->pendingSocket >= 0) {
+        close(conn->pendingSocket);
+        conn->pendingSocket = -1;
+    }
+    seal_stream_free(&conn->pendingSeal);
+    pthread_mutex_unlock(&conn->connLock);
+    seal_stream_free(&conn->txSeal);
+    replay_free(&conn->txReplay);
+    [self finishCapture:&conn->txCapture];
 }
 
 - (void)stopTunnelWithReason:(NEProviderStopReason)reason completionHandler:(void (^)(void))completionHandler {
@@ -239,28 +1832,66 @@
 
     _running = NO;
 
-    // Clean up resources
-    if (_reconnectTimer) {
-        [_reconnectTimer invalidate];
-        _reconnectTimer = nil;
-    }
-
-    if (_tunnelSocket >= 0) {
-        close(_tunnelSocket);
-        _tunnelSocket = -1;
+    // End the receive loops; the connection threads and the writers close
+    // the sockets they own
+    for (unsigned i = 0; i < _connectionCount; i++) {
+        int sock = _connections[i].tunnelSocket;
+        if (sock >= 0) {
+            shutdown(sock, SHUT_RDWR);
+        }
     }
 
     _packetBuffer = nil;
-    _packetQueue = nil;
+
+    // The writers drain what is queued, then exit
+    for (unsigned i = 0; i < _connectionCount; i++) {
+        spsc_ring_close(&_connections[i].txRing);
+    }
+    _threads = nil;
 
     completionHandler();
 }
 
 - (void)handleAppMessage:(NSData *)messageData completionHandler:(void (^)(NSData *))completionHandler {
-    // Handle messages from the containing app
-    if (completionHandler) {
+    if (!completionHandler) {
+        return;
+    }
+    id plist = [NSPropertyListSerialization propertyListWithData:messageData options:NSPropertyListImmutable
+                                                          format:NULL error:NULL];
+    if ([plist isKindOfClass:[NSDictionary class]]) {
+        NSString *reason = _running ? [self reloadConfiguration:plist] : @"The tunnel is not running";
+        completionHandler([(reason ?: @"OK") dataUsingEncoding:NSUTF8StringEncoding]);
+        return;
+    }
+    NSString *message = [[NSString alloc] initWithData:messageData encoding:NSUTF8StringEncoding];
+    if (![message isEqualToString:TUNNEL_MESSAGE_METRICS]) {
         completionHandler([@"OK" dataUsingEncoding:NSUTF8StringEncoding]);
+        return;
+    }
+
+    // Read while the threads keep writing; the text only grows in between
+    const struct metrics *sets[1 + 2 * STRIPE_MAX] = { &_captureMetrics };
+    int count = 1;
+    for (unsigned i = 0; i < _connectionCount; i++) {
+        sets[count++] = &_connections[i].rxMetrics;
+        sets[count++] = &_connections[i].txMetrics;
+    }
+    uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    size_t flowLen = _flows.flows ? pkt_flow_format(NULL, 0, &_flows, now) : 0;
+    NSMutableData *text = [NSMutableData dataWithLength:metrics_format(NULL, 0, sets, count, NULL) + flowLen + 4096];
+    size_t len = metrics_format(text.mutableBytes, text.length, sets, count, NULL);
+
+    // Flows come and go in between; each line is one flow's at some instant
+    if (_flows.flows && len < text.length) {
+        len += pkt_flow_format((char *)text.mutableBytes + len, text.length - len, &_flows, now);
+    }
+    if (len < text.length) {
+        len += snprintf((char *)text.mutableBytes + len, text.length - len,
+                        "# TYPE netrewire_tunnel_mtu gauge\nnetrewire_tunnel_mtu %u\n",
+                        __atomic_load_n(&_tunnelMTU, __ATOMIC_RELAXED));
     }
+    text.length = len < text.length ? len : text.length - 1;
+    completionHandler(text);
 }
 
 - (void)sleepWithCompletionHandler:(void (^)(void))completionHandler {
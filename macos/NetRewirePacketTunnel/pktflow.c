@@ -0,0 +1,315 @@
+//
+//  pktflow.c
+//  NetRewirePacketTunnel
+//
+
+// BSD flag names for struct tcphdr on glibc
+#define _DEFAULT_SOURCE
+
+#include "pktflow.h"
+#include "pktparse.h"
+#include "ip6.h"
+#include "metrics.h"
+#include "stripe.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+// ::ffff:0:0/96, under which IPv4 addresses are keyed
+static const uint8_t v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+int pkt_flow_init(struct pkt_flow_table *t, size_t capacity, unsigned connections) {
+    size_t sets = 1;
+    while (sets * PKT_FLOW_WAYS < capacity) {
+        sets <<= 1;
+    }
+
+    memset(t, 0, sizeof(*t));
+    if (posix_memalign((void **)&t->flows, 64, sets * PKT_FLOW_WAYS * sizeof(*t->flows)) != 0) {
+        t->flows = NULL;
+        return -1;
+    }
+    memset(t->flows, 0, sets * PKT_FLOW_WAYS * sizeof(*t->flows));
+    t->mask = sets - 1;
+    t->connections = connections > 0 ? connections : 1;
+    return 0;
+}
+
+void pkt_flow_free(struct pkt_flow_table *t) {
+    free(t->flows);
+    t->flows = NULL;
+}
+
+void pkt_flow_clear(struct pkt_flow_table *t) {
+    for (size_t i = 0; i < pkt_flow_slots(t); i++) {
+        __atomic_store_n(&t->flows[i].state, PKT_FLOW_FREE, __ATOMIC_RELAXED);
+    }
+}
+
+static uint32_t flow_ms(uint64_t now_ns) {
+    return (uint32_t)(now_ns / 1000000);
+}
+
+static int flow_expired(const struct pkt_flow *f, uint32_t now) {
+    uint32_t idle = now - f->last_ms;
+    return idle >= (f->state == PKT_FLOW_CLOSING ? PKT_FLOW_CLOSE_MS : PKT_FLOW_IDLE_MS);
+}
+
+// Low half of an IPv4 address's key, ::ffff:a.b.c.d. Keys are stored in
+// words, as the compare loads them: a load spanning several smaller
+// stores would wait for them to reach the cache.
+static uint64_t v4_mapped_low(uint32_t addr) {
+    uint8_t b[8] = { 0, 0, 0xff, 0xff };
+    uint64_t w;
+    memcpy(b + 4, &addr, sizeof(addr));
+    memcpy(&w, b, sizeof(w));
+    return w;
+}
+
+// Key of a TCP packet, and its hash in the table
+static uint32_t flow_key(const uint8_t *buf, uint8_t kind, size_t off, struct pkt_flow_key *key) {
+    uint32_t src, dst, ports;
+
+    if (kind == PKT_TCP_IPV6) {
+        memcpy(key->src, buf + 8, 16);
+        memcpy(key->dst, buf + 24, 16);
+        src = ip6_fold(key->src);
+        dst = ip6_fold(key->dst);
+    } else {
+        memcpy(&src, buf + 12, sizeof(src));
+        memcpy(&dst, buf + 16, sizeof(dst));
+        uint64_t zero = 0, src_low = v4_mapped_low(src), dst_low = v4_mapped_low(dst);
+        memcpy(key->src, &zero, sizeof(zero));
+        memcpy(key->src + 8, &src_low, sizeof(src_low));
+        memcpy(key->dst, &zero, sizeof(zero));
+        memcpy(key->dst + 8, &dst_low, sizeof(dst_low));
+    }
+    // Both ports in one store
+    memcpy(&ports, buf + off, sizeof(ports));
+    memcpy(&key->src_port, &ports, sizeof(ports));
+
+    // The upper half of each product depends on every bit below it
+    uint64_t h = ((uint64_t)src << 32 | dst) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)((h ^ ports) * 0xC2B2AE3D27D4EB4Full >> 32);
+}
+
+// A live flow of the set with this key; one that expired is freed, so
+// that a key is never in a set twice
+static struct pkt_flow *flow_find(struct pkt_flow *set, const struct pkt_flow_key *key, uint32_t now) {
+    for (int w = 0; w < PKT_FLOW_WAYS; w++) {
+        struct pkt_flow *f = &set[w];
+        if (f->state == PKT_FLOW_FREE || memcmp(&f->key, key, sizeof(*key)) != 0) {
+            continue;
+        }
+        if (flow_expired(f, now)) {
+            __atomic_store_n(&f->state, PKT_FLOW_FREE, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        return f;
+    }
+    return NULL;
+}
+
+// Entry of the set a new flow takes: a free or expired one, or else the
+// least recently used
+static struct pkt_flow *flow_victim(struct pkt_flow_table *t, struct pkt_flow *set, uint32_t now) {
+    struct pkt_flow *oldest = set;
+    for (int w = 0; w < PKT_FLOW_WAYS; w++) {
+        struct pkt_flow *f = &set[w];
+        if (f->state == PKT_FLOW_FREE || flow_expired(f, now)) {
+            return f;
+        }
+        if (now - f->last_ms > now - oldest->last_ms) {
+            oldest = f;
+        }
+    }
+    __atomic_store_n(&t->evictions, t->evictions + 1, __ATOMIC_RELAXED);
+    return oldest;
+}
+
+// Start an entry over, for a new flow or a new connection of the same one
+static void flow_reset(struct pkt_flow *f, const struct pkt_flow_key *key, uint8_t verdict, uint8_t conn,
+                       uint32_t now) {
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    f->key = *key;
+    f->verdict = verdict;
+    f->conn = conn;
+    f->last_ms = now;
+    f->packets = 0;
+    f->bytes = 0;
+    __atomic_store_n(&f->state, PKT_FLOW_OPEN, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELEASE);
+}
+
+void pkt_flow_classify(struct pkt_flow_table *t, const struct pkt_rules *r, const uint8_t **bufs,
+                       const size_t *lens, size_t n, uint8_t *verdicts, uint8_t *conns, uint64_t now_ns) {
+    uint32_t now = flow_ms(now_ns);
+    uint64_t hits = 0, misses = 0;
+
+    if (now_ns / 1000000 >= t->next_sweep_ms) {
+        pkt_flow_sweep(t, now_ns);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        size_t off;
+        uint8_t kind = pkt_tcp_locate(bufs[i], lens[i], &off);
+        conns[i] = 0;
+        if (kind == PKT_TCP_NONE) {
+            // Only TCP is captured
+            verdicts[i] = PKT_VERDICT_PASS;
+            continue;
+        }
+
+        struct pkt_flow_key key;
+        uint32_t hash = flow_key(bufs[i], kind, off, &key);
+        uint8_t flags = bufs[i][off + 13];
+        struct pkt_flow *set = &t->flows[(hash & t->mask) * PKT_FLOW_WAYS];
+        struct pkt_flow *f = flow_find(set, &key, now);
+
+        if (f) {
+            // A SYN on a known tuple opens a new connection
+            if ((flags & (TH_SYN | TH_ACK)) == TH_SYN) {
+                flow_reset(f, &key, f->verdict, f->conn, now);
+            }
+            hits++;
+        } else {
+            uint8_t verdict;
+            uint8_t conn = (uint8_t)stripe_pick(stripe_packet_hash(bufs[i], lens[i]), t->connections);
+            pkt_rules_classify(r, bufs + i, lens + i, 1, &verdict);
+            if (flags & TH_RST) {
+                // Nothing more will follow to track
+                verdicts[i] = verdict;
+                conns[i] = conn;
+                continue;
+            }
+            f = flow_victim(t, set, now);
+            flow_reset(f, &key, verdict, conn, now);
+            misses++;
+        }
+
+        verdicts[i] = f->verdict;
+        conns[i] = f->conn;
+        __atomic_store_n(&f->packets, f->packets + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&f->bytes, f->bytes + lens[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&f->last_ms, now, __ATOMIC_RELAXED);
+        if (flags & TH_RST) {
+            __atomic_store_n(&f->state, PKT_FLOW_FREE, __ATOMIC_RELAXED);
+        } else if (flags & TH_FIN) {
+            __atomic_store_n(&f->state, PKT_FLOW_CLOSING, __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_store_n(&t->hits, t->hits + hits, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->misses, t->misses + misses, __ATOMIC_RELAXED);
+}
+
+size_t pkt_flow_sweep(struct pkt_flow_table *t, uint64_t now_ns) {
+    uint32_t now = flow_ms(now_ns);
+    size_t freed = 0;
+
+    for (size_t i = 0; i < pkt_flow_slots(t); i++) {
+        struct pkt_flow *f = &t->flows[i];
+        if (f->state != PKT_FLOW_FREE && flow_expired(f, now)) {
+            __atomic_store_n(&f->state, PKT_FLOW_FREE, __ATOMIC_RELAXED);
+            freed++;
+        }
+    }
+    t->next_sweep_ms = now_ns / 1000000 + PKT_FLOW_SWEEP_MS;
+    return freed;
+}
+
+int pkt_flow_read(const struct pkt_flow_table *t, size_t slot, struct pkt_flow *out) {
+    const struct pkt_flow *f = &t->flows[slot];
+
+    // The writer replaces a key with a handful of stores; wait those out
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        out->key = f->key;
+        out->verdict = f->verdict;
+        out->conn = f->conn;
+        out->state = __atomic_load_n(&f->state, __ATOMIC_RELAXED);
+        out->last_ms = __atomic_load_n(&f->last_ms, __ATOMIC_RELAXED);
+        out->packets = __atomic_load_n(&f->packets, __ATOMIC_RELAXED);
+        out->bytes = __atomic_load_n(&f->bytes, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&f->seq, __ATOMIC_RELAXED) == seq) {
+            out->seq = seq;
+            return out->state != PKT_FLOW_FREE;
+        }
+    }
+}
+
+// "10.8.0.33:50000" or "[fd00:8::a08:21]:50000"
+static void format_endpoint(char *out, size_t cap, const uint8_t *addr, uint16_t port) {
+    char text[INET6_ADDRSTRLEN];
+    if (memcmp(addr, v4_mapped, sizeof(v4_mapped)) == 0) {
+        inet_ntop(AF_INET, addr + 12, text, sizeof(text));
+        snprintf(out, cap, "%s:%u", text, ntohs(port));
+    } else {
+        inet_ntop(AF_INET6, addr, text, sizeof(text));
+        snprintf(out, cap, "[%s]:%u", text, ntohs(port));
+    }
+}
+
+static void put_flows(struct metrics_text *t, const struct pkt_flow *flows, size_t count, int bytes) {
+    for (size_t i = 0; i < count; i++) {
+        const struct pkt_flow *f = &flows[i];
+        char src[INET6_ADDRSTRLEN + 8], dst[INET6_ADDRSTRLEN + 8];
+        if (f->verdict != PKT_VERDICT_TUNNEL) {
+            continue;
+        }
+        format_endpoint(src, sizeof(src), f->key.src, f->key.src_port);
+        format_endpoint(dst, sizeof(dst), f->key.dst, f->key.dst_port);
+        metrics_put(t, "netrewire_flow_%s_total{src=\"%s\",dst=\"%s\",connection=\"%u\"} %llu\n", bytes ? "bytes" : "packets",
+            src, dst, f->conn, bytes ? (unsigned long long)f->bytes : (unsigned long long)f->packets);
+    }
+}
+
+size_t pkt_flow_format(char *buf, size_t cap, const struct pkt_flow_table *t, uint64_t now_ns) {
+    struct metrics_text out = { buf, cap, 0 };
+    uint32_t now = flow_ms(now_ns);
+    size_t live[2] = { 0, 0 };
+
+    // One copy of the live flows, so that the counts and lines agree
+    struct pkt_flow *flows = malloc(pkt_flow_slots(t) * sizeof(*flows));
+    size_t count = 0;
+    for (size_t i = 0; flows && i < pkt_flow_slots(t); i++) {
+        if (pkt_flow_read(t, i, &flows[count]) && !flow_expired(&flows[count], now)) {
+            live[flows[count].verdict == PKT_VERDICT_TUNNEL]++;
+            count++;
+        }
+    }
+
+    metrics_put(&out, "# HELP netrewire_flows Flows in the capture flow table\n# TYPE netrewire_flows gauge\n");
+    metrics_put(&out, "netrewire_flows{verdict=\"tunnel\"} %zu\n", live[1]);
+    metrics_put(&out, "netrewire_flows{verdict=\"pass\"} %zu\n", live[0]);
+    metrics_put(&out, "# HELP netrewire_flow_lookups_total TCP packets classified by the flow table, as hits of known flows or misses that added one\n"
+              "# TYPE netrewire_flow_lookups_total counter\n");
+    metrics_put(&out, "netrewire_flow_lookups_total{result=\"hit\"} %llu\n",
+        (unsigned long long)__atomic_load_n(&t->hits, __ATOMIC_RELAXED));
+    metrics_put(&out, "netrewire_flow_lookups_total{result=\"miss\"} %llu\n",
+        (unsigned long long)__atomic_load_n(&t->misses, __ATOMIC_RELAXED));
+    metrics_put(&out, "# HELP netrewire_flow_evictions_total Flows pushed out of a full set before expiring\n"
+              "# TYPE netrewire_flow_evictions_total counter\n");
+    metrics_put(&out, "netrewire_flow_evictions_total %llu\n",
+        (unsigned long long)__atomic_load_n(&t->evictions, __ATOMIC_RELAXED));
+    metrics_put(&out, "# HELP netrewire_flow_packets_total Packets of each captured flow\n"
+              "# TYPE netrewire_flow_packets_total counter\n");
+    put_flows(&out, flows, count, 0);
+    metrics_put(&out, "# HELP netrewire_flow_bytes_total Bytes of those packets\n"
+              "# TYPE netrewire_flow_bytes_total counter\n");
+    put_flows(&out, flows, count, 1);
+    free(flows);
+
+    if (cap > 0) {
+        buf[out.len < cap ? out.len : cap - 1] = '\0';
+    }
+    return out.len;
+}
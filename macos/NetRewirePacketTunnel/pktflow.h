@@ -0,0 +1,144 @@
+//
+//  pktflow.h
+//  NetRewirePacketTunnel
+//
+//  Flow table for the capture path. A TCP flow is classified by the rules
+//  once, on its first packet; later packets take its verdict and pool
+//  connection from one probe of a set of PKT_FLOW_WAYS entries, each on a
+//  cache line of its own, and add to its counters. An entry is forgotten
+//  after an RST, PKT_FLOW_CLOSE_MS after a FIN, or PKT_FLOW_IDLE_MS after
+//  its last packet; a full set gives up its least recently used flow. Only
+//  the packets the host sends pass through here, so a flow is tracked by
+//  what it sends.
+//
+//  The capture callback is the only writer. Other threads read flows with
+//  pkt_flow_read(): an entry's sequence number is odd while its key is
+//  being replaced, and counters are stored whole, so a copy is always of
+//  one flow as it was at some recent instant.
+//
+
+#ifndef PKTFLOW_H
+#define PKTFLOW_H
+
+#include "pktrules.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PKT_FLOW_WAYS 4
+
+// SMTP servers wait up to 10 minutes for the end of DATA (RFC 5321)
+#define PKT_FLOW_IDLE_MS (600 * 1000)
+#define PKT_FLOW_CLOSE_MS (10 * 1000)
+
+// Expired flows are swept out this often, so that the counts are current
+#define PKT_FLOW_SWEEP_MS 1000
+
+enum pkt_flow_state {
+    PKT_FLOW_FREE = 0,
+    PKT_FLOW_OPEN = 1,
+    PKT_FLOW_CLOSING = 2,       // sent a FIN
+};
+
+struct pkt_flow_key {
+    uint8_t src[16];            // IPv6, or IPv4 mapped (::ffff:a.b.c.d)
+    uint8_t dst[16];
+    uint16_t src_port;          // network byte order
+    uint16_t dst_port;
+};
+
+struct pkt_flow {
+    uint32_t seq;               // odd while the key is being replaced
+    struct pkt_flow_key key;
+    uint8_t state;              // enum pkt_flow_state
+    uint8_t verdict;            // enum pkt_verdict
+    uint8_t conn;               // connection of the pool captured packets go on
+    uint32_t last_ms;           // last packet, on the caller's clock
+    uint32_t packets;
+    uint64_t bytes;
+} __attribute__((aligned(64)));
+
+struct pkt_flow_table {
+    struct pkt_flow *flows;
+    size_t mask;                // sets - 1
+    unsigned connections;
+    uint64_t next_sweep_ms;
+    uint64_t hits;              // packets of known flows
+    uint64_t misses;            // flows added
+    uint64_t evictions;         // of those, ones that pushed out a live flow
+};
+
+/**
+ * Allocate an empty table
+ * @param t Table
+ * @param capacity Flows held at most, rounded up to a power of two of at
+ *                 least PKT_FLOW_WAYS
+ * @param connections Connections in the pool, 1 to STRIPE_MAX
+ * @return 0 on success, -1 on allocation failure
+ */
+int pkt_flow_init(struct pkt_flow_table *t, size_t capacity, unsigned connections);
+
+/**
+ * Free the table
+ */
+void pkt_flow_free(struct pkt_flow_table *t);
+
+/**
+ * Writer: forget every flow, e.g. when the rules change
+ */
+void pkt_flow_clear(struct pkt_flow_table *t);
+
+/**
+ * Writer: classify a batch of IP packets as pkt_rules_classify() does and
+ * pick the connection each captured one goes on, by stripe_packet_hash().
+ * TCP packets of a known flow take its verdict; the others are classified
+ * by the rules, and their flows added. Expired flows are swept out once
+ * PKT_FLOW_SWEEP_MS has passed since the last sweep.
+ * @param t Table
+ * @param r Matcher; clear the table when it changes
+ * @param bufs Packet pointers
+ * @param lens Packet lengths
+ * @param n Number of packets
+ * @param verdicts Output, one enum pkt_verdict per packet
+ * @param conns Output, connection below the pool size per captured packet
+ * @param now_ns Monotonic clock in nanoseconds
+ */
+void pkt_flow_classify(struct pkt_flow_table *t, const struct pkt_rules *r, const uint8_t **bufs,
+                       const size_t *lens, size_t n, uint8_t *verdicts, uint8_t *conns, uint64_t now_ns);
+
+/**
+ * Writer: forget the flows that expired by now
+ * @return Number of flows forgotten
+ */
+size_t pkt_flow_sweep(struct pkt_flow_table *t, uint64_t now_ns);
+
+/**
+ * Entries in the table, i.e. slots pkt_flow_read() takes
+ */
+static inline size_t pkt_flow_slots(const struct pkt_flow_table *t) {
+    return (t->mask + 1) * PKT_FLOW_WAYS;
+}
+
+/**
+ * Reader: copy one entry, from any thread
+ * @param t Table
+ * @param slot Entry, below pkt_flow_slots()
+ * @param out Output
+ * @return 1 if it holds a flow, 0 if it is free
+ */
+int pkt_flow_read(const struct pkt_flow_table *t, size_t slot, struct pkt_flow *out);
+
+/**
+ * Reader: render the table as Prometheus text, in the format of
+ * metrics_format(): flows by verdict, lookups and evictions, and packets
+ * and bytes of each captured flow
+ * @param buf Output
+ * @param cap Output capacity
+ * @param t Table, possibly being written
+ * @param now_ns Monotonic clock; flows expired by then are left out
+ * @return Length of the whole text, which was cut short if cap was not
+ *         more than that
+ */
+size_t pkt_flow_format(char *buf, size_t cap, const struct pkt_flow_table *t, uint64_t now_ns);
+
+#endif
@@ -0,0 +1,314 @@
+//
+//  pktflow_test.c
+//  NetRewirePacketTunnel
+//
+
+#include "pktflow.h"
+#include "pktparse.h"
+#include "stripe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_ACK 0x10
+
+#define MS 1000000ull
+
+// IPv4 TCP packet from 10.8.0.33:sport to dst:dport with payload bytes
+static size_t make_packet(uint8_t *pkt, const char *dst, uint16_t sport, uint16_t dport, uint8_t flags,
+                          size_t payload) {
+    size_t len = 40 + payload;
+    memset(pkt, 0, len);
+    pkt[0] = 0x45;
+    pkt[2] = (uint8_t)(len >> 8);
+    pkt[3] = (uint8_t)len;
+    pkt[9] = 6;
+    pkt[12] = 10, pkt[13] = 8, pkt[15] = 33;
+    assert(inet_pton(AF_INET, dst, pkt + 16) == 1);
+    pkt[20] = (uint8_t)(sport >> 8);
+    pkt[21] = (uint8_t)sport;
+    pkt[22] = (uint8_t)(dport >> 8);
+    pkt[23] = (uint8_t)dport;
+    pkt[32] = 0x50;
+    pkt[33] = flags;
+    return len;
+}
+
+// The same over IPv6, from fd00:8::a08:21
+static size_t make_packet6(uint8_t *pkt, const char *dst, uint16_t sport, uint16_t dport, uint8_t flags) {
+    memset(pkt, 0, 60);
+    pkt[0] = 0x60;
+    pkt[5] = 20;
+    pkt[6] = 6;
+    assert(inet_pton(AF_INET6, "fd00:8::a08:21", pkt + 8) == 1);
+    assert(inet_pton(AF_INET6, dst, pkt + 24) == 1);
+    pkt[40] = (uint8_t)(sport >> 8);
+    pkt[41] = (uint8_t)sport;
+    pkt[42] = (uint8_t)(dport >> 8);
+    pkt[43] = (uint8_t)dport;
+    pkt[52] = 0x50;
+    pkt[53] = flags;
+    return 60;
+}
+
+// Classify one packet at now_ms
+static uint8_t classify(struct pkt_flow_table *t, const struct pkt_rules *r, const uint8_t *pkt, size_t len,
+                        uint64_t now_ms, uint8_t *conn) {
+    uint8_t verdict, c;
+    pkt_flow_classify(t, r, &pkt, &len, 1, &verdict, conn ? conn : &c, now_ms * MS);
+    return verdict;
+}
+
+// Live flows in the table
+static size_t live_flows(const struct pkt_flow_table *t) {
+    struct pkt_flow f;
+    size_t n = 0;
+    for (size_t i = 0; i < pkt_flow_slots(t); i++) {
+        n += pkt_flow_read(t, i, &f);
+    }
+    return n;
+}
+
+// The flow of a packet sent from sport
+static int find_flow(const struct pkt_flow_table *t, uint16_t sport, struct pkt_flow *out) {
+    for (size_t i = 0; i < pkt_flow_slots(t); i++) {
+        if (pkt_flow_read(t, i, out) && out->key.src_port == htons(sport)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void test_same_verdicts() {
+    enum { N = 64 };
+    static uint8_t pkts[N][256];
+    const uint8_t *bufs[N];
+    size_t lens[N];
+    uint8_t verdicts[N], expected[N], conns[N];
+    struct pkt_flow_table t;
+
+    struct pkt_rules *r = pkt_rules_compile_string("25 587 !10.0.0.0/8", NULL);
+    assert(pkt_flow_init(&t, 256, 3) == 0);
+    for (int i = 0; i < N; i++) {
+        uint16_t sport = (uint16_t)(40000 + i % 16);
+        switch (i % 8) {
+        case 0: lens[i] = make_packet(pkts[i], "192.0.2.25", sport, 25, TCP_ACK, 100); break;
+        case 1: lens[i] = make_packet(pkts[i], "192.0.2.25", sport, 587, TCP_SYN, 0); break;
+        case 2: lens[i] = make_packet(pkts[i], "10.8.8.8", sport, 25, TCP_ACK, 0); break;
+        case 3: lens[i] = make_packet(pkts[i], "192.0.2.80", sport, 80, TCP_ACK, 10); break;
+        case 4: lens[i] = make_packet6(pkts[i], "2001:db8::19", sport, 25, TCP_ACK); break;
+        case 5:
+            // Later fragment: no TCP header, whatever its bytes say
+            lens[i] = make_packet(pkts[i], "192.0.2.25", sport, 25, TCP_ACK, 100);
+            pkts[i][6] = 0x01;
+            break;
+        case 6:
+            lens[i] = make_packet(pkts[i], "192.0.2.25", sport, 25, TCP_ACK, 0);
+            pkts[i][9] = 17;
+            break;
+        default: lens[i] = make_packet(pkts[i], "192.0.2.25", sport, 25, TCP_ACK, 0) - 1; break;
+        }
+        bufs[i] = pkts[i];
+    }
+    pkt_rules_classify(r, bufs, lens, N, expected);
+
+    // Again and again: the first pass adds flows, the later ones hit them
+    for (int pass = 0; pass < 3; pass++) {
+        pkt_flow_classify(&t, r, bufs, lens, N, verdicts, conns, (uint64_t)pass * MS);
+        for (int i = 0; i < N; i++) {
+            assert(verdicts[i] == expected[i]);
+            if (verdicts[i] == PKT_VERDICT_TUNNEL) {
+                assert(conns[i] == stripe_pick(stripe_packet_hash(bufs[i], lens[i]), 3));
+            }
+        }
+    }
+
+    // Five kinds of TCP packet from two source ports each; a flow's later
+    // packets hit in the first pass already
+    assert(live_flows(&t) == 5 * 2);
+    assert(t.misses == 10 && t.hits == 5 * 8 * 3 - 10);
+    assert(t.evictions == 0);
+
+    pkt_flow_free(&t);
+    pkt_rules_free(r);
+    printf("✓ Same verdicts test passed\n");
+}
+
+void test_counters() {
+    uint8_t pkt[1500];
+    struct pkt_flow_table t;
+    struct pkt_flow f;
+    struct pkt_rules *r = pkt_rules_compile_string("25", NULL);
+    assert(pkt_flow_init(&t, 64, 1) == 0);
+
+    size_t len = make_packet(pkt, "192.0.2.25", 50000, 25, TCP_SYN, 0);
+    assert(classify(&t, r, pkt, len, 0, NULL) == PKT_VERDICT_TUNNEL);
+    for (int i = 0; i < 9; i++) {
+        len = make_packet(pkt, "192.0.2.25", 50000, 25, TCP_ACK, 1000);
+        classify(&t, r, pkt, len, 1, NULL);
+    }
+    assert(find_flow(&t, 50000, &f));
+    assert(f.state == PKT_FLOW_OPEN && f.verdict == PKT_VERDICT_TUNNEL && f.conn == 0);
+    assert(f.packets == 10 && f.bytes == 40 + 9 * 1040 && f.last_ms == 1);
+    assert(memcmp(f.key.dst + 10, "\xff\xff\xc0\x00\x02\x19", 6) == 0);
+
+    // A new connection on the same ports starts over
+    len = make_packet(pkt, "192.0.2.25", 50000, 25, TCP_SYN, 0);
+    classify(&t, r, pkt, len, 2, NULL);
+    assert(find_flow(&t, 50000, &f) && f.packets == 1 && f.bytes == 40);
+
+    // Passed flows count too
+    len = make_packet(pkt, "192.0.2.80", 50001, 80, TCP_ACK, 0);
+    assert(classify(&t, r, pkt, len, 2, NULL) == PKT_VERDICT_PASS);
+    assert(find_flow(&t, 50001, &f) && f.verdict == PKT_VERDICT_PASS && f.packets == 1);
+
+    pkt_flow_free(&t);
+    pkt_rules_free(r);
+    printf("✓ Counter test passed\n");
+}
+
+void test_close_and_expiry() {
+    uint8_t pkt[256];
+    struct pkt_flow_table t;
+    struct pkt_flow f;
+    struct pkt_rules *r = pkt_rules_compile_string("25", NULL);
+    assert(pkt_flow_init(&t, 64, 1) == 0);
+
+    // RST forgets the flow at once; one that starts with an RST is not added
+    size_t len = make_packet(pkt, "192.0.2.25", 1000, 25, TCP_ACK, 0);
+    classify(&t, r, pkt, len, 0, NULL);
+    len = make_packet(pkt, "192.0.2.25", 1000, 25, TCP_RST | TCP_ACK, 0);
+    assert(classify(&t, r, pkt, len, 0, NULL) == PKT_VERDICT_TUNNEL);
+    assert(live_flows(&t) == 0);
+    assert(classify(&t, r, pkt, len, 0, NULL) == PKT_VERDICT_TUNNEL);
+    assert(live_flows(&t) == 0 && t.misses == 1);
+
+    // FIN leaves PKT_FLOW_CLOSE_MS for the last ACKs
+    len = make_packet(pkt, "192.0.2.25", 1001, 25, TCP_FIN | TCP_ACK, 0);
+    classify(&t, r, pkt, len, 0, NULL);
+    assert(find_flow(&t, 1001, &f) && f.state == PKT_FLOW_CLOSING);
+    len = make_packet(pkt, "192.0.2.25", 1001, 25, TCP_ACK, 0);
+    classify(&t, r, pkt, len, PKT_FLOW_CLOSE_MS - 1, NULL);
+    assert(find_flow(&t, 1001, &f) && f.state == PKT_FLOW_CLOSING && f.packets == 2);
+    assert(pkt_flow_sweep(&t, (2 * PKT_FLOW_CLOSE_MS - 2) * MS) == 0);
+    assert(pkt_flow_sweep(&t, (2 * PKT_FLOW_CLOSE_MS - 1) * MS) == 1);
+    assert(live_flows(&t) == 0);
+
+    // Open flows last PKT_FLOW_IDLE_MS after their last packet
+    uint64_t start = 5 * PKT_FLOW_CLOSE_MS;
+    len = make_packet(pkt, "192.0.2.25", 1002, 25, TCP_ACK, 0);
+    classify(&t, r, pkt, len, start, NULL);
+    assert(pkt_flow_sweep(&t, (start + PKT_FLOW_IDLE_MS - 1) * MS) == 0);
+    assert(live_flows(&t) == 1);
+
+    // A packet past that is a new flow, and the sweep it runs clears the rest
+    len = make_packet(pkt, "192.0.2.25", 1003, 25, TCP_ACK, 0);
+    classify(&t, r, pkt, len, start + 1, NULL);
+    len = make_packet(pkt, "192.0.2.25", 1002, 25, TCP_ACK, 0);
+    classify(&t, r, pkt, len, start + PKT_FLOW_IDLE_MS + 1, NULL);
+    assert(find_flow(&t, 1002, &f) && f.packets == 1);
+    assert(t.misses == 5 && live_flows(&t) == 2);
+    len = make_packet(pkt, "192.0.2.25", 1002, 25, TCP_ACK, 0);
+    classify(&t, r, pkt, len, start + PKT_FLOW_IDLE_MS + 1 + PKT_FLOW_SWEEP_MS, NULL);
+    assert(live_flows(&t) == 1 && !find_flow(&t, 1003, &f));
+
+    // Clearing forgets everything
+    pkt_flow_clear(&t);
+    assert(live_flows(&t) == 0);
+
+    pkt_flow_free(&t);
+    pkt_rules_free(r);
+    printf("✓ Close and expiry test passed\n");
+}
+
+void test_eviction() {
+    uint8_t pkt[256];
+    struct pkt_flow_table t;
+    struct pkt_flow f;
+    struct pkt_rules *r = pkt_rules_compile_string("25", NULL);
+
+    // A single set: the fifth flow pushes out the least recently used
+    assert(pkt_flow_init(&t, 1, 1) == 0);
+    assert(pkt_flow_slots(&t) == PKT_FLOW_WAYS);
+    for (uint16_t p = 0; p < PKT_FLOW_WAYS; p++) {
+        size_t len = make_packet(pkt, "192.0.2.25", (uint16_t)(2000 + p), 25, TCP_ACK, 0);
+        classify(&t, r, pkt, len, 10 + p, NULL);
+    }
+    size_t len = make_packet(pkt, "192.0.2.25", 2000, 25, TCP_ACK, 0);
+    classify(&t, r, pkt, len, 20, NULL);
+    len = make_packet(pkt, "192.0.2.25", 3000, 25, TCP_ACK, 0);
+    classify(&t, r, pkt, len, 21, NULL);
+
+    assert(t.evictions == 1 && live_flows(&t) == PKT_FLOW_WAYS);
+    assert(find_flow(&t, 2000, &f) && find_flow(&t, 3000, &f));
+    assert(!find_flow(&t, 2001, &f));
+
+    pkt_flow_free(&t);
+    pkt_rules_free(r);
+    printf("✓ Eviction test passed\n");
+}
+
+void test_format() {
+    uint8_t pkt[256];
+    struct pkt_flow_table t;
+    struct pkt_rules *r = pkt_rules_compile_string("25", NULL);
+    assert(pkt_flow_init(&t, 64, 2) == 0);
+
+    uint8_t conn, conn6;
+    size_t len = make_packet(pkt, "192.0.2.25", 50000, 25, TCP_ACK, 60);
+    classify(&t, r, pkt, len, 0, NULL);
+    classify(&t, r, pkt, len, 0, &conn);
+    len = make_packet6(pkt, "2001:db8::19", 50001, 25, TCP_ACK);
+    classify(&t, r, pkt, len, 0, &conn6);
+    len = make_packet(pkt, "192.0.2.80", 50002, 80, TCP_ACK, 0);
+    classify(&t, r, pkt, len, 0, NULL);
+
+    char line[256];
+    size_t n = pkt_flow_format(NULL, 0, &t, 0);
+    char *text = malloc(n + 1);
+    assert(pkt_flow_format(text, n + 1, &t, 0) == n && strlen(text) == n);
+    assert(strstr(text, "# TYPE netrewire_flows gauge\n"));
+    assert(strstr(text, "netrewire_flows{verdict=\"tunnel\"} 2\n"));
+    assert(strstr(text, "netrewire_flows{verdict=\"pass\"} 1\n"));
+    assert(strstr(text, "netrewire_flow_lookups_total{result=\"hit\"} 1\n"));
+    assert(strstr(text, "netrewire_flow_lookups_total{result=\"miss\"} 3\n"));
+    snprintf(line, sizeof(line), "netrewire_flow_packets_total{src=\"10.8.0.33:50000\",dst=\"192.0.2.25:25\",connection=\"%u\"} 2\n", conn);
+    assert(strstr(text, line));
+    snprintf(line, sizeof(line), "netrewire_flow_bytes_total{src=\"10.8.0.33:50000\",dst=\"192.0.2.25:25\",connection=\"%u\"} 200\n", conn);
+    assert(strstr(text, line));
+    snprintf(line, sizeof(line), "netrewire_flow_packets_total{src=\"[fd00:8::a08:21]:50001\",dst=\"[2001:db8::19]:25\",connection=\"%u\"} 1\n", conn6);
+    assert(strstr(text, line));
+    assert(!strstr(text, "192.0.2.80"));
+
+    // Cut short, still terminated
+    assert(pkt_flow_format(line, 16, &t, 0) == n && strlen(line) == 15);
+
+    // Expired flows are left out before a sweep gets to them
+    free(text);
+    text = malloc(n + 1);
+    pkt_flow_format(text, n + 1, &t, (uint64_t)PKT_FLOW_IDLE_MS * MS);
+    assert(strstr(text, "netrewire_flows{verdict=\"tunnel\"} 0\n"));
+    free(text);
+
+    pkt_flow_free(&t);
+    pkt_rules_free(r);
+    printf("✓ Format test passed\n");
+}
+
+int main() {
+    printf("Running pktflow unit tests...\n");
+
+    test_same_verdicts();
+    test_counters();
+    test_close_and_expiry();
+    test_eviction();
+    test_format();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -5,11 +5,71 @@
 //  Created by Claude Code
 //
 
+// BSD field names for struct ip / struct tcphdr on glibc
+#define _DEFAULT_SOURCE
+
 #include "pktparse.h"
+#include "ip6.h"
 #include <string.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PKT_SIMD_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PKT_SIMD_SSE2 1
+#endif
+
+// Packets classified per vector step
+#define PKT_BATCH_LANES 16
+
+// IPv4 without options followed by a complete TCP header
+#define PKT_MIN_TCP_LEN 40
+
+// IPv6 packet: addresses, then whatever follows the extension headers
+static int pkt_parse_ipv6(const uint8_t *buf, size_t len, struct pkt_info *info) {
+    if (len < IP6_HEADER_LEN) {
+        return 0;
+    }
+
+    size_t total = IP6_HEADER_LEN + (size_t)(buf[4] << 8 | buf[5]);
+    if (total > len) {
+        total = len;
+    }
+    info->is_ipv6 = 1;
+    info->ip6_src = buf + 8;
+    info->ip6_dst = buf + 24;
+    info->ip_src = ip6_fold(info->ip6_src);
+    info->ip_dst = ip6_fold(info->ip6_dst);
+
+    uint8_t proto;
+    size_t off;
+    if (!ip6_upper_layer(buf, len, &proto, &off)) {
+        // Valid IPv6 packet, but no upper layer to look at
+        info->ip_header_len = IP6_HEADER_LEN;
+        info->payload_len = (int)(total - IP6_HEADER_LEN);
+        return 1;
+    }
+    info->ip_header_len = (int)off;
+    info->payload_len = total > off ? (int)(total - off) : 0;
+
+    if (proto != IPPROTO_TCP || len - off < sizeof(struct tcphdr)) {
+        return 1;
+    }
+    const struct tcphdr *tcph = (const struct tcphdr *)(buf + off);
+    info->is_tcp = 1;
+    info->tcp_header_len = tcph->th_off * 4;
+    info->tcp_src = tcph->th_sport;
+    info->tcp_dst = tcph->th_dport;
+    info->tcp_flags = tcph->th_flags;
+    if (info->tcp_header_len <= info->payload_len) {
+        info->payload_len -= info->tcp_header_len;
+    }
+    return 1;
+}
+
 int pkt_parse(const uint8_t *buf, size_t len, struct pkt_info *info) {
     memset(info, 0, sizeof(*info));
 
@@ -21,6 +81,9 @@ int pkt_parse(const uint8_t *buf, size_t len, struct pkt_info *info) {
     struct ip *iph = (struct ip *)buf;
 
     // Check IP version
+    if (iph->ip_v == 6) {
+        return pkt_parse_ipv6(buf, len, info);
+    }
     if ((iph->ip_v) != 4) {
         return 0;
     }
@@ -31,11 +94,17 @@ int pkt_parse(const uint8_t *buf, size_t len, struct pkt_info *info) {
         return 0;
     }
 
-    // Fill IP information
+    // Fill IP information; the payload ends where the header says, or
+    // where the buffer does if that is sooner
+    size_t total = ntohs(iph->ip_len);
+    if (total < (size_t)ihl || total > len) {
+        total = len;
+    }
     info->is_ipv4 = 1;
     info->ip_header_len = ihl;
     info->ip_src = iph->ip_src.s_addr;
     info->ip_dst = iph->ip_dst.s_addr;
+    info->payload_len = (int)(total - ihl);
 
     // Check if TCP
     if (iph->ip_p != IPPROTO_TCP) {
@@ -53,6 +122,147 @@ int pkt_parse(const uint8_t *buf, size_t len, struct pkt_info *info) {
     info->tcp_header_len = tcph->th_off * 4;
     info->tcp_src = tcph->th_sport;
     info->tcp_dst = tcph->th_dport;
+    info->tcp_flags = tcph->th_flags;
+    if (info->tcp_header_len <= info->payload_len) {
+        info->payload_len -= info->tcp_header_len;
+    }
 
     return 1;
-}
\ No newline at end of file
+}
+
+int pkt_is_urgent(const struct pkt_info *info) {
+    if (!info->is_ipv4 && !info->is_ipv6) {
+        return 0;
+    }
+    if (info->is_tcp && (info->tcp_flags & (TH_SYN | TH_FIN | TH_RST))) {
+        return 1;
+    }
+    return info->payload_len <= PKT_URGENT_PAYLOAD;
+}
+
+// TCP header of an IPv4 packet, whose IP header may carry options
+static uint8_t pkt_tcp_ipv4(const uint8_t *buf, size_t len, size_t *offset) {
+    if (len < 20 || (buf[0] >> 4) != 4 || buf[9] != IPPROTO_TCP) {
+        return PKT_TCP_NONE;
+    }
+    if ((buf[6] & 0x1f) != 0 || buf[7] != 0) {
+        return PKT_TCP_NONE;
+    }
+    size_t ihl = (size_t)(buf[0] & 0x0f) * 4;
+    if (ihl < 20 || len < ihl + sizeof(struct tcphdr)) {
+        return PKT_TCP_NONE;
+    }
+    *offset = ihl;
+    return PKT_TCP_IPV4;
+}
+
+// TCP header of an IPv6 packet, through its extension headers
+static uint8_t pkt_tcp_ipv6(const uint8_t *buf, size_t len, size_t *offset) {
+    uint8_t proto = buf[6];
+    size_t off = IP6_HEADER_LEN;
+
+    // Most packets have no extension headers to walk
+    if (proto != IPPROTO_TCP && !ip6_upper_layer(buf, len, &proto, &off)) {
+        return PKT_TCP_NONE;
+    }
+    if (proto != IPPROTO_TCP || len - off < sizeof(struct tcphdr)) {
+        return PKT_TCP_NONE;
+    }
+    *offset = off;
+    return PKT_TCP_IPV6;
+}
+
+static uint16_t pkt_dst_port(const uint8_t *buf, size_t offset) {
+    return (uint16_t)((buf[offset + 2] << 8) | buf[offset + 3]);
+}
+
+uint8_t pkt_tcp_locate(const uint8_t *buf, size_t len, size_t *offset) {
+    if (len < PKT_MIN_TCP_LEN) {
+        return PKT_TCP_NONE;
+    }
+    if ((buf[0] >> 4) == 6) {
+        return pkt_tcp_ipv6(buf, len, offset);
+    }
+    return pkt_tcp_ipv4(buf, len, offset);
+}
+
+size_t pkt_parse_tcp_batch(const uint8_t **bufs, const size_t *lens, size_t n,
+                           uint8_t *tcp, uint16_t *dst_ports, uint32_t *dst_addrs) {
+    size_t ipv6 = 0;
+
+    for (size_t base = 0; base < n; base += PKT_BATCH_LANES) {
+        size_t lanes = n - base < PKT_BATCH_LANES ? n - base : PKT_BATCH_LANES;
+
+        // Gather the bytes that decide the class, assuming a 20-byte IP
+        // header; lanes too short to hold IP and TCP headers are left zero
+        // and fail the version compare
+        uint8_t vhl[PKT_BATCH_LANES] = { 0 };
+        uint8_t proto[PKT_BATCH_LANES] = { 0 };
+        uint8_t frag[PKT_BATCH_LANES] = { 0 };
+        uint8_t out[PKT_BATCH_LANES];
+
+        for (size_t i = 0; i < lanes; i++) {
+            const uint8_t *p = bufs[base + i];
+            dst_ports[base + i] = 0;
+            dst_addrs[base + i] = 0;
+            if (lens[base + i] < PKT_MIN_TCP_LEN) {
+                continue;
+            }
+            vhl[i] = p[0];
+            proto[i] = p[9];
+            frag[i] = (uint8_t)((p[6] & 0x1f) | p[7]);
+            memcpy(&dst_addrs[base + i], p + 16, sizeof(uint32_t));
+            dst_ports[base + i] = (uint16_t)((p[22] << 8) | p[23]);
+        }
+
+#if defined(PKT_SIMD_NEON)
+        uint8x16_t m = vceqq_u8(vld1q_u8(vhl), vdupq_n_u8(0x45));
+        m = vandq_u8(m, vceqq_u8(vld1q_u8(proto), vdupq_n_u8(IPPROTO_TCP)));
+        m = vandq_u8(m, vceqq_u8(vld1q_u8(frag), vdupq_n_u8(0)));
+        vst1q_u8(out, vandq_u8(m, vdupq_n_u8(1)));
+#elif defined(PKT_SIMD_SSE2)
+        __m128i m = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)vhl), _mm_set1_epi8(0x45));
+        m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)proto), _mm_set1_epi8(IPPROTO_TCP)));
+        m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)frag), _mm_setzero_si128()));
+        _mm_storeu_si128((__m128i *)out, _mm_and_si128(m, _mm_set1_epi8(1)));
+#else
+        for (size_t i = 0; i < PKT_BATCH_LANES; i++) {
+            out[i] = vhl[i] == 0x45 && proto[i] == IPPROTO_TCP && frag[i] == 0;
+        }
+#endif
+
+        for (size_t i = 0; i < lanes; i++) {
+            // IPv4 with options: the TCP header is further in
+            size_t off;
+            if ((vhl[i] >> 4) == 4 && vhl[i] != 0x45) {
+                out[i] = pkt_tcp_ipv4(bufs[base + i], lens[base + i], &off);
+                if (out[i]) {
+                    dst_ports[base + i] = pkt_dst_port(bufs[base + i], off);
+                }
+            } else if ((vhl[i] >> 4) == 6) {
+                // IPv6: the gathered bytes meant nothing
+                dst_addrs[base + i] = 0;
+                out[i] = pkt_tcp_ipv6(bufs[base + i], lens[base + i], &off);
+                if (out[i]) {
+                    dst_ports[base + i] = pkt_dst_port(bufs[base + i], off);
+                    ipv6++;
+                }
+            }
+            tcp[base + i] = out[i];
+        }
+    }
+    return ipv6;
+}
+
+void pkt_parse_batch(const uint8_t **bufs, const size_t *lens, size_t n, uint8_t *verdicts) {
+    uint16_t ports[PKT_BATCH_LANES];
+    uint32_t addrs[PKT_BATCH_LANES];
+
+    for (size_t base = 0; base < n; base += PKT_BATCH_LANES) {
+        size_t lanes = n - base < PKT_BATCH_LANES ? n - base : PKT_BATCH_LANES;
+        pkt_parse_tcp_batch(bufs + base, lens + base, lanes, verdicts + base, ports, addrs);
+        for (size_t i = 0; i < lanes; i++) {
+            verdicts[base + i] = verdicts[base + i] != PKT_TCP_NONE && ports[i] == PKT_CAPTURE_PORT;
+        }
+    }
+}
@@ -13,17 +13,23 @@
 
 struct pkt_info {
     int is_ipv4;
+    int is_ipv6;
     int is_tcp;
-    uint32_t ip_src;
+    uint32_t ip_src;            // IPv4 address; IPv6 ones folded by ip6_fold()
     uint32_t ip_dst;
+    const uint8_t *ip6_src;     // IPv6 addresses, in the packet
+    const uint8_t *ip6_dst;
     uint16_t tcp_src;
     uint16_t tcp_dst;
-    int ip_header_len;
+    int ip_header_len;          // with any IPv6 extension headers
     int tcp_header_len;
+    uint8_t tcp_flags;          // TH_SYN, TH_ACK, ... of a TCP packet
+    int payload_len;            // bytes after the IP header, and the TCP header if any
 };
 
 /**
- * Parse IP packet and extract key information
+ * Parse an IPv4 or IPv6 packet and extract key information; IPv6 extension
+ * headers are skipped up to IP6_MAX_EXT_HEADERS
  * @param buf Raw packet bytes
  * @param len Packet length
  * @param info Output structure with parsed information
@@ -31,4 +37,71 @@ struct pkt_info {
  */
 int pkt_parse(const uint8_t *buf, size_t len, struct pkt_info *info);
 
-#endif
\ No newline at end of file
+// Payload up to which a packet is interactive: pure ACKs, SMTP commands and
+// the short lines of a dialog, rather than a message being transferred
+#define PKT_URGENT_PAYLOAD 256
+
+/**
+ * Whether a parsed packet is latency-sensitive: a TCP SYN, FIN or RST, or a
+ * packet with at most PKT_URGENT_PAYLOAD bytes of payload
+ * @param info Output of pkt_parse
+ * @return 1 if urgent, 0 for bulk
+ */
+int pkt_is_urgent(const struct pkt_info *info);
+
+// Destination port captured when no rules are compiled (SMTP); see pktrules.h
+#define PKT_CAPTURE_PORT 25
+
+// Per-packet result of pkt_parse_tcp_batch
+enum pkt_tcp_kind {
+    PKT_TCP_NONE = 0,           // not TCP, or no complete TCP header
+    PKT_TCP_IPV4 = 1,
+    PKT_TCP_IPV6 = 2,
+};
+
+// Per-packet result of pkt_parse_batch
+enum pkt_verdict {
+    PKT_VERDICT_PASS = 0,       // not ours; hand back to the host stack
+    PKT_VERDICT_TUNNEL = 1,     // captured; send through the tunnel
+};
+
+/**
+ * Find the TCP header of one packet, by the same tests as
+ * pkt_parse_tcp_batch(): the packet is TCP with a complete header and, for
+ * IPv4, not a later fragment
+ * @param buf Raw packet bytes
+ * @param len Packet length
+ * @param offset Output, where the TCP header starts, unless PKT_TCP_NONE
+ * @return enum pkt_tcp_kind
+ */
+uint8_t pkt_tcp_locate(const uint8_t *buf, size_t len, size_t *offset);
+
+/**
+ * Find the TCP packets in a batch and their destinations, without filling
+ * a pkt_info per packet. Header fields are gathered for 16 packets at a
+ * time and compared with NEON or SSE2 where available; IPv4 packets with
+ * options and IPv6 packets take a scalar path. Non-first fragments are not
+ * TCP here, since they carry no TCP header.
+ * @param bufs Packet pointers
+ * @param lens Packet lengths
+ * @param n Number of packets
+ * @param tcp Output, one enum pkt_tcp_kind per packet
+ * @param dst_ports Output, destination port in host byte order (TCP packets)
+ * @param dst_addrs Output, destination address in network byte order (IPv4
+ *                  TCP packets; 0 for IPv6)
+ * @return Number of IPv6 TCP packets
+ */
+size_t pkt_parse_tcp_batch(const uint8_t **bufs, const size_t *lens, size_t n,
+                           uint8_t *tcp, uint16_t *dst_ports, uint32_t *dst_addrs);
+
+/**
+ * Classify a batch of IP packets in one pass: TCP to PKT_CAPTURE_PORT is
+ * sent through the tunnel
+ * @param bufs Packet pointers
+ * @param lens Packet lengths
+ * @param n Number of packets
+ * @param verdicts Output, one enum pkt_verdict per packet
+ */
+void pkt_parse_batch(const uint8_t **bufs, const size_t *lens, size_t n, uint8_t *verdicts);
+
+#endif
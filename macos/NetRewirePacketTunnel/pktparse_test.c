@@ -63,12 +63,161 @@ void test_non_tcp_packet() {
     printf("✓ Non-TCP packet test passed\n");
 }
 
+// IPv6 TCP packet to port 25 behind ext_count extension headers of type
+// ext, each 8 bytes; returns its length
+static size_t make_ipv6(uint8_t *pkt, uint8_t ext, int ext_count, size_t payload) {
+    size_t off = 40 + (size_t)ext_count * 8;
+    size_t len = off + 20 + payload;
+
+    memset(pkt, 0, len);
+    pkt[0] = 0x60;
+    pkt[4] = (uint8_t)((len - 40) >> 8);
+    pkt[5] = (uint8_t)(len - 40);
+    pkt[6] = ext_count ? ext : 6;
+    pkt[7] = 64;
+    pkt[8] = 0xfd, pkt[11] = 0x08, pkt[20] = 10, pkt[21] = 8, pkt[23] = 33;   // fd00:8::a08:21
+    pkt[24] = 0x20, pkt[25] = 0x01, pkt[26] = 0x0d, pkt[27] = 0xb8, pkt[39] = 25;   // 2001:db8::19
+    for (int i = 0; i < ext_count; i++) {
+        pkt[40 + i * 8] = i + 1 < ext_count ? ext : 6;
+    }
+    pkt[off] = 0x04, pkt[off + 1] = 0xd2;
+    pkt[off + 3] = 25;
+    pkt[off + 12] = 0x50;
+    pkt[off + 13] = 0x02;
+    return len;
+}
+
+void test_ipv6_packet() {
+    uint8_t pkt[512];
+    struct pkt_info info;
+    size_t len;
+
+    len = make_ipv6(pkt, 0, 0, 0);
+    assert(pkt_parse(pkt, len, &info) == 1);
+    assert(info.is_ipv6 && !info.is_ipv4 && info.is_tcp);
+    assert(info.ip_header_len == 40 && info.tcp_header_len == 20);
+    assert(info.tcp_src == htons(1234) && info.tcp_dst == htons(25));
+    assert(info.ip6_dst == pkt + 24 && info.ip6_dst[15] == 25);
+    assert(info.tcp_flags == 0x02 && pkt_is_urgent(&info));
+
+    // Hop-by-hop options, then a first fragment
+    len = make_ipv6(pkt, 0, 1, 300);
+    pkt[40] = 44;
+    memmove(pkt + 56, pkt + 48, len - 48);
+    memset(pkt + 48, 0, 8);
+    pkt[48] = 6;
+    pkt[51] = 0x01;             // more fragments, offset 0
+    pkt[69] = 0x10;             // ACK, not SYN
+    len += 8;
+    pkt[5] += 8;
+    assert(pkt_parse(pkt, len, &info) == 1 && info.is_tcp);
+    assert(info.ip_header_len == 56 && info.payload_len == 300);
+    assert(ntohs(info.tcp_dst) == 25 && !pkt_is_urgent(&info));
+
+    // A later fragment has no TCP header
+    pkt[50] = 0x05, pkt[51] = 0x28;
+    assert(pkt_parse(pkt, len, &info) == 1 && info.is_ipv6 && !info.is_tcp);
+
+    // Destination options up to the limit, and one more
+    len = make_ipv6(pkt, 60, 8, 0);
+    assert(pkt_parse(pkt, len, &info) == 1 && info.is_tcp && info.ip_header_len == 104);
+    len = make_ipv6(pkt, 60, 9, 0);
+    assert(pkt_parse(pkt, len, &info) == 1 && !info.is_tcp);
+
+    // A header claiming more than the packet holds
+    len = make_ipv6(pkt, 43, 1, 0);
+    pkt[41] = 200;
+    assert(pkt_parse(pkt, len, &info) == 1 && !info.is_tcp);
+
+    // Truncated fixed header
+    assert(pkt_parse(pkt, 39, &info) == 0);
+
+    printf("✓ IPv6 packet test passed\n");
+}
+
+// Reference verdict built on pkt_parse
+static uint8_t expected_verdict(const uint8_t *buf, size_t len) {
+    struct pkt_info info;
+    if (!pkt_parse(buf, len, &info) || !info.is_tcp || info.ip_header_len < 20) {
+        return PKT_VERDICT_PASS;
+    }
+    if (info.is_ipv4 && ((buf[6] & 0x1f) != 0 || buf[7] != 0)) {
+        return PKT_VERDICT_PASS;
+    }
+    return ntohs(info.tcp_dst) == PKT_CAPTURE_PORT ? PKT_VERDICT_TUNNEL : PKT_VERDICT_PASS;
+}
+
+void test_batch_verdicts() {
+    enum { N = 37 };    // not a multiple of the vector width
+    static uint8_t pkts[N][96];
+    const uint8_t *bufs[N];
+    size_t lens[N];
+    uint8_t verdicts[N];
+
+    for (int i = 0; i < N; i++) {
+        memset(pkts[i], 0, sizeof(pkts[i]));
+        memcpy(pkts[i], test_packet, sizeof(test_packet));
+        bufs[i] = pkts[i];
+        lens[i] = sizeof(test_packet);
+
+        switch (i % 10) {
+        case 0:     // SMTP, matches
+            break;
+        case 1:     // other port
+            pkts[i][23] = 80;
+            break;
+        case 2:     // UDP
+            pkts[i][9] = 0x11;
+            break;
+        case 3:     // truncated TCP header
+            lens[i] = 30;
+            break;
+        case 4:     // non-first fragment
+            pkts[i][7] = 0x10;
+            break;
+        case 5:     // IPv6 version nibble
+            pkts[i][0] = 0x60;
+            break;
+        case 6:     // 4 bytes of IP options, TCP header moved back
+            pkts[i][0] = 0x46;
+            memmove(pkts[i] + 24, test_packet + 20, 20);
+            lens[i] = 44;
+            break;
+        case 7:     // options and a port high byte that only matches without them
+            pkts[i][0] = 0x46;
+            memmove(pkts[i] + 24, test_packet + 20, 20);
+            pkts[i][27] = 26;
+            lens[i] = 44;
+            break;
+        case 8:     // IPv6 behind a routing header, matches
+            lens[i] = make_ipv6(pkts[i], 43, 1, 0);
+            break;
+        case 9:     // IPv6, other port
+            lens[i] = make_ipv6(pkts[i], 0, 0, 0);
+            pkts[i][43] = 80;
+            break;
+        }
+    }
+
+    pkt_parse_batch(bufs, lens, N, verdicts);
+    for (int i = 0; i < N; i++) {
+        assert(verdicts[i] == expected_verdict(bufs[i], lens[i]));
+    }
+    assert(verdicts[0] == PKT_VERDICT_TUNNEL && verdicts[6] == PKT_VERDICT_TUNNEL);
+    assert(verdicts[1] == PKT_VERDICT_PASS && verdicts[7] == PKT_VERDICT_PASS);
+    assert(verdicts[8] == PKT_VERDICT_TUNNEL && verdicts[9] == PKT_VERDICT_PASS);
+
+    printf("✓ Batch verdict test passed\n");
+}
+
 int main() {
     printf("Running pktparse unit tests...\n");
 
     test_valid_tcp_packet();
     test_short_packet();
     test_non_tcp_packet();
+    test_ipv6_packet();
+    test_batch_verdicts();
 
     printf("All tests passed! ✅\n");
     return 0;
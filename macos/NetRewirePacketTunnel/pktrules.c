@@ -0,0 +1,321 @@
+//
+//  pktrules.c
+//  NetRewirePacketTunnel
+//
+
+#include "pktrules.h"
+#include "pktparse.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define TRIE_FANOUT 256
+#define TRIE_CHILD 0x80000000u      // entry is a child node index, not a verdict
+
+// Packets classified per call to the header pass
+#define RULES_BATCH 64
+
+struct pkt_rules {
+    uint8_t ports[65536 / 8];
+    uint32_t *nodes;                // TRIE_FANOUT entries per node, root first
+    size_t nnodes;
+    size_t cap;
+    struct pkt_rule *prefixes;      // source prefix rules, shortest first
+    size_t nprefixes;
+    uint8_t ipv6;                   // IPv6 destinations allowed: no include prefixes
+};
+
+static int trie_node_new(struct pkt_rules *r, uint32_t fill, uint32_t *index) {
+    if (r->nnodes == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 4;
+        uint32_t *nodes = realloc(r->nodes, cap * TRIE_FANOUT * sizeof(uint32_t));
+        if (!nodes) {
+            return -1;
+        }
+        r->nodes = nodes;
+        r->cap = cap;
+    }
+    uint32_t *node = r->nodes + r->nnodes * TRIE_FANOUT;
+    for (int i = 0; i < TRIE_FANOUT; i++) {
+        node[i] = fill;
+    }
+    *index = (uint32_t)r->nnodes++;
+    return 0;
+}
+
+// Prefixes must arrive shortest first: a longer prefix then only ever
+// overwrites the leaves a shorter one pushed down
+static int trie_insert(struct pkt_rules *r, uint32_t prefix, unsigned len, uint32_t value) {
+    uint32_t addr = ntohl(prefix);
+    uint32_t node = 0;
+    unsigned shift = 24;
+
+    while (len > 32 - shift) {
+        uint32_t *e = &r->nodes[node * TRIE_FANOUT + ((addr >> shift) & 0xff)];
+        if (!(*e & TRIE_CHILD)) {
+            uint32_t child;
+            if (trie_node_new(r, *e, &child) < 0) {
+                return -1;
+            }
+            // realloc may have moved the entry
+            e = &r->nodes[node * TRIE_FANOUT + ((addr >> shift) & 0xff)];
+            *e = TRIE_CHILD | child;
+        }
+        node = *e & ~TRIE_CHILD;
+        shift -= 8;
+    }
+
+    // Expand the prefix over the entries of its last level
+    unsigned span = 1u << (32 - shift - len);
+    unsigned first = ((addr >> shift) & 0xff) & ~(span - 1);
+    for (unsigned i = first; i < first + span; i++) {
+        r->nodes[node * TRIE_FANOUT + i] = value;
+    }
+    return 0;
+}
+
+static uint32_t trie_lookup(const struct pkt_rules *r, uint32_t dst_addr) {
+    uint32_t addr = ntohl(dst_addr);
+    const uint32_t *node = r->nodes;
+    for (unsigned shift = 24;; shift -= 8) {
+        uint32_t e = node[(addr >> shift) & 0xff];
+        if (!(e & TRIE_CHILD)) {
+            return e;
+        }
+        node = r->nodes + (size_t)(e & ~TRIE_CHILD) * TRIE_FANOUT;
+    }
+}
+
+static int prefix_cmp(const void *a, const void *b) {
+    const struct pkt_rule *x = *(const struct pkt_rule *const *)a;
+    const struct pkt_rule *y = *(const struct pkt_rule *const *)b;
+    if (x->prefix_len != y->prefix_len) {
+        return (int)x->prefix_len - (int)y->prefix_len;
+    }
+    // Excludes last, so they win over an include of the same prefix
+    return (int)(x->kind == PKT_RULE_EXCLUDE) - (int)(y->kind == PKT_RULE_EXCLUDE);
+}
+
+int pkt_rule_parse(const char *text, struct pkt_rule *rule) {
+    memset(rule, 0, sizeof(*rule));
+
+    if (isdigit((unsigned char)text[0]) && !strchr(text, '.')) {
+        char *end;
+        unsigned long lo = strtoul(text, &end, 10);
+        unsigned long hi = lo;
+        if (*end == '-') {
+            hi = strtoul(end + 1, &end, 10);
+        }
+        if (*end != '\0' || lo == 0 || lo > hi || hi > 65535) {
+            return 0;
+        }
+        rule->kind = PKT_RULE_PORTS;
+        rule->port_lo = (uint16_t)lo;
+        rule->port_hi = (uint16_t)hi;
+        return 1;
+    }
+
+    rule->kind = PKT_RULE_INCLUDE;
+    if (text[0] == '!') {
+        rule->kind = PKT_RULE_EXCLUDE;
+        text++;
+    }
+
+    char addr[INET_ADDRSTRLEN];
+    const char *slash = strchr(text, '/');
+    size_t addr_len = slash ? (size_t)(slash - text) : strlen(text);
+    if (addr_len == 0 || addr_len >= sizeof(addr)) {
+        return 0;
+    }
+    memcpy(addr, text, addr_len);
+    addr[addr_len] = '\0';
+
+    struct in_addr in;
+    if (inet_pton(AF_INET, addr, &in) != 1) {
+        return 0;
+    }
+
+    unsigned long len = 32;
+    if (slash) {
+        char *end;
+        if (!isdigit((unsigned char)slash[1])) {
+            return 0;
+        }
+        len = strtoul(slash + 1, &end, 10);
+        if (*end != '\0' || len > 32) {
+            return 0;
+        }
+    }
+
+    // Host bits are ignored
+    uint32_t mask = len ? htonl(0xffffffffu << (32 - len)) : 0;
+    rule->prefix = in.s_addr & mask;
+    rule->prefix_len = (uint8_t)len;
+    return 1;
+}
+
+struct pkt_rules *pkt_rules_compile(const struct pkt_rule *rules, size_t n) {
+    struct pkt_rules *r = calloc(1, sizeof(*r));
+    const struct pkt_rule **prefixes = malloc((n ? n : 1) * sizeof(*prefixes));
+    size_t nprefixes = 0;
+    int includes = 0;
+    uint32_t root;
+
+    if (!r || !prefixes) {
+        goto fail;
+    }
+    r->prefixes = malloc((n ? n : 1) * sizeof(*r->prefixes));
+    if (!r->prefixes) {
+        goto fail;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (rules[i].kind == PKT_RULE_PORTS) {
+            for (uint32_t port = rules[i].port_lo; port <= rules[i].port_hi; port++) {
+                r->ports[port >> 3] |= (uint8_t)(1u << (port & 7));
+            }
+        } else {
+            includes |= rules[i].kind == PKT_RULE_INCLUDE;
+            prefixes[nprefixes++] = &rules[i];
+        }
+    }
+
+    if (trie_node_new(r, includes ? 0 : 1, &root) < 0) {
+        goto fail;
+    }
+    r->ipv6 = !includes;
+    qsort(prefixes, nprefixes, sizeof(*prefixes), prefix_cmp);
+    for (size_t i = 0; i < nprefixes; i++) {
+        uint32_t value = prefixes[i]->kind == PKT_RULE_INCLUDE;
+        if (trie_insert(r, prefixes[i]->prefix, prefixes[i]->prefix_len, value) < 0) {
+            goto fail;
+        }
+        r->prefixes[r->nprefixes++] = *prefixes[i];
+    }
+
+    free(prefixes);
+    return r;
+
+fail:
+    free(prefixes);
+    pkt_rules_free(r);
+    return NULL;
+}
+
+struct pkt_rules *pkt_rules_compile_string(const char *spec, size_t *bad) {
+    size_t cap = 8, n = 0;
+    struct pkt_rule *rules = malloc(cap * sizeof(*rules));
+    const char *p = spec;
+
+    if (!rules) {
+        return NULL;
+    }
+
+    for (;;) {
+        while (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+
+        char token[64];
+        size_t len = strcspn(p, " ,\t\n");
+        if (len >= sizeof(token)) {
+            goto invalid;
+        }
+        memcpy(token, p, len);
+        token[len] = '\0';
+
+        if (n == cap) {
+            struct pkt_rule *grown = realloc(rules, cap * 2 * sizeof(*rules));
+            if (!grown) {
+                free(rules);
+                return NULL;
+            }
+            rules = grown;
+            cap *= 2;
+        }
+        if (!pkt_rule_parse(token, &rules[n])) {
+            goto invalid;
+        }
+        n++;
+        p += len;
+    }
+
+    struct pkt_rules *r = pkt_rules_compile(rules, n);
+    free(rules);
+    return r;
+
+invalid:
+    if (bad) {
+        *bad = (size_t)(p - spec);
+    }
+    free(rules);
+    return NULL;
+}
+
+void pkt_rules_free(struct pkt_rules *r) {
+    if (!r) {
+        return;
+    }
+    free(r->nodes);
+    free(r->prefixes);
+    free(r);
+}
+
+size_t pkt_rules_prefixes(const struct pkt_rules *r, enum pkt_rule_kind kind,
+                          struct pkt_rule *out, size_t max) {
+    size_t count = 0;
+    for (size_t i = 0; i < r->nprefixes; i++) {
+        if (r->prefixes[i].kind != kind) {
+            continue;
+        }
+        if (out && count < max) {
+            out[count] = r->prefixes[i];
+        }
+        count++;
+    }
+    return count;
+}
+
+int pkt_rules_ipv6(const struct pkt_rules *r) {
+    return r->ipv6;
+}
+
+int pkt_rules_match(const struct pkt_rules *r, uint32_t dst_addr, uint16_t dst_port) {
+    return ((r->ports[dst_port >> 3] >> (dst_port & 7)) & 1) && trie_lookup(r, dst_addr);
+}
+
+void pkt_rules_classify(const struct pkt_rules *r, const uint8_t **bufs, const size_t *lens,
+                        size_t n, uint8_t *verdicts) {
+    uint16_t ports[RULES_BATCH];
+    uint32_t addrs[RULES_BATCH];
+    uint8_t kinds[RULES_BATCH];
+
+    for (size_t base = 0; base < n; base += RULES_BATCH) {
+        size_t count = n - base < RULES_BATCH ? n - base : RULES_BATCH;
+        uint8_t *tcp = verdicts + base;
+
+        // IPv6 lanes fail the IPv4 test below, which stays as lean as
+        // without them; the few there are get their verdict afterwards
+        size_t ipv6 = pkt_parse_tcp_batch(bufs + base, lens + base, count, tcp, ports, addrs);
+        if (ipv6 && r->ipv6) {
+            memcpy(kinds, tcp, count);
+        } else {
+            ipv6 = 0;
+        }
+        for (size_t i = 0; i < count; i++) {
+            // The port bit is cheap and usually clear; only then walk the trie
+            uint8_t hit = tcp[i] & (r->ports[ports[i] >> 3] >> (ports[i] & 7));
+            tcp[i] = (hit & 1) && trie_lookup(r, addrs[i]) ? PKT_VERDICT_TUNNEL : PKT_VERDICT_PASS;
+        }
+        for (size_t i = 0; ipv6 && i < count; i++) {
+            if (kinds[i] == PKT_TCP_IPV6) {
+                tcp[i] = (r->ports[ports[i] >> 3] >> (ports[i] & 7)) & 1 ? PKT_VERDICT_TUNNEL : PKT_VERDICT_PASS;
+            }
+        }
+    }
+}
@@ -0,0 +1,114 @@
+//
+//  pktrules.h
+//  NetRewirePacketTunnel
+//
+//  Capture rules compiled once at tunnel start. A packet is captured when
+//  it is TCP, its destination port is in one of the port ranges and its
+//  destination address is allowed by the prefix rules. The ports become a
+//  65536-bit bitmap and the prefixes a stride-8 trie with leaf pushing, so
+//  a match costs one bit test and at most four table loads however many
+//  rules there are.
+//
+//  Prefix rules: with no include prefixes every destination is allowed.
+//  Otherwise only included ones are. The longest matching prefix decides,
+//  so "10.0.0.0/8 !10.1.0.0/16" includes 10/8 except 10.1/16. Between an
+//  include and an exclude of the same prefix, the exclude wins. Prefixes
+//  are IPv4, so IPv6 destinations are captured by port only, and only when
+//  there are no include prefixes to restrict capture to.
+//
+
+#ifndef PKTRULES_H
+#define PKTRULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum pkt_rule_kind {
+    PKT_RULE_PORTS,         // capture TCP to ports port_lo..port_hi
+    PKT_RULE_INCLUDE,       // destination prefix that may be captured
+    PKT_RULE_EXCLUDE,       // destination prefix that is never captured
+};
+
+struct pkt_rule {
+    enum pkt_rule_kind kind;
+    uint16_t port_lo;       // host byte order, PKT_RULE_PORTS
+    uint16_t port_hi;
+    uint32_t prefix;        // network byte order, PKT_RULE_INCLUDE/EXCLUDE
+    uint8_t prefix_len;
+};
+
+struct pkt_rules;
+
+/**
+ * Parse one rule: a port ("25"), a port range ("465-587"), an included
+ * prefix ("10.0.0.0/8"; a bare address is a /32) or an excluded prefix
+ * ("!192.168.0.0/16")
+ * @param text Rule text, NUL-terminated
+ * @param rule Output
+ * @return 1 on success, 0 if the text is not a valid rule
+ */
+int pkt_rule_parse(const char *text, struct pkt_rule *rule);
+
+/**
+ * Compile rules into a matcher
+ * @param rules Rules, in any order
+ * @param n Number of rules
+ * @return Matcher, or NULL on allocation failure
+ */
+struct pkt_rules *pkt_rules_compile(const struct pkt_rule *rules, size_t n);
+
+/**
+ * Parse and compile a rule list separated by spaces or commas,
+ * e.g. "25 465 587 !10.0.0.0/8"
+ * @param spec Rule list
+ * @param bad Output (may be NULL): offset of the first invalid rule
+ * @return Matcher, or NULL if a rule is invalid or allocation failed
+ */
+struct pkt_rules *pkt_rules_compile_string(const char *spec, size_t *bad);
+
+/**
+ * Release a matcher
+ */
+void pkt_rules_free(struct pkt_rules *r);
+
+/**
+ * Destination prefixes the rules were compiled from, e.g. for deriving the
+ * tunnel's routes
+ * @param r Matcher
+ * @param kind PKT_RULE_INCLUDE or PKT_RULE_EXCLUDE
+ * @param out Output, shortest prefix first; may be NULL to count
+ * @param max Capacity of out
+ * @return Number of prefixes of that kind
+ */
+size_t pkt_rules_prefixes(const struct pkt_rules *r, enum pkt_rule_kind kind,
+                          struct pkt_rule *out, size_t max);
+
+/**
+ * Whether IPv6 TCP traffic is captured (by port) at all; the tunnel then
+ * routes IPv6 too
+ * @param r Matcher
+ * @return 1 if the rules have no include prefixes, 0 otherwise
+ */
+int pkt_rules_ipv6(const struct pkt_rules *r);
+
+/**
+ * Whether IPv4 TCP traffic to a destination is captured
+ * @param r Matcher
+ * @param dst_addr Address in network byte order
+ * @param dst_port Port in host byte order
+ * @return 1 if captured, 0 otherwise
+ */
+int pkt_rules_match(const struct pkt_rules *r, uint32_t dst_addr, uint16_t dst_port);
+
+/**
+ * Classify a batch of IP packets in one pass
+ * @param r Matcher
+ * @param bufs Packet pointers
+ * @param lens Packet lengths
+ * @param n Number of packets
+ * @param verdicts Output, one enum pkt_verdict per packet
+ */
+void pkt_rules_classify(const struct pkt_rules *r, const uint8_t **bufs, const size_t *lens,
+                        size_t n, uint8_t *verdicts);
+
+#endif
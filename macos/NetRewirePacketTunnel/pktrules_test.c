@@ -0,0 +1,228 @@
+//
+//  pktrules_test.c
+//  NetRewirePacketTunnel
+//
+
+#include "pktrules.h"
+#include "pktparse.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+static uint32_t ip(const char *s) {
+    struct in_addr in;
+    assert(inet_pton(AF_INET, s, &in) == 1);
+    return in.s_addr;
+}
+
+void test_parse() {
+    struct pkt_rule rule;
+
+    assert(pkt_rule_parse("25", &rule) && rule.kind == PKT_RULE_PORTS);
+    assert(rule.port_lo == 25 && rule.port_hi == 25);
+    assert(pkt_rule_parse("465-587", &rule) && rule.port_lo == 465 && rule.port_hi == 587);
+    assert(pkt_rule_parse("10.1.2.3/8", &rule) && rule.kind == PKT_RULE_INCLUDE);
+    assert(rule.prefix == ip("10.0.0.0") && rule.prefix_len == 8);
+    assert(pkt_rule_parse("!192.168.1.1", &rule) && rule.kind == PKT_RULE_EXCLUDE);
+    assert(rule.prefix_len == 32);
+    assert(pkt_rule_parse("0.0.0.0/0", &rule) && rule.prefix_len == 0);
+
+    assert(!pkt_rule_parse("0", &rule));
+    assert(!pkt_rule_parse("70000", &rule));
+    assert(!pkt_rule_parse("600-500", &rule));
+    assert(!pkt_rule_parse("10.0.0.0/33", &rule));
+    assert(!pkt_rule_parse("10.0.0/8", &rule));
+    assert(!pkt_rule_parse("smtp", &rule));
+
+    size_t bad = 0;
+    assert(pkt_rules_compile_string("25 465 bogus", &bad) == NULL && bad == 7);
+
+    printf("✓ Rule parse test passed\n");
+}
+
+void test_ports_and_prefixes() {
+    struct pkt_rules *r = pkt_rules_compile_string("25, 465 587 !10.0.0.0/8 10.1.0.0/16 !10.1.2.0/23", NULL);
+    assert(r != NULL);
+
+    // Only includes listed: 10.1/16 minus 10.1.2.0/23
+    assert(pkt_rules_match(r, ip("10.1.0.1"), 25));
+    assert(pkt_rules_match(r, ip("10.1.4.1"), 587));
+    assert(!pkt_rules_match(r, ip("10.1.3.255"), 25));
+    assert(!pkt_rules_match(r, ip("10.1.2.0"), 25));
+    assert(!pkt_rules_match(r, ip("10.2.0.1"), 25));
+    assert(!pkt_rules_match(r, ip("8.8.8.8"), 25));
+    assert(!pkt_rules_match(r, ip("10.1.0.1"), 80));
+
+    struct pkt_rule prefixes[4];
+    assert(pkt_rules_prefixes(r, PKT_RULE_INCLUDE, NULL, 0) == 1);
+    assert(pkt_rules_prefixes(r, PKT_RULE_EXCLUDE, prefixes, 4) == 2);
+    assert(prefixes[0].prefix == ip("10.0.0.0") && prefixes[0].prefix_len == 8);
+    assert(prefixes[1].prefix == ip("10.1.2.0") && prefixes[1].prefix_len == 23);
+    pkt_rules_free(r);
+
+    // No includes: everything but the exclusions
+    r = pkt_rules_compile_string("25 !192.168.0.0/16", NULL);
+    assert(pkt_rules_match(r, ip("8.8.8.8"), 25));
+    assert(!pkt_rules_match(r, ip("192.168.7.7"), 25));
+    assert(!pkt_rules_match(r, ip("8.8.8.8"), 26));
+    pkt_rules_free(r);
+
+    printf("✓ Port and prefix test passed\n");
+}
+
+// Longest-prefix reference over the rule list
+static int reference_match(const struct pkt_rule *rules, size_t n, uint32_t addr, uint16_t port) {
+    int port_ok = 0, includes = 0, best_len = -1, best = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (rules[i].kind == PKT_RULE_PORTS) {
+            port_ok |= port >= rules[i].port_lo && port <= rules[i].port_hi;
+            continue;
+        }
+        includes |= rules[i].kind == PKT_RULE_INCLUDE;
+        uint32_t mask = rules[i].prefix_len ? htonl(0xffffffffu << (32 - rules[i].prefix_len)) : 0;
+        int longer = rules[i].prefix_len > best_len ||
+                     (rules[i].prefix_len == best_len && rules[i].kind == PKT_RULE_EXCLUDE);
+        if ((addr & mask) == rules[i].prefix && longer) {
+            best_len = rules[i].prefix_len;
+            best = rules[i].kind == PKT_RULE_INCLUDE;
+        }
+    }
+    return port_ok && (best_len >= 0 ? best : !includes);
+}
+
+void test_random_against_reference() {
+    enum { RULES = 40, PROBES = 20000 };
+    struct pkt_rule rules[RULES];
+    srand(7);
+
+    for (int i = 0; i < RULES; i++) {
+        memset(&rules[i], 0, sizeof(rules[i]));
+        if (i < 8) {
+            rules[i].kind = PKT_RULE_PORTS;
+            rules[i].port_lo = (uint16_t)(1 + rand() % 1000);
+            rules[i].port_hi = (uint16_t)(rules[i].port_lo + rand() % 20);
+            continue;
+        }
+        // Nested prefixes under 10/8 so that lengths interleave
+        unsigned len = (unsigned)(rand() % 33);
+        if (i % 5 == 0) {
+            // Same prefix as the previous rule, likely the other kind
+            rules[i] = rules[i - 1];
+            rules[i].kind = rules[i].kind == PKT_RULE_INCLUDE ? PKT_RULE_EXCLUDE : PKT_RULE_INCLUDE;
+            continue;
+        }
+        uint32_t addr = htonl(0x0a000000u | ((uint32_t)rand() & 0x00ffffffu));
+        uint32_t mask = len ? htonl(0xffffffffu << (32 - len)) : 0;
+        rules[i].kind = rand() % 2 ? PKT_RULE_INCLUDE : PKT_RULE_EXCLUDE;
+        rules[i].prefix = addr & mask;
+        rules[i].prefix_len = (uint8_t)len;
+    }
+
+    struct pkt_rules *r = pkt_rules_compile(rules, RULES);
+    assert(r != NULL);
+    for (int i = 0; i < PROBES; i++) {
+        uint32_t addr = i % 2 ? rules[8 + i % (RULES - 8)].prefix ^ htonl((uint32_t)rand() & 0xff)
+                              : htonl(0x0a000000u | ((uint32_t)rand() & 0x00ffffffu));
+        uint16_t port = (uint16_t)(1 + rand() % 1100);
+        assert(pkt_rules_match(r, addr, port) == reference_match(rules, RULES, addr, port));
+    }
+    pkt_rules_free(r);
+
+    printf("✓ Random rules against reference test passed\n");
+}
+
+void test_classify_batch() {
+    static const uint8_t tcp_packet[] = {
+        0x45, 0x00, 0x00, 0x28, 0x00, 0x01, 0x00, 0x00, 0x40, 0x06, 0x00, 0x00,
+        0xc0, 0xa8, 0x01, 0x01,
+        0x08, 0x08, 0x08, 0x08,     // dst: 8.8.8.8
+        0x04, 0xd2, 0x00, 0x19,     // dst port 25
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x50, 0x02, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    enum { N = 100 };
+    static uint8_t pkts[N][sizeof(tcp_packet)];
+    const uint8_t *bufs[N];
+    size_t lens[N];
+    uint8_t verdicts[N];
+
+    for (int i = 0; i < N; i++) {
+        memcpy(pkts[i], tcp_packet, sizeof(tcp_packet));
+        bufs[i] = pkts[i];
+        lens[i] = sizeof(tcp_packet);
+        if (i % 4 == 1) {
+            pkts[i][23] = 0x4b;     // 587 = 0x024b
+            pkts[i][22] = 0x02;
+        } else if (i % 4 == 2) {
+            pkts[i][16] = 10;       // 10.8.8.8, excluded
+        } else if (i % 4 == 3) {
+            pkts[i][23] = 80;
+        }
+    }
+
+    struct pkt_rules *r = pkt_rules_compile_string("25 587 !10.0.0.0/8", NULL);
+    pkt_rules_classify(r, bufs, lens, N, verdicts);
+    for (int i = 0; i < N; i++) {
+        assert(verdicts[i] == (i % 4 < 2 ? PKT_VERDICT_TUNNEL : PKT_VERDICT_PASS));
+    }
+    pkt_rules_free(r);
+
+    printf("✓ Batch classify test passed\n");
+}
+
+void test_classify_ipv6() {
+    enum { N = 4 };
+    static uint8_t pkts[N][60];
+    const uint8_t *bufs[N];
+    size_t lens[N];
+    uint8_t verdicts[N];
+
+    // IPv6 TCP from fd00:8::a08:21 to 2001:db8::19, to ports 25, 587, 80, 25
+    static const uint16_t ports[N] = { 25, 587, 80, 25 };
+    for (int i = 0; i < N; i++) {
+        memset(pkts[i], 0, sizeof(pkts[i]));
+        pkts[i][0] = 0x60;
+        pkts[i][5] = 20;
+        pkts[i][6] = 6;
+        assert(inet_pton(AF_INET6, "fd00:8::a08:21", pkts[i] + 8) == 1);
+        assert(inet_pton(AF_INET6, "2001:db8::19", pkts[i] + 24) == 1);
+        pkts[i][42] = (uint8_t)(ports[i] >> 8);
+        pkts[i][43] = (uint8_t)ports[i];
+        pkts[i][52] = 0x50;
+        bufs[i] = pkts[i];
+        lens[i] = sizeof(pkts[i]);
+    }
+    lens[3] = 59;   // truncated TCP header
+
+    // Exclude prefixes are IPv4 and leave IPv6 to the ports
+    struct pkt_rules *r = pkt_rules_compile_string("25 587 !10.0.0.0/8", NULL);
+    assert(pkt_rules_ipv6(r));
+    pkt_rules_classify(r, bufs, lens, N, verdicts);
+    assert(verdicts[0] == PKT_VERDICT_TUNNEL && verdicts[1] == PKT_VERDICT_TUNNEL);
+    assert(verdicts[2] == PKT_VERDICT_PASS && verdicts[3] == PKT_VERDICT_PASS);
+    pkt_rules_free(r);
+
+    // Include prefixes restrict capture to IPv4 destinations
+    r = pkt_rules_compile_string("25 192.0.2.0/24", NULL);
+    assert(!pkt_rules_ipv6(r));
+    pkt_rules_classify(r, bufs, lens, N, verdicts);
+    assert(verdicts[0] == PKT_VERDICT_PASS);
+    pkt_rules_free(r);
+
+    printf("✓ IPv6 classify test passed\n");
+}
+
+int main() {
+    printf("Running pktrules unit tests...\n");
+
+    test_parse();
+    test_ports_and_prefixes();
+    test_random_against_reference();
+    test_classify_batch();
+    test_classify_ipv6();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,93 @@
+//
+//  pktsched.c
+//  NetRewirePacketTunnel
+//
+
+#include "pktsched.h"
+#include "pktparse.h"
+#include "stripe.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int pkt_sched_init(struct pkt_sched *s, size_t capacity) {
+    size_t cap = 2;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+
+    memset(s, 0, sizeof(*s));
+    // Either class may hold every packet
+    for (int c = 0; c < 2; c++) {
+        s->queues[c].entries = calloc(cap, sizeof(*s->queues[c].entries));
+        if (!s->queues[c].entries) {
+            pkt_sched_free(s);
+            return -1;
+        }
+    }
+    s->mask = cap - 1;
+    return 0;
+}
+
+void pkt_sched_free(struct pkt_sched *s) {
+    for (int c = 0; c < 2; c++) {
+        free(s->queues[c].entries);
+        s->queues[c].entries = NULL;
+    }
+}
+
+size_t pkt_sched_room(const struct pkt_sched *s) {
+    return s->mask + 1 - s->count;
+}
+
+int pkt_sched_push(struct pkt_sched *s, const struct ring_desc *desc) {
+    if (s->count > s->mask) {
+        return -1;
+    }
+
+    struct pkt_info info;
+    pkt_parse(desc->data, desc->len, &info);
+    uint8_t bucket = (uint8_t)stripe_pick(stripe_hash(info.ip_src, info.ip_dst, info.tcp_src, info.tcp_dst),
+                                          PKT_SCHED_BUCKETS);
+
+    // Behind whatever of its flow is already in bulk
+    int c = pkt_is_urgent(&info) && s->waiting[PKT_CLASS_BULK][bucket] == 0 ? PKT_CLASS_URGENT : PKT_CLASS_BULK;
+    struct pkt_sched_queue *q = &s->queues[c];
+    struct pkt_sched_entry *e = &q->entries[q->tail++ & s->mask];
+    e->desc = *desc;
+    e->bucket = bucket;
+    s->waiting[c][bucket]++;
+    s->count++;
+    return c;
+}
+
+static int pkt_sched_empty(const struct pkt_sched *s, int c) {
+    return s->queues[c].head == s->queues[c].tail;
+}
+
+size_t pkt_sched_pop(struct pkt_sched *s, struct ring_desc *out, size_t max) {
+    size_t quota = max - max / PKT_SCHED_BULK_SHARE;
+    size_t n = 0, urgent = 0;
+
+    while (n < max && s->count > 0) {
+        int c = PKT_CLASS_URGENT;
+        if (pkt_sched_empty(s, PKT_CLASS_URGENT)) {
+            c = PKT_CLASS_BULK;
+        } else if (!pkt_sched_empty(s, PKT_CLASS_BULK) && urgent >= quota) {
+            // Bulk's turn, unless urgent packets of its next flow came first
+            const struct pkt_sched_queue *bulk = &s->queues[PKT_CLASS_BULK];
+            uint8_t bucket = bulk->entries[bulk->head & s->mask].bucket;
+            if (s->waiting[PKT_CLASS_URGENT][bucket] == 0) {
+                c = PKT_CLASS_BULK;
+            }
+        }
+
+        struct pkt_sched_queue *q = &s->queues[c];
+        struct pkt_sched_entry *e = &q->entries[q->head++ & s->mask];
+        out[n++] = e->desc;
+        s->waiting[c][e->bucket]--;
+        s->count--;
+        urgent += c == PKT_CLASS_URGENT;
+    }
+    return n;
+}
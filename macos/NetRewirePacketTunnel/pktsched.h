@@ -0,0 +1,88 @@
+//
+//  pktsched.h
+//  NetRewirePacketTunnel
+//
+//  Two-class send scheduler for the tunnel writer. Packets waiting to go out
+//  are split into an urgent class (handshakes, pure ACKs, SMTP commands; see
+//  pkt_is_urgent) and a bulk class, each first in, first out, and batches
+//  take urgent packets first. An EHLO or RCPT round trip then no longer
+//  waits behind the megabytes of DATA another session has queued.
+//
+//  A flow never overtakes itself: while a packet of its flow waits in the
+//  bulk class, an urgent packet queues behind it there, and a bulk packet
+//  is not taken while urgent ones of its flow wait. Flows are told apart by
+//  a hash bucket, so a collision can only hold a packet back, never
+//  reorder one. While both classes wait, a batch leaves at least
+//  1/PKT_SCHED_BULK_SHARE of its room to bulk, so bulk is never starved.
+//
+
+#ifndef PKTSCHED_H
+#define PKTSCHED_H
+
+#include "spsc_ring.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PKT_SCHED_BUCKETS 256
+#define PKT_SCHED_BULK_SHARE 4
+
+enum pkt_class {
+    PKT_CLASS_URGENT = 0,
+    PKT_CLASS_BULK = 1,
+};
+
+struct pkt_sched_entry {
+    struct ring_desc desc;
+    uint8_t bucket;
+};
+
+struct pkt_sched_queue {
+    struct pkt_sched_entry *entries;
+    size_t head;
+    size_t tail;
+};
+
+struct pkt_sched {
+    struct pkt_sched_queue queues[2];   // by enum pkt_class
+    size_t mask;
+    size_t count;                       // packets held in both classes
+    uint32_t waiting[2][PKT_SCHED_BUCKETS]; // packets held per class and flow bucket
+};
+
+/**
+ * Allocate an empty scheduler
+ * @param s Scheduler
+ * @param capacity Packets held at most, rounded up to a power of two
+ * @return 0 on success, -1 on allocation failure
+ */
+int pkt_sched_init(struct pkt_sched *s, size_t capacity);
+
+/**
+ * Free the queues; packets still held are not released
+ */
+void pkt_sched_free(struct pkt_sched *s);
+
+/**
+ * Packets that can still be pushed
+ */
+size_t pkt_sched_room(const struct pkt_sched *s);
+
+/**
+ * Queue a packet in its class, parsed with pkt_parse
+ * @param s Scheduler
+ * @param desc Packet
+ * @return The class it went to, or -1 if the scheduler is full
+ */
+int pkt_sched_push(struct pkt_sched *s, const struct ring_desc *desc);
+
+/**
+ * Take the next packets to send, urgent ones first
+ * @param s Scheduler
+ * @param out Output
+ * @param max Room in out
+ * @return Number of packets taken; 0 once the scheduler is empty
+ */
+size_t pkt_sched_pop(struct pkt_sched *s, struct ring_desc *out, size_t max);
+
+#endif
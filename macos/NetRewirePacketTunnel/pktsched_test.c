@@ -0,0 +1,203 @@
+//
+//  pktsched_test.c
+//  NetRewirePacketTunnel
+//
+
+#include "pktsched.h"
+#include "pktparse.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#define TCP_SYN 0x02
+#define TCP_ACK 0x10
+#define TCP_PSH 0x08
+
+// Packets of up to 1500 bytes; len and sport name the packet in the output
+static uint8_t packets[256][1500];
+static size_t next_packet;
+
+// IPv4 TCP packet from source port sport to port 25 with payload bytes
+static struct ring_desc make_packet(uint16_t sport, uint8_t flags, size_t payload) {
+    uint8_t *pkt = packets[next_packet++ % 256];
+    size_t len = 40 + payload;
+
+    memset(pkt, 0, len);
+    pkt[0] = 0x45;
+    pkt[2] = (uint8_t)(len >> 8);
+    pkt[3] = (uint8_t)len;
+    pkt[9] = 6;
+    pkt[12] = 10, pkt[13] = 8, pkt[15] = 33;
+    pkt[16] = 192, pkt[17] = 0, pkt[18] = 2, pkt[19] = 25;
+    pkt[20] = (uint8_t)(sport >> 8);
+    pkt[21] = (uint8_t)sport;
+    pkt[23] = 25;
+    pkt[32] = 0x50;
+    pkt[33] = flags;
+
+    struct ring_desc d = { .data = pkt, .len = len };
+    return d;
+}
+
+static uint16_t sport_of(const struct ring_desc *d) {
+    return (uint16_t)(d->data[20] << 8 | d->data[21]);
+}
+
+void test_classify() {
+    struct pkt_info info;
+    struct ring_desc d;
+
+    d = make_packet(1000, TCP_SYN, 0);
+    assert(pkt_parse(d.data, d.len, &info) == 1 && info.tcp_flags == TCP_SYN && info.payload_len == 0);
+    assert(pkt_is_urgent(&info));
+
+    d = make_packet(1000, TCP_ACK, 0);
+    pkt_parse(d.data, d.len, &info);
+    assert(pkt_is_urgent(&info));
+
+    d = make_packet(1000, TCP_ACK | TCP_PSH, 24);             // RCPT TO:<a@example.com>
+    pkt_parse(d.data, d.len, &info);
+    assert(info.payload_len == 24 && pkt_is_urgent(&info));
+
+    d = make_packet(1000, TCP_ACK, PKT_URGENT_PAYLOAD + 1);
+    pkt_parse(d.data, d.len, &info);
+    assert(!pkt_is_urgent(&info));
+
+    // The IP header's length counts, not trailing bytes after it
+    d = make_packet(1000, TCP_ACK, 1400);
+    ((uint8_t *)d.data)[2] = 0;
+    ((uint8_t *)d.data)[3] = 40;
+    pkt_parse(d.data, d.len, &info);
+    assert(info.payload_len == 0);
+
+    printf("✓ Classify test passed\n");
+}
+
+void test_urgent_first() {
+    struct pkt_sched s;
+    struct ring_desc d, out[64];
+
+    assert(pkt_sched_init(&s, 64) == 0);
+    for (int i = 0; i < 10; i++) {
+        d = make_packet(1000, TCP_ACK, 1400);
+        assert(pkt_sched_push(&s, &d) == PKT_CLASS_BULK);
+    }
+    for (int i = 0; i < 3; i++) {
+        d = make_packet(2000, TCP_ACK | TCP_PSH, 20);
+        assert(pkt_sched_push(&s, &d) == PKT_CLASS_URGENT);
+    }
+
+    assert(pkt_sched_pop(&s, out, 64) == 13);
+    for (int i = 0; i < 13; i++) {
+        assert(sport_of(&out[i]) == (i < 3 ? 2000 : 1000));
+    }
+    assert(pkt_sched_pop(&s, out, 64) == 0);
+    pkt_sched_free(&s);
+
+    printf("✓ Urgent first test passed\n");
+}
+
+void test_flow_order() {
+    struct pkt_sched s;
+    struct ring_desc d, out[8];
+
+    assert(pkt_sched_init(&s, 64) == 0);
+
+    // A flow's ACK queues behind its own data
+    d = make_packet(1000, TCP_ACK, 1400);
+    assert(pkt_sched_push(&s, &d) == PKT_CLASS_BULK);
+    d = make_packet(1000, TCP_ACK, 0);
+    assert(pkt_sched_push(&s, &d) == PKT_CLASS_BULK);
+    d = make_packet(2000, TCP_ACK, 0);
+    assert(pkt_sched_push(&s, &d) == PKT_CLASS_URGENT);
+    assert(pkt_sched_pop(&s, out, 8) == 3);
+    assert(sport_of(&out[0]) == 2000);
+    assert(sport_of(&out[1]) == 1000 && out[1].len == 1440);
+    assert(sport_of(&out[2]) == 1000 && out[2].len == 40);
+
+    // Data does not pass the command its flow sent first, even on bulk's turn
+    for (int i = 0; i < 5; i++) {
+        d = make_packet(2000, TCP_ACK, 10);
+        pkt_sched_push(&s, &d);
+    }
+    d = make_packet(1000, TCP_ACK, 10);
+    assert(pkt_sched_push(&s, &d) == PKT_CLASS_URGENT);
+    d = make_packet(1000, TCP_ACK, 1400);
+    assert(pkt_sched_push(&s, &d) == PKT_CLASS_BULK);
+
+    size_t small = 0, n;
+    int seen_command = 0;
+    while ((n = pkt_sched_pop(&s, out, 4)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (sport_of(&out[i]) == 1000) {
+                assert(seen_command == (out[i].len == 1440));
+                seen_command = 1;
+            } else {
+                small++;
+            }
+        }
+    }
+    assert(small == 5 && seen_command);
+    pkt_sched_free(&s);
+
+    printf("✓ Flow order test passed\n");
+}
+
+void test_bulk_share() {
+    struct pkt_sched s;
+    struct ring_desc d, out[64];
+
+    assert(pkt_sched_init(&s, 256) == 0);
+    for (int i = 0; i < 100; i++) {
+        d = make_packet((uint16_t)(3000 + i), TCP_ACK, 0);
+        pkt_sched_push(&s, &d);
+    }
+    for (int i = 0; i < 30; i++) {
+        d = make_packet(1000, TCP_ACK, 1400);
+        pkt_sched_push(&s, &d);
+    }
+
+    // Three quarters urgent, then bulk fills the batch
+    assert(pkt_sched_pop(&s, out, 64) == 64);
+    size_t bulk = 0;
+    for (int i = 0; i < 64; i++) {
+        bulk += out[i].len == 1440;
+    }
+    assert(bulk == 64 / PKT_SCHED_BULK_SHARE);
+    pkt_sched_free(&s);
+
+    printf("✓ Bulk share test passed\n");
+}
+
+void test_full() {
+    struct pkt_sched s;
+    struct ring_desc d, out[8];
+
+    assert(pkt_sched_init(&s, 3) == 0);
+    assert(pkt_sched_room(&s) == 4);
+    for (int i = 0; i < 4; i++) {
+        d = make_packet((uint16_t)(1000 + i), TCP_ACK, i % 2 ? 0 : 1400);
+        assert(pkt_sched_push(&s, &d) >= 0);
+    }
+    assert(pkt_sched_room(&s) == 0);
+    assert(pkt_sched_push(&s, &d) == -1);
+    assert(pkt_sched_pop(&s, out, 1) == 1);
+    assert(pkt_sched_room(&s) == 1);
+    assert(pkt_sched_pop(&s, out, 8) == 3);
+    pkt_sched_free(&s);
+
+    printf("✓ Full test passed\n");
+}
+
+int main() {
+    printf("Running scheduler unit tests...\n");
+
+    test_classify();
+    test_urgent_first();
+    test_flow_order();
+    test_bulk_share();
+    test_full();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,132 @@
+//
+//  slab.c
+//  NetRewirePacketTunnel
+//
+
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct slab_pool {
+    pthread_mutex_t lock;
+    struct slab *free_list;
+    unsigned nfree;
+    unsigned max_free;
+    size_t slab_size;
+    size_t allocated;
+    uint32_t refs;              // creator plus one per allocated slab
+};
+
+static void slab_pool_put(struct slab_pool *p) {
+    if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    struct slab *s = p->free_list;
+    while (s) {
+        struct slab *next = s->next;
+        free(s);
+        s = next;
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+struct slab_pool *slab_pool_create(size_t slab_size, unsigned max_free) {
+    struct slab_pool *p = calloc(1, sizeof(*p));
+    if (!p) {
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    p->slab_size = slab_size;
+    p->max_free = max_free;
+    p->refs = 1;
+    return p;
+}
+
+void slab_pool_destroy(struct slab_pool *p) {
+    if (!p) {
+        return;
+    }
+
+    // Free slabs are no longer wanted; slabs still out are freed on release
+    pthread_mutex_lock(&p->lock);
+    struct slab *s = p->free_list;
+    p->free_list = NULL;
+    p->max_free = 0;
+    while (s) {
+        struct slab *next = s->next;
+        free(s);
+        p->nfree--;
+        p->allocated--;
+        __atomic_sub_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+        s = next;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    slab_pool_put(p);
+}
+
+struct slab *slab_get(struct slab_pool *p) {
+    pthread_mutex_lock(&p->lock);
+    struct slab *s = p->free_list;
+    if (s) {
+        p->free_list = s->next;
+        p->nfree--;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (!s) {
+        s = malloc(sizeof(*s) + p->slab_size);
+        if (!s) {
+            return NULL;
+        }
+        s->pool = p;
+        s->cap = p->slab_size;
+        __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&p->lock);
+        p->allocated++;
+        pthread_mutex_unlock(&p->lock);
+    }
+    s->next = NULL;
+    s->refs = 1;
+    return s;
+}
+
+void slab_retain(struct slab *s) {
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+}
+
+void slab_release(struct slab *s) {
+    if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    struct slab_pool *p = s->pool;
+    pthread_mutex_lock(&p->lock);
+    if (p->nfree < p->max_free) {
+        s->next = p->free_list;
+        p->free_list = s;
+        p->nfree++;
+        s = NULL;
+    } else {
+        p->allocated--;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (s) {
+        free(s);
+        slab_pool_put(p);
+    }
+}
+
+int slab_shared(const struct slab *s) {
+    return __atomic_load_n(&s->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+size_t slab_pool_allocated(const struct slab_pool *p) {
+    pthread_mutex_lock((pthread_mutex_t *)&p->lock);
+    size_t n = p->allocated;
+    pthread_mutex_unlock((pthread_mutex_t *)&p->lock);
+    return n;
+}
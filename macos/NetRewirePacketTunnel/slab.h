@@ -0,0 +1,66 @@
+//
+//  slab.h
+//  NetRewirePacketTunnel
+//
+//  Reference-counted receive slabs. The receive loop decodes frames in place
+//  into a slab and hands each one to NetworkExtension as an NSData view; every
+//  view holds a reference, and the slab goes back to the pool when the last
+//  one is released. Releases may come from any thread.
+//
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct slab_pool;
+
+struct slab {
+    struct slab_pool *pool;
+    struct slab *next;          // free list link
+    uint32_t refs;
+    size_t cap;
+    uint8_t data[];
+};
+
+/**
+ * Create a pool
+ * @param slab_size Usable bytes per slab
+ * @param max_free Released slabs kept for reuse; the rest are freed
+ * @return Pool, or NULL on allocation failure
+ */
+struct slab_pool *slab_pool_create(size_t slab_size, unsigned max_free);
+
+/**
+ * Drop the creator's reference; the pool is freed once every slab is back
+ */
+void slab_pool_destroy(struct slab_pool *p);
+
+/**
+ * Take a slab from the pool, allocating when none is free
+ * @return Slab holding one reference, or NULL on allocation failure
+ */
+struct slab *slab_get(struct slab_pool *p);
+
+/**
+ * Add a reference
+ */
+void slab_retain(struct slab *s);
+
+/**
+ * Drop a reference; the last one returns the slab to its pool
+ */
+void slab_release(struct slab *s);
+
+/**
+ * Whether anyone besides the caller holds a reference
+ */
+int slab_shared(const struct slab *s);
+
+/**
+ * Slabs currently allocated, in use or free
+ */
+size_t slab_pool_allocated(const struct slab_pool *p);
+
+#endif
@@ -0,0 +1,204 @@
+//
+//  bufpool.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#define _GNU_SOURCE
+#include "bufpool.h"
+
+#include <stdlib.h>
+
+#define HOME_JUMBO (-1)
+
+// Precedes every buffer; 16 bytes keeps the data aligned
+struct buf_hdr {
+    struct buf_hdr *next;
+    int32_t home;           // thread whose free list it belongs to, or HOME_JUMBO
+    uint32_t size;
+};
+
+// Each thread on its own cache line. remote is pushed by other threads
+// and only ever emptied whole by the owner, so the push needs no ABA guard.
+struct pool_thread {
+    struct buf_hdr *local;
+    size_t nlocal;
+    struct buf_hdr *remote;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t jumbo;
+} __attribute__((aligned(64)));
+
+struct bufpool {
+    int nthreads;
+    size_t max_cached;
+    size_t in_use;
+    size_t high_water;
+    struct pool_thread threads[];
+};
+
+static void *hdr_data(struct buf_hdr *h) {
+    return h + 1;
+}
+
+static struct buf_hdr *data_hdr(const void *buf) {
+    return (struct buf_hdr *)buf - 1;
+}
+
+struct bufpool *bufpool_create(int nthreads, size_t max_cached) {
+    if (nthreads < 1 || nthreads > BUFPOOL_MAX_THREADS) {
+        return NULL;
+    }
+    struct bufpool *p;
+    if (posix_memalign((void **)&p, 64, sizeof(*p) + nthreads * sizeof(struct pool_thread)) != 0) {
+        return NULL;
+    }
+    p->nthreads = nthreads;
+    p->max_cached = max_cached;
+    p->in_use = 0;
+    p->high_water = 0;
+    for (int i = 0; i < nthreads; i++) {
+        struct pool_thread *t = &p->threads[i];
+        t->local = NULL;
+        t->nlocal = 0;
+        t->remote = NULL;
+        t->hits = t->misses = t->jumbo = 0;
+    }
+    return p;
+}
+
+static void free_list(struct buf_hdr *h) {
+    while (h) {
+        struct buf_hdr *next = h->next;
+        free(h);
+        h = next;
+    }
+}
+
+void bufpool_destroy(struct bufpool *p) {
+    if (!p) {
+        return;
+    }
+    for (int i = 0; i < p->nthreads; i++) {
+        free_list(p->threads[i].local);
+        free_list(p->threads[i].remote);
+    }
+    free(p);
+}
+
+// Owner-only counters, read by bufpool_stats from other threads
+static void bump(uint64_t *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static void set_nlocal(struct pool_thread *t, size_t n) {
+    __atomic_store_n(&t->nlocal, n, __ATOMIC_RELAXED);
+}
+
+static void count_out(struct bufpool *p) {
+    size_t n = __atomic_add_fetch(&p->in_use, 1, __ATOMIC_RELAXED);
+    size_t high = __atomic_load_n(&p->high_water, __ATOMIC_RELAXED);
+    while (n > high &&
+           !__atomic_compare_exchange_n(&p->high_water, &high, n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void *bufpool_get(struct bufpool *p, int thread, size_t len) {
+    struct pool_thread *t = &p->threads[thread];
+    struct buf_hdr *h;
+
+    if (len > BUFPOOL_BUF_SIZE) {
+        h = malloc(sizeof(*h) + len);
+        if (!h) {
+            return NULL;
+        }
+        h->home = HOME_JUMBO;
+        h->size = (uint32_t)len;
+        bump(&t->jumbo);
+        count_out(p);
+        return hdr_data(h);
+    }
+
+    if (!t->local && __atomic_load_n(&t->remote, __ATOMIC_RELAXED)) {
+        // Take back everything other threads returned, keeping at most
+        // max_cached of it
+        struct buf_hdr *back = __atomic_exchange_n(&t->remote, NULL, __ATOMIC_ACQUIRE);
+        size_t n = 0;
+        while (back) {
+            struct buf_hdr *next = back->next;
+            if (n < p->max_cached || n == 0) {
+                back->next = t->local;
+                t->local = back;
+                n++;
+            } else {
+                free(back);
+            }
+            back = next;
+        }
+        set_nlocal(t, n);
+    }
+
+    h = t->local;
+    if (h) {
+        t->local = h->next;
+        set_nlocal(t, t->nlocal - 1);
+        bump(&t->hits);
+    } else {
+        h = malloc(sizeof(*h) + BUFPOOL_BUF_SIZE);
+        if (!h) {
+            return NULL;
+        }
+        h->home = thread;
+        h->size = BUFPOOL_BUF_SIZE;
+        bump(&t->misses);
+    }
+    count_out(p);
+    return hdr_data(h);
+}
+
+void bufpool_put(struct bufpool *p, int thread, void *buf) {
+    if (!buf) {
+        return;
+    }
+    struct buf_hdr *h = data_hdr(buf);
+    __atomic_sub_fetch(&p->in_use, 1, __ATOMIC_RELAXED);
+
+    if (h->home == HOME_JUMBO) {
+        free(h);
+        return;
+    }
+
+    struct pool_thread *home = &p->threads[h->home];
+    if (h->home != thread) {
+        h->next = __atomic_load_n(&home->remote, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&home->remote, &h->next, h, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        return;
+    }
+
+    if (home->nlocal >= p->max_cached) {
+        free(h);
+        return;
+    }
+    h->next = home->local;
+    home->local = h;
+    set_nlocal(home, home->nlocal + 1);
+}
+
+size_t bufpool_size(const void *buf) {
+    return data_hdr(buf)->size;
+}
+
+void bufpool_stats(const struct bufpool *p, struct bufpool_stats *out) {
+    out->hits = out->misses = out->jumbo = 0;
+    out->cached = 0;
+    for (int i = 0; i < p->nthreads; i++) {
+        const struct pool_thread *t = &p->threads[i];
+        out->hits += __atomic_load_n(&t->hits, __ATOMIC_RELAXED);
+        out->misses += __atomic_load_n(&t->misses, __ATOMIC_RELAXED);
+        out->jumbo += __atomic_load_n(&t->jumbo, __ATOMIC_RELAXED);
+        out->cached += __atomic_load_n(&t->nlocal, __ATOMIC_RELAXED);
+    }
+    out->in_use = __atomic_load_n(&p->in_use, __ATOMIC_RELAXED);
+    out->high_water = __atomic_load_n(&p->high_water, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,76 @@
+//
+//  bufpool.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  Packet buffer pool shared by the workers. Buffers are MTU-sized; larger
+//  requests take a malloc slow path and are counted as jumbo. Each worker
+//  keeps its own free list, and a buffer always goes back to the worker
+//  that allocated it: workers are pinned, so the memory stays on the NUMA
+//  node that first touched it. A buffer freed by another worker is pushed
+//  onto its home worker's lock-free return list, and the home worker picks
+//  those up when its own list runs out.
+//
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Client MTU (1400) plus framing, with room for header growth
+#define BUFPOOL_BUF_SIZE 2048
+
+#define BUFPOOL_MAX_THREADS 64
+
+struct bufpool;
+
+struct bufpool_stats {
+    uint64_t hits;          // served from a free list
+    uint64_t misses;        // pooled size, but the free list was empty
+    uint64_t jumbo;         // larger than a pooled buffer
+    size_t in_use;          // buffers checked out now
+    size_t high_water;      // most buffers checked out at once
+    size_t cached;          // buffers on free lists
+};
+
+/**
+ * Create a pool
+ * @param nthreads Threads that get and put buffers, ids 0..nthreads-1
+ * @param max_cached Free buffers each thread keeps; the rest are freed
+ * @return Pool, or NULL on allocation failure
+ */
+struct bufpool *bufpool_create(int nthreads, size_t max_cached);
+
+/**
+ * Free the pool and every cached buffer; all buffers must be back
+ */
+void bufpool_destroy(struct bufpool *p);
+
+/**
+ * Check out a buffer
+ * @param p Pool
+ * @param thread Calling thread id
+ * @param len Bytes needed
+ * @return Buffer of at least len bytes, or NULL on allocation failure
+ */
+void *bufpool_get(struct bufpool *p, int thread, size_t len);
+
+/**
+ * Return a buffer; any thread may return any buffer
+ * @param p Pool
+ * @param thread Calling thread id
+ * @param buf Buffer from bufpool_get, or NULL
+ */
+void bufpool_put(struct bufpool *p, int thread, void *buf);
+
+/**
+ * Usable size of a buffer
+ */
+size_t bufpool_size(const void *buf);
+
+/**
+ * Counters summed over all threads; approximate while threads are running
+ */
+void bufpool_stats(const struct bufpool *p, struct bufpool_stats *out);
+
+#endif
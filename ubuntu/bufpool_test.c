@@ -0,0 +1,157 @@
+//
+//  bufpool_test.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#include "bufpool.h"
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+void test_reuse_and_counters() {
+    struct bufpool *p = bufpool_create(1, 16);
+    struct bufpool_stats st;
+
+    void *a = bufpool_get(p, 0, 1400);
+    assert(a && bufpool_size(a) == BUFPOOL_BUF_SIZE);
+    memset(a, 0x11, 1400);
+    void *b = bufpool_get(p, 0, BUFPOOL_BUF_SIZE);
+    bufpool_put(p, 0, a);
+
+    // The most recently returned buffer comes back first
+    void *c = bufpool_get(p, 0, 64);
+    assert(c == a);
+
+    bufpool_stats(p, &st);
+    assert(st.misses == 2 && st.hits == 1 && st.jumbo == 0);
+    assert(st.in_use == 2 && st.high_water == 2);
+
+    bufpool_put(p, 0, b);
+    bufpool_put(p, 0, c);
+    bufpool_stats(p, &st);
+    assert(st.in_use == 0 && st.high_water == 2 && st.cached == 2);
+
+    bufpool_destroy(p);
+    printf("✓ Reuse and counters test passed\n");
+}
+
+void test_jumbo() {
+    struct bufpool *p = bufpool_create(1, 16);
+    struct bufpool_stats st;
+
+    uint8_t *j = bufpool_get(p, 0, 65539);
+    assert(j && bufpool_size(j) == 65539);
+    memset(j, 0x22, 65539);
+    bufpool_put(p, 0, j);
+
+    bufpool_stats(p, &st);
+    assert(st.jumbo == 1 && st.hits == 0 && st.misses == 0);
+    assert(st.in_use == 0 && st.cached == 0);
+
+    bufpool_destroy(p);
+    printf("✓ Jumbo slow path test passed\n");
+}
+
+void test_cache_limit() {
+    struct bufpool *p = bufpool_create(1, 4);
+    struct bufpool_stats st;
+    void *bufs[10];
+
+    for (int i = 0; i < 10; i++) {
+        bufs[i] = bufpool_get(p, 0, 100);
+    }
+    for (int i = 0; i < 10; i++) {
+        bufpool_put(p, 0, bufs[i]);
+    }
+    bufpool_stats(p, &st);
+    assert(st.cached == 4 && st.high_water == 10);
+
+    bufpool_destroy(p);
+    printf("✓ Cache limit test passed\n");
+}
+
+void test_remote_put_returns_home() {
+    struct bufpool *p = bufpool_create(2, 16);
+    struct bufpool_stats st;
+
+    // Allocated by thread 0, freed by thread 1: thread 0 gets it back
+    void *a = bufpool_get(p, 0, 100);
+    bufpool_put(p, 1, a);
+    assert(bufpool_get(p, 1, 100) != a);
+    assert(bufpool_get(p, 0, 100) == a);
+
+    bufpool_stats(p, &st);
+    assert(st.hits == 1 && st.misses == 2);
+
+    bufpool_destroy(p);
+    printf("✓ Remote put test passed\n");
+}
+
+#define CROSS_ROUNDS 100000
+
+struct cross_args {
+    struct bufpool *p;
+    void **slots;
+    int *ready;
+};
+
+// Thread 1 frees whatever thread 0 hands it, like a mailbox
+static void *cross_consumer(void *arg) {
+    struct cross_args *a = arg;
+    for (int i = 0; i < CROSS_ROUNDS; i++) {
+        while (!__atomic_load_n(&a->ready[i % 64], __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+        void *buf = a->slots[i % 64];
+        assert(((uint8_t *)buf)[0] == (uint8_t)i);
+        __atomic_store_n(&a->ready[i % 64], 0, __ATOMIC_RELEASE);
+        bufpool_put(a->p, 1, buf);
+    }
+    return NULL;
+}
+
+void test_cross_thread() {
+    static void *slots[64];
+    static int ready[64];
+    struct bufpool *p = bufpool_create(2, 128);
+    struct cross_args args = { p, slots, ready };
+    struct bufpool_stats st;
+    pthread_t t;
+
+    assert(pthread_create(&t, NULL, cross_consumer, &args) == 0);
+    for (int i = 0; i < CROSS_ROUNDS; i++) {
+        while (__atomic_load_n(&ready[i % 64], __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+        uint8_t *buf = bufpool_get(p, 0, 1400);
+        assert(buf != NULL);
+        buf[0] = (uint8_t)i;
+        slots[i % 64] = buf;
+        __atomic_store_n(&ready[i % 64], 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(t, NULL);
+
+    bufpool_stats(p, &st);
+    assert(st.in_use == 0);
+    assert(st.hits + st.misses == CROSS_ROUNDS);
+    assert(st.misses < CROSS_ROUNDS / 10);
+
+    bufpool_destroy(p);
+    printf("✓ Cross-thread return test passed\n");
+}
+
+int main() {
+    printf("Running buffer pool unit tests...\n");
+
+    test_reuse_and_counters();
+    test_jumbo();
+    test_cache_limit();
+    test_remote_put_returns_home();
+    test_cross_thread();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
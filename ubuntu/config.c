@@ -0,0 +1,91 @@
+//
+//  config.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    size_t len = strlen(s);
+    while (len > 0 && isspace((unsigned char)s[len - 1])) {
+        s[--len] = '\0';
+    }
+    return s;
+}
+
+// Split "name value" or "name = value" in place; returns 0 for a blank
+// line, -1 for an '=' with no value after it
+static int parse_line(char *line, char **name, char **value) {
+    char *hash = strchr(line, '#');
+    if (hash) {
+        *hash = '\0';
+    }
+    line = trim(line);
+    if (*line == '\0') {
+        return 0;
+    }
+
+    size_t len = strcspn(line, " \t=");
+    char *rest = line + len;
+    int assigned = 0;
+    if (*rest) {
+        assigned = *rest == '=';
+        *rest++ = '\0';
+        rest = trim(rest);
+        if (*rest == '=') {
+            assigned = 1;
+            rest = trim(rest + 1);
+        }
+    }
+    *name = line;
+    *value = rest;
+    return assigned && *rest == '\0' ? -1 : 1;
+}
+
+int config_read(const char *path, config_setting_fn fn, void *ctx) {
+    char line[CONFIG_LINE_MAX + 2];
+    int lineno = 0, rc = 0;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *name, *value;
+        lineno++;
+        if (!strchr(line, '\n') && !feof(f)) {
+            fprintf(stderr, "%s:%d: line too long\n", path, lineno);
+            errno = EINVAL;
+            rc = -1;
+            break;
+        }
+        int found = parse_line(line, &name, &value);
+        if (found < 0) {
+            fprintf(stderr, "%s:%d: missing value: %s\n", path, lineno, name);
+            errno = EINVAL;
+            rc = -1;
+            break;
+        }
+        if (found && fn(ctx, name, value) < 0) {
+            fprintf(stderr, "%s:%d: invalid setting: %s %s\n", path, lineno, name, value);
+            errno = EINVAL;
+            rc = -1;
+            break;
+        }
+    }
+    if (rc == 0 && ferror(f)) {
+        rc = -1;
+    }
+    int err = errno;
+    fclose(f);
+    errno = err;
+    return rc;
+}
@@ -0,0 +1,37 @@
+//
+//  config.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  Configuration file reader. A file holds one setting per line, as
+//  "name value" or "name = value"; blank lines and everything after a '#'
+//  are ignored. A name alone has an empty value; an '=' with nothing after
+//  it is an error. What the names mean is up to the caller, which gets
+//  each setting in file order.
+//
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define CONFIG_LINE_MAX 1024
+
+/**
+ * Take one setting
+ * @param ctx Caller's context
+ * @param name Setting name
+ * @param value Its value, trimmed; "" when the line names it alone
+ * @return 0 to go on, -1 to reject the line
+ */
+typedef int (*config_setting_fn)(void *ctx, const char *name, const char *value);
+
+/**
+ * Read a configuration file
+ * @param path File
+ * @param fn Called for every setting
+ * @param ctx Passed to fn
+ * @return 0 on success; -1 if the file cannot be read (errno set) or has a
+ *         line that is too long or rejected, which is reported on stderr
+ *         as path:line
+ */
+int config_read(const char *path, config_setting_fn fn, void *ctx);
+
+#endif
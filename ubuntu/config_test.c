@@ -0,0 +1,113 @@
+//
+//  config_test.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// Settings seen, as "name=value;" one after another
+struct seen {
+    char text[4096];
+    int count;
+    const char *reject;     // name to refuse
+};
+
+static int take(void *ctx, const char *name, const char *value) {
+    struct seen *s = ctx;
+    if (s->reject && strcmp(name, s->reject) == 0) {
+        return -1;
+    }
+    size_t len = strlen(s->text);
+    snprintf(s->text + len, sizeof(s->text) - len, "%s=%s;", name, value);
+    s->count++;
+    return 0;
+}
+
+static void write_file(char *path, const char *text) {
+    strcpy(path, "/tmp/config_test.XXXXXX");
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+    close(fd);
+}
+
+void test_read() {
+    char path[64];
+    struct seen s = { .count = 0 };
+
+    write_file(path,
+               "# Net-Rewire tunnel server\n"
+               "\n"
+               "workers 4\n"
+               "  batch-bytes   =  32768   # smaller batches\n"
+               "udp\n"
+               "socket-tuning=nodelay,cc=bbr\n"
+               "capture = /var/tmp/t.pcapng\n"
+               "\tmetrics\t127.0.0.1:9100\n"
+               "offload\n"
+               "last 1");
+    assert(config_read(path, take, &s) == 0);
+    assert(strcmp(s.text, "workers=4;batch-bytes=32768;udp=;socket-tuning=nodelay,cc=bbr;"
+                          "capture=/var/tmp/t.pcapng;metrics=127.0.0.1:9100;offload=;last=1;") == 0);
+    assert(s.count == 8);
+
+    unlink(path);
+    printf("✓ Read test passed\n");
+}
+
+void test_errors() {
+    char path[64];
+    struct seen s = { .count = 0, .reject = "bogus" };
+
+    // A rejected line stops the read there
+    write_file(path, "workers 4\nbogus 1\nudp\n");
+    errno = 0;
+    assert(config_read(path, take, &s) < 0 && errno == EINVAL);
+    assert(s.count == 1);
+    unlink(path);
+
+    // So does an '=' without a value
+    write_file(path, "workers 4\noffload =\nudp\n");
+    s.count = 0;
+    errno = 0;
+    assert(config_read(path, take, &s) < 0 && errno == EINVAL && s.count == 1);
+    unlink(path);
+    write_file(path, "offload=  # on\n");
+    s.count = 0;
+    assert(config_read(path, take, &s) < 0 && errno == EINVAL && s.count == 0);
+    unlink(path);
+
+    // So does a line too long to hold
+    char *text = malloc(CONFIG_LINE_MAX + 64);
+    memset(text, 'x', CONFIG_LINE_MAX + 10);
+    strcpy(text + CONFIG_LINE_MAX + 10, " 1\n");
+    write_file(path, text);
+    s.count = 0;
+    assert(config_read(path, take, &s) < 0 && errno == EINVAL && s.count == 0);
+    free(text);
+    unlink(path);
+
+    errno = 0;
+    assert(config_read("/nonexistent/tunnel.conf", take, &s) < 0 && errno == ENOENT);
+
+    printf("✓ Error test passed\n");
+}
+
+int main() {
+    printf("Running configuration file unit tests...\n");
+
+    test_read();
+    test_errors();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
@@ -0,0 +1,97 @@
+//
+//  dgram.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#define _GNU_SOURCE
+
+#include "dgram.h"
+
+#include <string.h>
+#include <errno.h>
+
+void dgram_batch_init(struct dgram_batch *b) {
+    b->count = 0;
+}
+
+int dgram_batch_add(struct dgram_batch *b, const struct sockaddr_in *to, const void *data, size_t len) {
+    if (b->count == DGRAM_BATCH_MAX) {
+        return -1;
+    }
+    int i = b->count++;
+    b->addrs[i] = *to;
+    b->iov[i].iov_base = (void *)data;
+    b->iov[i].iov_len = len;
+
+    struct msghdr *h = &b->msgs[i].msg_hdr;
+    memset(h, 0, sizeof(*h));
+    h->msg_name = &b->addrs[i];
+    h->msg_namelen = sizeof(b->addrs[i]);
+    h->msg_iov = &b->iov[i];
+    h->msg_iovlen = 1;
+    return 0;
+}
+
+int dgram_batch_full(const struct dgram_batch *b) {
+    return b->count == DGRAM_BATCH_MAX;
+}
+
+int dgram_batch_send(struct dgram_batch *b, int fd) {
+    int next = 0;
+    int sent = 0;
+
+    while (next < b->count) {
+        int n = sendmmsg(fd, b->msgs + next, b->count - next, MSG_DONTWAIT);
+        if (n > 0) {
+            next += n;
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+            // Only the first datagram failed; the others may still go
+            next++;
+            continue;
+        }
+        break;
+    }
+
+    b->count = 0;
+    return sent;
+}
+
+void dgram_rx_init(struct dgram_rx *rx) {
+    memset(rx->msgs, 0, sizeof(rx->msgs));
+    for (int i = 0; i < DGRAM_RX_MAX; i++) {
+        rx->iov[i].iov_base = rx->slots[i];
+        rx->iov[i].iov_len = DGRAM_SLOT_SIZE;
+        rx->msgs[i].msg_hdr.msg_name = &rx->addrs[i];
+        rx->msgs[i].msg_hdr.msg_iov = &rx->iov[i];
+        rx->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+int dgram_rx_recv(struct dgram_rx *rx, int fd) {
+    // The kernel shrinks the name length to what it stored
+    for (int i = 0; i < DGRAM_RX_MAX; i++) {
+        rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->addrs[i]);
+    }
+
+    int n;
+    do {
+        n = recvmmsg(fd, rx->msgs, DGRAM_RX_MAX, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+const uint8_t *dgram_rx_get(const struct dgram_rx *rx, int i, size_t *len, const struct sockaddr_in **from) {
+    const struct mmsghdr *m = &rx->msgs[i];
+    if (m->msg_hdr.msg_flags & MSG_TRUNC) {
+        return NULL;
+    }
+    *len = m->msg_len;
+    *from = &rx->addrs[i];
+    return rx->slots[i];
+}
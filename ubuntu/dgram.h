@@ -0,0 +1,99 @@
+//
+//  dgram.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  Batched UDP I/O for the datagram transport, where every datagram carries
+//  exactly one IP packet and nothing else. Receiving fills a fixed set of
+//  slots with one recvmmsg(); sending gathers packets for any number of
+//  clients and hands them to the kernel with as few sendmmsg() calls as
+//  the socket allows. struct mmsghdr needs _GNU_SOURCE.
+//
+
+#ifndef DGRAM_H
+#define DGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+// Datagrams per sendmmsg() / recvmmsg()
+#define DGRAM_BATCH_MAX 64
+#define DGRAM_RX_MAX 32
+
+// Receive slot size. Clients keep their tunnel MTU below this, so a packet
+// that does not fit is not one of theirs and is dropped.
+#define DGRAM_SLOT_SIZE 2048
+
+struct dgram_batch {
+    struct mmsghdr msgs[DGRAM_BATCH_MAX];
+    struct iovec iov[DGRAM_BATCH_MAX];
+    struct sockaddr_in addrs[DGRAM_BATCH_MAX];
+    int count;
+};
+
+struct dgram_rx {
+    struct mmsghdr msgs[DGRAM_RX_MAX];
+    struct iovec iov[DGRAM_RX_MAX];
+    struct sockaddr_in addrs[DGRAM_RX_MAX];
+    uint8_t slots[DGRAM_RX_MAX][DGRAM_SLOT_SIZE];
+};
+
+/**
+ * Empty a batch
+ */
+void dgram_batch_init(struct dgram_batch *b);
+
+/**
+ * Queue one datagram; the batch points at data until it is sent
+ * @param b Batch
+ * @param to Destination, copied
+ * @param data Payload
+ * @param len Payload length
+ * @return 0 on success, -1 if the batch is full
+ */
+int dgram_batch_add(struct dgram_batch *b, const struct sockaddr_in *to, const void *data, size_t len);
+
+/**
+ * Whether the batch has no room for another datagram
+ */
+int dgram_batch_full(const struct dgram_batch *b);
+
+/**
+ * Send the whole batch on a non-blocking socket. A datagram the kernel
+ * refuses (e.g. no route to its client) is skipped, and once the socket
+ * buffer is full the rest are dropped: loss recovery is the inner
+ * protocol's job.
+ * @param b Batch, emptied either way
+ * @param fd UDP socket
+ * @return Datagrams sent
+ */
+int dgram_batch_send(struct dgram_batch *b, int fd);
+
+/**
+ * Point every receive slot at its buffer
+ */
+void dgram_rx_init(struct dgram_rx *rx);
+
+/**
+ * Receive whatever is queued, up to DGRAM_RX_MAX datagrams, without blocking
+ * @param rx Receive slots
+ * @param fd UDP socket
+ * @return Datagrams received, or -1 on error (errno set; EAGAIN included).
+ *         Fewer than DGRAM_RX_MAX means the socket queue ran dry.
+ */
+int dgram_rx_recv(struct dgram_rx *rx, int fd);
+
+/**
+ * One received datagram
+ * @param rx Receive slots
+ * @param i Index below the count the last dgram_rx_recv() returned
+ * @param len Output: payload length
+ * @param from Output: sender
+ * @return Payload, valid until the next receive, or NULL if the datagram
+ *         was truncated to fit its slot
+ */
+const uint8_t *dgram_rx_get(const struct dgram_rx *rx, int i, size_t *len, const struct sockaddr_in **from);
+
+#endif
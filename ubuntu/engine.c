@@ -0,0 +1,3100 @@
+//
+//  engine.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#define _GNU_SOURCE
+
+#include "engine.h"
+#include "bufpool.h"
+#include "dgram.h"
+#include "frame.h"
+#include "gso.h"
+#include "ip6.h"
+#include "lz.h"
+#include "metrics.h"
+#include "pmtu.h"
+#include "qsbr.h"
+#include "ratelimit.h"
+#include "replay.h"
+#include "seal.h"
+#include "session_table.h"
+#include "stripe.h"
+#include "uring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/virtio_net.h>
+
+#define EPOLL_BATCH 64
+#define SESSION_TX_CAP (256 * 1024)
+#define SESSION_TABLE_INITIAL 1024
+#define POOL_CACHED_PER_WORKER 4096
+
+// Resumable sessions: frames kept for resending, how long a session waits
+// for its client to come back, and how often the client is told what
+// arrived (whichever of frames or bytes comes first)
+#define SESSION_REPLAY_CAP (128 * 1024)
+#define SESSION_LINGER_MS 30000
+#define SESSION_ACK_FRAMES 64
+#define SESSION_ACK_BYTES (32 * 1024)
+
+// Clients share a worker's TUN by deficit round-robin: a readable session
+// may write this many bytes of packets per turn, and one with more waits
+// behind the others for its next. Client caps let this long of traffic
+// through at once.
+#define SESSION_QUANTUM (64 * 1024)
+#define CLIENT_BURST_MS 100
+
+// Sealed datagram clients: at most this many at once. One that sent nothing
+// after its handshake is dropped after PEER_HANDSHAKE_MS, one that went
+// quiet after PEER_IDLE_MS. Clients send keepalives well within that, and
+// shake hands again once theirs go unanswered.
+#define PEERS_MAX 4096
+#define PEER_HANDSHAKE_MS 10000
+#define PEER_IDLE_MS (60 * 1000)
+
+// TUN packets waiting to be batched; flushed whenever less than one maximum
+// read of room is left. With offloads every read starts with a virtio-net
+// header, whose bytes later hold the prefix of a GSO frame.
+#define TUN_VNET_HDR_LEN sizeof(struct virtio_net_hdr)
+#define TUN_READ_MAX (TUN_VNET_HDR_LEN + ENGINE_MAX_PACKET)
+#define WORKER_BURST_SIZE (8 * TUN_READ_MAX)
+
+// io_uring backend: ring sizes, the provided buffers every client socket
+// of a worker receives into, TUN reads kept in flight, and the registered
+// arena TUN writes are staged in until they complete
+#define RING_SQ_ENTRIES 1024
+#define RING_CQ_ENTRIES 8192
+#define RING_RECV_BUFFERS 256
+#define RING_RECV_BUFFER_SIZE (16 * 1024)
+#define RING_TUN_READS 16
+#define RING_TUN_WRITE_ARENA (1024 * 1024)
+
+// UDP segmentation offload; older headers predate it
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4 5
+#endif
+
+enum source_type {
+    SRC_LISTENER,
+    SRC_TUN,
+    SRC_WAKEUP,
+    SRC_FLUSH,
+    SRC_SESSION,
+    SRC_UDP,
+};
+
+// Every epoll registration points at one of these, so the loop can tell the
+// listener, TUN and client sockets apart without a lookup. Aligned so ring
+// requests can tag its address in the low bits.
+struct source {
+    enum source_type type;
+    int fd;                         // io_uring backend: polled again if a multishot poll ends
+    uint32_t events;
+} __attribute__((aligned(8)));
+
+// io_uring backend: what a completion is for, in the low bits of its
+// user_data; the rest is a pointer or a TUN read slot. Cancellations
+// complete with 0.
+enum ring_op {
+    RING_OP_POLL = 1,           // multishot poll on a source other than a client socket
+    RING_OP_SESSION_POLL,       // multishot poll on a client socket
+    RING_OP_SESSION_WRITABLE,   // multishot poll for room to send, once data comes by receive
+    RING_OP_SESSION_RECV,       // multishot receive on a client socket
+    RING_OP_TUN_READ,
+    RING_OP_TUN_WRITE,
+};
+#define RING_OP_BITS 3
+#define RING_OP_MASK ((1u << RING_OP_BITS) - 1)
+
+struct session;
+
+// io_uring backend: a client socket's requests on its worker's ring.
+// Completions reach the session through this, so the session can leave the
+// ring (closed, detached, migrated) while its requests are being
+// cancelled; the link goes with the last of them.
+struct ring_link {
+    struct session *session;    // NULL once the session left the ring
+    int armed;                  // multishot requests not yet ended
+    int recv;                   // data arrives by multishot receive, not through poll
+    struct ring_link *prev, *next;  // every link of the worker
+};
+
+struct worker;
+
+// Compression state of one connection, when its HELLO asked for it: both
+// histories and the frames of the last chunk received that are not written
+// yet. Taken from the buffer pool once per connection; histories start
+// empty on a resumed one.
+struct session_lz {
+    struct lz_encoder tx;
+    struct lz_decoder rx;
+    struct frame_decoder frames;
+    int tx_on;                      // our HELLO is out; frames after it go compressed
+};
+
+#define SESSION_LZ_MEM (sizeof(struct session_lz) + LZ_ENCODER_MEM + LZ_DECODER_MEM)
+
+// Encryption state of a connection to a server with a key. The connection
+// opens with a KEY exchange, and every frame after it comes in a sealed
+// record, decrypted in place in the receive buffer. A record stays there
+// until all its frames are taken, so one left half-read by a migration or
+// a resume travels with the session, already decrypted.
+struct session_seal {
+    struct seal_stream tx, rx;
+    int keyed;                      // KEY exchange done; frames go sealed both ways
+    int open;                       // the record at the head of rx is decrypted
+    size_t open_len;                // its frames' bytes
+    size_t taken;                   // of those, taken before the session stopped reading
+    struct frame_decoder frames;    // its frames not taken yet, while reading
+};
+
+// What a client may send on to the TUN per second (ratelimit.h)
+struct client_limit {
+    struct rate_bucket bytes;
+    struct rate_bucket packets;
+    unsigned gen;                   // limits generation the buckets were set up for
+};
+
+// The connections a client opened as one pool (stripe.h), on the worker
+// that owns its tunnel address; the table holds one of them. Members whose
+// connection was lost stay in place, buffering for their resume.
+struct stripe_group {
+    unsigned count;                 // pool size the client named
+    unsigned members;               // slots filled
+    struct session *slots[STRIPE_MAX];
+    struct client_limit limit;      // shared by the pool's connections
+};
+
+// One connected client
+struct session {
+    struct source src;
+    int fd;
+    struct worker *worker;
+    struct sockaddr_in peer;
+    uint32_t inner_ip;              // tunnel address (network order), learned from traffic
+    int published;                  // inner_ip maps to this session in the table,
+                                    // or to another of its stripe group
+    struct session *prev, *next;
+    unsigned stripe, stripes;       // place in the client's pool and its size; 0 stripes
+                                    // for a client with one connection
+    struct stripe_group *group;     // owner worker only: while published in a pool
+
+    // Frames received but not yet written to the TUN. The decoder works in
+    // the worker's scratch buffer while the socket is read; bytes left over
+    // are parked in a pooled buffer, so idle sessions hold none.
+    struct frame_decoder rx;
+    uint8_t *rx_park;
+
+    // Bytes the socket would not take yet, flushed on EPOLLOUT
+    uint8_t *tx_buf;
+    size_t tx_off;
+    size_t tx_len;
+
+    // Packets for this client from the current TUN burst, sent in one writev
+    struct frame_batch batch;
+    int dirty;                      // on the worker's dirty list
+    struct session *dirty_prev, *dirty_next;
+
+    // Fair share of the TUN: bytes this turn may still write, and the
+    // worker's queue of sessions left with data to read
+    size_t deficit;
+    int deferred;
+    struct session *defer_prev, *defer_next;
+    struct client_limit limit;      // unless the client's pool has one
+
+    // Resumable sessions, opened by a HELLO; id is 0 for clients without one
+    uint64_t id;
+    uint64_t rx_seq;                // data frames received from the client
+    uint64_t rx_acked;              // rx_seq last reported to the client
+    size_t rx_unacked_bytes;
+    struct replay replay;           // data frames sent, until acknowledged
+    uint8_t hello[FRAME_HELLO_FEATURES_LEN];
+    uint8_t ack[FRAME_ACK_LEN];
+    int detached;                   // connection lost, waiting for the client
+    uint64_t linger_until;          // CLOCK_MONOTONIC ms at which a detached session ends
+    uint64_t resume_id;             // session this new connection asked to resume
+    uint64_t resume_seq;            // data frames the client had received in it
+    int gso;                        // the client segments super-packets itself
+    uint64_t batch_since;           // ns at which the oldest packet in batch was read
+    struct session_lz *lz;          // the connection is compressed
+    struct session_seal *seal;      // the server has a key
+
+    struct ring_link *ring;         // io_uring backend: while the socket is on the ring
+
+    // Packets and bytes each way over the session's life, told when it ends
+    uint64_t to_client_packets, to_client_bytes;
+    uint64_t from_client_packets, from_client_bytes;
+};
+
+// Where a datagram client's packets for one tunnel address come from. A
+// plain peer is never changed once published: a client that moves gets a
+// new peer, and the old one is released through QSBR, so readers need no
+// lock. A sealed one is the client's end of a handshake; it keeps its keys
+// when the client moves, so its address is read and changed under its lock.
+struct peer {
+    struct sockaddr_in addr;
+    uint32_t inner_ip;              // sealed: atomic, 0 until its first packet
+
+    // Sealed datagrams only
+    uint32_t id;                    // what the client's datagrams carry
+    pthread_mutex_t lock;           // held sealing, opening and moving
+    struct seal_stream tx, rx;
+    uint64_t created_ns;
+    uint64_t heard_ns;              // atomic: last datagram opened, 0 before the first
+    struct peer *next;              // in engine.sealed_peers
+};
+
+enum mail_kind {
+    MAIL_PACKET,        // TUN packet read by a worker that does not own its destination
+    MAIL_SESSION,       // session handed over once its tunnel address is known
+    MAIL_RESUME,        // new connection for a resumable session this worker owns
+    MAIL_LIMITS,        // engine_reload(): a struct reload in data; malloc()ed, as the
+                        // main thread has no bufpool cache
+};
+
+struct reload {
+    struct engine_limits limits;
+    unsigned gen;
+};
+
+struct mail {
+    struct mail *next;
+    enum mail_kind kind;
+    struct session *session;
+    uint32_t dst;
+    uint16_t gso_size;          // segment payload size of a super-packet, else 0
+    uint64_t read_ns;           // when the packet came off the TUN
+    size_t len;
+    uint8_t data[];
+};
+
+struct worker {
+    int id;
+    int epfd;
+    int tun_fd;                 // this worker's TUN queue, or -1
+    int tun_wfd;                // queue used for client->TUN writes
+    struct source tun;
+    struct source wakeup;
+    int wakeup_fd;
+    struct source flush;
+    int flush_fd;               // timerfd bounding how long batches are held
+    int flush_armed;
+    pthread_t thread;
+    struct session *sessions;
+    int detached;               // sessions on the list waiting for a resume
+
+    pthread_mutex_t mail_lock;
+    struct mail *mail_head, *mail_tail;
+
+    // Receive buffer every session decodes in while it is being read
+    uint8_t *rx_scratch;
+    uint8_t *lz_out;                // compressed frames of the batch being sent
+    struct frame_batch *lz_batch;
+    uint8_t *seal_out;              // sealed records of the batch being sent
+    struct frame_batch *seal_batch;
+
+    // With offloads: a super-packet being cut up for a client that cannot
+    // take it whole, copied out of the burst buffer the segments go to
+    uint8_t *gso_scratch;
+    struct gso_iter gso;
+
+    // Batched packets point in here until their session is flushed
+    uint8_t *burst;
+    size_t burst_len;
+    struct session *dirty;      // sessions with a non-empty batch
+
+    // Sessions waiting for another turn to read, oldest first
+    struct session *deferred, *deferred_tail;
+    unsigned ndeferred;
+
+    // Stream transport: the listener this worker accepts on, its own or
+    // engine.listen_fd
+    int listen_fd;
+
+    // The limits in force here; engine_reload() mails every worker new ones
+    struct engine_limits limits;
+    unsigned limits_gen;
+
+    // Datagram transport: this worker's socket, its receive slots, and the
+    // packets from the current TUN burst, sent with one sendmmsg
+    int udp_fd;
+    struct source udp;
+    struct dgram_rx *udp_rx;
+    struct dgram_batch *udp_tx;
+    uint8_t (*udp_sealed)[DGRAM_SLOT_SIZE];     // with a key: the datagrams udp_tx points at
+    uint64_t udp_since;         // ns at which the oldest datagram in udp_tx was read
+
+    // io_uring backend: the ring every request of this worker goes through.
+    // TUN reads land in registered slots and are copied into the burst
+    // buffer; TUN writes are staged in a registered arena, reused once
+    // every write in it completed.
+    struct uring *ring;
+    uint8_t *tun_rx;
+    uint8_t *tun_tx;
+    size_t tun_tx_used;
+    unsigned tun_tx_inflight;
+    int tun_burst;              // TUN packets arrived in this batch of completions
+    struct io_uring_cqe *held;  // completions set aside while the arena drained,
+    unsigned nheld;             // handled first in the next iteration
+    struct ring_link *links;
+
+    // Written by this worker only; the stats endpoint reads them any time.
+    // Latencies start when the loop woke up with the packet: wake_ns, and
+    // read_ns and recv_ns for the packet being routed or frames being taken.
+    uint64_t wake_ns;
+    uint64_t read_ns;
+    uint64_t recv_ns;
+    struct metrics metrics;
+
+    // This worker's chunk of the capture, if there is one
+    struct pcapng_writer capture;
+};
+
+static struct {
+    int nworkers;
+    enum engine_transport transport;
+    enum engine_backend backend;
+    int listen_fd;                  // shared by every worker, or -1 with one each
+    int pin_cpus;
+    int vnet_hdr;                   // TUN reads and writes carry a virtio-net header
+    int compress;                   // grant FRAME_FEATURE_LZ to clients asking for it
+    int encrypt;                    // connections must open with a KEY exchange,
+                                    // datagrams with a HELLO
+    uint8_t key[SEAL_KEY_LEN];
+    struct engine_limits limits;    // at startup; workers keep their own copy
+    unsigned limits_gen;            // bumped by every engine_reload()
+    struct pcapng *capture;
+    struct source listener;
+    struct worker *workers;
+    struct session_table *table;    // inner address -> session, read by every worker
+    struct bufpool *pool;           // parked receive bytes and mailed packets
+    struct session_table *resumable;    // low 32 bits of a session id -> session
+    uint32_t next_key;
+    uint32_t tunnel_net;            // clients' tunnel addresses lie in this subnet
+    uint32_t tunnel_mask;
+    struct session_table *peers;    // datagram transport: inner address -> peer
+    struct session_table *peer_ids; // sealed datagrams: peer id -> peer
+    struct peer *sealed_peers;      // every sealed peer, under peer_lock
+    unsigned nsealed;
+    pthread_mutex_t peer_lock;      // serializes replacing a peer
+    volatile int running;
+} engine;
+
+static void wake_worker(struct worker *w) {
+    uint64_t one = 1;
+    if (write(w->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Error waking worker");
+    }
+}
+
+// A session's owner is read by other workers routing TUN packets to it
+static struct worker *session_owner(const struct session *s) {
+    return __atomic_load_n(&s->worker, __ATOMIC_ACQUIRE);
+}
+
+static void session_link(struct worker *w, struct session *s) {
+    __atomic_store_n(&s->worker, w, __ATOMIC_RELEASE);
+    s->prev = NULL;
+    s->next = w->sessions;
+    if (w->sessions) {
+        w->sessions->prev = s;
+    }
+    w->sessions = s;
+}
+
+static void session_unlink(struct worker *w, struct session *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        w->sessions = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    s->prev = s->next = NULL;
+}
+
+static void session_mark_dirty(struct worker *w, struct session *s) {
+    if (s->dirty) {
+        return;
+    }
+    s->dirty = 1;
+    s->dirty_prev = NULL;
+    s->dirty_next = w->dirty;
+    if (w->dirty) {
+        w->dirty->dirty_prev = s;
+    }
+    w->dirty = s;
+}
+
+static void session_mark_clean(struct worker *w, struct session *s) {
+    if (!s->dirty) {
+        return;
+    }
+    if (s->dirty_prev) {
+        s->dirty_prev->dirty_next = s->dirty_next;
+    } else {
+        w->dirty = s->dirty_next;
+    }
+    if (s->dirty_next) {
+        s->dirty_next->dirty_prev = s->dirty_prev;
+    }
+    s->dirty = 0;
+    s->dirty_prev = s->dirty_next = NULL;
+}
+
+// Queue a session whose turn ended with data left to read
+static void session_defer(struct worker *w, struct session *s) {
+    if (s->deferred) {
+        return;
+    }
+    s->deferred = 1;
+    s->defer_next = NULL;
+    s->defer_prev = w->deferred_tail;
+    if (w->deferred_tail) {
+        w->deferred_tail->defer_next = s;
+    } else {
+        w->deferred = s;
+    }
+    w->deferred_tail = s;
+    w->ndeferred++;
+}
+
+static void session_undefer(struct worker *w, struct session *s) {
+    if (!s->deferred) {
+        return;
+    }
+    if (s->defer_prev) {
+        s->defer_prev->defer_next = s->defer_next;
+    } else {
+        w->deferred = s->defer_next;
+    }
+    if (s->defer_next) {
+        s->defer_next->defer_prev = s->defer_prev;
+    } else {
+        w->deferred_tail = s->defer_prev;
+    }
+    s->deferred = 0;
+    s->defer_prev = s->defer_next = NULL;
+    w->ndeferred--;
+}
+
+// Each cap holds up to CLIENT_BURST_MS of traffic; the byte bucket always
+// holds at least one packet of the largest size
+static void client_limit_init(struct worker *w, struct client_limit *l) {
+    uint64_t byte_rate = w->limits.client_bytes_per_sec, packet_rate = w->limits.client_packets_per_sec;
+    uint64_t bytes = byte_rate * CLIENT_BURST_MS / 1000;
+    uint64_t packets = packet_rate * CLIENT_BURST_MS / 1000;
+    rate_bucket_init(&l->bytes, byte_rate, bytes > ENGINE_MAX_PACKET ? bytes : ENGINE_MAX_PACKET);
+    rate_bucket_init(&l->packets, packet_rate, packets > 1 ? packets : 1);
+    l->gen = w->limits_gen;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t ring_data(const void *ptr, enum ring_op op) {
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+// Poll one of the worker's sources through the ring until cancelled
+static int ring_poll_source(struct worker *w, struct source *src) {
+    if (uring_poll_multishot(w->ring, src->fd, src->events, ring_data(src, RING_OP_POLL)) < 0) {
+        fprintf(stderr, "Error queueing poll request\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int ring_arm(struct worker *w, struct ring_link *l, enum ring_op op) {
+    int fd = l->session->fd;
+    int rc;
+    if (op == RING_OP_SESSION_RECV) {
+        rc = uring_recv_multishot(w->ring, fd, ring_data(l, op));
+    } else {
+        uint32_t events = op == RING_OP_SESSION_POLL ? POLLIN | POLLOUT | POLLRDHUP : POLLOUT;
+        rc = uring_poll_multishot(w->ring, fd, events, ring_data(l, op));
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Error queueing client socket request\n");
+        return -1;
+    }
+    l->armed++;
+    return 0;
+}
+
+static void ring_link_free(struct worker *w, struct ring_link *l) {
+    if (l->prev) {
+        l->prev->next = l->next;
+    } else {
+        w->links = l->next;
+    }
+    if (l->next) {
+        l->next->prev = l->prev;
+    }
+    free(l);
+}
+
+// Take the client socket off the ring. The link stays until the cancelled
+// requests have completed; the socket is only released then.
+static void ring_unlink_session(struct worker *w, struct session *s) {
+    struct ring_link *l = s->ring;
+    s->ring = NULL;
+    l->session = NULL;
+    if (l->armed == 0) {
+        ring_link_free(w, l);
+        return;
+    }
+    if (l->recv) {
+        uring_cancel(w->ring, ring_data(l, RING_OP_SESSION_WRITABLE));
+        uring_cancel(w->ring, ring_data(l, RING_OP_SESSION_RECV));
+    } else {
+        uring_cancel(w->ring, ring_data(l, RING_OP_SESSION_POLL));
+    }
+}
+
+// Put a client socket on the ring, polled like the epoll backend's sockets
+static int ring_link_session(struct worker *w, struct session *s) {
+    struct ring_link *l = calloc(1, sizeof(*l));
+    if (!l) {
+        return -1;
+    }
+    l->session = s;
+    l->next = w->links;
+    if (w->links) {
+        w->links->prev = l;
+    }
+    w->links = l;
+    s->ring = l;
+    if (ring_arm(w, l, RING_OP_SESSION_POLL) < 0) {
+        ring_unlink_session(w, s);
+        return -1;
+    }
+    return 0;
+}
+
+static int session_lz_start(struct worker *w, struct session *s) {
+    uint8_t *mem = bufpool_get(engine.pool, w->id, SESSION_LZ_MEM);
+    if (!mem) {
+        fprintf(stderr, "Error allocating compression state\n");
+        return -1;
+    }
+    struct session_lz *lz = (struct session_lz *)mem;
+    mem += sizeof(*lz);
+    lz_encoder_init(&lz->tx, mem);
+    lz_decoder_init(&lz->rx, mem + LZ_ENCODER_MEM);
+    frame_decoder_init(&lz->frames, NULL, 0);
+    lz->tx_on = 0;
+    s->lz = lz;
+    return 0;
+}
+
+static void session_lz_stop(struct worker *w, struct session *s) {
+    bufpool_put(engine.pool, w->id, s->lz);
+    s->lz = NULL;
+}
+
+static int session_seal_start(struct worker *w, struct session *s) {
+    struct session_seal *seal = bufpool_get(engine.pool, w->id, sizeof(*seal));
+    if (!seal) {
+        fprintf(stderr, "Error allocating encryption state\n");
+        return -1;
+    }
+    memset(seal, 0, sizeof(*seal));
+    s->seal = seal;
+    return 0;
+}
+
+static void session_seal_stop(struct worker *w, struct session *s) {
+    if (s->seal) {
+        seal_stream_free(&s->seal->tx);
+        seal_stream_free(&s->seal->rx);
+    }
+    bufpool_put(engine.pool, w->id, s->seal);
+    s->seal = NULL;
+}
+
+static void session_free(void *ptr) {
+    struct session *s = ptr;
+    free(s->tx_buf);
+    replay_free(&s->replay);
+    free(s);
+}
+
+// Release a session no worker has registered, e.g. one whose handover failed
+static void session_discard(struct worker *w, struct session *s) {
+    if (s->ring) {
+        ring_unlink_session(w, s);
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    bufpool_put(engine.pool, w->id, s->rx_park);
+    s->rx_park = NULL;
+    session_lz_stop(w, s);
+    session_seal_stop(w, s);
+    if (s->id) {
+        session_table_remove(engine.resumable, (uint32_t)s->id, s);
+    }
+    qsbr_retire(w->id, s, session_free);
+}
+
+static void session_unpublish(struct session *s);
+
+static void session_destroy(struct session *s) {
+    char client_ip[INET_ADDRSTRLEN];
+    struct worker *w = s->worker;
+
+    inet_ntop(AF_INET, &s->peer.sin_addr, client_ip, sizeof(client_ip));
+    printf("Closing connection for client %s:%d: %llu packets (%llu bytes) in, %llu packets (%llu bytes) out\n",
+           client_ip, ntohs(s->peer.sin_port), (unsigned long long)s->from_client_packets,
+           (unsigned long long)s->from_client_bytes, (unsigned long long)s->to_client_packets,
+           (unsigned long long)s->to_client_bytes);
+
+    if (s->published) {
+        session_unpublish(s);
+    }
+    if (s->detached) {
+        w->detached--;
+    }
+    session_mark_clean(w, s);
+    session_undefer(w, s);
+    session_unlink(w, s);
+
+    // Other workers may have looked the session up; free it once they quiesce
+    session_discard(w, s);
+}
+
+// Drop the connection but keep the session, its address and its replay
+// buffer, so the client can resume it. Until then packets for it only go
+// to the replay buffer.
+static void session_detach(struct session *s) {
+    char client_ip[INET_ADDRSTRLEN];
+    struct worker *w = s->worker;
+
+    inet_ntop(AF_INET, &s->peer.sin_addr, client_ip, sizeof(client_ip));
+    printf("Connection lost for client %s:%d, holding session %016llx\n",
+           client_ip, ntohs(s->peer.sin_port), (unsigned long long)s->id);
+
+    session_mark_clean(w, s);
+    session_undefer(w, s);
+    s->deficit = 0;
+    frame_batch_init(&s->batch);
+    if (s->ring) {
+        ring_unlink_session(w, s);
+    }
+    close(s->fd);
+    s->fd = -1;
+
+    // A partial frame either way is resent whole after the resume
+    bufpool_put(engine.pool, w->id, s->rx_park);
+    s->rx_park = NULL;
+    frame_decoder_init(&s->rx, NULL, 0);
+    session_lz_stop(w, s);
+    session_seal_stop(w, s);
+    s->tx_off = 0;
+    s->tx_len = 0;
+
+    s->detached = 1;
+    s->linger_until = now_ms() + SESSION_LINGER_MS;
+    w->detached++;
+}
+
+// The connection failed or ended
+static void session_close(struct session *s) {
+    if (s->id && !s->detached && engine.running) {
+        session_detach(s);
+    } else {
+        session_destroy(s);
+    }
+}
+
+// Take this connection's place in its client's pool: in the group of the
+// session the address was published for, or in a new one if that session
+// is of no pool or of another size. A connection already in the place is
+// replaced, as the latest claim wins.
+static void stripe_join(struct session *s, struct stripe_group *g) {
+    if (!g || g->count != s->stripes) {
+        g = calloc(1, sizeof(*g));
+        if (!g) {
+            // Return traffic takes this connection alone
+            fprintf(stderr, "Error allocating stripe group\n");
+            return;
+        }
+        g->count = s->stripes;
+        client_limit_init(s->worker, &g->limit);
+    }
+    struct session *prev = g->slots[s->stripe];
+    if (prev) {
+        prev->group = NULL;
+        prev->published = 0;
+        g->members--;
+    }
+    g->slots[s->stripe] = s;
+    g->members++;
+    s->group = g;
+}
+
+// Leave the stripe group, freeing it with its last member; returns a member
+// left to stand in for s, if any
+static struct session *stripe_leave(struct session *s) {
+    struct stripe_group *g = s->group;
+    struct session *next = NULL;
+
+    if (!g) {
+        return NULL;
+    }
+    s->group = NULL;
+    g->slots[s->stripe] = NULL;
+    if (--g->members == 0) {
+        free(g);
+        return NULL;
+    }
+    for (unsigned i = 0; i < g->count && !next; i++) {
+        next = g->slots[i];
+    }
+    return next;
+}
+
+// The member of a stripe group a packet's flow goes to, by the hash the
+// client sends the flow's packets with; a place not filled yet passes its
+// flows on to the next
+static struct session *stripe_member(struct session *s, const uint8_t *pkt, size_t len) {
+    struct stripe_group *g = s->group;
+    unsigned first = stripe_pick(stripe_packet_hash(pkt, len), g->count);
+
+    for (unsigned i = 0; i < g->count; i++) {
+        struct session *m = g->slots[(first + i) % g->count];
+        if (m) {
+            return m;
+        }
+    }
+    return s;
+}
+
+// Make this session the one return traffic for its address goes to; the
+// latest session to claim an address wins. A connection of a pool takes it
+// for the whole pool, which return traffic is striped over.
+static void session_publish(struct session *s) {
+    struct session *cur = session_table_lookup(engine.table, s->inner_ip);
+
+    if (session_table_insert(engine.table, s->inner_ip, s, s->worker->id) < 0) {
+        fprintf(stderr, "Error publishing session\n");
+        return;
+    }
+    s->published = 1;
+    if (s->stripes > 1) {
+        stripe_join(s, cur && session_owner(cur) == s->worker ? cur->group : NULL);
+    }
+}
+
+// Stop return traffic going to this session; if the table held it for its
+// pool, another member of the pool is put there instead
+static void session_unpublish(struct session *s) {
+    struct session *next = stripe_leave(s);
+
+    if (session_table_lookup(engine.table, s->inner_ip) == s &&
+        (!next || session_table_insert(engine.table, s->inner_ip, next, s->worker->id) < 0)) {
+        session_table_remove(engine.table, s->inner_ip, s);
+    }
+    s->published = 0;
+}
+
+// Tunnel address a packet comes from, or goes to if dst is set, in network
+// byte order: the IPv4 address, or the one an IPv6 tunnel address embeds,
+// so both of a client's families key the same session. Returns 0 for a
+// packet with neither.
+static int packet_tunnel_addr(const uint8_t *pkt, size_t len, int dst, uint32_t *addr) {
+    if (len >= 20 && (pkt[0] >> 4) == 4) {
+        memcpy(addr, pkt + (dst ? 16 : 12), sizeof(*addr));
+        return 1;
+    }
+    if (len >= IP6_HEADER_LEN && (pkt[0] >> 4) == 6) {
+        return ip6_tunnel_v4(pkt + (dst ? 24 : 8), addr);
+    }
+    return 0;
+}
+
+// The first packet from a client tells us which tunnel address it uses;
+// returns 1 if the session now belongs to another worker
+static int session_learn_address(struct session *s, const uint8_t *pkt, size_t len) {
+    uint32_t src;
+    if (!packet_tunnel_addr(pkt, len, 0, &src) || src == s->inner_ip) {
+        return 0;
+    }
+    if (s->published) {
+        session_unpublish(s);
+    }
+    s->inner_ip = src;
+
+    if (engine_shard(src, engine.nworkers) != s->worker->id) {
+        return 1;
+    }
+    session_publish(s);
+    return 0;
+}
+
+// Push buffered bytes out; returns -1 if the connection failed
+static int session_flush(struct session *s) {
+    while (s->tx_len > 0) {
+        ssize_t sent = send(s->fd, s->tx_buf + s->tx_off, s->tx_len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error sending to client");
+            return -1;
+        }
+        s->tx_off += sent;
+        s->tx_len -= sent;
+    }
+    s->tx_off = 0;
+    return 0;
+}
+
+// Make room for len more bytes behind whatever is already waiting for EPOLLOUT
+static uint8_t *session_reserve(struct session *s, size_t len) {
+    if (!s->tx_buf) {
+        s->tx_buf = malloc(SESSION_TX_CAP);
+        if (!s->tx_buf) {
+            return NULL;
+        }
+    }
+    if (s->tx_len + len > SESSION_TX_CAP) {
+        return NULL;
+    }
+    if (s->tx_off + s->tx_len + len > SESSION_TX_CAP) {
+        memmove(s->tx_buf, s->tx_buf + s->tx_off, s->tx_len);
+        s->tx_off = 0;
+    }
+    uint8_t *dst = s->tx_buf + s->tx_off + s->tx_len;
+    s->tx_len += len;
+    return dst;
+}
+
+// Send the batched frames in one writev and queue what the socket would not
+// take; returns -1 if the connection failed
+static int session_flush_batch(struct session *s) {
+    struct frame_batch *b = &s->batch;
+    uint64_t since = s->batch_since;
+
+    s->batch_since = 0;
+
+    // Compressed frames are only in the worker's scratch until queued below
+    if (s->lz && s->lz->tx_on && b->count > 0) {
+        struct worker *w = s->worker;
+        lz_compress_batch(&s->lz->tx, b, w->lz_batch, w->lz_out);
+        b = w->lz_batch;
+    }
+    if (s->seal && s->seal->keyed && b->count > 0) {
+        struct worker *w = s->worker;
+        if (seal_batch(&s->seal->tx, b, w->seal_batch, w->seal_out) < 0) {
+            fprintf(stderr, "Error encrypting packets to client\n");
+            return -1;
+        }
+        b = w->seal_batch;
+    }
+
+    // Anything already queued goes first, so the whole batch queues behind it
+    if (s->tx_len == 0 && frame_batch_write(b, s->fd) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Error sending packets to client");
+        frame_batch_init(b);
+        return -1;
+    }
+
+    size_t len = frame_batch_pending(b);
+    if (since) {
+        metrics_record(&s->worker->metrics, METRICS_TUN_TO_SOCKET, now_ns() - since);
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    // A frame is either queued completely or dropped before its first byte,
+    // so the stream never loses sync. Resumable sessions count every frame
+    // sent, so rather than drop one they reconnect and resend.
+    uint8_t *dst = session_reserve(s, len);
+    if (!dst && s->id) {
+        fprintf(stderr, "Client send buffer full, dropping connection\n");
+        frame_batch_init(b);
+        return -1;
+    }
+    if (!dst) {
+        len = frame_batch_partial(b);
+        metrics_add(&s->worker->metrics, METRICS_DROPS, (uint64_t)(b->count - b->next / 2 - (len > 0)));
+        if (len > 0) {
+            dst = session_reserve(s, len);
+            if (!dst) {
+                fprintf(stderr, "Client send buffer overflow, closing session\n");
+                frame_batch_init(b);
+                return -1;
+            }
+        }
+    }
+    if (len > 0) {
+        frame_batch_copy(b, dst, len);
+    }
+    frame_batch_init(b);
+    return 0;
+}
+
+// Start the latency deadline for packets held in batches
+static void worker_arm_flush(struct worker *w) {
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = w->limits.batch_delay_us / 1000000,
+            .tv_nsec = (long)(w->limits.batch_delay_us % 1000000) * 1000,
+        },
+    };
+    if (timerfd_settime(w->flush_fd, 0, &its, NULL) < 0) {
+        perror("Error arming flush timer");
+        return;
+    }
+    w->flush_armed = 1;
+}
+
+// Add a packet held in the worker's burst buffer to the session's batch.
+// The batch goes out once it reaches the flush threshold; otherwise at the end
+// of the burst, or at the deadline when one is configured. A super-packet
+// (gso_size set) is only queued for clients that segment it themselves; its
+// GSO frame prefix goes into the headroom in front of it.
+static void session_queue_packet(struct worker *w, struct session *s, uint8_t *pkt, size_t len, uint16_t gso_size) {
+    enum frame_type type = FRAME_TYPE_DATA;
+    if (gso_size) {
+        pkt -= FRAME_GSO_PREFIX_LEN;
+        len += FRAME_GSO_PREFIX_LEN;
+        frame_put_u16(pkt, gso_size);
+        type = FRAME_TYPE_GSO;
+    }
+    s->to_client_packets++;
+    s->to_client_bytes += len;
+    metrics_add(&w->metrics, METRICS_TUN_TO_SOCKET_PACKETS, 1);
+    metrics_add(&w->metrics, METRICS_TUN_TO_SOCKET_BYTES, len);
+
+    if (s->id) {
+        replay_push_typed(&s->replay, type, pkt, len);
+        if (s->detached) {
+            return;
+        }
+    }
+    if (frame_batch_full(&s->batch) && session_flush_batch(s) < 0) {
+        session_close(s);
+        return;
+    }
+    frame_batch_add_typed(&s->batch, type, pkt, len);
+    session_mark_dirty(w, s);
+    if (!s->batch_since) {
+        s->batch_since = w->read_ns;
+    }
+
+    if (frame_batch_pending(&s->batch) >= w->limits.batch_bytes) {
+        if (session_flush_batch(s) < 0) {
+            session_close(s);
+        }
+    } else if (w->limits.batch_delay_us > 0 && !w->flush_armed) {
+        worker_arm_flush(w);
+    }
+}
+
+// Control frames join the batch, so they keep their place among data frames
+static int session_send_control(struct session *s, enum frame_type type, const uint8_t *payload, size_t len) {
+    if (frame_batch_full(&s->batch) && session_flush_batch(s) < 0) {
+        return -1;
+    }
+    frame_batch_add_typed(&s->batch, type, payload, len);
+    return session_flush_batch(s);
+}
+
+// The HELLO of a compressed connection, or one of a pool, names the
+// features granted; the client compresses from then on, and so do we
+static int session_send_hello(struct session *s) {
+    size_t len = FRAME_HELLO_LEN;
+    frame_put_u64(s->hello, s->id);
+    frame_put_u64(s->hello + 8, s->rx_seq);
+    if (s->lz || s->stripes) {
+        frame_put_u32(s->hello + FRAME_HELLO_LEN, (s->lz ? FRAME_FEATURE_LZ : 0) |
+                      (s->gso ? FRAME_FEATURE_GSO : 0) | (s->stripes ? FRAME_FEATURE_STRIPE : 0));
+        len = FRAME_HELLO_FEATURES_LEN;
+    }
+    if (session_send_control(s, FRAME_TYPE_HELLO, s->hello, len) < 0) {
+        return -1;
+    }
+    if (s->lz) {
+        s->lz->tx_on = 1;
+    }
+    return 0;
+}
+
+static int session_send_ack(struct session *s) {
+    s->rx_acked = s->rx_seq;
+    s->rx_unacked_bytes = 0;
+    frame_put_u64(s->ack, s->rx_seq);
+    return session_send_control(s, FRAME_TYPE_ACK, s->ack, sizeof(s->ack));
+}
+
+// Send every frame the client has not received, right after the HELLO
+static int session_send_replay(struct session *s) {
+    struct replay_cursor c;
+    struct frame f;
+
+    replay_cursor_init(&s->replay, &c);
+    while (replay_cursor_next(&s->replay, &c, &f) == 1) {
+        if (frame_batch_full(&s->batch) && session_flush_batch(s) < 0) {
+            return -1;
+        }
+        frame_batch_add_typed(&s->batch, f.type, f.data, f.len);
+    }
+    return session_flush_batch(s);
+}
+
+// Give the session an id and a replay buffer; the id is a counter for the
+// table key and a random tag, so it cannot be guessed from another
+static int session_make_resumable(struct session *s) {
+    uint32_t key, tag;
+    do {
+        key = __atomic_add_fetch(&engine.next_key, 1, __ATOMIC_RELAXED);
+    } while (key == 0);
+    if (getrandom(&tag, sizeof(tag), 0) != sizeof(tag)) {
+        perror("Error generating session id");
+        return -1;
+    }
+    if (replay_init(&s->replay, SESSION_REPLAY_CAP) < 0) {
+        fprintf(stderr, "Error allocating replay buffer\n");
+        return -1;
+    }
+    s->id = ((uint64_t)tag << 32) | key;
+    if (session_table_insert(engine.resumable, key, s, s->worker->id) < 0) {
+        fprintf(stderr, "Error registering session\n");
+        s->id = 0;
+        replay_free(&s->replay);
+        return -1;
+    }
+    return 0;
+}
+
+static void worker_send_datagrams(struct worker *w) {
+    int count = w->udp_tx->count;
+    int sent = dgram_batch_send(w->udp_tx, w->udp_fd);
+    if (sent < count) {
+        metrics_add(&w->metrics, METRICS_DROPS, (uint64_t)(count - sent));
+    }
+    metrics_record(&w->metrics, METRICS_TUN_TO_SOCKET, now_ns() - w->udp_since);
+}
+
+// Send every pending batch; afterwards nothing points into the burst buffer
+static void worker_flush(struct worker *w) {
+    if (w->udp_tx && w->udp_tx->count > 0) {
+        worker_send_datagrams(w);
+    }
+    while (w->dirty) {
+        struct session *s = w->dirty;
+        session_mark_clean(w, s);
+        if (session_flush_batch(s) < 0) {
+            session_close(s);
+        }
+    }
+    w->burst_len = 0;
+}
+
+// Room for one more packet in the burst buffer
+static uint8_t *worker_burst_space(struct worker *w) {
+    if (WORKER_BURST_SIZE - w->burst_len < TUN_READ_MAX) {
+        worker_flush(w);
+    }
+    return w->burst + w->burst_len;
+}
+
+// Burst ended: send now, unless batches may wait for the deadline
+static void worker_burst_done(struct worker *w) {
+    if (w->limits.batch_delay_us == 0) {
+        worker_flush(w);
+    }
+}
+
+static void flush_expired(struct worker *w) {
+    uint64_t count;
+    if (read(w->flush_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Error reading flush timer");
+    }
+    w->flush_armed = 0;
+    worker_flush(w);
+}
+
+// Move the decoder onto the worker's scratch buffer for reading
+static void session_rx_attach(struct session *s) {
+    struct worker *w = s->worker;
+    w->recv_ns = w->wake_ns;
+    if (s->rx_park) {
+        frame_decoder_rebase(&s->rx, w->rx_scratch, FRAME_RX_BUFFER_SIZE);
+        bufpool_put(engine.pool, w->id, s->rx_park);
+        s->rx_park = NULL;
+    } else {
+        frame_decoder_init(&s->rx, w->rx_scratch, FRAME_RX_BUFFER_SIZE);
+    }
+}
+
+// Copy whatever the decoder still holds out of the scratch buffer; usually
+// a partial frame that fits a pooled buffer
+static int session_rx_park(struct session *s) {
+    size_t pending = frame_decoder_pending(&s->rx);
+    if (pending == 0) {
+        frame_decoder_init(&s->rx, NULL, 0);
+        return 0;
+    }
+    s->rx_park = bufpool_get(engine.pool, s->worker->id, pending);
+    if (!s->rx_park) {
+        fprintf(stderr, "Error allocating receive buffer\n");
+        return -1;
+    }
+    frame_decoder_rebase(&s->rx, s->rx_park, pending);
+    return 0;
+}
+
+// io_uring backend: wait until every queued TUN write completed. Other
+// completions are held for the loop, in order, as handling them here could
+// close the session being read. Returns -1 if there was no room to hold
+// them or the ring failed, with writes still in flight.
+static int ring_drain_tun_writes(struct worker *w) {
+    while (w->tun_tx_inflight > 0) {
+        if (uring_wait(w->ring, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_uring_enter error");
+            return -1;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(w->ring))) {
+            if ((cqe->user_data & RING_OP_MASK) == RING_OP_TUN_WRITE) {
+                w->tun_tx_inflight--;
+                if (cqe->res < 0) {
+                    fprintf(stderr, "Error writing to TUN device: %s\n", strerror(-cqe->res));
+                }
+            } else if (w->nheld < RING_CQ_ENTRIES) {
+                w->held[w->nheld++] = *cqe;
+            } else {
+                return -1;
+            }
+            uring_cqe_seen(w->ring);
+        }
+    }
+    return 0;
+}
+
+// Write one packet from a client to the TUN; with offloads on, behind a
+// header saying it needs none
+static void tun_write(struct worker *w, const uint8_t *pkt, size_t len) {
+    static const struct virtio_net_hdr plain = { .gso_type = VIRTIO_NET_HDR_GSO_NONE };
+    ssize_t n;
+
+    if (w->capture.cap) {
+        pcapng_write(&w->capture, pkt, len, PCAPNG_INBOUND);
+    }
+
+    // The ring writes a copy, submitted with the rest of the loop iteration.
+    // With the arena full, the queued writes are waited for first, so that
+    // this packet cannot overtake them, and it goes at the arena's start.
+    if (w->ring) {
+        size_t hdr = engine.vnet_hdr ? sizeof(plain) : 0;
+        for (int drained = 0;; drained = 1) {
+            if (w->tun_tx_inflight == 0) {
+                w->tun_tx_used = 0;
+            }
+            if (w->tun_tx_used + hdr + len <= RING_TUN_WRITE_ARENA) {
+                uint8_t *dst = w->tun_tx + w->tun_tx_used;
+                memcpy(dst, &plain, hdr);
+                memcpy(dst + hdr, pkt, len);
+                if (uring_rw_fixed(w->ring, IORING_OP_WRITE_FIXED, w->tun_wfd, dst, hdr + len, 0,
+                                   RING_OP_TUN_WRITE) == 0) {
+                    w->tun_tx_used += hdr + len;
+                    w->tun_tx_inflight++;
+                    return;
+                }
+            }
+            if (drained || ring_drain_tun_writes(w) < 0) {
+                metrics_add(&w->metrics, METRICS_DROPS, 1);
+                return;
+            }
+        }
+    }
+
+    if (engine.vnet_hdr) {
+        struct iovec iov[2] = {
+            { .iov_base = (void *)&plain, .iov_len = sizeof(plain) },
+            { .iov_base = (void *)pkt, .iov_len = len },
+        };
+        n = writev(w->tun_wfd, iov, 2);
+    } else {
+        n = write(w->tun_wfd, pkt, len);
+    }
+    if (n < 0) {
+        perror("Error writing to TUN device");
+        metrics_add(&w->metrics, METRICS_DROPS, 1);
+    }
+}
+
+// A HELLO opens a resumable session and must come first; an ACK trims the
+// replay buffer. Returns -1 on a protocol error, 2 if the connection asks
+// to resume an earlier session.
+static int session_control(struct session *s, const struct frame *f) {
+    if (f->type == FRAME_TYPE_ACK) {
+        if (!s->id || f->len != FRAME_ACK_LEN || replay_ack(&s->replay, frame_get_u64(f->data)) < 0) {
+            fprintf(stderr, "Invalid acknowledgement from client\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (f->type != FRAME_TYPE_HELLO || s->id || s->rx_seq > 0 ||
+        (f->len != FRAME_HELLO_LEN && f->len != FRAME_HELLO_FEATURES_LEN && f->len != FRAME_HELLO_STRIPE_LEN)) {
+        fprintf(stderr, "Unexpected handshake from client\n");
+        return -1;
+    }
+    // Super-packets only exist when the TUN hands them out
+    uint32_t features = f->len >= FRAME_HELLO_FEATURES_LEN ? frame_get_u32(f->data + FRAME_HELLO_LEN) : 0;
+
+    // A connection of a pool says which one it is; a resumed session keeps
+    // the place it had
+    const uint8_t *pool = f->data + FRAME_HELLO_FEATURES_LEN;
+    if ((f->len == FRAME_HELLO_STRIPE_LEN) != !!(features & FRAME_FEATURE_STRIPE) ||
+        (f->len == FRAME_HELLO_STRIPE_LEN && (pool[1] < 2 || pool[1] > STRIPE_MAX || pool[0] >= pool[1]))) {
+        fprintf(stderr, "Invalid connection pool from client\n");
+        return -1;
+    }
+    if (features & FRAME_FEATURE_STRIPE) {
+        s->stripe = pool[0];
+        s->stripes = pool[1];
+    }
+    s->gso = engine.vnet_hdr && (features & FRAME_FEATURE_GSO);
+    if (engine.compress && (features & FRAME_FEATURE_LZ) && session_lz_start(s->worker, s) < 0) {
+        return -1;
+    }
+
+    uint64_t id = frame_get_u64(f->data);
+    if (id != 0) {
+        s->resume_id = id;
+        s->resume_seq = frame_get_u64(f->data + 8);
+        return 2;
+    }
+    if (session_make_resumable(s) < 0) {
+        return -1;
+    }
+    return session_send_hello(s);
+}
+
+// Frames come from the socket, except while a compressed chunk or an open
+// record has some left; a record is let go once all its frames are taken
+static struct frame_decoder *session_source(struct session *s) {
+    if (s->lz && frame_decoder_pending(&s->lz->frames) > 0) {
+        return &s->lz->frames;
+    }
+    if (s->seal && s->seal->open) {
+        if (frame_decoder_pending(&s->seal->frames) > 0) {
+            return &s->seal->frames;
+        }
+        s->seal->open = 0;
+        frame_decoder_consume(&s->rx);
+    }
+    return &s->rx;
+}
+
+// Decompress a chunk of frames; they are taken before the socket's next ones
+static int session_inflate(struct session *s, const struct frame *f) {
+    const uint8_t *chunk;
+    long n = s->lz ? lz_decoder_decompress(&s->lz->rx, f->data, f->len, &chunk) : -1;
+    if (n <= 0) {
+        fprintf(stderr, "Invalid compressed frame from client\n");
+        return -1;
+    }
+    frame_decoder_init(&s->lz->frames, (uint8_t *)chunk, (size_t)n);
+    frame_decoder_commit(&s->lz->frames, (size_t)n);
+    return 0;
+}
+
+// Answer the client's KEY frame with ours and derive the connection's keys;
+// ours is the last frame sent in the clear
+static int session_key(struct session *s, const struct frame *f) {
+    struct session_seal *seal = s->seal;
+    uint8_t reply[SEAL_KEY_FRAME_LEN];
+
+    if (f->type != FRAME_TYPE_KEY || f->len != SEAL_KEY_FRAME_LEN) {
+        fprintf(stderr, "Client did not open an encrypted connection\n");
+        return -1;
+    }
+    if (f->data[0] != SEAL_SUITE_AES_256_GCM) {
+        fprintf(stderr, "Unsupported cipher suite from client: %u\n", f->data[0]);
+        return -1;
+    }
+    if (seal_key_frame(reply) < 0 || seal_start(engine.key, f->data, reply, 0, &seal->tx, &seal->rx) < 0) {
+        fprintf(stderr, "Error setting up connection keys\n");
+        return -1;
+    }
+    if (session_send_control(s, FRAME_TYPE_KEY, reply, sizeof(reply)) < 0) {
+        return -1;
+    }
+    seal->keyed = 1;
+    return 0;
+}
+
+// Authenticate and decrypt the record at the head of the socket's frames,
+// where it stays until its frames are taken
+static int session_unseal(struct session *s, const struct frame *f) {
+    struct session_seal *seal = s->seal;
+    uint8_t *plain;
+    long n = f->type == FRAME_TYPE_SEALED ? seal_open(&seal->rx, (uint8_t *)f->data, f->len, &plain) : -1;
+    if (n < 0) {
+        fprintf(stderr, "Invalid encrypted record from client\n");
+        return -1;
+    }
+    seal->open = 1;
+    seal->open_len = (size_t)n;
+    seal->taken = 0;
+    frame_decoder_init(&seal->frames, plain, (size_t)n);
+    frame_decoder_commit(&seal->frames, (size_t)n);
+    return 0;
+}
+
+// Find the rest of an open record's frames again; the receive buffer may
+// have been parked or replaced since it was opened
+static void session_reopen(struct session *s) {
+    struct session_seal *seal = s->seal;
+    struct frame f;
+    frame_decoder_peek(&s->rx, &f);
+    uint8_t *rest = (uint8_t *)f.data + SEAL_SEQ_LEN + seal->taken;
+    frame_decoder_init(&seal->frames, rest, seal->open_len - seal->taken);
+    frame_decoder_commit(&seal->frames, seal->open_len - seal->taken);
+}
+
+// Whether a packet of len must wait for the session's next turn. Receives
+// on the ring have already taken the bytes off the socket, a 16 KB buffer
+// at a time, so those sessions take turns by completion instead.
+static int session_turn_over(struct session *s, size_t len) {
+    if (s->ring && s->ring->recv) {
+        return 0;
+    }
+    if (s->deficit < len) {
+        return 1;
+    }
+    s->deficit -= len;
+    return 0;
+}
+
+// Whether the client's caps let a packet of len on to the TUN; the bytes
+// were received at recv_ns. Caps set up before a reload, or on another
+// worker, start over under this worker's limits.
+static int session_admit(struct session *s, size_t len) {
+    struct client_limit *l = s->group ? &s->group->limit : &s->limit;
+    uint64_t now = s->worker->recv_ns;
+
+    if (l->gen != s->worker->limits_gen) {
+        client_limit_init(s->worker, l);
+    }
+
+    if (!rate_bucket_has(&l->bytes, len, now) || !rate_bucket_has(&l->packets, 1, now)) {
+        return 0;
+    }
+    rate_bucket_spend(&l->bytes, len);
+    rate_bucket_spend(&l->packets, 1);
+    return 1;
+}
+
+// Write every complete frame to the TUN, as session_frames()
+static int session_take_frames(struct session *s) {
+    struct frame_decoder *d;
+    struct frame f;
+    int rc;
+
+    while ((rc = frame_decoder_peek(d = session_source(s), &f)) == 1) {
+        // An encrypted connection sends a KEY, then nothing but records
+        if (s->seal && d == &s->rx) {
+            if (!s->seal->keyed) {
+                frame_decoder_consume(d);
+                rc = session_key(s, &f);
+            } else {
+                rc = session_unseal(s, &f);
+            }
+            if (rc < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (f.type == FRAME_TYPE_LZ) {
+            frame_decoder_consume(d);
+            if ((s->lz && d == &s->lz->frames) || session_inflate(s, &f) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (f.type != FRAME_TYPE_DATA) {
+            // The payload stays readable until the next recv
+            frame_decoder_consume(d);
+            rc = session_control(s, &f);
+            if (rc != 0) {
+                return rc;
+            }
+            continue;
+        }
+
+        if (session_turn_over(s, f.len)) {
+            return 3;
+        }
+        // Migrate before writing, so the reply cannot reach the new
+        // owner's queue ahead of the session; the frame travels along
+        if (session_learn_address(s, f.data, f.len)) {
+            return 1;
+        }
+        if (session_admit(s, f.len)) {
+            tun_write(s->worker, f.data, f.len);
+            metrics_add(&s->worker->metrics, METRICS_SOCKET_TO_TUN_PACKETS, 1);
+            metrics_add(&s->worker->metrics, METRICS_SOCKET_TO_TUN_BYTES, f.len);
+        } else {
+            metrics_add(&s->worker->metrics, METRICS_DROPS, 1);
+            metrics_add(&s->worker->metrics, METRICS_RATE_LIMITED, 1);
+        }
+        frame_decoder_consume(d);
+        s->rx_seq++;
+        s->rx_unacked_bytes += f.len;
+        s->from_client_packets++;
+        s->from_client_bytes += f.len;
+    }
+    // Chunks and records end on a frame boundary
+    if (rc < 0 || d != &s->rx) {
+        fprintf(stderr, "Invalid packet length from client: %u\n", d->payload_len);
+        metrics_add(&s->worker->metrics, METRICS_INVALID_LENGTHS, 1);
+        return -1;
+    }
+    return 0;
+}
+
+// Write every complete frame the decoder holds to the TUN; returns 0 once
+// it needs more bytes, otherwise as session_drain(). A record still open
+// when reading stops remembers how far its frames were taken.
+static int session_frames(struct session *s) {
+    uint64_t packets = s->from_client_packets;
+    if (s->seal && s->seal->open) {
+        session_reopen(s);
+    }
+    int rc = session_take_frames(s);
+    if (s->seal && s->seal->open) {
+        s->seal->taken = s->seal->open_len - frame_decoder_pending(&s->seal->frames);
+    }
+    if (s->from_client_packets != packets) {
+        metrics_record(&s->worker->metrics, METRICS_SOCKET_TO_TUN, now_ns() - s->worker->recv_ns);
+    }
+    return rc;
+}
+
+// Drain the client socket, writing every complete frame to the TUN;
+// returns -1 if the connection failed, 1 if the session must migrate, 2 if
+// the connection resumes another session, 3 if its turn is over first
+static int session_drain(struct session *s) {
+    for (;;) {
+        int rc = session_frames(s);
+        if (rc != 0) {
+            return rc;
+        }
+
+        ssize_t n = frame_decoder_recv(&s->rx, s->fd);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("Error reading from client");
+            return -1;
+        }
+        s->worker->recv_ns = now_ns();
+    }
+}
+
+// Reading stopped with rc from session_drain(): park what is left over and
+// tell the client what arrived when it is time to
+static int session_rx_done(struct session *s, int rc) {
+    if (rc >= 0 && session_rx_park(s) < 0) {
+        return -1;
+    }
+    if ((rc == 0 || rc == 3) && s->id &&
+        (s->rx_seq - s->rx_acked >= SESSION_ACK_FRAMES || s->rx_unacked_bytes >= SESSION_ACK_BYTES) &&
+        session_send_ack(s) < 0) {
+        return -1;
+    }
+    return rc;
+}
+
+static int session_readable(struct session *s) {
+    session_rx_attach(s);
+    return session_rx_done(s, session_drain(s));
+}
+
+// io_uring backend: bytes a multishot receive delivered
+static int session_received(struct session *s, const uint8_t *data, size_t len) {
+    int rc = 0;
+
+    session_rx_attach(s);
+    while (rc == 0 && len > 0) {
+        size_t room;
+        uint8_t *dst = frame_decoder_space(&s->rx, &room);
+        size_t n = len < room ? len : room;
+        if (n == 0) {
+            rc = -1;
+            break;
+        }
+        memcpy(dst, data, n);
+        frame_decoder_commit(&s->rx, n);
+        data += n;
+        len -= n;
+        rc = session_frames(s);
+    }
+    return session_rx_done(s, rc);
+}
+
+static void post_mail(struct worker *target, struct mail *m);
+
+static void mail_free(struct worker *w, struct mail *m) {
+    if (m->kind == MAIL_LIMITS) {
+        free(m);
+        return;
+    }
+    bufpool_put(engine.pool, w->id, m);
+}
+
+// Stop watching a client socket that stays open for another worker
+static void session_unwatch(struct worker *w, struct session *s) {
+    session_undefer(w, s);
+    if (s->ring) {
+        ring_unlink_session(w, s);
+        return;
+    }
+    if (epoll_ctl(w->epfd, EPOLL_CTL_DEL, s->fd, NULL) < 0) {
+        perror("Error unregistering client socket");
+    }
+}
+
+// Hand the session to the worker its tunnel address hashes to. The new owner
+// re-registers the fd, and EPOLL_CTL_ADD reports any data already pending.
+static void session_migrate(struct session *s) {
+    struct worker *w = s->worker;
+    struct mail *m = bufpool_get(engine.pool, w->id, sizeof(*m));
+    if (!m) {
+        session_close(s);
+        return;
+    }
+
+    // Return traffic still held for this client must not travel with it
+    session_mark_clean(w, s);
+    if (session_flush_batch(s) < 0) {
+        bufpool_put(engine.pool, w->id, m);
+        session_close(s);
+        return;
+    }
+
+    session_unwatch(w, s);
+    session_unlink(w, s);
+
+    m->kind = MAIL_SESSION;
+    m->session = s;
+    post_mail(&engine.workers[engine_shard(s->inner_ip, engine.nworkers)], m);
+}
+
+static int session_watch(struct worker *w, struct session *s) {
+    if (w->ring) {
+        if (ring_link_session(w, s) < 0) {
+            fprintf(stderr, "Error registering client socket\n");
+            return -1;
+        }
+        return 0;
+    }
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = s,
+    };
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0) {
+        perror("Error registering client socket");
+        return -1;
+    }
+    return 0;
+}
+
+static int session_register(struct worker *w, struct session *s) {
+    if (session_watch(w, s) < 0) {
+        return -1;
+    }
+    session_link(w, s);
+    return 0;
+}
+
+// The connection asked to resume a session: hand it to the worker owning
+// that session. The lookup here only picks the worker; the owner checks
+// again, since the session may expire or move before the mail arrives.
+static void session_request_resume(struct session *t) {
+    struct worker *w = t->worker;
+    struct mail *m = bufpool_get(engine.pool, w->id, sizeof(*m));
+    if (!m) {
+        session_close(t);
+        return;
+    }
+
+    session_unwatch(w, t);
+    session_unlink(w, t);
+
+    struct session *s = session_table_lookup(engine.resumable, (uint32_t)t->resume_id);
+    m->kind = MAIL_RESUME;
+    m->session = t;
+    post_mail(s && s->id == t->resume_id ? session_owner(s) : w, m);
+}
+
+// io_uring backend: the session has settled on the worker that owns its
+// address, so nothing can move it mid-stream any more. Its data now comes
+// by multishot receive into the ring's provided buffers.
+static void ring_start_recv(struct session *s) {
+    struct worker *w = s->worker;
+    struct ring_link *l = s->ring;
+
+    uring_cancel(w->ring, ring_data(l, RING_OP_SESSION_POLL));
+    l->recv = 1;
+    if (ring_arm(w, l, RING_OP_SESSION_WRITABLE) < 0 || ring_arm(w, l, RING_OP_SESSION_RECV) < 0) {
+        session_close(s);
+    }
+}
+
+// Give the session a turn at reading its socket
+static void session_read(struct session *s) {
+    s->deficit += SESSION_QUANTUM;
+    int rc = session_readable(s);
+    if (rc < 0) {
+        session_close(s);
+    } else if (rc == 1) {
+        session_migrate(s);
+    } else if (rc == 2) {
+        session_request_resume(s);
+    } else if (rc == 3) {
+        session_defer(s->worker, s);
+    } else {
+        // Nothing left to read: a share is not saved up while idle
+        s->deficit = 0;
+        if (s->ring && !s->ring->recv && s->published) {
+            ring_start_recv(s);
+        }
+    }
+}
+
+// One more turn for every session that still had data to read, in the
+// order their turns ended; those that still have some go round again
+static void worker_serve_deferred(struct worker *w) {
+    for (unsigned n = w->ndeferred; n > 0 && w->deferred; n--) {
+        struct session *s = w->deferred;
+        session_undefer(w, s);
+        session_read(s);
+    }
+}
+
+static void session_event(struct session *s, uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        session_close(s);
+        return;
+    }
+    if ((events & EPOLLOUT) && session_flush(s) < 0) {
+        session_close(s);
+        return;
+    }
+    // A session waiting for its turn reads then
+    if ((events & (EPOLLIN | EPOLLRDHUP)) && !s->deferred) {
+        session_read(s);
+    }
+}
+
+static void accept_clients(struct worker *w) {
+    for (;;) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(w->listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error accepting client connection");
+            }
+            return;
+        }
+
+        // Failures were reported once, on the listener
+        socktune_apply(fd, &w->limits.tune);
+        socktune_fit_buffers(fd, &w->limits.tune);
+
+        struct session *s = calloc(1, sizeof(*s));
+        if (!s) {
+            fprintf(stderr, "Error allocating session\n");
+            close(fd);
+            continue;
+        }
+        s->src.type = SRC_SESSION;
+        s->fd = fd;
+        s->peer = addr;
+        frame_decoder_init(&s->rx, NULL, 0);
+        frame_batch_init(&s->batch);
+        client_limit_init(w, &s->limit);
+
+        if ((engine.encrypt && session_seal_start(w, s) < 0) || session_register(w, s) < 0) {
+            session_seal_stop(w, s);
+            close(fd);
+            free(s);
+            continue;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, client_ip, sizeof(client_ip));
+        printf("Client connected: %s:%d (worker %d)\n", client_ip, ntohs(addr.sin_port), w->id);
+    }
+}
+
+static void session_take_packet(struct worker *w, struct session *s, uint8_t *pkt, size_t len, size_t used, uint16_t gso_size);
+
+// A packet another worker read for one of this worker's sessions. Room for
+// the GSO frame prefix is left in front of it, as a TUN read leaves the
+// virtio-net header there.
+static void deliver_packet(struct worker *w, uint32_t dst, const uint8_t *pkt, size_t len, uint16_t gso_size) {
+    uint8_t *held = worker_burst_space(w) + FRAME_GSO_PREFIX_LEN;
+    struct session *s = session_table_lookup(engine.table, dst);
+    if (!s || session_owner(s) != w) {
+        metrics_add(&w->metrics, METRICS_DROPS, 1);
+        return;
+    }
+    memcpy(held, pkt, len);
+    session_take_packet(w, s, held, len, len + FRAME_GSO_PREFIX_LEN, gso_size);
+}
+
+static void post_mail(struct worker *target, struct mail *m) {
+    m->next = NULL;
+
+    pthread_mutex_lock(&target->mail_lock);
+    int was_empty = target->mail_head == NULL;
+    if (target->mail_tail) {
+        target->mail_tail->next = m;
+    } else {
+        target->mail_head = m;
+    }
+    target->mail_tail = m;
+    pthread_mutex_unlock(&target->mail_lock);
+
+    if (was_empty) {
+        wake_worker(target);
+    }
+}
+
+// Hand a packet to the worker that owns its destination
+static void post_packet(struct worker *w, struct worker *target, uint32_t dst, const uint8_t *pkt, size_t len, uint16_t gso_size) {
+    struct mail *m = bufpool_get(engine.pool, w->id, sizeof(*m) + len);
+    if (!m) {
+        metrics_add(&w->metrics, METRICS_DROPS, 1);
+        return;
+    }
+    m->kind = MAIL_PACKET;
+    m->dst = dst;
+    m->gso_size = gso_size;
+    m->read_ns = w->read_ns;
+    m->len = len;
+    memcpy(m->data, pkt, len);
+    post_mail(target, m);
+}
+
+// Start a fresh resumable session on a connection whose old one is gone
+static void session_restart(struct worker *w, struct session *t) {
+    if (session_register(w, t) < 0) {
+        session_discard(w, t);
+        return;
+    }
+    if (session_make_resumable(t) < 0 || session_send_hello(t) < 0) {
+        session_destroy(t);
+        return;
+    }
+    session_event(t, EPOLLIN);
+}
+
+// Move a resuming connection into its session: answer the HELLO with the
+// frames received so far, then resend whatever the client is missing.
+// Returns 1 if the mail was passed on to the session's new owner instead.
+static int session_adopt(struct worker *w, struct mail *m) {
+    struct session *t = m->session;
+    struct session *s = session_table_lookup(engine.resumable, (uint32_t)t->resume_id);
+
+    if (!s || s->id != t->resume_id) {
+        printf("Session %016llx expired, starting a new one\n", (unsigned long long)t->resume_id);
+        session_restart(w, t);
+        return 0;
+    }
+    if (session_owner(s) != w) {
+        post_mail(session_owner(s), m);
+        return 1;
+    }
+
+    // The client may notice a dead connection before we do
+    if (!s->detached) {
+        session_detach(s);
+    }
+    if (replay_ack(&s->replay, t->resume_seq) < 0) {
+        fprintf(stderr, "Invalid resume request from client\n");
+        session_discard(w, t);
+        return 0;
+    }
+
+    s->fd = t->fd;
+    s->peer = t->peer;
+    s->rx = t->rx;
+    s->rx_park = t->rx_park;
+    s->gso = t->gso;
+    s->lz = t->lz;
+    s->seal = t->seal;
+    t->fd = -1;
+    t->rx_park = NULL;
+    t->lz = NULL;
+    t->seal = NULL;
+    session_discard(w, t);
+
+    s->detached = 0;
+    w->detached--;
+    if (session_watch(w, s) < 0) {
+        session_close(s);
+        return 0;
+    }
+
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &s->peer.sin_addr, client_ip, sizeof(client_ip));
+    printf("Client %s:%d resumed session %016llx, resending %zu packets\n", client_ip,
+           ntohs(s->peer.sin_port), (unsigned long long)s->id, s->replay.count);
+
+    if (session_send_hello(s) < 0 || session_send_replay(s) < 0) {
+        session_close(s);
+        return 0;
+    }
+    session_event(s, EPOLLIN);
+    return 0;
+}
+
+// Sessions whose client did not come back in time
+static void worker_expire_sessions(struct worker *w) {
+    uint64_t now = now_ms();
+    struct session *s = w->sessions;
+    while (s && w->detached > 0) {
+        struct session *next = s->next;
+        if (s->detached && now >= s->linger_until) {
+            printf("Session %016llx was not resumed in time\n", (unsigned long long)s->id);
+            session_destroy(s);
+        }
+        s = next;
+    }
+}
+
+static void drain_mail(struct worker *w) {
+    uint64_t count;
+    if (read(w->wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Error reading worker wakeup");
+    }
+
+    pthread_mutex_lock(&w->mail_lock);
+    struct mail *m = w->mail_head;
+    w->mail_head = w->mail_tail = NULL;
+    pthread_mutex_unlock(&w->mail_lock);
+
+    while (m) {
+        struct mail *next = m->next;
+        if (m->kind == MAIL_PACKET) {
+            w->read_ns = m->read_ns;
+            deliver_packet(w, m->dst, m->data, m->len, m->gso_size);
+        } else if (m->kind == MAIL_RESUME) {
+            if (session_adopt(w, m)) {
+                m = next;
+                continue;
+            }
+        } else if (m->kind == MAIL_LIMITS) {
+            const struct reload *r = (const struct reload *)m->data;
+            w->limits = r->limits;
+            w->limits_gen = r->gen;
+        } else if (session_register(w, m->session) < 0) {
+            session_discard(w, m->session);
+        } else {
+            // Write the frame that triggered the move, then keep reading
+            session_publish(m->session);
+            session_event(m->session, EPOLLIN);
+        }
+        mail_free(w, m);
+        m = next;
+    }
+    worker_burst_done(w);
+}
+
+static void peer_free(void *value) {
+    struct peer *p = value;
+    if (engine.encrypt) {
+        seal_stream_free(&p->tx);
+        seal_stream_free(&p->rx);
+        pthread_mutex_destroy(&p->lock);
+    }
+    free(p);
+}
+
+// Whether a datagram client may use a tunnel address: one in the tunnel's
+// subnet, which also bounds how many plain peers there can be
+static int peer_addr_valid(uint32_t ip) {
+    return ip != 0 && (ip & engine.tunnel_mask) == engine.tunnel_net && ip != engine.tunnel_net;
+}
+
+// Remember the address a datagram client sends from, so return traffic for
+// its tunnel address goes there; as with sessions, the latest claim wins
+static void peer_learn(struct worker *w, uint32_t inner_ip, const struct sockaddr_in *from) {
+    struct peer *p = session_table_lookup(engine.peers, inner_ip);
+    if (p && p->addr.sin_addr.s_addr == from->sin_addr.s_addr && p->addr.sin_port == from->sin_port) {
+        return;
+    }
+
+    // Another worker may be replacing the same peer
+    pthread_mutex_lock(&engine.peer_lock);
+    p = session_table_lookup(engine.peers, inner_ip);
+    if (p && p->addr.sin_addr.s_addr == from->sin_addr.s_addr && p->addr.sin_port == from->sin_port) {
+        pthread_mutex_unlock(&engine.peer_lock);
+        return;
+    }
+    struct peer *fresh = malloc(sizeof(*fresh));
+    if (fresh) {
+        fresh->addr = *from;
+        fresh->inner_ip = inner_ip;
+    }
+    if (!fresh || session_table_insert(engine.peers, inner_ip, fresh, w->id) < 0) {
+        pthread_mutex_unlock(&engine.peer_lock);
+        fprintf(stderr, "Error registering datagram client\n");
+        free(fresh);
+        return;
+    }
+    pthread_mutex_unlock(&engine.peer_lock);
+    if (p) {
+        qsbr_retire(w->id, p, peer_free);
+    }
+
+    char client_ip[INET_ADDRSTRLEN], tunnel_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from->sin_addr, client_ip, sizeof(client_ip));
+    inet_ntop(AF_INET, &inner_ip, tunnel_ip, sizeof(tunnel_ip));
+    printf("Datagram client %s:%d is %s (worker %d)\n", client_ip, ntohs(from->sin_port), tunnel_ip, w->id);
+}
+
+// Drop sealed peers whose handshake or traffic is too old; under peer_lock
+static void peers_expire(struct worker *w, uint64_t now) {
+    for (struct peer **link = &engine.sealed_peers; *link;) {
+        struct peer *p = *link;
+        uint64_t heard = __atomic_load_n(&p->heard_ns, __ATOMIC_RELAXED);
+        if (heard ? now - heard < PEER_IDLE_MS * 1000000ull : now - p->created_ns < PEER_HANDSHAKE_MS * 1000000ull) {
+            link = &p->next;
+            continue;
+        }
+        *link = p->next;
+        engine.nsealed--;
+        session_table_remove(engine.peer_ids, p->id, p);
+        uint32_t inner_ip = __atomic_load_n(&p->inner_ip, __ATOMIC_RELAXED);
+        if (inner_ip) {
+            session_table_remove(engine.peers, inner_ip, p);
+        }
+        qsbr_retire(w->id, p, peer_free);
+    }
+}
+
+// Answer a HELLO made with the key: agree the peer's keys and give it an id
+static void peer_accept(struct worker *w, const uint8_t *hello, size_t len, const struct sockaddr_in *from) {
+    uint8_t client_key[SEAL_KEY_FRAME_LEN], server_key[SEAL_KEY_FRAME_LEN];
+    uint8_t reply[SEAL_DGRAM_ACCEPT_LEN];
+
+    if (seal_dgram_hello_check(engine.key, hello, len, client_key) < 0) {
+        metrics_add(&w->metrics, METRICS_DROPS, 1);
+        return;
+    }
+    struct peer *p = calloc(1, sizeof(*p));
+    if (!p) {
+        fprintf(stderr, "Error registering datagram client\n");
+        return;
+    }
+    p->addr = *from;
+    p->created_ns = now_ns();
+    pthread_mutex_init(&p->lock, NULL);
+
+    pthread_mutex_lock(&engine.peer_lock);
+    peers_expire(w, p->created_ns);
+    uint32_t id = 0;
+    while (id == 0 || session_table_lookup(engine.peer_ids, id)) {
+        if (seal_random((uint8_t *)&id, sizeof(id)) < 0) {
+            id = 0;
+            break;
+        }
+    }
+    p->id = id;
+    if (engine.nsealed >= PEERS_MAX || id == 0 ||
+        seal_dgram_accept(engine.key, client_key, p->id, server_key, reply) < 0 ||
+        seal_start(engine.key, client_key, server_key, 0, &p->tx, &p->rx) < 0 ||
+        session_table_insert(engine.peer_ids, p->id, p, w->id) < 0) {
+        pthread_mutex_unlock(&engine.peer_lock);
+        fprintf(stderr, "%s\n", engine.nsealed >= PEERS_MAX ? "Too many datagram clients; refusing one"
+                                                           : "Error registering datagram client");
+        peer_free(p);
+        return;
+    }
+    p->next = engine.sealed_peers;
+    engine.sealed_peers = p;
+    engine.nsealed++;
+    pthread_mutex_unlock(&engine.peer_lock);
+
+    sendto(w->udp_fd, reply, sizeof(reply), MSG_DONTWAIT, (const struct sockaddr *)from, sizeof(*from));
+}
+
+// A sealed peer's first packet names its tunnel address, which it keeps;
+// as with plain peers, the latest claim to an address wins
+static int peer_claim(struct worker *w, struct peer *p, uint32_t inner_ip) {
+    uint32_t claimed = __atomic_load_n(&p->inner_ip, __ATOMIC_RELAXED);
+    if (claimed) {
+        return claimed == inner_ip ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&engine.peer_lock);
+    claimed = __atomic_load_n(&p->inner_ip, __ATOMIC_RELAXED);
+    if (!claimed) {
+        if (session_table_insert(engine.peers, inner_ip, p, w->id) < 0) {
+            pthread_mutex_unlock(&engine.peer_lock);
+            fprintf(stderr, "Error registering datagram client\n");
+            return -1;
+        }
+        __atomic_store_n(&p->inner_ip, inner_ip, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&engine.peer_lock);
+    if (claimed) {
+        return claimed == inner_ip ? 0 : -1;
+    }
+
+    char client_ip[INET_ADDRSTRLEN], tunnel_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &p->addr.sin_addr, client_ip, sizeof(client_ip));
+    inet_ntop(AF_INET, &inner_ip, tunnel_ip, sizeof(tunnel_ip));
+    printf("Sealed datagram client %s:%d is %s (worker %d)\n", client_ip, ntohs(p->addr.sin_port), tunnel_ip, w->id);
+    return 0;
+}
+
+// Open a sealed datagram in place; the client may have moved, and where the
+// datagram came from is where its traffic goes from now on. Returns the
+// packet, or NULL for a datagram that is not an intact one of a peer's.
+static uint8_t *peer_open(struct worker *w, uint8_t *dgram, size_t len, const struct sockaddr_in *from,
+                          struct peer **peer, size_t *pkt_len) {
+    uint32_t id = seal_dgram_peer(dgram, len);
+    struct peer *p = id ? session_table_lookup(engine.peer_ids, id) : NULL;
+    uint8_t *pkt;
+    if (!p) {
+        metrics_add(&w->metrics, METRICS_DROPS, 1);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    long n = seal_dgram_open(&p->rx, dgram, len, &pkt);
+    if (n >= 0) {
+        p->addr = *from;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (n < 0) {
+        metrics_add(&w->metrics, METRICS_DROPS, 1);
+        return NULL;
+    }
+    __atomic_store_n(&p->heard_ns, now_ns(), __ATOMIC_RELAXED);
+    *peer = p;
+    *pkt_len = (size_t)n;
+    return pkt;
+}
+
+// Answer a peer's keepalive, an empty sealed datagram, with one of ours, so
+// the client knows its peer id still stands
+static void peer_keepalive(struct worker *w, struct peer *p) {
+    uint8_t dgram[SEAL_DGRAM_OVERHEAD];
+    struct sockaddr_in to;
+
+    pthread_mutex_lock(&p->lock);
+    size_t n = seal_dgram_seal(&p->tx, p->id, dgram, 0);
+    to = p->addr;
+    pthread_mutex_unlock(&p->lock);
+    if (n > 0) {
+        sendto(w->udp_fd, dgram, n, MSG_DONTWAIT, (const struct sockaddr *)&to, sizeof(to));
+    }
+}
+
+// Write every datagram the socket has queued to the TUN. Each one is a
+// whole IP packet; there is no framing and nothing to reassemble. With a
+// key, a datagram is a HELLO, or a sealed packet or keepalive of a peer's.
+static void udp_readable(struct worker *w) {
+    for (;;) {
+        int n = dgram_rx_recv(w->udp_rx, w->udp_fd);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error receiving from clients");
+            }
+            return;
+        }
+
+        uint64_t received = now_ns();
+        int written = 0;
+        for (int i = 0; i < n; i++) {
+            const struct sockaddr_in *from;
+            size_t len;
+            uint8_t *pkt = (uint8_t *)dgram_rx_get(w->udp_rx, i, &len, &from);
+            struct peer *p = NULL;
+            if (!pkt) {
+                // Truncated: larger than any packet
+                metrics_add(&w->metrics, METRICS_INVALID_LENGTHS, 1);
+                continue;
+            }
+            // Path MTU probes go back as they came (pmtu.h)
+            if (pmtu_is_probe(pkt, len)) {
+                sendto(w->udp_fd, pkt, len, MSG_DONTWAIT, (const struct sockaddr *)from, sizeof(*from));
+                continue;
+            }
+            if (engine.encrypt && len > 0 && pkt[0] == SEAL_DGRAM_HELLO) {
+                peer_accept(w, pkt, len, from);
+                continue;
+            }
+            if (engine.encrypt && !(pkt = peer_open(w, pkt, len, from, &p, &len))) {
+                continue;
+            }
+            if (p && len == 0) {
+                peer_keepalive(w, p);
+                continue;
+            }
+            uint32_t src;
+            if (!packet_tunnel_addr(pkt, len, 0, &src)) {
+                metrics_add(&w->metrics, len < 20 ? METRICS_SHORT_READS : METRICS_DROPS, 1);
+                continue;
+            }
+            if (!peer_addr_valid(src) || (p && peer_claim(w, p, src) < 0)) {
+                metrics_add(&w->metrics, METRICS_DROPS, 1);
+                continue;
+            }
+            if (!p) {
+                peer_learn(w, src, from);
+            }
+            tun_write(w, pkt, len);
+            metrics_add(&w->metrics, METRICS_SOCKET_TO_TUN_PACKETS, 1);
+            metrics_add(&w->metrics, METRICS_SOCKET_TO_TUN_BYTES, len);
+            written++;
+        }
+        if (written > 0) {
+            metrics_record(&w->metrics, METRICS_SOCKET_TO_TUN, now_ns() - received);
+        }
+
+        // A short batch drained the queue; later datagrams raise a new edge
+        if (n < DGRAM_RX_MAX) {
+            return;
+        }
+    }
+}
+
+// Add a packet held in the burst buffer to the worker's datagram batch.
+// Any worker may send to any peer, so datagram clients never need mail.
+static void worker_queue_datagram(struct worker *w, struct peer *p, const uint8_t *pkt, size_t len) {
+    if (dgram_batch_full(w->udp_tx)) {
+        worker_send_datagrams(w);
+    }
+    if (engine.encrypt) {
+        // Sealed into the slot of the batch entry it becomes
+        uint8_t *dgram = w->udp_sealed[w->udp_tx->count];
+        struct sockaddr_in to;
+        size_t n = 0;
+        if (len + SEAL_DGRAM_OVERHEAD <= DGRAM_SLOT_SIZE) {
+            memcpy(dgram + SEAL_DGRAM_HEADER_LEN, pkt, len);
+            pthread_mutex_lock(&p->lock);
+            n = seal_dgram_seal(&p->tx, p->id, dgram, len);
+            to = p->addr;
+            pthread_mutex_unlock(&p->lock);
+        }
+        if (n == 0) {
+            metrics_add(&w->metrics, METRICS_DROPS, 1);
+            return;
+        }
+        if (w->udp_tx->count == 0) {
+            w->udp_since = w->read_ns;
+        }
+        dgram_batch_add(w->udp_tx, &to, dgram, n);
+    } else {
+        if (w->udp_tx->count == 0) {
+            w->udp_since = w->read_ns;
+        }
+        dgram_batch_add(w->udp_tx, &p->addr, pkt, len);
+    }
+    metrics_add(&w->metrics, METRICS_TUN_TO_SOCKET_PACKETS, 1);
+    metrics_add(&w->metrics, METRICS_TUN_TO_SOCKET_BYTES, len);
+    if (w->limits.batch_delay_us > 0 && !w->flush_armed) {
+        worker_arm_flush(w);
+    }
+}
+
+// Route one packet held in the burst buffer, used bytes of which it takes
+// up, to the client its destination belongs to
+static void worker_route(struct worker *w, uint8_t *pkt, size_t len, size_t used, uint16_t gso_size);
+
+// Cut a super-packet into segments and route each on its own. The packet is
+// copied out first: making room for the segments may flush the burst buffer.
+static void worker_segment(struct worker *w, const uint8_t *pkt, size_t len, uint16_t gso_size) {
+    memcpy(w->gso_scratch, pkt, len);
+    if (gso_iter_init(&w->gso, w->gso_scratch, len, gso_size) < 0) {
+        return;
+    }
+    for (;;) {
+        uint8_t *seg = worker_burst_space(w);
+        size_t n = gso_iter_next(&w->gso, seg);
+        if (n == 0) {
+            break;
+        }
+        worker_route(w, seg, n, n, 0);
+    }
+}
+
+// Queue a packet for a session this worker owns, on the connection of its
+// pool the flow hashes to, whole if the client takes super-packets and it
+// fits in a frame, else segment by segment. A frame for an encrypted
+// connection must also fit in a record.
+static void session_take_packet(struct worker *w, struct session *s, uint8_t *pkt, size_t len, size_t used, uint16_t gso_size) {
+    if (s->group) {
+        s = stripe_member(s, pkt, len);
+    }
+    size_t max = s->seal ? SEAL_FRAME_MAX_PAYLOAD : FRAME_MAX_PAYLOAD;
+    if (gso_size && (!s->gso || len + FRAME_GSO_PREFIX_LEN > max)) {
+        worker_segment(w, pkt, len, gso_size);
+        return;
+    }
+    if (len > max) {
+        metrics_add(&w->metrics, METRICS_DROPS, 1);
+        return;
+    }
+    w->burst_len += used;
+    session_queue_packet(w, s, pkt, len, gso_size);
+}
+
+static void worker_route(struct worker *w, uint8_t *pkt, size_t len, size_t used, uint16_t gso_size) {
+    uint32_t dst;
+    if (!packet_tunnel_addr(pkt, len, 1, &dst)) {
+        metrics_add(&w->metrics, METRICS_DROPS, 1);
+        return;
+    }
+
+    // One datagram carries one packet, so super-packets are always cut up
+    if (engine.transport == ENGINE_TRANSPORT_DATAGRAM) {
+        struct peer *p = session_table_lookup(engine.peers, dst);
+        if (!p) {
+            metrics_add(&w->metrics, METRICS_DROPS, 1);
+            return;
+        }
+        if (gso_size) {
+            worker_segment(w, pkt, len, gso_size);
+            return;
+        }
+        w->burst_len += used;
+        worker_queue_datagram(w, p, pkt, len);
+        return;
+    }
+
+    struct session *s = session_table_lookup(engine.table, dst);
+    if (!s) {
+        metrics_add(&w->metrics, METRICS_DROPS, 1);
+        return;
+    }
+    struct worker *owner = session_owner(s);
+    if (owner != w) {
+        post_packet(w, owner, dst, pkt, len, gso_size);
+    } else {
+        session_take_packet(w, s, pkt, len, used, gso_size);
+    }
+}
+
+// Strip the virtio-net header off a TUN read. Checksums the kernel left for
+// the device to finish are finished here; a super-packet keeps its segment
+// size, and every segment gets full checksums when it is cut.
+static int tun_offload(uint8_t *buf, size_t n, uint8_t **pkt, size_t *len, uint16_t *gso_size) {
+    struct virtio_net_hdr h;
+    if (n < TUN_VNET_HDR_LEN) {
+        return -1;
+    }
+    memcpy(&h, buf, sizeof(h));
+    *pkt = buf + TUN_VNET_HDR_LEN;
+    *len = n - TUN_VNET_HDR_LEN;
+    *gso_size = 0;
+
+    switch (h.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+        if ((h.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+            gso_finish_checksum(*pkt, *len, h.csum_start, h.csum_offset) < 0) {
+            return -1;
+        }
+        return 0;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+    case VIRTIO_NET_HDR_GSO_UDP_L4:
+        *gso_size = h.gso_size;
+        return h.gso_size ? 0 : -1;
+    default:
+        return -1;
+    }
+}
+
+// Route one TUN read of n bytes, made into the burst buffer
+static void tun_packet(struct worker *w, uint8_t *buf, size_t n) {
+    uint8_t *pkt = buf;
+    size_t len = n;
+    uint16_t gso_size = 0;
+    if (engine.vnet_hdr && tun_offload(buf, n, &pkt, &len, &gso_size) < 0) {
+        metrics_add(&w->metrics, n < TUN_VNET_HDR_LEN ? METRICS_SHORT_READS : METRICS_DROPS, 1);
+        return;
+    }
+    if (len < 20 || ((pkt[0] >> 4) != 4 && (pkt[0] >> 4) != 6)) {
+        metrics_add(&w->metrics, len < 20 ? METRICS_SHORT_READS : METRICS_DROPS, 1);
+        return;
+    }
+    if (w->capture.cap) {
+        pcapng_write(&w->capture, pkt, len, PCAPNG_OUTBOUND);
+    }
+    worker_route(w, pkt, len, n, gso_size);
+}
+
+// Read everything this TUN queue has and route each packet by destination.
+// With the steering program attached the kernel already picked the owner's
+// queue, so the mailbox is only used without it.
+static void tun_readable(struct worker *w) {
+    size_t want = engine.vnet_hdr ? TUN_READ_MAX : ENGINE_MAX_PACKET;
+
+    w->read_ns = w->wake_ns;
+    for (;;) {
+        uint8_t *buf = worker_burst_space(w);
+        ssize_t n = read(w->tun_fd, buf, want);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error reading from TUN device");
+            }
+            break;
+        }
+
+        tun_packet(w, buf, n);
+    }
+    worker_burst_done(w);
+}
+
+// Pin worker i to the i-th CPU the process may run on
+static void worker_pin(struct worker *w) {
+    cpu_set_t allowed, mine;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return;
+    }
+    int count = CPU_COUNT(&allowed);
+    if (count <= 0) {
+        return;
+    }
+
+    int want = w->id % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || want-- > 0) {
+            continue;
+        }
+        CPU_ZERO(&mine);
+        CPU_SET(cpu, &mine);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+        if (rc != 0) {
+            fprintf(stderr, "Error pinning worker %d to CPU %d: %s\n", w->id, cpu, strerror(rc));
+        }
+        return;
+    }
+}
+
+static void worker_dispatch(struct worker *w, struct source *src, uint32_t events) {
+    switch (src->type) {
+    case SRC_LISTENER:
+        accept_clients(w);
+        break;
+    case SRC_TUN:
+        tun_readable(w);
+        break;
+    case SRC_WAKEUP:
+        drain_mail(w);
+        break;
+    case SRC_FLUSH:
+        flush_expired(w);
+        break;
+    case SRC_SESSION:
+        session_event((struct session *)src, events);
+        break;
+    case SRC_UDP:
+        udp_readable(w);
+        break;
+    }
+}
+
+// How long a worker may sleep: not at all while sessions wait for a turn;
+// retired sessions only make the wait finite until the other workers have
+// moved on, detached ones until they expire
+static int worker_timeout(struct worker *w, int pending) {
+    return w->deferred ? 0 : pending ? 1 : w->detached ? 1000 : -1;
+}
+
+static void worker_run_epoll(struct worker *w) {
+    struct epoll_event events[EPOLL_BATCH];
+
+    while (engine.running) {
+        // Blocked workers hold no table references
+        int pending = qsbr_reclaim(w->id);
+        qsbr_offline(w->id);
+        int n = epoll_wait(w->epfd, events, EPOLL_BATCH, worker_timeout(w, pending));
+        qsbr_quiescent(w->id);
+        w->wake_ns = now_ns();
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait error");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            worker_dispatch(w, events[i].data.ptr, events[i].events);
+        }
+        worker_serve_deferred(w);
+        if (w->detached > 0) {
+            worker_expire_sessions(w);
+        }
+    }
+}
+
+// Keep one read in flight per registered TUN slot
+static void ring_tun_read(struct worker *w, unsigned slot) {
+    uint8_t *buf = w->tun_rx + (size_t)slot * TUN_READ_MAX;
+    if (uring_rw_fixed(w->ring, IORING_OP_READ_FIXED, w->tun_fd, buf, TUN_READ_MAX, 1,
+                       (uint64_t)slot << RING_OP_BITS | RING_OP_TUN_READ) < 0) {
+        fprintf(stderr, "Error queueing TUN read\n");
+    }
+}
+
+static void ring_tun_read_done(struct worker *w, unsigned slot, int res) {
+    if (res > 0) {
+        w->read_ns = w->wake_ns;
+        uint8_t *buf = worker_burst_space(w);
+        memcpy(buf, w->tun_rx + (size_t)slot * TUN_READ_MAX, res);
+        tun_packet(w, buf, res);
+        w->tun_burst = 1;
+    } else if (res < 0 && res != -EAGAIN && res != -EINTR) {
+        fprintf(stderr, "Error reading from TUN device: %s\n", strerror(-res));
+        return;
+    }
+    ring_tun_read(w, slot);
+}
+
+// A completion for a client socket's poll or receive
+static void ring_session_done(struct worker *w, struct ring_link *l, enum ring_op op,
+                              const struct io_uring_cqe *cqe) {
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    struct session *s = l->session;
+
+    if (!more) {
+        l->armed--;
+    }
+
+    if (op == RING_OP_SESSION_RECV) {
+        uint16_t bid = 0;
+        const uint8_t *data = cqe->flags & IORING_CQE_F_BUFFER ? uring_provided(w->ring, cqe, &bid) : NULL;
+        if (s && cqe->res > 0) {
+            int rc = session_received(s, data, cqe->res);
+            if (rc == 1) {
+                // Bytes behind this frame may already sit in later buffers
+                fprintf(stderr, "Client changed its tunnel address mid-stream\n");
+            }
+            if (rc != 0) {
+                session_close(s);
+            }
+        } else if (s && cqe->res != -ENOBUFS) {
+            if (cqe->res < 0) {
+                fprintf(stderr, "Error reading from client: %s\n", strerror(-cqe->res));
+            }
+            session_close(s);
+        }
+        if (data) {
+            uring_recycle(w->ring, bid);
+        }
+        // Out of buffers ends the receive; they are back by now
+        s = l->session;
+        if (s && !more && ring_arm(w, l, RING_OP_SESSION_RECV) < 0) {
+            session_close(s);
+        }
+    } else {
+        // Once data comes by receive, polls only report room to send
+        if (s && cqe->res > 0) {
+            session_event(s, l->recv ? (uint32_t)cqe->res & POLLOUT : (uint32_t)cqe->res);
+        }
+        s = l->session;
+        if (s && !more && cqe->res != -ECANCELED && (op == RING_OP_SESSION_WRITABLE) == l->recv &&
+            ring_arm(w, l, op) < 0) {
+            session_close(s);
+        }
+    }
+
+    if (!l->session && l->armed == 0) {
+        ring_link_free(w, l);
+    }
+}
+
+static void ring_complete(struct worker *w, const struct io_uring_cqe *cqe) {
+    enum ring_op op = cqe->user_data & RING_OP_MASK;
+    uint64_t arg = cqe->user_data & ~(uint64_t)RING_OP_MASK;
+
+    switch (op) {
+    case RING_OP_POLL: {
+        struct source *src = (struct source *)(uintptr_t)arg;
+        if (cqe->res > 0) {
+            worker_dispatch(w, src, cqe->res);
+        } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            fprintf(stderr, "Error polling: %s\n", strerror(-cqe->res));
+            return;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            ring_poll_source(w, src);
+        }
+        break;
+    }
+    case RING_OP_SESSION_POLL:
+    case RING_OP_SESSION_WRITABLE:
+    case RING_OP_SESSION_RECV:
+        ring_session_done(w, (struct ring_link *)(uintptr_t)arg, op, cqe);
+        break;
+    case RING_OP_TUN_READ:
+        ring_tun_read_done(w, (unsigned)(arg >> RING_OP_BITS), cqe->res);
+        break;
+    case RING_OP_TUN_WRITE:
+        w->tun_tx_inflight--;
+        if (cqe->res < 0) {
+            fprintf(stderr, "Error writing to TUN device: %s\n", strerror(-cqe->res));
+        }
+        break;
+    default:
+        // A cancellation
+        break;
+    }
+}
+
+// One io_uring_enter() per iteration submits everything the last one
+// queued - TUN writes, reads to replace the ones consumed, re-armed
+// receives - and waits for the next completions
+static void worker_run_ring(struct worker *w) {
+    while (engine.running) {
+        int pending = qsbr_reclaim(w->id);
+        qsbr_offline(w->id);
+        int rc = uring_wait(w->ring, w->nheld ? 0 : worker_timeout(w, pending));
+        qsbr_quiescent(w->id);
+        w->wake_ns = now_ns();
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_uring_enter error");
+            break;
+        }
+
+        // Held completions came first; more may be held while they are handled
+        for (unsigned i = 0; i < w->nheld; i++) {
+            struct io_uring_cqe done = w->held[i];
+            ring_complete(w, &done);
+        }
+        w->nheld = 0;
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(w->ring))) {
+            struct io_uring_cqe done = *cqe;
+            uring_cqe_seen(w->ring);
+            ring_complete(w, &done);
+        }
+        if (w->tun_burst) {
+            w->tun_burst = 0;
+            worker_burst_done(w);
+        }
+        worker_serve_deferred(w);
+        if (w->detached > 0) {
+            worker_expire_sessions(w);
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+
+    if (engine.pin_cpus) {
+        worker_pin(w);
+    }
+
+    qsbr_quiescent(w->id);
+    if (w->ring) {
+        worker_run_ring(w);
+    } else {
+        worker_run_epoll(w);
+    }
+
+    while (w->sessions) {
+        session_close(w->sessions);
+    }
+    return NULL;
+}
+
+// Watch one of the worker's own fds: through epoll, or with a multishot
+// poll on the ring, which completes on every wakeup much like EPOLLET
+static int worker_watch(struct worker *w, int fd, struct source *src, uint32_t events) {
+    if (w->ring) {
+        src->fd = fd;
+        src->events = events & ~(uint32_t)(EPOLLET | EPOLLEXCLUSIVE);
+        return ring_poll_source(w, src);
+    }
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+    return epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// io_uring backend: the ring, its receive buffers, and the registered TUN
+// slots (buffer 1) and write arena (buffer 0)
+static int worker_ring_init(struct worker *w) {
+    w->ring = malloc(sizeof(*w->ring));
+    if (!w->ring) {
+        fprintf(stderr, "Error allocating io_uring\n");
+        return -1;
+    }
+    if (uring_init(w->ring, RING_SQ_ENTRIES, RING_CQ_ENTRIES) < 0) {
+        perror("Error creating io_uring");
+        free(w->ring);
+        w->ring = NULL;
+        return -1;
+    }
+    if (uring_setup_provided(w->ring, RING_RECV_BUFFERS, RING_RECV_BUFFER_SIZE) < 0) {
+        perror("Error registering receive buffers");
+        return -1;
+    }
+
+    w->tun_tx = malloc(RING_TUN_WRITE_ARENA);
+    w->tun_rx = malloc(RING_TUN_READS * TUN_READ_MAX);
+    w->held = malloc(RING_CQ_ENTRIES * sizeof(*w->held));
+    if (!w->tun_tx || !w->tun_rx || !w->held) {
+        fprintf(stderr, "Error allocating TUN buffers\n");
+        return -1;
+    }
+    struct iovec iov[2] = {
+        { .iov_base = w->tun_tx, .iov_len = RING_TUN_WRITE_ARENA },
+        { .iov_base = w->tun_rx, .iov_len = RING_TUN_READS * TUN_READ_MAX },
+    };
+    if (uring_register_buffers(w->ring, iov, 2) < 0) {
+        perror("Error registering TUN buffers");
+        return -1;
+    }
+    return 0;
+}
+
+static int worker_init(struct worker *w, int id, int tun_fd) {
+    w->id = id;
+    w->tun_fd = tun_fd;
+    w->limits = engine.limits;
+    w->limits_gen = engine.limits_gen;
+    w->tun.type = SRC_TUN;
+    w->wakeup.type = SRC_WAKEUP;
+    w->flush.type = SRC_FLUSH;
+    w->udp.type = SRC_UDP;
+    pthread_mutex_init(&w->mail_lock, NULL);
+    pcapng_writer_init(&w->capture, engine.capture);
+
+    if (engine.backend == ENGINE_BACKEND_URING) {
+        if (worker_ring_init(w) < 0) {
+            return -1;
+        }
+    } else {
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epfd < 0) {
+            perror("Error creating epoll instance");
+            return -1;
+        }
+    }
+
+    w->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->wakeup_fd < 0) {
+        perror("Error creating eventfd");
+        return -1;
+    }
+
+    if (worker_watch(w, w->wakeup_fd, &w->wakeup, EPOLLIN | EPOLLET) < 0) {
+        perror("Error registering eventfd");
+        return -1;
+    }
+
+    w->burst = malloc(WORKER_BURST_SIZE);
+    if (!w->burst) {
+        fprintf(stderr, "Error allocating burst buffer\n");
+        return -1;
+    }
+
+    w->rx_scratch = malloc(FRAME_RX_BUFFER_SIZE);
+    if (!w->rx_scratch) {
+        fprintf(stderr, "Error allocating receive buffer\n");
+        return -1;
+    }
+
+    if (engine.compress) {
+        w->lz_out = malloc(LZ_BATCH_SCRATCH);
+        w->lz_batch = malloc(sizeof(*w->lz_batch));
+        if (!w->lz_out || !w->lz_batch) {
+            fprintf(stderr, "Error allocating compression buffers\n");
+            return -1;
+        }
+    }
+
+    // Sized for the largest batch there can be; only what a batch holds is
+    // ever touched
+    if (engine.encrypt && engine.transport == ENGINE_TRANSPORT_STREAM) {
+        w->seal_out = malloc(SEAL_BATCH_SCRATCH(FRAME_BATCH_MAX * FRAME_MAX_LEN));
+        w->seal_batch = malloc(sizeof(*w->seal_batch));
+        if (!w->seal_out || !w->seal_batch) {
+            fprintf(stderr, "Error allocating encryption buffers\n");
+            return -1;
+        }
+    }
+
+    if (engine.vnet_hdr) {
+        w->gso_scratch = malloc(ENGINE_MAX_PACKET);
+        if (!w->gso_scratch) {
+            fprintf(stderr, "Error allocating segmentation buffer\n");
+            return -1;
+        }
+    }
+
+    w->flush_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (w->flush_fd < 0) {
+        perror("Error creating flush timer");
+        return -1;
+    }
+    if (worker_watch(w, w->flush_fd, &w->flush, EPOLLIN | EPOLLET) < 0) {
+        perror("Error registering flush timer");
+        return -1;
+    }
+
+    if (engine.transport == ENGINE_TRANSPORT_STREAM) {
+        // On a shared listener every worker accepts, and EPOLLEXCLUSIVE wakes
+        // only one of them per connection; on its own the kernel already chose
+        uint32_t exclusive = w->listen_fd == engine.listen_fd ? EPOLLEXCLUSIVE : 0;
+        if (worker_watch(w, w->listen_fd, &engine.listener, EPOLLIN | EPOLLET | exclusive) < 0) {
+            perror("Error registering listener");
+            return -1;
+        }
+    } else {
+        // The kernel spreads clients across the workers' sockets by address
+        w->udp_rx = malloc(sizeof(*w->udp_rx));
+        w->udp_tx = malloc(sizeof(*w->udp_tx));
+        if (!w->udp_rx || !w->udp_tx) {
+            fprintf(stderr, "Error allocating datagram buffers\n");
+            return -1;
+        }
+        dgram_rx_init(w->udp_rx);
+        dgram_batch_init(w->udp_tx);
+        if (engine.encrypt) {
+            w->udp_sealed = malloc(DGRAM_BATCH_MAX * sizeof(*w->udp_sealed));
+            if (!w->udp_sealed) {
+                fprintf(stderr, "Error allocating datagram buffers\n");
+                return -1;
+            }
+        }
+
+        if (worker_watch(w, w->udp_fd, &w->udp, EPOLLIN | EPOLLET) < 0) {
+            perror("Error registering datagram socket");
+            return -1;
+        }
+    }
+
+    // Without IFF_MULTI_QUEUE only the first worker has a queue to read
+    if (tun_fd >= 0 && w->ring) {
+        for (unsigned i = 0; i < RING_TUN_READS; i++) {
+            ring_tun_read(w, i);
+        }
+    } else if (tun_fd >= 0) {
+        if (worker_watch(w, tun_fd, &w->tun, EPOLLIN | EPOLLET) < 0) {
+            perror("Error registering TUN device");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void worker_destroy(struct worker *w) {
+    struct mail *m = w->mail_head;
+    while (m) {
+        struct mail *next = m->next;
+        if (m->kind != MAIL_PACKET && m->kind != MAIL_LIMITS) {
+            session_discard(w, m->session);
+        }
+        mail_free(w, m);
+        m = next;
+    }
+    pcapng_writer_flush(&w->capture);
+    if (w->wakeup_fd >= 0) {
+        close(w->wakeup_fd);
+    }
+    if (w->flush_fd >= 0) {
+        close(w->flush_fd);
+    }
+    free(w->burst);
+    free(w->rx_scratch);
+    free(w->gso_scratch);
+    free(w->lz_out);
+    free(w->lz_batch);
+    free(w->seal_out);
+    free(w->seal_batch);
+    free(w->udp_rx);
+    free(w->udp_tx);
+    free(w->udp_sealed);
+    while (w->links) {
+        ring_link_free(w, w->links);
+    }
+    if (w->ring) {
+        uring_free(w->ring);
+        free(w->ring);
+    }
+    free(w->tun_rx);
+    free(w->held);
+    free(w->tun_tx);
+    if (w->udp_fd >= 0) {
+        close(w->udp_fd);
+    }
+    if (w->listen_fd >= 0 && w->listen_fd != engine.listen_fd) {
+        close(w->listen_fd);
+    }
+    if (w->epfd >= 0) {
+        close(w->epfd);
+    }
+    if (w->tun_fd >= 0) {
+        close(w->tun_fd);
+    }
+    pthread_mutex_destroy(&w->mail_lock);
+}
+
+int engine_start(const struct engine_config *cfg) {
+    if (cfg->nworkers < 1 || cfg->nworkers > ENGINE_MAX_WORKERS) {
+        fprintf(stderr, "Invalid worker count: %d\n", cfg->nworkers);
+        return -1;
+    }
+    if (cfg->transport == ENGINE_TRANSPORT_STREAM && cfg->nlisten != 1 && cfg->nlisten != cfg->nworkers) {
+        fprintf(stderr, "Need one listener, or one per worker, got %d for %d\n", cfg->nlisten, cfg->nworkers);
+        return -1;
+    }
+    if (cfg->ntun != 1 && cfg->ntun != cfg->nworkers) {
+        fprintf(stderr, "Need one TUN queue per worker, got %d for %d\n", cfg->ntun, cfg->nworkers);
+        return -1;
+    }
+
+    engine.nworkers = cfg->nworkers;
+    engine.transport = cfg->transport;
+    engine.backend = cfg->backend;
+    engine.listen_fd = cfg->transport == ENGINE_TRANSPORT_STREAM && cfg->nlisten == 1 ? cfg->listen_fds[0] : -1;
+    engine.pin_cpus = cfg->pin_cpus;
+    engine.vnet_hdr = cfg->vnet_hdr;
+    engine.compress = cfg->compress && cfg->transport == ENGINE_TRANSPORT_STREAM;
+    engine.encrypt = cfg->encrypt;
+    engine.tunnel_net = cfg->tunnel_net & cfg->tunnel_mask;
+    engine.tunnel_mask = cfg->tunnel_mask;
+    memcpy(engine.key, cfg->key, sizeof(engine.key));
+    engine.limits = cfg->limits;
+    if (engine.limits.batch_bytes == 0) {
+        engine.limits.batch_bytes = ENGINE_BATCH_BYTES;
+    }
+    engine.capture = cfg->capture;
+    engine.listener.type = SRC_LISTENER;
+    engine.running = 1;
+    qsbr_init(engine.nworkers);
+
+    engine.table = session_table_create(SESSION_TABLE_INITIAL);
+    if (!engine.table) {
+        fprintf(stderr, "Error allocating session table\n");
+        return -1;
+    }
+
+    engine.resumable = session_table_create(SESSION_TABLE_INITIAL);
+    if (!engine.resumable) {
+        fprintf(stderr, "Error allocating session table\n");
+        return -1;
+    }
+
+    engine.peers = session_table_create(SESSION_TABLE_INITIAL);
+    engine.peer_ids = session_table_create(SESSION_TABLE_INITIAL);
+    if (!engine.peers || !engine.peer_ids) {
+        fprintf(stderr, "Error allocating peer table\n");
+        return -1;
+    }
+    pthread_mutex_init(&engine.peer_lock, NULL);
+
+    engine.pool = bufpool_create(engine.nworkers, POOL_CACHED_PER_WORKER);
+    if (!engine.pool) {
+        fprintf(stderr, "Error allocating buffer pool\n");
+        return -1;
+    }
+
+    engine.workers = calloc(engine.nworkers, sizeof(struct worker));
+    if (!engine.workers) {
+        fprintf(stderr, "Error allocating workers\n");
+        return -1;
+    }
+    for (int i = 0; i < engine.nworkers; i++) {
+        engine.workers[i].epfd = -1;
+        engine.workers[i].wakeup_fd = -1;
+        engine.workers[i].flush_fd = -1;
+        engine.workers[i].tun_fd = i < cfg->ntun ? cfg->tun_fds[i] : -1;
+        engine.workers[i].tun_wfd = i < cfg->ntun ? cfg->tun_fds[i] : cfg->tun_fds[0];
+        engine.workers[i].udp_fd = engine.transport == ENGINE_TRANSPORT_DATAGRAM ? cfg->udp_fds[i] : -1;
+        engine.workers[i].listen_fd = engine.transport != ENGINE_TRANSPORT_STREAM ? -1 :
+                                      cfg->nlisten == 1 ? cfg->listen_fds[0] : cfg->listen_fds[i];
+    }
+
+    for (int i = 0; i < engine.nworkers; i++) {
+        if (worker_init(&engine.workers[i], i, engine.workers[i].tun_fd) < 0) {
+            engine.nworkers = i + 1;
+            engine.running = 0;
+            engine_stop();
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < engine.nworkers; i++) {
+        if (pthread_create(&engine.workers[i].thread, NULL, worker_main, &engine.workers[i]) != 0) {
+            fprintf(stderr, "Error creating worker thread\n");
+            engine.running = 0;
+            for (int j = 0; j < i; j++) {
+                wake_worker(&engine.workers[j]);
+                pthread_join(engine.workers[j].thread, NULL);
+                engine.workers[j].thread = 0;
+            }
+            engine_stop();
+            return -1;
+        }
+    }
+
+    printf("Started %d worker%s\n", engine.nworkers, engine.nworkers == 1 ? "" : "s");
+    return 0;
+}
+
+// Every mail is allocated before any is posted, so either each worker
+// switches or none does
+int engine_reload(const struct engine_limits *limits) {
+    struct mail *mails[ENGINE_MAX_WORKERS];
+    unsigned gen = ++engine.limits_gen;
+
+    for (int i = 0; i < engine.nworkers; i++) {
+        mails[i] = malloc(sizeof(struct mail) + sizeof(struct reload));
+        if (!mails[i]) {
+            while (i > 0) {
+                free(mails[--i]);
+            }
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    for (int i = 0; i < engine.nworkers; i++) {
+        struct reload *r = (struct reload *)mails[i]->data;
+        r->limits = *limits;
+        if (r->limits.batch_bytes == 0) {
+            r->limits.batch_bytes = ENGINE_BATCH_BYTES;
+        }
+        r->gen = gen;
+        mails[i]->kind = MAIL_LIMITS;
+        mails[i]->session = NULL;
+        mails[i]->len = sizeof(*r);
+        post_mail(&engine.workers[i], mails[i]);
+    }
+    return 0;
+}
+
+size_t engine_metrics(char *buf, size_t cap) {
+    const struct metrics *sets[ENGINE_MAX_WORKERS];
+    for (int i = 0; i < engine.nworkers; i++) {
+        sets[i] = &engine.workers[i].metrics;
+    }
+    return metrics_format(buf, cap, sets, engine.nworkers, "worker");
+}
+
+void engine_stop(void) {
+    engine.running = 0;
+
+    for (int i = 0; i < engine.nworkers; i++) {
+        if (engine.workers[i].thread) {
+            wake_worker(&engine.workers[i]);
+        }
+    }
+    for (int i = 0; i < engine.nworkers; i++) {
+        if (engine.workers[i].thread) {
+            pthread_join(engine.workers[i].thread, NULL);
+        }
+        worker_destroy(&engine.workers[i]);
+    }
+
+    free(engine.workers);
+    engine.workers = NULL;
+
+    if (engine.pool) {
+        struct bufpool_stats st;
+        bufpool_stats(engine.pool, &st);
+        printf("Buffer pool: %llu hits, %llu misses, %llu jumbo, high-water %zu buffers\n",
+               (unsigned long long)st.hits, (unsigned long long)st.misses,
+               (unsigned long long)st.jumbo, st.high_water);
+        bufpool_destroy(engine.pool);
+        engine.pool = NULL;
+    }
+
+    qsbr_drain();
+    session_table_destroy(engine.table);
+    engine.table = NULL;
+    session_table_destroy(engine.resumable);
+    engine.resumable = NULL;
+    if (engine.peers) {
+        // Sealed peers are on their list, and may be in both tables
+        if (engine.encrypt) {
+            while (engine.sealed_peers) {
+                struct peer *p = engine.sealed_peers;
+                engine.sealed_peers = p->next;
+                peer_free(p);
+            }
+            engine.nsealed = 0;
+        } else {
+            session_table_foreach(engine.peers, peer_free);
+        }
+        session_table_destroy(engine.peers);
+        engine.peers = NULL;
+        pthread_mutex_destroy(&engine.peer_lock);
+    }
+    session_table_destroy(engine.peer_ids);
+    engine.peer_ids = NULL;
+
+    if (engine.listen_fd >= 0) {
+        close(engine.listen_fd);
+    }
+}
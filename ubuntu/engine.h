@@ -0,0 +1,137 @@
+//
+//  engine.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  Event-driven forwarding engine: one edge-triggered epoll loop per worker
+//  thread, each multiplexing the listener, its client sockets and its own
+//  TUN queue. Sessions live on the worker chosen by engine_shard().
+//
+//  Clients reach the engine over one of two transports, chosen at startup:
+//  a TCP stream of length-prefixed frames, or UDP with one IP packet per
+//  datagram. Datagram clients have no session: the engine just remembers
+//  which address each tunnel address was last heard from, for addresses in
+//  the tunnel's subnet.
+//
+//  With a pre-shared key, stream connections and datagrams are encrypted
+//  and clients without the key are refused (seal.h). A datagram client is
+//  then a peer the handshake made, which keeps one tunnel address.
+//
+//  The stream clients of a worker take turns writing to its TUN queue, by
+//  deficit round-robin over their sockets, and each may be capped in bytes
+//  and packets per second; packets over a cap are dropped.
+//
+//  The loops wait on epoll by default, or on an io_uring per worker that
+//  takes socket receives and TUN reads and writes as completions.
+//
+//  Stream connections take the socket tuning profile (socktune.h) as they
+//  are accepted, from one listener every worker accepts on or, with
+//  SO_REUSEPORT, a listener per worker.
+//
+//  With a capture, every worker records the headers of the packets it reads
+//  from and writes to the TUN device (pcapng.h).
+//
+//  The limits (batching, per-client caps, socket tuning) can be changed while
+//  the engine runs: each worker takes the new ones between events, and the
+//  sessions it serves stay connected.
+//
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "pcapng.h"
+#include "seal.h"
+#include "socktune.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#define ENGINE_MAX_WORKERS 64
+#define ENGINE_MAX_PACKET 65535
+#define ENGINE_BATCH_BYTES (64 * 1024)
+
+enum engine_transport {
+    ENGINE_TRANSPORT_STREAM,            // framed packets over TCP
+    ENGINE_TRANSPORT_DATAGRAM,          // one packet per UDP datagram
+};
+
+enum engine_backend {
+    ENGINE_BACKEND_EPOLL,               // readiness events, then read()/recv()
+    ENGINE_BACKEND_URING,               // multishot receives and fixed-buffer TUN I/O
+};
+
+// What engine_reload() can change
+struct engine_limits {
+    size_t batch_bytes;                 // send a client's batch once it holds this much (0: default)
+    unsigned batch_delay_us;            // hold batches up to this long after a burst (0: send at burst end)
+    uint64_t client_bytes_per_sec;      // stream: cap on what one client sends on to the TUN (0: none)
+    uint64_t client_packets_per_sec;
+    struct socktune tune;               // stream: applied to every connection accepted from then on
+};
+
+struct engine_config {
+    int nworkers;                       // number of event loops, normally one per core
+    enum engine_transport transport;
+    enum engine_backend backend;
+    int listen_fds[ENGINE_MAX_WORKERS]; // stream: bound, listening, non-blocking TCP sockets,
+    int nlisten;                        // one every worker accepts on or one per worker
+                                        // sharing the port through SO_REUSEPORT
+    int udp_fds[ENGINE_MAX_WORKERS];    // datagram: non-blocking UDP sockets sharing the port
+                                        // through SO_REUSEPORT, one per worker
+    int tun_fds[ENGINE_MAX_WORKERS];    // TUN queues, one per worker; non-blocking
+                                        // for epoll, blocking for io_uring
+    int ntun;                           // nworkers, or 1 without IFF_MULTI_QUEUE
+    int pin_cpus;                       // pin worker i to the i-th allowed CPU
+    int vnet_hdr;                       // TUN queues opened with IFF_VNET_HDR and offloads on
+    int compress;                       // stream: compress connections whose HELLO asks for it
+    int encrypt;                        // accept only connections and datagrams sealed with key
+    uint8_t key[SEAL_KEY_LEN];          // pre-shared key
+    uint32_t tunnel_net;                // datagram: subnet client tunnel addresses must be in,
+    uint32_t tunnel_mask;               // network byte order
+    struct engine_limits limits;
+    struct pcapng *capture;             // record packets here (NULL: no capture); the
+                                        // caller closes it after engine_stop()
+};
+
+/**
+ * Hash a tunnel address to the worker (and TUN queue) that serves it.
+ * Must match the steering program attached to the TUN device.
+ * @param ip IPv4 address in network byte order
+ * @param nworkers Number of workers
+ * @return Worker index
+ */
+static inline int engine_shard(uint32_t ip, int nworkers) {
+    uint32_t h = ntohl(ip) * 0x9E3779B1u;
+    return (int)((uint16_t)(h >> 16) % (unsigned)nworkers);
+}
+
+/**
+ * Start the worker threads
+ * @param cfg Engine configuration; copied, fds are owned by the engine afterwards
+ * @return 0 on success, -1 on failure
+ */
+int engine_start(const struct engine_config *cfg);
+
+/**
+ * Change the limits of a running engine. Every worker switches to them at
+ * its next wakeup; a client's caps restart from a full burst.
+ * @param limits New limits; copied
+ * @return 0 on success, -1 if out of memory, with nothing changed
+ */
+int engine_reload(const struct engine_limits *limits);
+
+/**
+ * Render every worker's counters and latency histograms as Prometheus
+ * text; safe to call from any thread while the engine runs
+ * @param buf Output
+ * @param cap Output capacity
+ * @return Length of the whole text, as metrics_format()
+ */
+size_t engine_metrics(char *buf, size_t cap);
+
+/**
+ * Wake every worker, wait for them to exit and release all sessions
+ */
+void engine_stop(void);
+
+#endif
@@ -0,0 +1,280 @@
+//
+//  flowtable.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#define _GNU_SOURCE
+
+#include "flowtable.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#define FLOWTABLE_MSG(type) ((NFNL_SUBSYS_NFTABLES << 8) | (type))
+#define FLOWTABLE_REPLY_MAX 8192
+
+// The kernel answers at once; this only guards against a lost reply
+#define FLOWTABLE_TIMEOUT_MS 1000
+
+// Netlink header and netfilter header of a message, at off
+static size_t put_msg(uint8_t *buf, size_t off, uint16_t type, uint16_t flags, uint32_t seq,
+                      uint8_t family, uint16_t res_id) {
+    struct nlmsghdr nh = {
+        .nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg)),
+        .nlmsg_type = type,
+        .nlmsg_flags = NLM_F_REQUEST | flags,
+        .nlmsg_seq = seq,
+    };
+    struct nfgenmsg nfg = {
+        .nfgen_family = family,
+        .version = NFNETLINK_V0,
+        .res_id = htons(res_id),
+    };
+    memcpy(buf + off, &nh, sizeof(nh));
+    memcpy(buf + off + NLMSG_HDRLEN, &nfg, sizeof(nfg));
+    return off + NLMSG_ALIGN(nh.nlmsg_len);
+}
+
+// Attribute at off, padded to the alignment
+static size_t put_attr(uint8_t *buf, size_t off, uint16_t type, const void *data, size_t len) {
+    struct nlattr a = { .nla_len = (uint16_t)(NLA_HDRLEN + len), .nla_type = type };
+    memcpy(buf + off, &a, sizeof(a));
+    memcpy(buf + off + NLA_HDRLEN, data, len);
+    memset(buf + off + a.nla_len, 0, NLA_ALIGN(a.nla_len) - a.nla_len);
+    return off + NLA_ALIGN(a.nla_len);
+}
+
+static size_t put_string(uint8_t *buf, size_t off, uint16_t type, const char *s) {
+    return put_attr(buf, off, type, s, strlen(s) + 1);
+}
+
+static size_t put_be32(uint8_t *buf, size_t off, uint16_t type, uint32_t value) {
+    value = htonl(value);
+    return put_attr(buf, off, type, &value, sizeof(value));
+}
+
+// Close the nested attribute started at start, now that it ends at off
+static void end_nest(uint8_t *buf, size_t start, size_t off) {
+    struct nlattr a = { .nla_len = (uint16_t)(off - start) };
+    memcpy(&a.nla_type, buf + start + offsetof(struct nlattr, nla_type), sizeof(a.nla_type));
+    memcpy(buf + start, &a, sizeof(a));
+}
+
+static size_t begin_nest(uint8_t *buf, size_t off, uint16_t type) {
+    struct nlattr a = { .nla_len = NLA_HDRLEN, .nla_type = NLA_F_NESTED | type };
+    memcpy(buf + off, &a, sizeof(a));
+    return off + NLA_HDRLEN;
+}
+
+// Set the length of the message started at start, now that it ends at off
+static void end_msg(uint8_t *buf, size_t start, size_t off) {
+    uint32_t len = (uint32_t)(off - start);
+    memcpy(buf + start + offsetof(struct nlmsghdr, nlmsg_len), &len, sizeof(len));
+}
+
+size_t flowtable_get_request(uint8_t *buf, uint32_t seq) {
+    size_t off = put_msg(buf, 0, FLOWTABLE_MSG(NFT_MSG_GETFLOWTABLE), 0, seq, NFPROTO_INET, 0);
+    off = put_string(buf, off, NFTA_FLOWTABLE_TABLE, FLOWTABLE_TABLE);
+    off = put_string(buf, off, NFTA_FLOWTABLE_NAME, FLOWTABLE_NAME);
+    end_msg(buf, 0, off);
+    return off;
+}
+
+size_t flowtable_add_request(uint8_t *buf, uint32_t seq, const char *ifname, int32_t priority) {
+    // Table changes only go through in a batch
+    size_t off = put_msg(buf, 0, NFNL_MSG_BATCH_BEGIN, 0, seq, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+
+    // Without NLM_F_EXCL an existing flowtable takes the devices it lacks
+    size_t msg = off;
+    off = put_msg(buf, off, FLOWTABLE_MSG(NFT_MSG_NEWFLOWTABLE), NLM_F_CREATE | NLM_F_ACK, seq + 1,
+                  NFPROTO_INET, 0);
+    off = put_string(buf, off, NFTA_FLOWTABLE_TABLE, FLOWTABLE_TABLE);
+    off = put_string(buf, off, NFTA_FLOWTABLE_NAME, FLOWTABLE_NAME);
+    size_t hook = off;
+    off = begin_nest(buf, off, NFTA_FLOWTABLE_HOOK);
+    off = put_be32(buf, off, NFTA_FLOWTABLE_HOOK_NUM, NF_NETDEV_INGRESS);
+    off = put_be32(buf, off, NFTA_FLOWTABLE_HOOK_PRIORITY, (uint32_t)priority);
+    size_t devs = off;
+    off = begin_nest(buf, off, NFTA_FLOWTABLE_HOOK_DEVS);
+    off = put_string(buf, off, NFTA_DEVICE_NAME, ifname);
+    end_nest(buf, devs, off);
+    end_nest(buf, hook, off);
+    end_msg(buf, msg, off);
+
+    return put_msg(buf, off, NFNL_MSG_BATCH_END, 0, seq + 2, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+}
+
+// Step to the attribute at *off, before end; 0 past the last one or on a bad length
+static int next_attr(const uint8_t *msg, size_t *off, size_t end, uint16_t *type, size_t *start,
+                     size_t *stop) {
+    struct nlattr a;
+    if (*off >= end || end - *off < sizeof(a)) {
+        return 0;
+    }
+    memcpy(&a, msg + *off, sizeof(a));
+    if (a.nla_len < sizeof(a) || a.nla_len > end - *off) {
+        return 0;
+    }
+    *type = a.nla_type & NLA_TYPE_MASK;
+    *start = *off + NLA_HDRLEN;
+    *stop = *off + a.nla_len;
+    *off += NLA_ALIGN(a.nla_len);
+    return 1;
+}
+
+// Payload of the first attribute of a type between off and end
+static int find_attr(const uint8_t *msg, size_t off, size_t end, uint16_t want, size_t *start,
+                     size_t *stop) {
+    uint16_t type;
+    while (next_attr(msg, &off, end, &type, start, stop)) {
+        if (type == want) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int flowtable_has_device(const uint8_t *msg, size_t len, const char *ifname, int32_t *priority) {
+    struct nlmsghdr nh;
+    if (len < sizeof(nh)) {
+        return -EBADMSG;
+    }
+    memcpy(&nh, msg, sizeof(nh));
+    if (nh.nlmsg_len < sizeof(nh) || nh.nlmsg_len > len) {
+        return -EBADMSG;
+    }
+    if (nh.nlmsg_type == NLMSG_ERROR) {
+        int error;
+        if (nh.nlmsg_len < NLMSG_LENGTH(sizeof(error))) {
+            return -EBADMSG;
+        }
+        memcpy(&error, msg + NLMSG_HDRLEN, sizeof(error));
+        return error < 0 ? error : -EBADMSG;
+    }
+    if (nh.nlmsg_type != FLOWTABLE_MSG(NFT_MSG_NEWFLOWTABLE)) {
+        return -EBADMSG;
+    }
+
+    size_t end = nh.nlmsg_len, hook, hook_end, start, stop;
+    if (!find_attr(msg, NLMSG_LENGTH(sizeof(struct nfgenmsg)), end, NFTA_FLOWTABLE_HOOK, &hook,
+                   &hook_end)) {
+        return -EBADMSG;
+    }
+    if (!find_attr(msg, hook, hook_end, NFTA_FLOWTABLE_HOOK_PRIORITY, &start, &stop) ||
+        stop - start != sizeof(uint32_t)) {
+        return -EBADMSG;
+    }
+    uint32_t prio;
+    memcpy(&prio, msg + start, sizeof(prio));
+    *priority = (int32_t)ntohl(prio);
+
+    // A flowtable on no device has no device list at all
+    size_t devs, devs_end;
+    if (!find_attr(msg, hook, hook_end, NFTA_FLOWTABLE_HOOK_DEVS, &devs, &devs_end)) {
+        return 0;
+    }
+    size_t name_len = strlen(ifname);
+    uint16_t type;
+    while (next_attr(msg, &devs, devs_end, &type, &start, &stop)) {
+        // Names come terminated, but need not be
+        size_t n = stop - start;
+        if (n > 0 && msg[start + n - 1] == '\0') {
+            n--;
+        }
+        if (type == NFTA_DEVICE_NAME && n == name_len && memcmp(msg + start, ifname, n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Send a request and wait for its answer: the reply to seq is left in reply
+// and its length returned, an acknowledgement of seq is 0, and an error for
+// any message of the batch is returned as -errno
+static ssize_t flowtable_request(int fd, const uint8_t *req, size_t len, uint32_t seq,
+                                 uint8_t *reply, size_t cap) {
+    if (send(fd, req, len, 0) < 0) {
+        return -errno;
+    }
+    for (;;) {
+        ssize_t n = recv(fd, reply, cap, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        size_t off = 0;
+        while ((size_t)n - off >= sizeof(struct nlmsghdr)) {
+            struct nlmsghdr nh;
+            memcpy(&nh, reply + off, sizeof(nh));
+            if (nh.nlmsg_len < sizeof(nh) || nh.nlmsg_len > (size_t)n - off) {
+                return -EBADMSG;
+            }
+            if (nh.nlmsg_type == NLMSG_ERROR && nh.nlmsg_len >= NLMSG_LENGTH(sizeof(int))) {
+                int error;
+                memcpy(&error, reply + off + NLMSG_HDRLEN, sizeof(error));
+                if (error < 0) {
+                    return error;
+                }
+                if (nh.nlmsg_seq == seq) {
+                    return 0;
+                }
+            } else if (nh.nlmsg_seq == seq) {
+                if (off > 0) {
+                    memmove(reply, reply + off, nh.nlmsg_len);
+                }
+                return nh.nlmsg_len;
+            }
+            off += NLMSG_ALIGN(nh.nlmsg_len);
+        }
+    }
+}
+
+int flowtable_attach(const char *ifname) {
+    union {
+        struct nlmsghdr nh;
+        uint8_t bytes[FLOWTABLE_REPLY_MAX];
+    } reply;
+    uint8_t req[256];
+    uint32_t seq = 1;
+
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (fd < 0) {
+        // No netfilter netlink, so no nftables either
+        return errno == EPROTONOSUPPORT ? 0 : -1;
+    }
+    struct timeval timeout = { .tv_sec = FLOWTABLE_TIMEOUT_MS / 1000,
+                               .tv_usec = FLOWTABLE_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int32_t priority = 0;
+    ssize_t n = flowtable_request(fd, req, flowtable_get_request(req, seq), seq, reply.bytes,
+                                  sizeof(reply.bytes));
+    int rc = n < 0 ? (int)n : flowtable_has_device(reply.bytes, (size_t)n, ifname, &priority);
+    if (rc == 0) {
+        seq++;
+        n = flowtable_request(fd, req, flowtable_add_request(req, seq, ifname, priority), seq + 1,
+                              reply.bytes, sizeof(reply.bytes));
+        rc = n < 0 ? (int)n : 1;
+    }
+    close(fd);
+
+    // No table or no flowtable in it: the offload was not set up
+    if (rc == -ENOENT && seq == 1) {
+        return 0;
+    }
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    return 1;
+}
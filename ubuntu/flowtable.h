@@ -0,0 +1,66 @@
+//
+//  flowtable.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  The nftables flowtable setup-vpn-forward.sh installs with OFFLOAD=flowtable.
+//  Once an SMTP connection is established, the kernel forwards its packets
+//  between tun0 and eth0 from the ingress hook, NAT included, without the
+//  forward chains or a conntrack lookup. A flowtable only holds devices
+//  that exist, so the kernel drops tun0 from it whenever the device goes
+//  away; the server adds it back at start, over netfilter netlink rather
+//  than by running nft(8).
+//
+//  Requests and replies are built and read here without a socket, so they
+//  can be checked without privileges.
+//
+
+#ifndef FLOWTABLE_H
+#define FLOWTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Keep in line with setup-vpn-forward.sh
+#define FLOWTABLE_TABLE "net_rewire"    // in the inet family
+#define FLOWTABLE_NAME "smtp"
+
+/**
+ * Build the request for the flowtable
+ * @param buf Output, at least 64 bytes
+ * @param seq Request sequence number
+ * @return Length of the request
+ */
+size_t flowtable_get_request(uint8_t *buf, uint32_t seq);
+
+/**
+ * Build the batch adding a device to the flowtable; devices it already
+ * holds are left alone
+ * @param buf Output, at least 128 bytes
+ * @param seq Sequence number of the batch's first message; it takes three
+ * @param ifname Device name, shorter than IFNAMSIZ
+ * @param priority The flowtable's hook priority, which cannot change
+ * @return Length of the batch; the addition is acknowledged under seq + 1
+ */
+size_t flowtable_add_request(uint8_t *buf, uint32_t seq, const char *ifname, int32_t priority);
+
+/**
+ * Read a reply to flowtable_get_request()
+ * @param msg Netlink message
+ * @param len Bytes received
+ * @param ifname Device to look for
+ * @param priority Output, the flowtable's hook priority when there is one
+ * @return 1 if the flowtable holds the device, 0 if it does not, -errno
+ *         if the kernel answered with an error (-ENOENT: no flowtable),
+ *         -EBADMSG if the reply could not be read
+ */
+int flowtable_has_device(const uint8_t *msg, size_t len, const char *ifname, int32_t *priority);
+
+/**
+ * Make sure the flowtable, if installed, holds a device
+ * @param ifname Device name
+ * @return 1 if it does now, 0 if there is no flowtable, -1 if it could not
+ *         be looked up or changed (errno set)
+ */
+int flowtable_attach(const char *ifname);
+
+#endif
@@ -26,6 +26,8 @@ After=network.target
 [Service]
 Type=oneshot
 ExecStart=/sbin/iptables-restore /etc/iptables/rules.v4
+ExecStart=/sbin/ip6tables-restore /etc/iptables/rules.v6
+ExecStart=/bin/sh -c 'if [ -f /etc/net-rewire/flowtable.nft ]; then /usr/sbin/nft -f /etc/net-rewire/flowtable.nft; fi'
 RemainAfterExit=yes
 
 [Install]
@@ -42,6 +44,10 @@ cat << 'EOF' | sudo tee /usr/local/bin/net-rewire-restore-rules
 # Net-Rewire iptables rules restore script
 
 /sbin/iptables-restore /etc/iptables/rules.v4
+/sbin/ip6tables-restore /etc/iptables/rules.v6
+if [ -f /etc/net-rewire/flowtable.nft ]; then
+    /usr/sbin/nft -f /etc/net-rewire/flowtable.nft
+fi
 echo "Net-Rewire iptables rules restored"
 EOF
 
@@ -0,0 +1,106 @@
+//
+//  qsbr.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#include "qsbr.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct retired {
+    struct retired *next;
+    uint64_t epoch;
+    void *ptr;
+    void (*release)(void *);
+};
+
+// Each thread on its own cache line; epoch is the global epoch seen at the
+// last quiescent state, or 0 while offline
+struct qsbr_thread {
+    uint64_t epoch;
+    struct retired *pending;
+    int npending;
+} __attribute__((aligned(64)));
+
+static struct qsbr_thread threads[QSBR_MAX_THREADS];
+static int nthreads;
+static uint64_t global_epoch = 1;
+
+void qsbr_init(int count) {
+    nthreads = count < QSBR_MAX_THREADS ? count : QSBR_MAX_THREADS;
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].epoch = 0;
+        threads[i].pending = NULL;
+        threads[i].npending = 0;
+    }
+}
+
+void qsbr_quiescent(int id) {
+    uint64_t now = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&threads[id].epoch, now, __ATOMIC_SEQ_CST);
+}
+
+void qsbr_offline(int id) {
+    __atomic_store_n(&threads[id].epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+void qsbr_retire(int id, void *ptr, void (*release)(void *)) {
+    struct retired *r = malloc(sizeof(*r));
+    if (!r) {
+        // Leaking is safer than freeing under a reader
+        return;
+    }
+    r->ptr = ptr;
+    r->release = release;
+    r->epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    r->next = threads[id].pending;
+    threads[id].pending = r;
+    threads[id].npending++;
+}
+
+int qsbr_reclaim(int id) {
+    struct qsbr_thread *self = &threads[id];
+    if (!self->pending) {
+        return 0;
+    }
+
+    qsbr_quiescent(id);
+
+    // Oldest epoch any online thread may still be reading under
+    uint64_t safe = UINT64_MAX;
+    for (int i = 0; i < nthreads; i++) {
+        uint64_t e = __atomic_load_n(&threads[i].epoch, __ATOMIC_SEQ_CST);
+        if (e != 0 && e < safe) {
+            safe = e;
+        }
+    }
+
+    struct retired **link = &self->pending;
+    while (*link) {
+        struct retired *r = *link;
+        if (r->epoch <= safe) {
+            *link = r->next;
+            r->release(r->ptr);
+            free(r);
+            self->npending--;
+        } else {
+            link = &r->next;
+        }
+    }
+    return self->npending;
+}
+
+void qsbr_drain(void) {
+    for (int i = 0; i < nthreads; i++) {
+        struct retired *r = threads[i].pending;
+        while (r) {
+            struct retired *next = r->next;
+            r->release(r->ptr);
+            free(r);
+            r = next;
+        }
+        threads[i].pending = NULL;
+        threads[i].npending = 0;
+    }
+}
@@ -0,0 +1,56 @@
+//
+//  qsbr.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  Quiescent-state-based reclamation, the userspace RCU flavour that suits
+//  event loops: readers take no locks and announce a quiescent state once per
+//  loop iteration; memory unlinked by a writer is freed only after every
+//  online thread has passed one.
+//
+
+#ifndef QSBR_H
+#define QSBR_H
+
+#define QSBR_MAX_THREADS 64
+
+/**
+ * Reset state for a set of reader threads
+ * @param nthreads Number of threads, ids 0..nthreads-1
+ */
+void qsbr_init(int nthreads);
+
+/**
+ * Announce that the thread holds no references to shared objects.
+ * Also brings an offline thread back online.
+ * @param id Thread id
+ */
+void qsbr_quiescent(int id);
+
+/**
+ * Mark the thread as not reading (e.g. while blocked in epoll_wait),
+ * so it does not hold up reclamation
+ * @param id Thread id
+ */
+void qsbr_offline(int id);
+
+/**
+ * Free ptr once every thread that might still see it has quiesced
+ * @param id Calling thread id
+ * @param ptr Object already unlinked from all shared structures
+ * @param release Destructor
+ */
+void qsbr_retire(int id, void *ptr, void (*release)(void *));
+
+/**
+ * Free whatever the calling thread retired that is now safe to free
+ * @param id Thread id
+ * @return Number of objects still waiting
+ */
+int qsbr_reclaim(int id);
+
+/**
+ * Free everything immediately; only valid once all readers have stopped
+ */
+void qsbr_drain(void);
+
+#endif
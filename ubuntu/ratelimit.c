@@ -0,0 +1,46 @@
+//
+//  ratelimit.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#include "ratelimit.h"
+
+#define NS_PER_SEC 1000000000ull
+
+void rate_bucket_init(struct rate_bucket *b, uint64_t rate, uint64_t burst) {
+    b->rate = rate;
+    b->burst = burst > 0 ? burst : 1;
+    b->tokens = b->burst;
+    b->stamp_ns = 0;
+}
+
+static void rate_bucket_refill(struct rate_bucket *b, uint64_t now_ns) {
+    uint64_t missing = b->burst - b->tokens;
+    if (now_ns <= b->stamp_ns) {
+        return;
+    }
+    uint64_t elapsed = now_ns - b->stamp_ns;
+
+    // Long enough to fill the bucket; also keeps the products below in range
+    uint64_t add = missing;
+    if (elapsed / NS_PER_SEC < missing / b->rate + 1) {
+        add = elapsed * b->rate / NS_PER_SEC;
+    }
+    if (add >= missing) {
+        b->tokens = b->burst;
+        b->stamp_ns = now_ns;
+        return;
+    }
+    // Count only the time the added tokens stand for; the rest goes
+    // towards the next one
+    b->tokens += add;
+    b->stamp_ns += add * NS_PER_SEC / b->rate;
+}
+
+int rate_bucket_has(struct rate_bucket *b, uint64_t cost, uint64_t now_ns) {
+    if (b->rate == 0) {
+        return 1;
+    }
+    rate_bucket_refill(b, now_ns);
+    return b->tokens >= cost;
+}
@@ -0,0 +1,51 @@
+//
+//  ratelimit.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  Token buckets for capping what one client sends through the server.
+//  A bucket fills at its rate up to its burst and a packet passes if the
+//  bucket holds its cost. Buckets are refilled from the caller's clock
+//  when they are checked, in whole tokens, so nothing runs while a client
+//  is idle and no fraction of a token is lost between checks.
+//
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+struct rate_bucket {
+    uint64_t rate;          // tokens per second; 0 for no limit
+    uint64_t burst;         // tokens held at most
+    uint64_t tokens;
+    uint64_t stamp_ns;      // time the tokens were counted up to
+};
+
+/**
+ * Set up a full bucket
+ * @param b Bucket
+ * @param rate Tokens per second, 0 for no limit
+ * @param burst Tokens held at most; at least 1. Rate and burst together
+ *              must stay below 10^10.
+ */
+void rate_bucket_init(struct rate_bucket *b, uint64_t rate, uint64_t burst);
+
+/**
+ * Refill the bucket up to now and tell whether it holds cost tokens
+ * @param b Bucket
+ * @param cost Tokens needed
+ * @param now_ns Monotonic clock in nanoseconds, never going back
+ * @return 1 if they are there (always without a limit), 0 otherwise
+ */
+int rate_bucket_has(struct rate_bucket *b, uint64_t cost, uint64_t now_ns);
+
+/**
+ * Take tokens that rate_bucket_has() found
+ */
+static inline void rate_bucket_spend(struct rate_bucket *b, uint64_t cost) {
+    if (b->rate) {
+        b->tokens -= cost;
+    }
+}
+
+#endif
@@ -0,0 +1,184 @@
+//
+//  session_table.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#include "session_table.h"
+#include "qsbr.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// key 0 marks a never-used slot. Removing only clears the value, so probe
+// chains stay intact; a resize drops those tombstones.
+struct st_slot {
+    uint32_t key;
+    uint32_t reserved;
+    void *value;
+};
+
+struct st_array {
+    size_t mask;
+    size_t used;    // slots with a key, live or tombstone
+    unsigned shift;
+    struct st_slot slots[];
+};
+
+struct session_table {
+    struct st_array *array;
+    size_t live;
+    pthread_mutex_t lock;
+};
+
+static size_t st_index(const struct st_array *a, uint32_t key) {
+    return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> a->shift);
+}
+
+static struct st_array *st_array_create(size_t capacity) {
+    size_t cap = 16;
+    unsigned bits = 4;
+    while (cap < capacity) {
+        cap <<= 1;
+        bits++;
+    }
+
+    struct st_array *a = calloc(1, sizeof(*a) + cap * sizeof(struct st_slot));
+    if (!a) {
+        return NULL;
+    }
+    a->mask = cap - 1;
+    a->shift = 64 - bits;
+    return a;
+}
+
+// Slot holding key, or the empty slot ending its probe chain
+static struct st_slot *st_probe(struct st_array *a, uint32_t key) {
+    size_t i = st_index(a, key);
+    for (;;) {
+        struct st_slot *slot = &a->slots[i];
+        if (slot->key == key || slot->key == 0) {
+            return slot;
+        }
+        i = (i + 1) & a->mask;
+    }
+}
+
+struct session_table *session_table_create(size_t capacity) {
+    struct session_table *t = calloc(1, sizeof(*t));
+    if (!t) {
+        return NULL;
+    }
+    t->array = st_array_create(capacity);
+    if (!t->array) {
+        free(t);
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    return t;
+}
+
+void session_table_destroy(struct session_table *t) {
+    if (!t) {
+        return;
+    }
+    free(t->array);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+void *session_table_lookup(const struct session_table *t, uint32_t key) {
+    const struct st_array *a = __atomic_load_n(&t->array, __ATOMIC_ACQUIRE);
+    size_t i = st_index(a, key);
+
+    for (;;) {
+        const struct st_slot *slot = &a->slots[i];
+        uint32_t k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (k == key) {
+            return __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+        }
+        if (k == 0) {
+            return NULL;
+        }
+        i = (i + 1) & a->mask;
+    }
+}
+
+// Rebuild without tombstones, doubling when live entries need the room.
+// Readers keep using the old array until they quiesce.
+static int st_rebuild(struct session_table *t, int thread) {
+    struct st_array *old = t->array;
+    size_t cap = old->mask + 1;
+    if ((t->live + 1) * 2 > cap) {
+        cap *= 2;
+    }
+
+    struct st_array *a = st_array_create(cap);
+    if (!a) {
+        return -1;
+    }
+    for (size_t i = 0; i <= old->mask; i++) {
+        if (old->slots[i].value) {
+            struct st_slot *slot = st_probe(a, old->slots[i].key);
+            *slot = old->slots[i];
+            a->used++;
+        }
+    }
+
+    __atomic_store_n(&t->array, a, __ATOMIC_RELEASE);
+    qsbr_retire(thread, old, free);
+    return 0;
+}
+
+int session_table_insert(struct session_table *t, uint32_t key, void *value, int thread) {
+    pthread_mutex_lock(&t->lock);
+
+    struct st_slot *slot = st_probe(t->array, key);
+    if (slot->key == 0 && (t->array->used + 1) * 10 > (t->array->mask + 1) * 7) {
+        if (st_rebuild(t, thread) < 0) {
+            pthread_mutex_unlock(&t->lock);
+            return -1;
+        }
+        slot = st_probe(t->array, key);
+    }
+
+    if (!slot->value) {
+        __atomic_add_fetch(&t->live, 1, __ATOMIC_RELAXED);
+    }
+    // Value before key, so a reader that sees the key sees the value
+    __atomic_store_n(&slot->value, value, __ATOMIC_RELEASE);
+    if (slot->key == 0) {
+        __atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+        t->array->used++;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+    return 0;
+}
+
+int session_table_remove(struct session_table *t, uint32_t key, const void *value) {
+    int removed = 0;
+    pthread_mutex_lock(&t->lock);
+
+    struct st_slot *slot = st_probe(t->array, key);
+    if (slot->key == key && slot->value == value) {
+        __atomic_store_n(&slot->value, NULL, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&t->live, 1, __ATOMIC_RELAXED);
+        removed = 1;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+    return removed;
+}
+
+void session_table_foreach(const struct session_table *t, void (*fn)(void *value)) {
+    const struct st_array *a = t->array;
+    for (size_t i = 0; i <= a->mask; i++) {
+        if (a->slots[i].value) {
+            fn(a->slots[i].value);
+        }
+    }
+}
+
+size_t session_table_count(const struct session_table *t) {
+    return __atomic_load_n(&t->live, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,66 @@
+//
+//  session_table.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  Map from inner tunnel address to session. Open addressing with linear
+//  probing over 16-byte slots (four per cache line); lookups take no locks
+//  and may run on any worker, writers serialize on a mutex. Arrays replaced
+//  by a resize are released through QSBR.
+//
+
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct session_table;
+
+/**
+ * Create an empty table
+ * @param capacity Initial number of slots, rounded up to a power of two
+ * @return Table, or NULL on allocation failure
+ */
+struct session_table *session_table_create(size_t capacity);
+
+/**
+ * Destroy the table; no reader may be active
+ */
+void session_table_destroy(struct session_table *t);
+
+/**
+ * Find the session serving an address
+ * @param t Table
+ * @param key IPv4 address in network byte order, never 0
+ * @return Session, or NULL. Stays valid until the caller's next quiescent state.
+ */
+void *session_table_lookup(const struct session_table *t, uint32_t key);
+
+/**
+ * Map key to value, replacing any previous mapping
+ * @param t Table
+ * @param key IPv4 address in network byte order, never 0
+ * @param value Session
+ * @param thread QSBR id of the caller, for retiring a replaced slot array
+ * @return 0 on success, -1 on allocation failure
+ */
+int session_table_insert(struct session_table *t, uint32_t key, void *value, int thread);
+
+/**
+ * Remove the mapping for key if it still points at value
+ * @return 1 if removed, 0 if key maps elsewhere or nowhere
+ */
+int session_table_remove(struct session_table *t, uint32_t key, const void *value);
+
+/**
+ * Call fn on every live value, e.g. to free them before destroying the
+ * table; no writer may be active
+ */
+void session_table_foreach(const struct session_table *t, void (*fn)(void *value));
+
+/**
+ * Number of live mappings
+ */
+size_t session_table_count(const struct session_table *t);
+
+#endif
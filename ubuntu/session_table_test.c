@@ -0,0 +1,167 @@
+//
+//  session_table_test.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#include "session_table.h"
+#include "qsbr.h"
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+static int values[4096];
+
+static uint32_t addr(uint32_t host) {
+    return htonl(0x0a080000 | host);
+}
+
+void test_insert_lookup_remove() {
+    struct session_table *t = session_table_create(16);
+
+    assert(session_table_lookup(t, addr(33)) == NULL);
+    assert(session_table_insert(t, addr(33), &values[0], 0) == 0);
+    assert(session_table_insert(t, addr(34), &values[1], 0) == 0);
+    assert(session_table_lookup(t, addr(33)) == &values[0]);
+    assert(session_table_lookup(t, addr(34)) == &values[1]);
+    assert(session_table_count(t) == 2);
+
+    // Removing with a stale value leaves the newer mapping alone
+    assert(session_table_remove(t, addr(33), &values[1]) == 0);
+    assert(session_table_remove(t, addr(33), &values[0]) == 1);
+    assert(session_table_lookup(t, addr(33)) == NULL);
+    assert(session_table_lookup(t, addr(34)) == &values[1]);
+    assert(session_table_count(t) == 1);
+
+    session_table_destroy(t);
+    printf("✓ Insert/lookup/remove test passed\n");
+}
+
+void test_replace() {
+    struct session_table *t = session_table_create(16);
+
+    assert(session_table_insert(t, addr(33), &values[0], 0) == 0);
+    assert(session_table_insert(t, addr(33), &values[1], 0) == 0);
+    assert(session_table_lookup(t, addr(33)) == &values[1]);
+    assert(session_table_count(t) == 1);
+
+    session_table_destroy(t);
+    printf("✓ Replace test passed\n");
+}
+
+static int visited;
+
+static void visit(void *value) {
+    *(int *)value += 1;
+    visited++;
+}
+
+void test_foreach() {
+    struct session_table *t = session_table_create(16);
+
+    for (uint32_t i = 1; i <= 40; i++) {
+        values[i] = 0;
+        assert(session_table_insert(t, addr(i), &values[i], 0) == 0);
+    }
+    session_table_remove(t, addr(7), &values[7]);
+
+    // Every live value once; removed ones are skipped
+    visited = 0;
+    session_table_foreach(t, visit);
+    assert(visited == 39);
+    assert(values[7] == 0 && values[1] == 1 && values[40] == 1);
+
+    session_table_destroy(t);
+    printf("✓ Foreach test passed\n");
+}
+
+void test_grow_and_tombstones() {
+    struct session_table *t = session_table_create(16);
+
+    for (uint32_t i = 1; i <= 3000; i++) {
+        assert(session_table_insert(t, addr(i), &values[i], 0) == 0);
+    }
+    for (uint32_t i = 1; i <= 3000; i++) {
+        assert(session_table_lookup(t, addr(i)) == &values[i]);
+    }
+    for (uint32_t i = 1; i <= 3000; i += 2) {
+        assert(session_table_remove(t, addr(i), &values[i]) == 1);
+    }
+    // Churn through fresh keys so tombstones force rebuilds
+    for (uint32_t round = 0; round < 4; round++) {
+        for (uint32_t i = 0; i < 1000; i++) {
+            uint32_t key = addr(0x10000 + round * 1000 + i);
+            assert(session_table_insert(t, key, &values[i], 0) == 0);
+            assert(session_table_remove(t, key, &values[i]) == 1);
+        }
+        qsbr_reclaim(0);
+    }
+    for (uint32_t i = 1; i <= 3000; i++) {
+        assert(session_table_lookup(t, addr(i)) == ((i & 1) ? NULL : &values[i]));
+    }
+    assert(session_table_count(t) == 1500);
+
+    session_table_destroy(t);
+    qsbr_drain();
+    printf("✓ Grow and tombstone test passed\n");
+}
+
+static struct session_table *shared;
+static volatile int stop;
+
+static void *reader(void *arg) {
+    int id = (int)(long)arg;
+    long hits = 0;
+
+    while (!stop) {
+        qsbr_quiescent(id);
+        for (uint32_t i = 1; i <= 256; i++) {
+            int *v = session_table_lookup(shared, addr(i));
+            // A hit is always the value stored for that key
+            assert(v == NULL || v == &values[i]);
+            hits += v != NULL;
+        }
+    }
+    qsbr_offline(id);
+    return (void *)hits;
+}
+
+void test_concurrent_readers() {
+    pthread_t threads[2];
+    shared = session_table_create(16);
+
+    for (long i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, reader, (void *)(i + 1));
+    }
+    for (int round = 0; round < 200; round++) {
+        for (uint32_t i = 1; i <= 256; i++) {
+            session_table_insert(shared, addr(i), &values[i], 0);
+        }
+        for (uint32_t i = 1; i <= 256; i++) {
+            session_table_remove(shared, addr(i), &values[i]);
+        }
+        qsbr_reclaim(0);
+    }
+    stop = 1;
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    qsbr_drain();
+    session_table_destroy(shared);
+    printf("✓ Concurrent reader test passed\n");
+}
+
+int main() {
+    printf("Running session table unit tests...\n");
+    qsbr_init(3);
+
+    test_insert_lookup_remove();
+    test_replace();
+    test_foreach();
+    test_grow_and_tombstones();
+    test_concurrent_readers();
+
+    printf("All tests passed! ✅\n");
+    return 0;
+}
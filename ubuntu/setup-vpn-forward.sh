@@ -2,7 +2,7 @@
 set -euo pipefail
 
 # Net-Rewire Ubuntu VPN Forwarder Setup Script
-# This script configures IP forwarding and iptables rules for TCP port 25 forwarding
+# This script configures IP forwarding and iptables rules for SMTP (25, 465, 587) forwarding
 
 echo "Setting up Net-Rewire VPN forwarder..."
 
@@ -10,40 +10,79 @@ echo "Setting up Net-Rewire VPN forwarder..."
 PUB_IF="eth0"
 VPN_IF="tun0"
 TUNNEL_NET="10.8.0.0/24"
+TUNNEL_NET6="fd00:8::a08:0/120"   # the same subnet under the IPv6 tunnel prefix
+SMTP_PORTS="25,465,587"   # keep in line with the extension's capture rules
+OFFLOAD="${OFFLOAD:-}"    # "flowtable": forward established SMTP flows from the ingress hook
+FLOWTABLE_FILE="/etc/net-rewire/flowtable.nft"
 
 # Enable IP forwarding
 echo "Enabling IP forwarding..."
 sudo sysctl -w net.ipv4.ip_forward=1
-echo "net.ipv4.ip_forward=1" | sudo tee /etc/sysctl.d/99-net-rewire.conf
+sudo sysctl -w net.ipv6.conf.all.forwarding=1
+printf "net.ipv4.ip_forward=1\nnet.ipv6.conf.all.forwarding=1\n" | sudo tee /etc/sysctl.d/99-net-rewire.conf
 sudo sysctl --system
 
-# Create tun0 interface if it doesn't exist
+# Create tun0 interface if it doesn't exist (multi_queue: one queue per server worker)
 if ! ip link show "$VPN_IF" &>/dev/null; then
     echo "Creating $VPN_IF interface..."
-    sudo ip tuntap add dev "$VPN_IF" mode tun
+    sudo ip tuntap add dev "$VPN_IF" mode tun multi_queue
     sudo ip addr add 10.8.0.1/24 dev "$VPN_IF"
+    sudo ip -6 addr add fd00:8::a08:1/120 dev "$VPN_IF"
     sudo ip link set "$VPN_IF" up
 fi
 
-# Configure iptables rules for TCP port 25 forwarding
+# Configure iptables rules for SMTP forwarding
 echo "Configuring iptables rules..."
 
 # Clear existing rules for our setup (optional - be careful in production)
 # sudo iptables -F FORWARD
 # sudo iptables -t nat -F POSTROUTING
 
-# Allow forwarding from VPN to public interface for TCP port 25
-sudo iptables -A FORWARD -i "$VPN_IF" -o "$PUB_IF" -p tcp --dport 25 -j ACCEPT
+# Allow forwarding from VPN to public interface for the SMTP ports
+sudo iptables -A FORWARD -i "$VPN_IF" -o "$PUB_IF" -p tcp -m multiport --dports "$SMTP_PORTS" -j ACCEPT
 
 # Allow established/related connections back through VPN
 sudo iptables -A FORWARD -i "$PUB_IF" -o "$VPN_IF" -m state --state ESTABLISHED,RELATED -j ACCEPT
 
-# NAT outgoing TCP port 25 traffic (MASQUERADE)
-sudo iptables -t nat -A POSTROUTING -o "$PUB_IF" -p tcp --dport 25 -j MASQUERADE
+# NAT outgoing SMTP traffic (MASQUERADE)
+sudo iptables -t nat -A POSTROUTING -o "$PUB_IF" -p tcp -m multiport --dports "$SMTP_PORTS" -j MASQUERADE
+
+# The same for IPv6 mail servers; the tunnel addresses are unique local,
+# so they are masqueraded behind the public interface's address too
+sudo ip6tables -A FORWARD -i "$VPN_IF" -o "$PUB_IF" -s "$TUNNEL_NET6" -p tcp -m multiport --dports "$SMTP_PORTS" -j ACCEPT
+sudo ip6tables -A FORWARD -i "$PUB_IF" -o "$VPN_IF" -m state --state ESTABLISHED,RELATED -j ACCEPT
+sudo ip6tables -t nat -A POSTROUTING -o "$PUB_IF" -s "$TUNNEL_NET6" -p tcp -m multiport --dports "$SMTP_PORTS" -j MASQUERADE
 
 # Additional security: drop other forwarded traffic from VPN (optional)
 # sudo iptables -A FORWARD -i "$VPN_IF" -o "$PUB_IF" -j DROP
 
+# Flowtable fast path: once an SMTP connection is established, the kernel
+# forwards its packets from the ingress hook, NAT included, so they skip the
+# forward chains and the conntrack lookup. The FORWARD rules above still see
+# each connection's first packets. tun0 does not survive a reboot, so it is
+# not listed here; the tunnel server adds it to the flowtable at start.
+if [ "$OFFLOAD" = "flowtable" ]; then
+    echo "Configuring nftables flowtable..."
+    sudo apt-get install -y nftables
+    sudo mkdir -p "$(dirname "$FLOWTABLE_FILE")"
+    cat << EOF | sudo tee "$FLOWTABLE_FILE"
+# Net-Rewire flowtable for established SMTP flows (names in ubuntu/flowtable.h)
+table inet net_rewire
+delete table inet net_rewire
+table inet net_rewire {
+    flowtable smtp {
+        hook ingress priority filter
+        devices = { $PUB_IF }
+    }
+    chain forward {
+        type filter hook forward priority filter; policy accept;
+        iifname "$VPN_IF" oifname "$PUB_IF" tcp dport { $SMTP_PORTS } ct state established flow add @smtp
+    }
+}
+EOF
+    sudo nft -f "$FLOWTABLE_FILE"
+fi
+
 echo "Installing iptables-persistent..."
 sudo apt-get update
 sudo apt-get install -y iptables-persistent
@@ -54,15 +93,22 @@ sudo netfilter-persistent save
 echo "Setup completed!"
 echo ""
 echo "Current configuration:"
-echo "- IP forwarding: $(cat /proc/sys/net/ipv4/ip_forward)"
-echo "- VPN interface: $VPN_IF (10.8.0.1/24)"
+echo "- IP forwarding: $(cat /proc/sys/net/ipv4/ip_forward), IPv6: $(cat /proc/sys/net/ipv6/conf/all/forwarding)"
+echo "- VPN interface: $VPN_IF (10.8.0.1/24, fd00:8::a08:1/120)"
 echo "- Public interface: $PUB_IF"
-echo "- Forwarding TCP port 25 traffic from $VPN_IF to $PUB_IF"
+echo "- Forwarding TCP ports $SMTP_PORTS from $VPN_IF to $PUB_IF"
+if [ "$OFFLOAD" = "flowtable" ]; then
+    echo "- Flowtable offload for established flows ($FLOWTABLE_FILE; persist-iptables.sh loads it at boot)"
+fi
 echo ""
 echo "To verify rules:"
 echo "  sudo iptables -L FORWARD -n -v"
 echo "  sudo iptables -t nat -L POSTROUTING -n -v"
+echo "  sudo ip6tables -L FORWARD -n -v"
+if [ "$OFFLOAD" = "flowtable" ]; then
+    echo "  sudo nft list flowtables"
+fi
 echo ""
 echo "To monitor traffic:"
-echo "  sudo tcpdump -ni $PUB_IF tcp port 25"
+echo "  sudo tcpdump -ni $PUB_IF 'tcp port 25 or tcp port 465 or tcp port 587'"
 echo "  sudo tcpdump -ni $VPN_IF"
\ No newline at end of file
@@ -0,0 +1,211 @@
+//
+//  stats.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#define _GNU_SOURCE
+
+#include "stats.h"
+#include "engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// How long a client gets to send its request before it is answered anyway
+#define STATS_REQUEST_TIMEOUT_MS 1000
+#define STATS_REQUEST_MAX 4096
+
+static struct {
+    int fd;
+    pthread_t thread;
+    volatile int running;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} stats = { .fd = -1 };
+
+static int stats_listen_unix(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Stats socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating stats socket");
+        return -1;
+    }
+    // A socket left behind by an earlier run would refuse the bind
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Error binding stats socket");
+        close(fd);
+        return -1;
+    }
+    strcpy(stats.path, path);
+    return fd;
+}
+
+static int stats_listen_tcp(const char *spec) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    char host[INET_ADDRSTRLEN] = "127.0.0.1";
+    const char *port = spec;
+    const char *colon = strrchr(spec, ':');
+
+    if (colon) {
+        size_t len = (size_t)(colon - spec);
+        if (len >= sizeof(host)) {
+            fprintf(stderr, "Invalid stats address: %s\n", spec);
+            return -1;
+        }
+        memcpy(host, spec, len);
+        host[len] = '\0';
+        port = colon + 1;
+    }
+    int p = atoi(port);
+    if (p <= 0 || p > 65535 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid stats address: %s\n", spec);
+        return -1;
+    }
+    addr.sin_port = htons((uint16_t)p);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating stats socket");
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Error binding stats socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Wait for the request's headers to end; whatever was asked, the answer is
+// the metrics
+static void stats_read_request(int fd) {
+    char req[STATS_REQUEST_MAX + 1];
+    size_t len = 0;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    while (len < STATS_REQUEST_MAX && poll(&pfd, 1, STATS_REQUEST_TIMEOUT_MS) > 0) {
+        ssize_t n = recv(fd, req + len, STATS_REQUEST_MAX - len, 0);
+        if (n <= 0) {
+            return;
+        }
+        len += (size_t)n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            return;
+        }
+    }
+}
+
+static void stats_send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+static void stats_serve(int fd) {
+    char header[128];
+    char *body = NULL;
+    size_t cap = 0, len;
+
+    stats_read_request(fd);
+
+    // Counters only grow, so the text may get longer between the calls
+    while ((len = engine_metrics(body, cap)) >= cap) {
+        free(body);
+        cap = len + 256;
+        body = malloc(cap);
+        if (!body) {
+            return;
+        }
+    }
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n\r\n", len);
+    stats_send_all(fd, header, (size_t)n);
+    stats_send_all(fd, body, len);
+    free(body);
+}
+
+static void *stats_main(void *arg) {
+    (void)arg;
+    while (stats.running) {
+        int fd = accept4(stats.fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (stats.running) {
+                perror("Error accepting stats client");
+            }
+            break;
+        }
+        stats_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int stats_start(const char *addr) {
+    stats.fd = addr[0] == '/' ? stats_listen_unix(addr) : stats_listen_tcp(addr);
+    if (stats.fd < 0) {
+        return -1;
+    }
+    if (listen(stats.fd, 16) < 0) {
+        perror("Error listening on stats socket");
+        stats_stop();
+        return -1;
+    }
+    stats.running = 1;
+    if (pthread_create(&stats.thread, NULL, stats_main, NULL) != 0) {
+        fprintf(stderr, "Error creating stats thread\n");
+        stats.running = 0;
+        stats_stop();
+        return -1;
+    }
+    printf("Serving stats on %s\n", addr);
+    return 0;
+}
+
+void stats_stop(void) {
+    if (stats.fd < 0) {
+        return;
+    }
+    // Shutting the listener down wakes the thread out of accept()
+    if (stats.running) {
+        stats.running = 0;
+        shutdown(stats.fd, SHUT_RDWR);
+        pthread_join(stats.thread, NULL);
+    }
+    close(stats.fd);
+    stats.fd = -1;
+    if (stats.path[0]) {
+        unlink(stats.path);
+        stats.path[0] = '\0';
+    }
+}
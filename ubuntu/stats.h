@@ -0,0 +1,27 @@
+//
+//  stats.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  Stats endpoint: a thread of its own serving engine_metrics() as
+//  Prometheus text over HTTP, on a TCP address for a scraper or a Unix
+//  socket for local tools (`curl --unix-socket`). It only ever reads the
+//  workers' counters, so scraping costs the forwarding path nothing.
+//
+
+#ifndef STATS_H
+#define STATS_H
+
+/**
+ * Start serving
+ * @param addr A Unix socket path (starting with '/'), or "[host:]port" for
+ *             TCP; host defaults to 127.0.0.1
+ * @return 0 on success, -1 on failure
+ */
+int stats_start(const char *addr);
+
+/**
+ * Stop serving; call before engine_stop()
+ */
+void stats_stop(void);
+
+#endif
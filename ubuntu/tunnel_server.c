@@ -5,9 +5,18 @@
 //  Created by Claude Code
 //
 
+#define _GNU_SOURCE
+
+#include "engine.h"
+#include "stats.h"
+#include "flowtable.h"
+#include "config.h"
+#include "ip6.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -15,26 +24,43 @@
 #include <sys/ioctl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/ipv6.h>
+#include <linux/bpf.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <limits.h>
 
+// Defaults of -l, -i and -a
 #define SERVER_PORT 12345
 #define TUN_DEVICE "tun0"
 #define TUN_IP "10.8.0.1"
 #define TUN_NETMASK "255.255.255.0"
 
-static volatile int running = 1;
+// The same subnet under the IPv6 tunnel prefix (ip6.h): for 10.8.0.1,
+// fd00:8::a08:1 in fd00:8::a08:0/120
+#define TUN_IP6_PREFIX_LEN 120
+
+// Highest per-client cap, in bytes or packets per second; the token buckets
+// count to 10^10 with the burst (ratelimit.h)
+#define CLIENT_RATE_MAX 4000000000LL
+
+// Capture ring size in MiB, by default and at most
+#define CAPTURE_MB_DEFAULT 64
+#define CAPTURE_MB_MAX 65536
 
-// Structure to hold client information
-typedef struct {
-    int socket_fd;
-    struct sockaddr_in client_addr;
-} client_info_t;
+// UDP segmentation offload; older headers predate it
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#endif
 
-// Create TUN device
-int create_tun_device() {
+// Open one queue of the TUN device; every queue of a multi-queue device
+// shares the interface, the kernel spreads packets across them. With
+// offload, every packet is preceded by a virtio-net header.
+int create_tun_device(const char *device, int multi_queue, int offload) {
     struct ifreq ifr;
     int tun_fd;
 
@@ -45,274 +71,867 @@ int create_tun_device() {
     }
 
     memset(&ifr, 0, sizeof(ifr));
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-    strncpy(ifr.ifr_name, TUN_DEVICE, IFNAMSIZ);
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | (multi_queue ? IFF_MULTI_QUEUE : 0) | (offload ? IFF_VNET_HDR : 0);
+    strncpy(ifr.ifr_name, device, IFNAMSIZ - 1);
 
     // Configure TUN device
     if (ioctl(tun_fd, TUNSETIFF, (void *)&ifr) < 0) {
-        perror("Error configuring TUN device");
+        if (!multi_queue || errno != EINVAL) {
+            perror("Error configuring TUN device");
+        }
         close(tun_fd);
         return -1;
     }
 
-    printf("Created TUN device: %s\n", ifr.ifr_name);
     return tun_fd;
 }
 
-// Configure TUN device IP address
-int configure_tun_device(int tun_fd) {
-    char cmd[256];
+// Open one queue per worker, falling back to a single queue when the kernel
+// or an existing non-multi-queue tun0 refuses IFF_MULTI_QUEUE
+int create_tun_queues(const char *device, int *fds, int count, int offload) {
+    int opened = 0;
 
-    // Set IP address
-    snprintf(cmd, sizeof(cmd), "ip addr add %s/%s dev %s", TUN_IP, "24", TUN_DEVICE);
-    if (system(cmd) != 0) {
-        fprintf(stderr, "Error setting IP address on TUN device\n");
-        return -1;
+    if (count > 1) {
+        for (; opened < count; opened++) {
+            fds[opened] = create_tun_device(device, 1, offload);
+            if (fds[opened] < 0) {
+                break;
+            }
+        }
+        if (opened == count) {
+            printf("Created TUN device: %s (%d queues)\n", device, count);
+            return count;
+        }
+        while (opened > 0) {
+            close(fds[--opened]);
+        }
+        fprintf(stderr, "Multi-queue TUN unavailable, using a single queue\n");
     }
 
-    // Bring interface up
-    snprintf(cmd, sizeof(cmd), "ip link set %s up", TUN_DEVICE);
-    if (system(cmd) != 0) {
-        fprintf(stderr, "Error bringing TUN device up\n");
+    fds[0] = create_tun_device(device, 0, offload);
+    if (fds[0] < 0) {
         return -1;
     }
-
-    printf("Configured TUN device %s with IP %s\n", TUN_DEVICE, TUN_IP);
-    return 0;
+    printf("Created TUN device: %s\n", device);
+    return 1;
 }
 
-// Handle client connection
-void* handle_client(void* arg) {
-    client_info_t* client = (client_info_t*)arg;
-    int client_fd = client->socket_fd;
-    int tun_fd;
-    char client_ip[INET_ADDRSTRLEN];
-
-    inet_ntop(AF_INET, &(client->client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-    printf("Client connected: %s:%d\n", client_ip, ntohs(client->client_addr.sin_port));
-
-    // Create TUN device for this client
-    tun_fd = create_tun_device();
-    if (tun_fd < 0) {
-        fprintf(stderr, "Failed to create TUN device for client %s\n", client_ip);
-        close(client_fd);
-        free(client);
-        return NULL;
+// Let the kernel hand the TUN unfinished checksums and TCP and UDP
+// super-packets of up to 64 KB, cut into segments only when they leave
+// through a tunnel. Without these the device still works, it just gets
+// every packet segmented and checksummed. Segmentation is IPv4 only
+// (gso.h), so the kernel still cuts IPv6 super-packets itself.
+void enable_tun_offloads(int tun_fd) {
+    unsigned long offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO_ECN | TUN_F_USO4;
+
+    if (ioctl(tun_fd, TUNSETOFFLOAD, offloads) == 0) {
+        printf("TUN offloads: checksum, TCP and UDP segmentation\n");
+        return;
     }
-
-    // Configure TUN device
-    if (configure_tun_device(tun_fd) < 0) {
-        fprintf(stderr, "Failed to configure TUN device for client %s\n", client_ip);
-        close(tun_fd);
-        close(client_fd);
-        free(client);
-        return NULL;
+    // Kernels before 6.2 know no UDP segmentation offload
+    offloads &= ~(unsigned long)TUN_F_USO4;
+    if (errno == EINVAL && ioctl(tun_fd, TUNSETOFFLOAD, offloads) == 0) {
+        printf("TUN offloads: checksum, TCP segmentation\n");
+        return;
     }
+    perror("Error enabling TUN offloads");
+}
 
-    // Set non-blocking mode for both sockets
-    fcntl(client_fd, F_SETFL, O_NONBLOCK);
-    fcntl(tun_fd, F_SETFL, O_NONBLOCK);
-
-    fd_set read_fds;
-    int max_fd = (client_fd > tun_fd) ? client_fd : tun_fd;
-
-    // Main packet forwarding loop
-    while (running) {
-        FD_ZERO(&read_fds);
-        FD_SET(client_fd, &read_fds);
-        FD_SET(tun_fd, &read_fds);
+// Steer every packet the kernel sends into the TUN to the queue of the worker
+// owning its destination, so TUN->client traffic never crosses workers.
+// The program returns the same hash as engine_shard(); the kernel takes it
+// modulo the number of queues. An IPv6 destination hashes by its last 32
+// bits, the IPv4 address a tunnel address embeds.
+int attach_tun_steering(int tun_fd) {
+    struct bpf_insn prog[] = {
+        // r6 = skb (required by LD_ABS)
+        { .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1 },
+        // if ((ip[0] & 0xf0) == 0x60) goto ipv6
+        { .code = BPF_LD | BPF_B | BPF_ABS, .imm = 0 },
+        { .code = BPF_ALU | BPF_AND | BPF_K, .dst_reg = BPF_REG_0, .imm = 0xf0 },
+        { .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .off = 2, .imm = 0x60 },
+        // r0 = ntohl(*(u32 *)(ip + 16)), the IPv4 destination
+        { .code = BPF_LD | BPF_W | BPF_ABS, .imm = 16 },
+        { .code = BPF_JMP | BPF_JA, .off = 1 },
+        // ipv6: r0 = ntohl(*(u32 *)(ip + 36)), the destination's last word
+        { .code = BPF_LD | BPF_W | BPF_ABS, .imm = 36 },
+        { .code = BPF_ALU | BPF_MUL | BPF_K, .dst_reg = BPF_REG_0, .imm = (int32_t)0x9E3779B1u },
+        { .code = BPF_ALU | BPF_RSH | BPF_K, .dst_reg = BPF_REG_0, .imm = 16 },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+
+    int prog_fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+    if (prog_fd < 0) {
+        perror("Error loading TUN steering program");
+        return -1;
+    }
 
-        struct timeval timeout = {1, 0}; // 1 second timeout
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
+    if (ioctl(tun_fd, TUNSETSTEERINGEBPF, &prog_fd) < 0) {
+        perror("Error attaching TUN steering program");
+        close(prog_fd);
+        return -1;
+    }
 
-        if (activity < 0 && errno != EINTR) {
-            perror("select error");
-            break;
-        }
+    // The device holds its own reference
+    close(prog_fd);
+    return 0;
+}
 
-        if (activity == 0) {
-            // Timeout - check if still running
-            continue;
-        }
+// Established SMTP flows bypass the forward path through the flowtable
+// setup-vpn-forward.sh installs with OFFLOAD=flowtable, once the TUN is in it
+void report_flowtable(const char *device) {
+    int rc = flowtable_attach(device);
+    if (rc > 0) {
+        printf("Flowtable offload: established SMTP flows through %s\n", device);
+    } else if (rc == 0) {
+        printf("Flowtable offload: not set up, every packet takes the forward path\n");
+    } else {
+        perror("Error adding TUN device to the flowtable");
+        fprintf(stderr, "Continuing without flowtable offload\n");
+    }
+}
 
-        // Forward packets from client to TUN
-        if (FD_ISSET(client_fd, &read_fds)) {
-            uint32_t packet_length;
-            ssize_t bytes_read = recv(client_fd, &packet_length, 4, 0);
+// Set an IPv4 address-family field of an ifreq through ioctl
+static int set_if_addr(int sock, struct ifreq *ifr, unsigned long request, struct in_addr addr) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ifr->ifr_addr;
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_addr = addr;
+    return ioctl(sock, request, ifr);
+}
 
-            if (bytes_read <= 0) {
-                if (bytes_read == 0) {
-                    printf("Client %s disconnected\n", client_ip);
-                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                    perror("Error reading packet length");
-                }
-                break;
-            }
+static int configure_interface(int sock, struct ifreq *ifr, struct in_addr ip) {
+    struct in_addr netmask;
 
-            // Convert network byte order to host byte order
-            packet_length = ntohl(packet_length);
+    inet_pton(AF_INET, TUN_NETMASK, &netmask);
+    if (set_if_addr(sock, ifr, SIOCSIFADDR, ip) < 0) {
+        perror("Error setting IP address on TUN device");
+        return -1;
+    }
+    if (set_if_addr(sock, ifr, SIOCSIFNETMASK, netmask) < 0) {
+        perror("Error setting netmask on TUN device");
+        return -1;
+    }
 
-            if (packet_length > 65535 || packet_length == 0) {
-                fprintf(stderr, "Invalid packet length from client: %u\n", packet_length);
-                continue;
-            }
+    // Bring interface up
+    if (ioctl(sock, SIOCGIFFLAGS, ifr) < 0) {
+        perror("Error reading TUN device flags");
+        return -1;
+    }
+    ifr->ifr_flags |= IFF_UP | IFF_RUNNING;
+    if (ioctl(sock, SIOCSIFFLAGS, ifr) < 0) {
+        perror("Error bringing TUN device up");
+        return -1;
+    }
+    return 0;
+}
 
-            // Read packet data
-            char packet_buffer[65535];
-            bytes_read = recv(client_fd, packet_buffer, packet_length, 0);
+// The IPv4 address under the IPv6 tunnel prefix
+static void tunnel_address6(struct in_addr ip, struct in6_addr *ip6) {
+    memcpy(ip6->s6_addr, IP6_TUNNEL_PREFIX, 12);
+    memcpy(ip6->s6_addr + 12, &ip, 4);
+}
 
-            if (bytes_read <= 0) {
-                if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                    perror("Error reading packet data");
-                }
-                continue;
-            }
+// Add the IPv6 tunnel address; unlike the IPv4 one it is added next to any
+// others, so one left from an earlier run is fine too
+static int configure_interface6(struct ifreq *ifr, struct in_addr ip) {
+    struct in6_ifreq ifr6;
+    int rc = -1;
 
-            // Write packet to TUN device
-            ssize_t bytes_written = write(tun_fd, packet_buffer, bytes_read);
-            if (bytes_written < 0) {
-                perror("Error writing to TUN device");
-            } else {
-                printf("Forwarded packet from client to TUN, length: %zd\n", bytes_written);
-            }
+    int sock = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Error creating IPv6 configuration socket");
+        return -1;
+    }
+    memset(&ifr6, 0, sizeof(ifr6));
+    if (ioctl(sock, SIOCGIFINDEX, ifr) < 0) {
+        perror("Error reading TUN device index");
+    } else {
+        tunnel_address6(ip, &ifr6.ifr6_addr);
+        ifr6.ifr6_prefixlen = TUN_IP6_PREFIX_LEN;
+        ifr6.ifr6_ifindex = ifr->ifr_ifindex;
+        if (ioctl(sock, SIOCSIFADDR, &ifr6) == 0 || errno == EEXIST) {
+            rc = 0;
+        } else {
+            perror("Error setting IPv6 address on TUN device");
         }
+    }
+    close(sock);
+    return rc;
+}
 
-        // Forward packets from TUN to client
-        if (FD_ISSET(tun_fd, &read_fds)) {
-            char packet_buffer[65535];
-            ssize_t bytes_read = read(tun_fd, packet_buffer, sizeof(packet_buffer));
-
-            if (bytes_read > 0) {
-                // Send packet length (4 bytes, network byte order)
-                uint32_t packet_length = htonl((uint32_t)bytes_read);
-                ssize_t bytes_sent = send(client_fd, &packet_length, 4, 0);
-
-                if (bytes_sent != 4) {
-                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                        perror("Error sending packet length");
-                        break;
-                    }
-                } else {
-                    // Send packet data
-                    bytes_sent = send(client_fd, packet_buffer, bytes_read, 0);
-                    if (bytes_sent < 0) {
-                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                            perror("Error sending packet data");
-                            break;
-                        }
-                    } else {
-                        printf("Forwarded packet from TUN to client, length: %zd\n", bytes_sent);
-                    }
-                }
-            } else if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                perror("Error reading from TUN device");
-                break;
-            }
-        }
+// Assign the tunnel address and bring the interface up, once at startup.
+// Uses the interface ioctls rather than running ip(8); setting the address
+// replaces any previous one, so an address left from an earlier run is fine.
+// Without IPv6 on the host the tunnel carries IPv4 only.
+int configure_tun_device(int tun_fd, struct in_addr ip) {
+    struct ifreq ifr;
+    char text[INET_ADDRSTRLEN], text6[INET6_ADDRSTRLEN];
+    struct in6_addr ip6;
+
+    memset(&ifr, 0, sizeof(ifr));
+    if (ioctl(tun_fd, TUNGETIFF, &ifr) < 0) {
+        perror("Error reading TUN device name");
+        return -1;
     }
 
-    // Cleanup
-    printf("Closing connection for client %s\n", client_ip);
-    close(tun_fd);
-    close(client_fd);
-    free(client);
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Error creating configuration socket");
+        return -1;
+    }
+    int rc = configure_interface(sock, &ifr, ip);
+    close(sock);
+    if (rc < 0) {
+        return -1;
+    }
 
-    return NULL;
+    inet_ntop(AF_INET, &ip, text, sizeof(text));
+    if (configure_interface6(&ifr, ip) < 0) {
+        printf("Configured TUN device %s with IP %s\n", ifr.ifr_name, text);
+        return 0;
+    }
+    tunnel_address6(ip, &ip6);
+    inet_ntop(AF_INET6, &ip6, text6, sizeof(text6));
+    printf("Configured TUN device %s with IP %s and %s\n", ifr.ifr_name, text, text6);
+    return 0;
 }
 
-// Signal handler for graceful shutdown
-void signal_handler(int sig) {
-    printf("\nReceived signal %d, shutting down...\n", sig);
-    running = 0;
+static void server_address(struct sockaddr_in *addr, int port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = INADDR_ANY;
+    addr->sin_port = htons((uint16_t)port);
 }
 
-int main() {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len;
-
-    printf("Starting Net-Rewire Tunnel Server...\n");
-
-    // Set up signal handlers
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+// One listening socket for the stream transport. The tuning profile is set
+// before listen(), so the buffer sizes it asks for shape the window scale
+// accepted connections offer.
+static int open_listener(int port, int reuseport, const struct socktune *tune, unsigned *failed) {
+    struct sockaddr_in server_addr;
 
     // Create server socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_fd < 0) {
         perror("Error creating server socket");
-        return 1;
+        return -1;
     }
 
     // Set socket options
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
         perror("Error setting socket options");
         close(server_fd);
-        return 1;
+        return -1;
     }
-
-    // Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
+    *failed |= socktune_apply(server_fd, tune);
 
     // Bind server socket
+    server_address(&server_addr, port);
     if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Error binding server socket");
         close(server_fd);
-        return 1;
+        return -1;
     }
 
     // Listen for connections
-    if (listen(server_fd, 5) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("Error listening on server socket");
         close(server_fd);
-        return 1;
+        return -1;
     }
+    return server_fd;
+}
 
-    printf("Server listening on port %d\n", SERVER_PORT);
+// With reuseport in the profile, one listener per worker: the kernel picks
+// one by the client's address, and a burst of reconnects is spread over as
+// many accept queues. Returns the number of listeners.
+static int create_listeners(int *fds, int count, int port, const struct socktune *tune) {
+    int n = tune->reuseport ? count : 1;
+    unsigned failed = 0;
+    char text[160];
+
+    for (int i = 0; i < n; i++) {
+        fds[i] = open_listener(port, n > 1, tune, &failed);
+        if (fds[i] < 0) {
+            while (i > 0) {
+                close(fds[--i]);
+            }
+            return -1;
+        }
+    }
 
-    // Main server loop
-    while (running) {
-        client_len = sizeof(client_addr);
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
+    if (n > 1) {
+        printf("Server listening on TCP port %d (%d listeners)\n", port, n);
+    } else {
+        printf("Server listening on TCP port %d\n", port);
+    }
+    socktune_describe(tune, ~failed, text, sizeof(text));
+    printf("Socket tuning: %s\n", text);
+    if (failed) {
+        socktune_describe(tune, failed, text, sizeof(text));
+        fprintf(stderr, "Socket tuning not applied: %s\n", text);
+    }
+    return n;
+}
 
-        if (client_fd < 0) {
-            if (errno != EINTR) {
-                perror("Error accepting client connection");
-            }
+// One UDP socket per worker, all bound to the tunnel port. SO_REUSEPORT
+// makes the kernel pick one by the sender's address, so each client's
+// datagrams are read by one worker.
+static int create_udp_sockets(int *fds, int count, int port) {
+    struct sockaddr_in server_addr;
+    int opt = 1;
+    // Never fragment: a probe echoed in fragments would pass for one that
+    // fits, and clients keep their packets to the MTU the probes found
+    int pmtu = IP_PMTUDISC_DO;
+
+    server_address(&server_addr, port);
+    for (int i = 0; i < count; i++) {
+        fds[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fds[i] < 0) {
+            perror("Error creating datagram socket");
+        } else if (setsockopt(fds[i], SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 ||
+                   setsockopt(fds[i], IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu)) < 0) {
+            perror("Error setting socket options");
+        } else if (bind(fds[i], (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Error binding datagram socket");
+        } else {
             continue;
         }
+        for (int j = 0; j <= i; j++) {
+            if (fds[j] >= 0) {
+                close(fds[j]);
+            }
+        }
+        return -1;
+    }
 
-        // Create client info structure
-        client_info_t* client_info = malloc(sizeof(client_info_t));
-        if (!client_info) {
-            fprintf(stderr, "Error allocating client info\n");
-            close(client_fd);
-            continue;
+    printf("Server listening on UDP port %d\n", port);
+    return 0;
+}
+
+// The pre-shared key: 64 hex digits, e.g. from `openssl rand -hex 32`
+static int read_key(const char *path, uint8_t key[SEAL_KEY_LEN]) {
+    char text[256];
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Error opening key file");
+        return -1;
+    }
+    size_t len = fread(text, 1, sizeof(text), f);
+    fclose(f);
+    if (seal_parse_key(text, len, key) < 0) {
+        fprintf(stderr, "Key file %s does not hold a key of 64 hex digits\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Everything the command line and the configuration file set
+struct server_options {
+    char config_file[PATH_MAX];
+    enum engine_transport transport;
+    enum engine_backend backend;
+    int nworkers;
+    int pin_cpus;
+    int offload;
+    int compress;
+    char key_file[PATH_MAX];        // "" for none, as the other names
+    char stats_addr[PATH_MAX];
+    char capture_file[PATH_MAX];
+    long capture_mb;
+    long batch_bytes;
+    long batch_delay_us;
+    long long client_bytes, client_packets;
+    struct socktune tune;
+    int port;
+    char device[IFNAMSIZ];
+    struct in_addr address;
+};
+
+#define SERVER_OPTIONS "f:uozk:e:w:Pb:d:r:p:m:c:C:T:l:i:a:h"
+
+// Configuration file names of the options. A flag takes yes or no (also
+// true/false, on/off, 1/0), and yes when the name stands alone.
+static const struct {
+    const char *name;
+    char option;
+    int flag;                       // 1: flag, -1: flag meaning the option's opposite
+} settings[] = {
+    { "udp", 'u', 1 },
+    { "offload", 'o', 1 },
+    { "compress", 'z', 1 },
+    { "key-file", 'k', 0 },
+    { "backend", 'e', 0 },
+    { "workers", 'w', 0 },
+    { "pin", 'P', -1 },
+    { "batch-bytes", 'b', 0 },
+    { "batch-delay", 'd', 0 },
+    { "client-bytes", 'r', 0 },
+    { "client-packets", 'p', 0 },
+    { "metrics", 'm', 0 },
+    { "capture", 'c', 0 },
+    { "capture-mb", 'C', 0 },
+    { "socket-tuning", 'T', 0 },
+    { "port", 'l', 0 },
+    { "device", 'i', 0 },
+    { "address", 'a', 0 },
+};
+
+static void default_options(struct server_options *o) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(o, 0, sizeof(*o));
+    o->transport = ENGINE_TRANSPORT_STREAM;
+    o->backend = ENGINE_BACKEND_EPOLL;
+    o->nworkers = ncpu > 0 ? (int)(ncpu < ENGINE_MAX_WORKERS ? ncpu : ENGINE_MAX_WORKERS) : 1;
+    o->pin_cpus = 1;
+    o->capture_mb = CAPTURE_MB_DEFAULT;
+    o->batch_bytes = ENGINE_BATCH_BYTES;
+    socktune_parse(&o->tune, SOCKTUNE_DEFAULT);
+    o->port = SERVER_PORT;
+    strcpy(o->device, TUN_DEVICE);
+    inet_pton(AF_INET, TUN_IP, &o->address);
+}
+
+static int set_string(char *dst, size_t cap, const char *arg) {
+    if (strlen(arg) >= cap) {
+        return -1;
+    }
+    strcpy(dst, arg);
+    return 0;
+}
+
+// A whole decimal number, clamped to [min, max]
+static int set_number(long long *out, const char *arg, long long min, long long max) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(arg, &end, 10);
+    if (errno || end == arg || *end) {
+        return -1;
+    }
+    *out = v < min ? min : v > max ? max : v;
+    return 0;
+}
+
+// Command-line flags come without an argument, configuration file ones
+// with "1" or "0"
+static int flag_on(const char *arg) {
+    return !arg || strcmp(arg, "1") == 0;
+}
+
+// Take one option, as getopt() returns it
+static int set_option(struct server_options *o, int c, const char *arg) {
+    long long v;
+
+    switch (c) {
+    case 'f':
+        return set_string(o->config_file, sizeof(o->config_file), arg);
+    case 'u':
+        o->transport = flag_on(arg) ? ENGINE_TRANSPORT_DATAGRAM : ENGINE_TRANSPORT_STREAM;
+        return 0;
+    case 'o':
+        o->offload = flag_on(arg);
+        return 0;
+    case 'z':
+        o->compress = flag_on(arg);
+        return 0;
+    case 'P':
+        o->pin_cpus = !flag_on(arg);
+        return 0;
+    case 'k':
+        return set_string(o->key_file, sizeof(o->key_file), arg);
+    case 'e':
+        if (strcmp(arg, "uring") == 0) {
+            o->backend = ENGINE_BACKEND_URING;
+        } else if (strcmp(arg, "epoll") == 0) {
+            o->backend = ENGINE_BACKEND_EPOLL;
+        } else {
+            return -1;
+        }
+        return 0;
+    case 'w':
+        if (set_number(&v, arg, 1, ENGINE_MAX_WORKERS) < 0) {
+            return -1;
+        }
+        o->nworkers = (int)v;
+        return 0;
+    case 'b':
+        if (set_number(&v, arg, 1, LONG_MAX) < 0) {
+            return -1;
+        }
+        o->batch_bytes = (long)v;
+        return 0;
+    case 'd':
+        if (set_number(&v, arg, 0, 1000000) < 0) {
+            return -1;
+        }
+        o->batch_delay_us = (long)v;
+        return 0;
+    case 'r':
+        return set_number(&o->client_bytes, arg, 0, CLIENT_RATE_MAX);
+    case 'p':
+        return set_number(&o->client_packets, arg, 0, CLIENT_RATE_MAX);
+    case 'm':
+        return set_string(o->stats_addr, sizeof(o->stats_addr), arg);
+    case 'c':
+        return set_string(o->capture_file, sizeof(o->capture_file), arg);
+    case 'C':
+        if (set_number(&v, arg, 1, CAPTURE_MB_MAX) < 0) {
+            return -1;
+        }
+        o->capture_mb = (long)v;
+        return 0;
+    case 'T':
+        return socktune_parse(&o->tune, arg);
+    case 'l':
+        if (set_number(&v, arg, 0, 65536) < 0 || v < 1 || v > 65535) {
+            return -1;
         }
+        o->port = (int)v;
+        return 0;
+    case 'i':
+        return arg[0] ? set_string(o->device, sizeof(o->device), arg) : -1;
+    case 'a':
+        return inet_pton(AF_INET, arg, &o->address) == 1 ? 0 : -1;
+    default:
+        return -1;
+    }
+}
 
-        client_info->socket_fd = client_fd;
-        memcpy(&client_info->client_addr, &client_addr, sizeof(client_addr));
+static int parse_flag(const char *value) {
+    const char *yes[] = { "", "yes", "true", "on", "1" };
+    const char *no[] = { "no", "false", "off", "0" };
 
-        // Create thread to handle client
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, client_info) != 0) {
-            fprintf(stderr, "Error creating client thread\n");
-            free(client_info);
-            close(client_fd);
+    for (size_t i = 0; i < sizeof(yes) / sizeof(yes[0]); i++) {
+        if (strcasecmp(value, yes[i]) == 0) {
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < sizeof(no) / sizeof(no[0]); i++) {
+        if (strcasecmp(value, no[i]) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// config_read() callback
+static int set_setting(void *ctx, const char *name, const char *value) {
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+        if (strcmp(name, settings[i].name) != 0) {
             continue;
         }
+        if (!settings[i].flag) {
+            return set_option(ctx, settings[i].option, value);
+        }
+        int on = parse_flag(value);
+        if (on < 0) {
+            return -1;
+        }
+        return set_option(ctx, settings[i].option, on == (settings[i].flag > 0) ? "1" : "0");
+    }
+    return -1;
+}
+
+// Apply every option of the command line; returns 0, or the option that
+// was refused ('?' if unknown, 'h' for help)
+static int scan_args(struct server_options *o, int argc, char *argv[]) {
+    int c;
+
+    optind = 1;
+    while ((c = getopt(argc, argv, SERVER_OPTIONS)) != -1) {
+        if (c == '?' || c == 'h') {
+            return c;
+        }
+        if (set_option(o, c, optarg) < 0) {
+            fprintf(stderr, "Invalid -%c argument: %s\n", c, optarg ? optarg : "");
+            return c;
+        }
+    }
+    return 0;
+}
+
+// Defaults, then the configuration file, then the command line over both.
+// Returns 0, -1 if the file is unreadable or invalid, or as scan_args().
+static int load_options(struct server_options *o, int argc, char *argv[]) {
+    char path[PATH_MAX];
+
+    default_options(o);
+    int rc = scan_args(o, argc, argv);
+    if (rc != 0 || !o->config_file[0]) {
+        return rc;
+    }
+
+    strcpy(path, o->config_file);
+    default_options(o);
+    strcpy(o->config_file, path);
+    if (config_read(path, set_setting, o) < 0) {
+        if (errno != EINVAL) {
+            perror(path);
+        }
+        return -1;
+    }
+    return scan_args(o, argc, argv);
+}
+
+static void options_limits(const struct server_options *o, struct engine_limits *l) {
+    l->batch_bytes = (size_t)o->batch_bytes;
+    l->batch_delay_us = (unsigned)o->batch_delay_us;
+    l->client_bytes_per_sec = (uint64_t)o->client_bytes;
+    l->client_packets_per_sec = (uint64_t)o->client_packets;
+    l->tune = o->tune;
+}
+
+// Everything but the limits is set up once, at startup
+static void report_restart_changes(const struct server_options *cur, const struct server_options *next) {
+    char names[256] = "";
+    size_t used = 0;
+    const struct {
+        int changed;
+        const char *name;
+    } checks[] = {
+        { cur->transport != next->transport, "udp" },
+        { cur->offload != next->offload, "offload" },
+        { cur->compress != next->compress, "compress" },
+        { strcmp(cur->key_file, next->key_file) != 0, "key-file" },
+        { cur->backend != next->backend, "backend" },
+        { cur->nworkers != next->nworkers, "workers" },
+        { cur->pin_cpus != next->pin_cpus, "pin" },
+        { strcmp(cur->stats_addr, next->stats_addr) != 0, "metrics" },
+        { strcmp(cur->capture_file, next->capture_file) != 0, "capture" },
+        { cur->capture_mb != next->capture_mb, "capture-mb" },
+        { cur->tune.reuseport != next->tune.reuseport, "socket-tuning reuseport" },
+        { cur->port != next->port, "port" },
+        { strcmp(cur->device, next->device) != 0, "device" },
+        { cur->address.s_addr != next->address.s_addr, "address" },
+    };
+
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        if (checks[i].changed) {
+            int n = snprintf(names + used, sizeof(names) - used, "%s%s", used ? ", " : "", checks[i].name);
+            if (n > 0 && (size_t)n < sizeof(names) - used) {
+                used += (size_t)n;
+            }
+        }
+    }
+    if (used) {
+        printf("Changed settings take effect on restart: %s\n", names);
+    }
+}
+
+// SIGHUP: read the configuration file and command line again and hand the
+// new limits to the engine; sessions stay connected. A file that does not
+// load leaves everything as it was.
+static void reload_options(struct server_options *cur, int argc, char *argv[]) {
+    struct server_options next;
+    struct engine_limits limits;
+    char text[160];
+
+    printf("Reloading configuration...\n");
+    if (load_options(&next, argc, argv) != 0) {
+        fprintf(stderr, "Configuration not reloaded, keeping the current one\n");
+        return;
+    }
+    report_restart_changes(cur, &next);
+
+    options_limits(&next, &limits);
+    if (engine_reload(&limits) < 0) {
+        perror("Error reloading limits");
+        return;
+    }
+    int reuseport = cur->tune.reuseport;
+    cur->batch_bytes = next.batch_bytes;
+    cur->batch_delay_us = next.batch_delay_us;
+    cur->client_bytes = next.client_bytes;
+    cur->client_packets = next.client_packets;
+    cur->tune = next.tune;
+    cur->tune.reuseport = reuseport;
+
+    socktune_describe(&cur->tune, ~0u, text, sizeof(text));
+    printf("Reloaded: batches of %ld bytes held up to %ld us; per client %lld bytes/s, %lld packets/s (0: no cap); "
+           "socket tuning: %s\n", cur->batch_bytes, cur->batch_delay_us, cur->client_bytes, cur->client_packets, text);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f file] [-u] [-o] [-z] [-k keyfile] [-e epoll|uring] [-w workers] [-P] [-b bytes] [-d usec] [-r bytes] [-p packets] [-m addr] [-c file] [-C MiB] [-T profile] [-l port] [-i device] [-a address]\n", prog);
+    fprintf(stderr, "  -f file     Read settings from this file first; the options given here override it\n");
+    fprintf(stderr, "              (SIGHUP reads both again and applies -b, -d, -r, -p and -T without a restart)\n");
+    fprintf(stderr, "  -u          Carry one packet per UDP datagram instead of framing them over TCP\n");
+    fprintf(stderr, "  -o          Take checksum and segmentation offloads from the TUN device\n");
+    fprintf(stderr, "  -z          Compress connections for clients that ask for it\n");
+    fprintf(stderr, "  -k keyfile  Encrypt connections or datagrams with this pre-shared key; clients without it are refused\n");
+    fprintf(stderr, "  -e backend  Wait on epoll (default) or on an io_uring per worker\n");
+    fprintf(stderr, "  -w workers  Number of event loops (default: one per online CPU)\n");
+    fprintf(stderr, "  -P          Do not pin workers to CPUs\n");
+    fprintf(stderr, "  -b bytes    Send a client's batched packets once they reach this size (default: %d)\n",
+            ENGINE_BATCH_BYTES);
+    fprintf(stderr, "  -d usec     Hold batches up to this long for more packets (default: 0, send at burst end)\n");
+    fprintf(stderr, "  -r bytes    Cap what each client sends on at this many bytes per second (default: no cap)\n");
+    fprintf(stderr, "  -p packets  Cap what each client sends on at this many packets per second (default: no cap)\n");
+    fprintf(stderr, "  -m addr     Serve Prometheus metrics on [host:]port (host default 127.0.0.1) or a Unix socket path\n");
+    fprintf(stderr, "  -c file     Record packet headers, both ways, into this pcapng file\n");
+    fprintf(stderr, "  -C MiB      Keep the most recent this many MiB of capture (default: %d)\n", CAPTURE_MB_DEFAULT);
+    fprintf(stderr, "  -T profile  Socket tuning of TCP connections, e.g. nodelay,lowat=131072,buf=auto,busypoll=50,cc=bbr,reuseport\n");
+    fprintf(stderr, "              (default: %s; none for kernel defaults)\n", SOCKTUNE_DEFAULT);
+    fprintf(stderr, "  -l port     Listen on this TCP or UDP port (default: %d)\n", SERVER_PORT);
+    fprintf(stderr, "  -i device   TUN device name (default: %s)\n", TUN_DEVICE);
+    fprintf(stderr, "  -a address  Server's tunnel address, in a /24 (default: %s)\n", TUN_IP);
+}
 
-        // Detach thread (we don't need to join it)
-        pthread_detach(thread_id);
+int main(int argc, char *argv[]) {
+    int listen_fds[ENGINE_MAX_WORKERS];
+    int nlisten = 0, ntun;
+    int tun_fds[ENGINE_MAX_WORKERS];
+    int udp_fds[ENGINE_MAX_WORKERS];
+    struct server_options opts;
+    struct pcapng capture;
+    uint8_t key[SEAL_KEY_LEN] = { 0 };
+
+    int rc = load_options(&opts, argc, argv);
+    if (rc != 0) {
+        if (rc > 0) {
+            usage(argv[0]);
+        }
+        return rc == 'h' ? 0 : 1;
     }
+    int nworkers = opts.nworkers;
+    int capture_on = opts.capture_file[0] != '\0';
+
+    if (opts.key_file[0] && read_key(opts.key_file, key) < 0) {
+        return 1;
+    }
+
+    printf("Starting Net-Rewire Tunnel Server...\n");
+    if (opts.config_file[0]) {
+        printf("Configuration: %s\n", opts.config_file);
+    }
+
+    // Signals are taken synchronously by the main thread; workers never see them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Opened before the devices, so that a bad path leaves nothing to close
+    if (capture_on) {
+        if (pcapng_open(&capture, opts.capture_file, (size_t)opts.capture_mb << 20) < 0) {
+            perror(opts.capture_file);
+            return 1;
+        }
+        printf("Capturing packet headers to %s (last %ld MiB)\n", opts.capture_file, opts.capture_mb);
+    }
+
+    if (opts.transport == ENGINE_TRANSPORT_STREAM) {
+        nlisten = create_listeners(listen_fds, nworkers, opts.port, &opts.tune);
+    } else if (create_udp_sockets(udp_fds, nworkers, opts.port) < 0) {
+        nlisten = -1;
+    }
+    if (nlisten < 0) {
+        if (capture_on) {
+            pcapng_close(&capture);
+        }
+        return 1;
+    }
+
+    // The TUN device is shared by every session, one queue per worker
+    ntun = create_tun_queues(opts.device, tun_fds, nworkers, opts.offload);
+    if (ntun < 0 || configure_tun_device(tun_fds[0], opts.address) < 0) {
+        for (int i = 0; i < ntun; i++) {
+            close(tun_fds[i]);
+        }
+        if (opts.transport == ENGINE_TRANSPORT_STREAM) {
+            for (int i = 0; i < nlisten; i++) {
+                close(listen_fds[i]);
+            }
+        } else {
+            for (int i = 0; i < nworkers; i++) {
+                close(udp_fds[i]);
+            }
+        }
+        if (capture_on) {
+            pcapng_close(&capture);
+        }
+        return 1;
+    }
+    if (opts.offload) {
+        enable_tun_offloads(tun_fds[0]);
+    }
+    if (ntun > 1 && attach_tun_steering(tun_fds[0]) < 0) {
+        fprintf(stderr, "Continuing without TUN steering; packets will be handed between workers\n");
+    }
+    report_flowtable(opts.device);
+    // Ring reads on a blocking queue wait for a packet instead of failing with EAGAIN
+    for (int i = 0; opts.backend == ENGINE_BACKEND_EPOLL && i < ntun; i++) {
+        fcntl(tun_fds[i], F_SETFL, O_NONBLOCK);
+    }
+
+    struct engine_config cfg = {
+        .nworkers = nworkers,
+        .transport = opts.transport,
+        .backend = opts.backend,
+        .nlisten = nlisten,
+        .ntun = ntun,
+        .pin_cpus = opts.pin_cpus,
+        .vnet_hdr = opts.offload,
+        .compress = opts.compress,
+        .encrypt = opts.key_file[0] != '\0',
+        .capture = capture_on ? &capture : NULL,
+        .tunnel_net = opts.address.s_addr,
+    };
+    inet_pton(AF_INET, TUN_NETMASK, &cfg.tunnel_mask);
+    options_limits(&opts, &cfg.limits);
+    memcpy(cfg.tun_fds, tun_fds, sizeof(tun_fds));
+    memcpy(cfg.listen_fds, listen_fds, sizeof(listen_fds));
+    memcpy(cfg.udp_fds, udp_fds, sizeof(udp_fds));
+    memcpy(cfg.key, key, sizeof(key));
+    if (engine_start(&cfg) < 0) {
+        if (capture_on) {
+            pcapng_close(&capture);
+        }
+        return 1;
+    }
+    if (opts.stats_addr[0] && stats_start(opts.stats_addr) < 0) {
+        engine_stop();
+        if (capture_on) {
+            pcapng_close(&capture);
+        }
+        return 1;
+    }
+
+    // Main server loop: SIGHUP reloads, anything else stops
+    int sig;
+    for (;;) {
+        if (sigwait(&signals, &sig) != 0) {
+            continue;
+        }
+        if (sig != SIGHUP) {
+            break;
+        }
+        reload_options(&opts, argc, argv);
+    }
+    printf("\nReceived signal %d, shutting down...\n", sig);
 
     // Cleanup
     printf("Shutting down server...\n");
-    close(server_fd);
+    stats_stop();
+    engine_stop();
+    if (capture_on) {
+        printf("Capture: %llu packets, %llu dropped\n", (unsigned long long)capture.packets,
+               (unsigned long long)capture.dropped);
+        pcapng_close(&capture);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
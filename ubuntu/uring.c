@@ -0,0 +1,303 @@
+//
+//  uring.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/time_types.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+int uring_init(struct uring *r, unsigned sq_entries, unsigned cq_entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    // Completions are only reaped between loop iterations, so task work
+    // need not interrupt the worker; older kernels lack the flags
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = cq_entries;
+    r->fd = sys_setup(sq_entries, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+        r->fd = sys_setup(sq_entries, &p);
+    }
+    if (r->fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        // Waiting with a timeout needs it (5.11)
+        uring_free(r);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    r->features = p.features;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        uring_free(r);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            uring_free(r);
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_free(r);
+        return -1;
+    }
+
+    uint8_t *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Entry i always sits in slot i
+    for (unsigned i = 0; i < r->sq_entries; i++) {
+        r->sq_array[i] = i;
+    }
+    return 0;
+}
+
+void uring_free(struct uring *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    // Only now is the kernel done with the provided buffers
+    if (r->br) {
+        munmap(r->br, r->br_size);
+    }
+    if (r->br_bufs) {
+        munmap(r->br_bufs, (size_t)r->br_count * r->br_buf_size);
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+    if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries &&
+        (uring_submit(r) < 0 || r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_local & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local++;
+    return sqe;
+}
+
+// Publish the queued entries; returns how many the kernel has yet to take
+static unsigned uring_publish(struct uring *r) {
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    return r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int uring_submit(struct uring *r) {
+    unsigned pending = uring_publish(r);
+    while (pending > 0) {
+        int n = sys_enter(r->fd, pending, 0, 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        pending = uring_publish(r);
+    }
+    return 0;
+}
+
+int uring_wait(struct uring *r, int timeout_ms) {
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = { .ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0 };
+    unsigned pending = uring_publish(r);
+
+    // Nothing to wait for if a completion is already there
+    unsigned wait = uring_cqe(r) ? 0 : 1;
+    int n = sys_enter(r->fd, pending, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (n < 0 && (errno == ETIME || errno == EBUSY || errno == EAGAIN)) {
+        // Timed out, or completions must be reaped before more are taken
+        return 0;
+    }
+    return n < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned count) {
+    return sys_register(r->fd, IORING_REGISTER_BUFFERS, iov, count) < 0 ? -1 : 0;
+}
+
+int uring_setup_provided(struct uring *r, unsigned count, size_t size) {
+    r->br_size = (size_t)count * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        return -1;
+    }
+    r->br_bufs = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br_bufs == MAP_FAILED) {
+        r->br_bufs = NULL;
+        return -1;
+    }
+    r->br_count = count;
+    r->br_buf_size = size;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)r->br,
+        .ring_entries = count,
+        .bgid = 0,
+    };
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        uring_recycle(r, (uint16_t)i);
+    }
+    return 0;
+}
+
+uint8_t *uring_provided(struct uring *r, const struct io_uring_cqe *cqe, uint16_t *bid) {
+    *bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    return r->br_bufs + (size_t)*bid * r->br_buf_size;
+}
+
+void uring_recycle(struct uring *r, uint16_t bid) {
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (r->br_count - 1)];
+    b->addr = (uint64_t)(uintptr_t)(r->br_bufs + (size_t)bid * r->br_buf_size);
+    b->len = (uint32_t)r->br_buf_size;
+    b->bid = bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+int uring_poll_multishot(struct uring *r, int fd, unsigned events, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_recv_multishot(struct uring *r, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_rw_fixed(struct uring *r, int opcode, int fd, void *buf, size_t len, unsigned buf_index,
+                   uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = (uint64_t)-1;
+    sqe->buf_index = (uint16_t)buf_index;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_cancel(struct uring *r, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = 0;
+    return 0;
+}
@@ -0,0 +1,158 @@
+//
+//  uring.h
+//  Net-Rewire Ubuntu Tunnel Server
+//
+//  The few pieces of io_uring the engine's io_uring backend needs, on the
+//  raw system calls: a submission and completion ring, fixed buffers, and
+//  one ring of provided buffers for multishot receives. Requests are only
+//  queued until uring_wait(), so a whole event loop iteration costs one
+//  io_uring_enter().
+//
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned features;
+
+    // Submission queue, shared with the kernel
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned sq_local;          // our tail, published to the kernel on submit
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    // Provided buffers, handed out by the kernel as data arrives
+    struct io_uring_buf_ring *br;
+    uint8_t *br_bufs;
+    size_t br_size, br_buf_size;
+    unsigned br_count;
+    uint16_t br_tail;
+};
+
+/**
+ * Set up a ring
+ * @param r Ring
+ * @param sq_entries Submission queue size, a power of two
+ * @param cq_entries Completion queue size, a power of two; multishot
+ *                   requests can complete many times each
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int uring_init(struct uring *r, unsigned sq_entries, unsigned cq_entries);
+
+/**
+ * Tear a ring down; requests still in flight are cancelled
+ */
+void uring_free(struct uring *r);
+
+/**
+ * Next free submission entry, zeroed. A full queue is submitted first.
+ * @return Entry, or NULL if the kernel would not take the queued ones
+ */
+struct io_uring_sqe *uring_sqe(struct uring *r);
+
+/**
+ * Hand every queued entry to the kernel without waiting
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int uring_submit(struct uring *r);
+
+/**
+ * Submit the queued entries and wait for a completion
+ * @param r Ring
+ * @param timeout_ms Longest wait, -1 for no limit
+ * @return 0 once a completion is ready or the wait timed out, -1 on
+ *         failure (errno set; EINTR included)
+ */
+int uring_wait(struct uring *r, int timeout_ms);
+
+/**
+ * Oldest completion not yet consumed, or NULL
+ */
+struct io_uring_cqe *uring_cqe(struct uring *r);
+
+/**
+ * Consume the completion uring_cqe() returned
+ */
+void uring_cqe_seen(struct uring *r);
+
+/**
+ * Register buffers for IORING_OP_READ_FIXED / WRITE_FIXED
+ * @param r Ring
+ * @param iov Buffers; entry i becomes buf_index i
+ * @param count Number of buffers
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned count);
+
+/**
+ * Allocate and register the ring's provided buffers, all of them handed to
+ * the kernel. Receives pick them with IOSQE_BUFFER_SELECT and group 0.
+ * @param r Ring
+ * @param count Number of buffers, a power of two up to 32768
+ * @param size Bytes per buffer
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int uring_setup_provided(struct uring *r, unsigned count, size_t size);
+
+/**
+ * A provided buffer a completion carries
+ * @param r Ring
+ * @param cqe Completion with IORING_CQE_F_BUFFER set
+ * @param bid Output: buffer id, for uring_recycle()
+ * @return Buffer data
+ */
+uint8_t *uring_provided(struct uring *r, const struct io_uring_cqe *cqe, uint16_t *bid);
+
+/**
+ * Give a provided buffer back to the kernel
+ */
+void uring_recycle(struct uring *r, uint16_t bid);
+
+/**
+ * Queue a multishot poll; it completes on every wakeup until cancelled
+ * @return 0, or -1 if no submission entry was free
+ */
+int uring_poll_multishot(struct uring *r, int fd, unsigned events, uint64_t user_data);
+
+/**
+ * Queue a multishot receive into provided buffers
+ * @return 0, or -1 if no submission entry was free
+ */
+int uring_recv_multishot(struct uring *r, int fd, uint64_t user_data);
+
+/**
+ * Queue a read or write of a registered buffer
+ * @param r Ring
+ * @param opcode IORING_OP_READ_FIXED or IORING_OP_WRITE_FIXED
+ * @param fd File
+ * @param buf Memory inside registered buffer buf_index
+ * @param len Bytes
+ * @param buf_index Registered buffer
+ * @param user_data Returned in the completion
+ * @return 0, or -1 if no submission entry was free
+ */
+int uring_rw_fixed(struct uring *r, int opcode, int fd, void *buf, size_t len, unsigned buf_index,
+                   uint64_t user_data);
+
+/**
+ * Queue the cancellation of every request carrying user_data; its own
+ * completion carries 0
+ * @return 0, or -1 if no submission entry was free
+ */
+int uring_cancel(struct uring *r, uint64_t user_data);
+
+#endif
@@ -0,0 +1,166 @@
+//
+//  uring_test.c
+//  Net-Rewire Ubuntu Tunnel Server
+//
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+static struct uring ring;
+
+// The parts of a completion the tests look at
+struct done {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+};
+
+// Wait for the next completion and copy it out
+static struct done next_cqe(void) {
+    struct io_uring_cqe *cqe;
+    while (!(cqe = uring_cqe(&ring))) {
+        assert(uring_wait(&ring, 1000) == 0);
+    }
+    struct done d = { cqe->user_data, cqe->res, cqe->flags };
+    uring_cqe_seen(&ring);
+    return d;
+}
+
+void test_poll_multishot() {
+    int efd = eventfd(0, EFD_NONBLOCK);
+    uint64_t one = 1, count;
+
+    assert(uring_poll_multishot(&ring, efd, POLLIN, 7) == 0);
+    assert(uring_submit(&ring) == 0);
+
+    // Every wakeup completes again, and the request stays armed
+    for (int i = 0; i < 2; i++) {
+        assert(write(efd, &one, sizeof(one)) == sizeof(one));
+        struct done c = next_cqe();
+        assert(c.user_data == 7 && (c.res & POLLIN) && (c.flags & IORING_CQE_F_MORE));
+        assert(read(efd, &count, sizeof(count)) == sizeof(count));
+    }
+
+    // Cancelling ends it with a last completion of its own
+    assert(uring_cancel(&ring, 7) == 0);
+    int seen_cancel = 0, seen_end = 0;
+    while (!seen_cancel || !seen_end) {
+        struct done c = next_cqe();
+        if (c.user_data == 0) {
+            assert(c.res == 1);
+            seen_cancel = 1;
+        } else {
+            assert(c.user_data == 7 && c.res == -ECANCELED && !(c.flags & IORING_CQE_F_MORE));
+            seen_end = 1;
+        }
+    }
+
+    close(efd);
+    printf("✓ Multishot poll test passed\n");
+}
+
+void test_recv_multishot() {
+    int sv[2];
+    uint8_t sent[3000], got[3000];
+    size_t have = 0;
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    for (size_t i = 0; i < sizeof(sent); i++) {
+        sent[i] = (uint8_t)(i * 13);
+    }
+    assert(uring_recv_multishot(&ring, sv[0], 9) == 0);
+    assert(uring_submit(&ring) == 0);
+
+    // Three writes, received in order through 1 KB provided buffers
+    for (int i = 0; i < 3; i++) {
+        assert(write(sv[1], sent + i * 1000, 1000) == 1000);
+    }
+    while (have < sizeof(sent)) {
+        struct done c = next_cqe();
+        assert(c.user_data == 9 && c.res > 0 && (c.flags & IORING_CQE_F_BUFFER));
+        assert(c.flags & IORING_CQE_F_MORE);
+        uint16_t bid;
+        struct io_uring_cqe cqe = { .flags = c.flags };
+        uint8_t *data = uring_provided(&ring, &cqe, &bid);
+        memcpy(got + have, data, c.res);
+        have += c.res;
+        uring_recycle(&ring, bid);
+    }
+    assert(memcmp(sent, got, sizeof(sent)) == 0);
+
+    // The peer closing ends the receive
+    close(sv[1]);
+    struct done c = next_cqe();
+    assert(c.user_data == 9 && c.res == 0 && !(c.flags & IORING_CQE_F_MORE));
+
+    close(sv[0]);
+    printf("✓ Multishot receive test passed\n");
+}
+
+void test_fixed_buffers() {
+    static uint8_t region[4096];
+    struct iovec iov = { .iov_base = region, .iov_len = sizeof(region) };
+    int p[2];
+
+    assert(pipe(p) == 0);
+    assert(uring_register_buffers(&ring, &iov, 1) == 0);
+
+    memcpy(region, "net-rewire", 10);
+    assert(uring_rw_fixed(&ring, IORING_OP_WRITE_FIXED, p[1], region, 10, 0, 1) == 0);
+    assert(uring_rw_fixed(&ring, IORING_OP_READ_FIXED, p[0], region + 2048, 10, 0, 2) == 0);
+
+    int done = 0;
+    while (done != 3) {
+        struct done c = next_cqe();
+        assert((c.user_data == 1 || c.user_data == 2) && c.res == 10);
+        done |= (int)c.user_data;
+    }
+    assert(memcmp(region + 2048, "net-rewire", 10) == 0);
+
+    close(p[0]);
+    close(p[1]);
+    printf("✓ Fixed buffer test passed\n");
+}
+
+void test_wait_timeout() {
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    assert(uring_wait(&ring, 50) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    long ms = (b.tv_sec - a.tv_sec) * 1000 + (b.tv_nsec - a.tv_nsec) / 1000000;
+    assert(ms >= 40 && uring_cqe(&ring) == NULL);
+
+    printf("✓ Wait timeout test passed\n");
+}
+
+int main() {
+    printf("Running io_uring unit tests...\n");
+
+    if (uring_init(&ring, 64, 256) < 0) {
+        // Disabled by the kernel or a seccomp policy; nothing to test
+        printf("io_uring unavailable (%s), skipping\n", strerror(errno));
+        return 0;
+    }
+    assert(uring_setup_provided(&ring, 8, 1024) == 0);
+
+    test_poll_multishot();
+    test_recv_multishot();
+    test_fixed_buffers();
+    test_wait_timeout();
+
+    uring_free(&ring);
+    printf("All tests passed! ✅\n");
+    return 0;
+}